@@ -11,14 +11,19 @@ WEBCA_HOME=/srv/app/webCA
 WEBCA_BASE=/srv/www/webcert
 
 
+# The CGIs create their index files in $WEBCA_HOME, and
+# replace them by rename(). The folder must be writable
+# for the webserver group.
 echo "Check for $WEBCA_HOME folder."
 if [ -d $WEBCA_HOME ]; then
+   chmod 770 $WEBCA_HOME
+   chgrp www-data $WEBCA_HOME
    ls -ld $WEBCA_HOME
    echo "$WEBCA_HOME folder exists."
 else
    echo "Creating $WEBCA_HOME folder..."
    mkdir $WEBCA_HOME
-   chmod 750 $WEBCA_HOME
+   chmod 770 $WEBCA_HOME
    chgrp www-data $WEBCA_HOME
    ls -ld $WEBCA_HOME
 fi
@@ -84,6 +89,52 @@ fi
 echo "Done."
 echo
 
+echo "Check for $WEBCA_HOME/profiles.cnf signing profiles."
+if [ -f $WEBCA_HOME/profiles.cnf ]; then
+   ls -l $WEBCA_HOME/profiles.cnf
+   echo "$WEBCA_HOME/profiles.cnf signing profiles exist."
+else
+   echo "Creating $WEBCA_HOME/profiles.cnf..."
+   cat > $WEBCA_HOME/profiles.cnf <<EOF
+# certsign.cgi signing profiles: name = section of X509V3 extensions.
+# subjectKeyIdentifier and authorityKeyIdentifier are always added.
+[profiles]
+server   = server_exts
+client   = client_exts
+email    = email_exts
+codesign = codesign_exts
+
+[server_exts]
+basicConstraints      = critical,CA:FALSE
+keyUsage              = digitalSignature,keyEncipherment
+extendedKeyUsage      = serverAuth
+crlDistributionPoints = URI:http://fm4dd.com/sw/webcert/webcert.crl
+
+[client_exts]
+basicConstraints      = critical,CA:FALSE
+keyUsage              = digitalSignature
+extendedKeyUsage      = clientAuth
+crlDistributionPoints = URI:http://fm4dd.com/sw/webcert/webcert.crl
+
+[email_exts]
+basicConstraints      = critical,CA:FALSE
+keyUsage              = digitalSignature,keyEncipherment
+extendedKeyUsage      = emailProtection
+crlDistributionPoints = URI:http://fm4dd.com/sw/webcert/webcert.crl
+
+[codesign_exts]
+basicConstraints      = critical,CA:FALSE
+keyUsage              = digitalSignature
+extendedKeyUsage      = codeSigning
+crlDistributionPoints = URI:http://fm4dd.com/sw/webcert/webcert.crl
+EOF
+   chmod 640 $WEBCA_HOME/profiles.cnf
+   chgrp www-data $WEBCA_HOME/profiles.cnf
+   ls -l $WEBCA_HOME/profiles.cnf
+fi
+echo "Done."
+echo
+
 echo "Check for $WEBCA_HOME/certs folder."
 if [ -d $WEBCA_HOME/certs ]; then
    ls -ld $WEBCA_HOME/certs
@@ -99,6 +150,166 @@ fi
 echo "Done."
 echo
 
+echo "Check for $WEBCA_HOME/certs.idx cert store index."
+if [ -f $WEBCA_HOME/certs.idx ]; then
+   chmod 660 $WEBCA_HOME/certs.idx
+   chgrp www-data $WEBCA_HOME/certs.idx
+   ls -l $WEBCA_HOME/certs.idx
+   echo "$WEBCA_HOME/certs.idx cert store index exists."
+else
+   echo "$WEBCA_HOME/certs.idx is built from the cert store on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/dn.idx DN trigram index."
+if [ -f $WEBCA_HOME/dn.idx ]; then
+   chmod 660 $WEBCA_HOME/dn.idx
+   chgrp www-data $WEBCA_HOME/dn.idx
+   ls -l $WEBCA_HOME/dn.idx
+   echo "$WEBCA_HOME/dn.idx DN trigram index exists."
+else
+   echo "$WEBCA_HOME/dn.idx is built by certsearch.cgi on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/dn.idx.log DN trigram index log."
+if [ -f $WEBCA_HOME/dn.idx.log ]; then
+   chmod 660 $WEBCA_HOME/dn.idx.log
+   chgrp www-data $WEBCA_HOME/dn.idx.log
+   ls -l $WEBCA_HOME/dn.idx.log
+   echo "$WEBCA_HOME/dn.idx.log DN trigram index log exists."
+else
+   echo "$WEBCA_HOME/dn.idx.log is created by certsign.cgi on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/san.idx SAN index."
+if [ -f $WEBCA_HOME/san.idx ]; then
+   chmod 660 $WEBCA_HOME/san.idx
+   chgrp www-data $WEBCA_HOME/san.idx
+   ls -l $WEBCA_HOME/san.idx
+   echo "$WEBCA_HOME/san.idx SAN index exists."
+else
+   echo "$WEBCA_HOME/san.idx is built by certsearch.cgi on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/san.idx.log SAN index log."
+if [ -f $WEBCA_HOME/san.idx.log ]; then
+   chmod 660 $WEBCA_HOME/san.idx.log
+   chgrp www-data $WEBCA_HOME/san.idx.log
+   ls -l $WEBCA_HOME/san.idx.log
+   echo "$WEBCA_HOME/san.idx.log SAN index log exists."
+else
+   echo "$WEBCA_HOME/san.idx.log is created by certsign.cgi on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/certs.col column table."
+if [ -f $WEBCA_HOME/certs.col ]; then
+   chmod 660 $WEBCA_HOME/certs.col
+   chgrp www-data $WEBCA_HOME/certs.col
+   ls -l $WEBCA_HOME/certs.col
+   echo "$WEBCA_HOME/certs.col column table exists."
+else
+   echo "$WEBCA_HOME/certs.col is built by certsearch.cgi on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/certs.arc cert archive."
+if [ -f $WEBCA_HOME/certs.arc ]; then
+   chmod 660 $WEBCA_HOME/certs.arc
+   chgrp www-data $WEBCA_HOME/certs.arc
+   ls -l $WEBCA_HOME/certs.arc
+   echo "$WEBCA_HOME/certs.arc cert archive exists."
+else
+   echo "$WEBCA_HOME/certs.arc is created by certsign.cgi or certimport with ARCHIVE_STORE set."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/cache search cache folder."
+if [ -d $WEBCA_HOME/cache ]; then
+   chmod 770 $WEBCA_HOME/cache
+   chgrp www-data $WEBCA_HOME/cache
+   ls -ld $WEBCA_HOME/cache
+   echo "$WEBCA_HOME/cache search cache folder exists."
+else
+   echo "Creating $WEBCA_HOME/cache search cache folder..."
+   mkdir $WEBCA_HOME/cache
+   chmod 770 $WEBCA_HOME/cache
+   chgrp www-data $WEBCA_HOME/cache
+   ls -ld $WEBCA_HOME/cache
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/profiles.der compiled signing profiles."
+if [ -f $WEBCA_HOME/profiles.der ]; then
+   chmod 660 $WEBCA_HOME/profiles.der
+   chgrp www-data $WEBCA_HOME/profiles.der
+   ls -l $WEBCA_HOME/profiles.der
+   echo "$WEBCA_HOME/profiles.der compiled signing profiles exists."
+else
+   echo "$WEBCA_HOME/profiles.der is compiled from profiles.cnf by certsign.cgi on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/issue.log issuance journal."
+if [ -f $WEBCA_HOME/issue.log ]; then
+   chmod 660 $WEBCA_HOME/issue.log
+   chgrp www-data $WEBCA_HOME/issue.log
+   ls -l $WEBCA_HOME/issue.log
+   echo "$WEBCA_HOME/issue.log issuance journal exists."
+else
+   echo "$WEBCA_HOME/issue.log is created by certsign.cgi on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/db.log database journal."
+if [ -f $WEBCA_HOME/db.log ]; then
+   chmod 660 $WEBCA_HOME/db.log
+   chgrp www-data $WEBCA_HOME/db.log
+   ls -l $WEBCA_HOME/db.log
+   echo "$WEBCA_HOME/db.log database journal exists."
+else
+   echo "$WEBCA_HOME/db.log is created by certsign.cgi on first use."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/index.db CA database."
+if [ -f $WEBCA_HOME/index.db ]; then
+   chmod 660 $WEBCA_HOME/index.db
+   chgrp www-data $WEBCA_HOME/index.db
+   ls -l $WEBCA_HOME/index.db
+   echo "$WEBCA_HOME/index.db CA database exists."
+else
+   echo "$WEBCA_HOME/index.db is created by certdbconv import, or by the first cert signed."
+fi
+echo "Done."
+echo
+
+echo "Check for $WEBCA_HOME/crl.cache CRL entry cache."
+if [ -f $WEBCA_HOME/crl.cache ]; then
+   chmod 660 $WEBCA_HOME/crl.cache
+   chgrp www-data $WEBCA_HOME/crl.cache
+   ls -l $WEBCA_HOME/crl.cache
+   echo "$WEBCA_HOME/crl.cache CRL entry cache exists."
+else
+   echo "$WEBCA_HOME/crl.cache is created by certrevoke.cgi on first use."
+fi
+echo "Done."
+echo
+
 echo "Check for $WEBCA_BASE folder."
 if [ -d $WEBCA_BASE ]; then
    ls -ld $WEBCA_BASE
@@ -168,4 +379,17 @@ else
    ls -ld $WEBCA_BASE/export
 fi
 echo "Done."
+echo
+
+echo "Check for $WEBCA_BASE/webcert.crl CRL file."
+if [ -f $WEBCA_BASE/webcert.crl ]; then
+   chmod 664 $WEBCA_BASE/webcert.crl
+   chgrp www-data $WEBCA_BASE/webcert.crl
+   ls -l $WEBCA_BASE/webcert.crl
+   echo "$WEBCA_BASE/webcert.crl CRL file exists."
+else
+   echo "$WEBCA_BASE/webcert.crl does not exist, certrevoke.cgi cannot create it"
+   echo "in $WEBCA_BASE. Put a first CRL there, group www-data, mode 664."
+fi
+echo "Done."
 echo "End of setup.sh"
@@ -0,0 +1,400 @@
+/* ---------------------------------------------------------- *
+ * file:	casign.c                                      *
+ * purpose:	CA signing of the new certs and CRLs. The CA  *
+ *              key stays loaded in the certsignd daemon, the *
+ *              CGIs send it the unsigned cert or CRL through *
+ *              SIGNSOCKET. Without the daemon, the key is    *
+ *              loaded from CAKEY and signed here, as before. *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * load_cakey(): loads the CA private key from CAKEY.         *
+ * ---------------------------------------------------------- */
+EVP_PKEY *load_cakey() {
+  EVP_PKEY *key = NULL;
+  FILE *fp;
+
+  if (! (fp = fopen(CAKEY, "r")))
+    int_error("Error reading CA private key file");
+  if (! (key = PEM_read_PrivateKey(fp, NULL, NULL, PASS)))
+    int_error("Error importing key content from file");
+  fclose(fp);
+  return key;
+}
+
+/* ---------------------------------------------------------- *
+ * casign_read(), casign_write(): one frame and its DER data, *
+ * retried over short reads and writes. casign_read() checks  *
+ * the header and mallocs 'data'. returns 1, or 0 for errors  *
+ * and EOF.                                                   *
+ * ---------------------------------------------------------- */
+static int casign_io(int fd, void *buf, size_t len, int wr) {
+  unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = wr ? send(fd, p, len, MSG_NOSIGNAL) : read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    p += n;
+    len -= n;
+  }
+  return 1;
+}
+
+int casign_read(int fd, CASIGN_FRAME *f, unsigned char **data) {
+  *data = NULL;
+  if (! casign_io(fd, f, sizeof(CASIGN_FRAME), 0) ||
+      f->magic != CASIGN_MAGIC || f->len > SIGND_MAXLEN) return 0;
+  if (f->len == 0) return 1;
+  if ((*data = malloc(f->len)) == NULL) return 0;
+  if (! casign_io(fd, *data, f->len, 0)) {
+    free(*data);
+    *data = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+int casign_write(int fd, const CASIGN_FRAME *f, const unsigned char *data) {
+  return (casign_io(fd, (void *) f, sizeof(CASIGN_FRAME), 1) &&
+          (f->len == 0 || casign_io(fd, (void *) data, f->len, 1)));
+}
+
+/* ---------------------------------------------------------- *
+ * casign_seal(): an unsigned cert or CRL has no DER form, it *
+ * is sealed with a throwaway key to send it. The signature   *
+ * of certsignd replaces the seal, algorithm ids and all.     *
+ * ---------------------------------------------------------- */
+static EVP_PKEY *casign_seal() {
+  static EVP_PKEY *seal = NULL;
+
+  if (seal == NULL) seal = EVP_EC_gen("P-256");
+  return seal;
+}
+
+/* ---------------------------------------------------------- *
+ * casign_connect(): connects to certsignd. returns the fd,   *
+ * or -1 if it is not running.                                *
+ * ---------------------------------------------------------- */
+static int casign_connect() {
+  struct sockaddr_un addr;
+  struct timeval tv = { SIGND_TIMEOUT, 0 };
+  int fd;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0) return -1;
+  memset(&addr, '\0', sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", SIGNSOCKET);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  /* a hung certsignd fails the request, it does not hang the CGI */
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+/* ---------------------------------------------------------- *
+ * casign_send(), casign_recv(): a request to certsignd, and  *
+ * the next reply. casign_recv() returns 1 with the signed    *
+ * DER in 'out', 0 if certsignd refused the request, and -1   *
+ * if the connection failed, like casign_send() returning 0.  *
+ * ---------------------------------------------------------- */
+static int casign_send(int fd, int op, const EVP_MD *md,
+                                       const unsigned char *der, int len) {
+  CASIGN_FRAME f;
+
+  memset(&f, '\0', sizeof(f));
+  f.magic = CASIGN_MAGIC;
+  f.op    = op;
+  f.md    = EVP_MD_type(md);
+  f.len   = len;
+  return casign_write(fd, &f, der);
+}
+
+static int casign_recv(int fd, unsigned char **out, uint32_t *outlen) {
+  CASIGN_FRAME f;
+
+  if (! casign_read(fd, &f, out)) return -1;
+  if (f.status != CASIGN_OK || f.len == 0) {
+    free(*out);
+    *out = NULL;
+    return 0;
+  }
+  *outlen = f.len;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * casign_cert(): signs the new cert with the CA key, by      *
+ * certsignd, or with CAKEY if it is not running. The signed  *
+ * cert from certsignd replaces '*cert'. returns 1, 0 errors. *
+ * ---------------------------------------------------------- */
+int casign_cert(X509 **cert, const EVP_MD *md) {
+  unsigned char *der = NULL, *out = NULL;
+  const unsigned char *p;
+  X509 *signedcert;
+  uint32_t outlen = 0;
+  int fd, len, ret = -1;
+
+  if ((fd = casign_connect()) >= 0) {
+    if (casign_seal() == NULL || ! X509_sign(*cert, casign_seal(), EVP_sha256()) ||
+        (len = i2d_X509(*cert, &der)) <= 0) ret = 0;
+    else if (casign_send(fd, CASIGN_CERT, md, der, len))
+      ret = casign_recv(fd, &out, &outlen);
+    OPENSSL_free(der);
+    close(fd);
+  }
+
+  if (ret == 1) {
+    p = out;
+    if ((signedcert = d2i_X509(NULL, &p, outlen)) != NULL) {
+      X509_free(*cert);
+      *cert = signedcert;
+    }
+    else ret = 0;
+    free(out);
+  }
+#ifndef SIGND_ONLY
+  if (ret == -1) {
+    EVP_PKEY *key = load_cakey();
+    ret = (X509_sign(*cert, key, md) > 0);
+    EVP_PKEY_free(key);
+  }
+#endif
+  return (ret == 1);
+}
+
+/* ---------------------------------------------------------- *
+ * casign_crl(): signs the new CRL, the same as casign_cert() *
+ * ---------------------------------------------------------- */
+int casign_crl(X509_CRL **crl, const EVP_MD *md) {
+  unsigned char *der = NULL, *out = NULL;
+  const unsigned char *p;
+  X509_CRL *signedcrl;
+  uint32_t outlen = 0;
+  int fd, len, ret = -1;
+
+  if ((fd = casign_connect()) >= 0) {
+    if (casign_seal() == NULL || ! X509_CRL_sign(*crl, casign_seal(), EVP_sha256()) ||
+        (len = i2d_X509_CRL(*crl, &der)) <= 0) ret = 0;
+    else if (casign_send(fd, CASIGN_CRL, md, der, len))
+      ret = casign_recv(fd, &out, &outlen);
+    OPENSSL_free(der);
+    close(fd);
+  }
+
+  if (ret == 1) {
+    p = out;
+    if ((signedcrl = d2i_X509_CRL(NULL, &p, outlen)) != NULL) {
+      X509_CRL_free(*crl);
+      *crl = signedcrl;
+    }
+    else ret = 0;
+    free(out);
+  }
+#ifndef SIGND_ONLY
+  if (ret == -1) {
+    EVP_PKEY *key = load_cakey();
+    ret = (X509_CRL_sign(*crl, key, md) > 0);
+    EVP_PKEY_free(key);
+  }
+#endif
+  return (ret == 1);
+}
+
+/* ---------------------------------------------------------- *
+ * casign_aid(): the DER AlgorithmIdentifier of a signature   *
+ * with 'key' and 'md', as the signature field of a TBS has   *
+ * it. The CA cert's public key gives the same as the CA key. *
+ * *aidlen has the size of 'aid', and returns the length.     *
+ * returns 1 for success, 0 for errors.                       *
+ * ---------------------------------------------------------- */
+int casign_aid(EVP_PKEY *key, const EVP_MD *md, unsigned char *aid,
+                                                      size_t *aidlen) {
+  EVP_MD_CTX *ctx;
+  EVP_PKEY_CTX *pctx;
+  OSSL_PARAM params[2];
+  int ret = 0;
+
+  if ((ctx = EVP_MD_CTX_new()) == NULL) return 0;
+  params[0] = OSSL_PARAM_construct_octet_string(
+                            OSSL_SIGNATURE_PARAM_ALGORITHM_ID, aid, *aidlen);
+  params[1] = OSSL_PARAM_construct_end();
+  if (EVP_DigestVerifyInit(ctx, &pctx, md, NULL, key) > 0 &&
+      EVP_PKEY_CTX_get_params(pctx, params) > 0 &&
+      OSSL_PARAM_modified(&params[0])) {
+    *aidlen = params[0].return_size;
+    ret = 1;
+  }
+  EVP_MD_CTX_free(ctx);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * casign_crltbs(): signs the DER TBSCertList of a CRL that   *
+ * was put together by crlcache_tbs(), by certsignd, or with  *
+ * CAKEY if it is not running. The signature is returned in a *
+ * malloc() 'sig'. returns 1 for success, 0 for errors.       *
+ * ---------------------------------------------------------- */
+int casign_crltbs(const unsigned char *tbs, size_t tbslen, const EVP_MD *md,
+                                      unsigned char **sig, size_t *siglen) {
+  uint32_t outlen = 0;
+  int fd, ret = -1;
+
+  *sig = NULL;
+  if (tbslen > SIGND_MAXLEN) return 0;
+  if ((fd = casign_connect()) >= 0) {
+    if (casign_send(fd, CASIGN_CRLTBS, md, tbs, tbslen))
+      ret = casign_recv(fd, sig, &outlen);
+    close(fd);
+    *siglen = outlen;
+  }
+#ifndef SIGND_ONLY
+  if (ret == -1) {
+    EVP_PKEY *key = load_cakey();
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    ret = 0;
+    if (ctx && EVP_DigestSignInit(ctx, NULL, md, NULL, key) > 0 &&
+        EVP_DigestSign(ctx, NULL, siglen, tbs, tbslen) > 0 &&
+        (*sig = malloc(*siglen)) != NULL &&
+        EVP_DigestSign(ctx, *sig, siglen, tbs, tbslen) > 0) ret = 1;
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(key);
+  }
+#endif
+  if (ret != 1) {
+    free(*sig);
+    *sig = NULL;
+  }
+  return (ret == 1);
+}
+
+/* ---------------------------------------------------------- *
+ * CASIGN_JOB: the share of one casign_certs() thread, certs  *
+ * first to last-1. With 'key' they are signed locally, else  *
+ * pipelined to certsignd, SIGND_WINDOW requests in flight.   *
+ * ---------------------------------------------------------- */
+typedef struct casign_job_st {
+  X509        **certs;
+  int           first;
+  int           last;
+  const EVP_MD *md;
+  EVP_PKEY     *key;
+  int           ret;
+} CASIGN_JOB;
+
+static void *casign_worker(void *arg) {
+  CASIGN_JOB *job = arg;
+  unsigned char *der, *out;
+  const unsigned char *p;
+  X509 *signedcert;
+  uint32_t outlen = 0;
+  int fd, len, sent, done;
+
+  job->ret = 0;
+  if (job->key) {
+    for (done = job->first; done < job->last; done++)
+      if (X509_sign(job->certs[done], job->key, job->md) <= 0) return NULL;
+    job->ret = 1;
+    return NULL;
+  }
+
+  if ((fd = casign_connect()) < 0) return NULL;
+  for (sent = done = job->first; done < job->last; done++) {
+    /* keep the window full, then take the oldest reply */
+    for (; sent < job->last && sent - done < SIGND_WINDOW; sent++) {
+      der = NULL;
+      if (! X509_sign(job->certs[sent], casign_seal(), EVP_sha256()) ||
+          (len = i2d_X509(job->certs[sent], &der)) <= 0 ||
+          ! casign_send(fd, CASIGN_CERT, job->md, der, len)) {
+        OPENSSL_free(der);
+        close(fd);
+        return NULL;
+      }
+      OPENSSL_free(der);
+    }
+    if (casign_recv(fd, &out, &outlen) != 1) break;
+    p = out;
+    signedcert = d2i_X509(NULL, &p, outlen);
+    free(out);
+    if (signedcert == NULL) break;
+    X509_free(job->certs[done]);
+    job->certs[done] = signedcert;
+  }
+  close(fd);
+  job->ret = (done == job->last);
+  return NULL;
+}
+
+/* ---------------------------------------------------------- *
+ * casign_certs(): signs a batch of new certs in parallel, a  *
+ * thread and certsignd connection per CPU, or with the CAKEY *
+ * loaded once if certsignd is not running. The signed certs  *
+ * replace the 'certs' entries. returns 1 if all were signed. *
+ * ---------------------------------------------------------- */
+int casign_certs(X509 **certs, int count, const EVP_MD *md) {
+  CASIGN_JOB jobs[CERTSCAN_MAXTHREADS];
+  pthread_t tids[CERTSCAN_MAXTHREADS];
+  EVP_PKEY *key = NULL;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads, started, i, fd, ret = 1;
+
+  if (count <= 0) return 1;
+  if ((fd = casign_connect()) >= 0) {
+    close(fd);
+    /* the seal key is made once, before the threads share it */
+    if (casign_seal() == NULL) return 0;
+  }
+  else {
+#ifdef SIGND_ONLY
+    return 0;
+#else
+    key = load_cakey();
+#endif
+  }
+
+  nthreads = (cpus < 1) ? 1 : (cpus > CERTSCAN_MAXTHREADS) ?
+                                           CERTSCAN_MAXTHREADS : (int) cpus;
+  if (nthreads > count) nthreads = count;
+
+  for (i = 0; i < nthreads; i++) {
+    jobs[i].certs = certs;
+    jobs[i].first = (int) ((long) count * i / nthreads);
+    jobs[i].last  = (int) ((long) count * (i + 1) / nthreads);
+    jobs[i].md    = md;
+    jobs[i].key   = key;
+    jobs[i].ret   = 0;
+  }
+  for (started = 0; started < nthreads; started++)
+    if (pthread_create(&tids[started], NULL, casign_worker, &jobs[started]) != 0)
+      break;
+  /* a thread that did not start leaves its share to this one */
+  for (i = started; i < nthreads; i++) {
+    casign_worker(&jobs[i]);
+    if (! jobs[i].ret) ret = 0;
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+    if (! jobs[i].ret) ret = 0;
+  }
+  EVP_PKEY_free(key);
+  return ret;
+}
@@ -0,0 +1,344 @@
+/* -------------------------------------------------------------------------- *
+ * file:	certbatch.cgi                                                 *
+ * purpose:	sign a bundle of certificate requests with one profile, for   *
+ *              rolling out certs to many hosts. The "csrbundle" is a list of *
+ *              PEM requests, or a JSON array of PEM strings. The serials are *
+ *              issued in one call, the certs are signed in parallel and      *
+ *              committed to INDEXDB, the store and its index at once.        *
+ *              Without a bundle, the batch request form is shown.            *
+ * ---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <cgic.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * batch_add(): appends one request to the batch list.        *
+ * ---------------------------------------------------------- */
+static void batch_add(X509_REQ ***reqs, int *count, X509_REQ *req) {
+  if (*count >= BATCH_MAXCSR) {
+    X509_REQ_free(req);
+    int_error("Error the bundle has too many requests, see BATCH_MAXCSR");
+  }
+  if ((*reqs = realloc(*reqs, (*count + 1) * sizeof(X509_REQ *))) == NULL)
+    int_error("Error out of memory for the request list");
+  (*reqs)[(*count)++] = req;
+}
+
+/* ---------------------------------------------------------- *
+ * batch_pem(): reads the requests of a PEM text, one or many *
+ * Text around the requests is skipped, a request that fails  *
+ * to parse fails the batch, with its position in the bundle. *
+ * ---------------------------------------------------------- */
+static void batch_pem(const char *pem, size_t len, X509_REQ ***reqs,
+                                                              int *count) {
+  BIO *bio = BIO_new_mem_buf(pem, (int) len);
+  X509_REQ *req;
+  unsigned long err;
+
+  while ((req = PEM_read_bio_X509_REQ(bio, NULL, NULL, NULL)) != NULL)
+    batch_add(reqs, count, req);
+  BIO_free(bio);
+
+  /* the end of the bundle is a "no start line" error, not data */
+  err = ERR_peek_last_error();
+  if (err != 0 && (ERR_GET_LIB(err) != ERR_LIB_PEM
+                   || ERR_GET_REASON(err) != PEM_R_NO_START_LINE)) {
+    snprintf(error_str, sizeof(error_str),
+        "Error reading request #%d of the bundle, it is not a valid PEM "
+        "certificate request", *count + 1);
+    int_error(error_str);
+  }
+  ERR_clear_error();
+}
+
+/* ---------------------------------------------------------- *
+ * batch_json(): reads the requests of a JSON array of PEM    *
+ * strings, i.e. ["-----BEGIN CERTIFICATE REQUEST-----\n..."] *
+ * The strings are unescaped in place. returns 1, 0 for bad   *
+ * JSON.                                                      *
+ * ---------------------------------------------------------- */
+static int batch_json(char *s, X509_REQ ***reqs, int *count) {
+  char *str, *out;
+  int n, strnum = 0;
+
+  while (isspace((unsigned char) *s)) s++;
+  if (*s++ != '[') return 0;
+  for (;;) {
+    while (isspace((unsigned char) *s)) s++;
+    if (*s == ']' && *count == 0) return 1;
+    if (*s++ != '"') return 0;
+
+    for (str = out = s; *s != '"'; s++) {
+      if (*s == '\0') return 0;
+      if (*s != '\\') {
+        *out++ = *s;
+        continue;
+      }
+      switch (*++s) {
+        case 'n':  *out++ = '\n'; break;
+        case 'r':  *out++ = '\r'; break;
+        case 't':  *out++ = '\t'; break;
+        case '"':  *out++ = '"';  break;
+        case '\\': *out++ = '\\'; break;
+        case '/':  *out++ = '/';  break;
+        default: return 0;   /* no \u escapes in PEM */
+      }
+    }
+    s++;
+    strnum++;
+    n = *count;
+    batch_pem(str, out - str, reqs, count);
+    if (*count == n) {
+      snprintf(error_str, sizeof(error_str),
+          "Error string #%d of the bundle has no PEM certificate request",
+          strnum);
+      int_error(error_str);
+    }
+
+    while (isspace((unsigned char) *s)) s++;
+    if (*s == ']') return 1;
+    if (*s++ != ',') return 0;
+  }
+}
+
+int cgiMain() {
+   ASN1_INTEGER **aserials = NULL;
+   X509_REQ    **reqs = NULL;
+   X509        **certs = NULL;
+   X509          *cacert;
+   uint64_t     *file_offs = NULL;
+   SIGN_PROFILE  prof;
+   CERT_SERIAL   serial;
+   char          serialhex[SERIAL_HEXLEN];
+   char          firsthex[SERIAL_HEXLEN] = "";
+   char          bundlefile[512] = "";
+   char          format[8] = "";
+   char          *bundle;
+   int           bundlelen = 0;
+   int           count = 0, stored = 0;
+   int           i;
+   FILE          *fp;
+
+/* ---------------------------------------------------------- *
+ * These function calls are essential to make many PEM +      *
+ * other openssl functions work.                              *
+ * ---------------------------------------------------------- */
+   OpenSSL_add_all_algorithms();
+   ERR_load_crypto_strings();
+   ERR_load_BIO_strings();
+
+/* ---------------------------------------------------------- *
+ * without a bundle, show the batch form                      *
+ * ---------------------------------------------------------- */
+   if (cgiFormStringSpaceNeeded("csrbundle", &bundlelen) != cgiFormSuccess
+       || bundlelen <= 1) {
+      static char title[] = "Sign a Batch of Requests";
+      pagehead(title);
+      display_signing(NULL);
+      pagefoot();
+      return(0);
+   }
+   if (bundlelen > BATCH_MAXCSR * REQLEN)
+      int_error("Error the request bundle is too big, see BATCH_MAXCSR");
+   if ((bundle = malloc(bundlelen)) == NULL)
+      int_error("Error out of memory for the request bundle");
+   if (cgiFormString("csrbundle", bundle, bundlelen) != cgiFormSuccess)
+      int_error("Error getting the request bundle from the batch form");
+
+/* ---------------------------------------------------------- *
+ * read the requests, a JSON array or PEM text, and check the *
+ * signature of each before anything is reserved or signed    *
+ * ---------------------------------------------------------- */
+   for (i = 0; isspace((unsigned char) bundle[i]); i++);
+   if (bundle[i] == '[') {
+      if (! batch_json(bundle, &reqs, &count))
+         int_error("Error the request bundle is not a JSON array of PEM strings");
+   }
+   else batch_pem(bundle, strlen(bundle), &reqs, &count);
+   free(bundle);
+   if (count == 0)
+      int_error("Error no PEM certificate request found in the bundle");
+
+   for (i = 0; i < count; i++) {
+      EVP_PKEY *pkey = X509_REQ_get_pubkey(reqs[i]);
+      if (pkey == NULL || X509_REQ_verify(reqs[i], pkey) != 1) {
+         snprintf(error_str, sizeof(error_str),
+              "Error verifying signature on request #%d of the bundle", i + 1);
+         int_error(error_str);
+      }
+      EVP_PKEY_free(pkey);
+   }
+
+   cgi_load_profile(&prof);
+   cgiFormString("format", format, sizeof(format));
+
+/* ----------------------------------------------------------- *
+ * Load CA Certificate from file for signer info               *
+ * ------------------------------------------------------------*/
+   if (! (fp=fopen(CACERT, "r")))
+      int_error("Error reading CA cert file");
+   if(! (cacert = PEM_read_X509(fp,NULL,NULL,NULL)))
+      int_error("Error loading CA cert into memory");
+   fclose(fp);
+
+/* ----------------------------------------------------------- *
+ * get the serials, leased as one block from SERIALFILE or     *
+ * random ones, after joining the issuance journal             *
+ * ------------------------------------------------------------*/
+   if ((aserials = calloc(count, sizeof(ASN1_INTEGER *))) == NULL)
+      int_error("Error out of memory for the batch serials");
+   issuelog_begin();
+   if (! issue_serials(aserials, count))
+      int_error("Error getting serial # from serial file");
+
+/* ----------------------------------------------------------- *
+ * build and sign the certs, the signing runs in parallel      *
+ * ------------------------------------------------------------*/
+   if ((certs = calloc(count, sizeof(X509 *))) == NULL ||
+       (file_offs = calloc(count, sizeof(uint64_t))) == NULL)
+      int_error("Error out of memory for the batch certs");
+
+   for (i = 0; i < count; i++) {
+      certs[i] = build_cert(reqs[i], cacert, &prof, aserials[i]);
+      X509_REQ_free(reqs[i]);
+      ASN1_INTEGER_free(aserials[i]);
+   }
+   free(aserials);
+   free(reqs);
+
+   if (! casign_certs(certs, count, prof.digest))
+      int_error("Error signing the batch certificates");
+
+/* ---------------------------------------------------------- *
+ * register the new certs as valid in the CA database, in one *
+ * commit. An active duplicate subject fails the batch        *
+ * -----------------------------------------------------------*/
+   CA_DB *db = NULL;
+   DB_ATTR db_attr = { UNIQUE_SUBJECT };
+   if ((db = certdb_open(INDEXDB, &db_attr)) == NULL)
+      int_error("Error cannot load CA certificate database file");
+   for (i = 0; i < count; i++) add_index(certs[i], db);
+   if (certdb_commit(db, 0) != 1)
+      int_error("Error cannot write CA certificate database file");
+   certdb_close(db);
+
+/* ---------------------------------------------------------- *
+ * only the committed batch goes to the journal, and it has   *
+ * to be durable there before the store files and the page    *
+ * -----------------------------------------------------------*/
+   if (! issuelog_commit(certs, count))
+      int_error("Error writing the batch certificates to the issuance journal");
+
+/* ---------------------------------------------------------- *
+ * write the certs to the cert store, and the multi-PEM file  *
+ * of the batch to CERTEXPORTDIR for the download             *
+ * -----------------------------------------------------------*/
+   for (i = 0; i < count; i++)
+      if (write_storecert(certs[i], &file_offs[i])) stored++;
+
+   if (! serial_from_asn1(&serial, X509_get_serialNumber(certs[0])))
+      int_error("Error serial number is negative or exceeds 20 bytes");
+   serial_to_hex(&serial, firsthex, sizeof(firsthex));
+   if (! serial_from_asn1(&serial, X509_get_serialNumber(certs[count-1])))
+      int_error("Error serial number is negative or exceeds 20 bytes");
+   serial_to_hex(&serial, serialhex, sizeof(serialhex));
+   snprintf(bundlefile, sizeof(bundlefile), "%s/batch-%s-%s.pem",
+                                       CERTEXPORTDIR, firsthex, serialhex);
+   if ((fp = fopen(bundlefile, "w")) != NULL) {
+      for (i = 0; i < count; i++) PEM_write_X509(fp, certs[i]);
+      if (fclose(fp) != 0) bundlefile[0] = '\0';
+   }
+   else bundlefile[0] = '\0';
+
+/* ---------------------------------------------------------- *
+ * add the batch to the cert store metadata index as a whole  *
+ * -----------------------------------------------------------*/
+   int idx_ok = update_certindex_batch(CERTINDEX, certs, file_offs, count);
+   int dn_ok = 1, san_ok = 1;
+   for (i = 0; i < count; i++) {
+      if (! serial_from_asn1(&serial, X509_get_serialNumber(certs[i])) ||
+          ! dngram_add(DNINDEX, &serial)) dn_ok = 0;
+      if (! sanidx_add(SANINDEX, certs[i])) san_ok = 0;
+   }
+   issuelog_done();
+
+/* ---------------------------------------------------------- *
+ * "format=pem" returns the signed certs as one PEM response, *
+ * for scripted roll-outs. Otherwise list them in html.       *
+ * -----------------------------------------------------------*/
+   if (strcmp(format, "pem") == 0) {
+      cgiHeaderContentType("application/x-pem-file");
+      for (i = 0; i < count; i++) PEM_write_X509(cgiOut, certs[i]);
+      for (i = 0; i < count; i++) X509_free(certs[i]);
+      free(certs);
+      free(file_offs);
+      return(0);
+   }
+
+   static char title[]  = "Signed Certificate Batch";
+   pagehead(title);
+
+   fprintf(cgiOut, "<table>\n");
+   fprintf(cgiOut, "<tr>\n");
+   fprintf(cgiOut, "<th colspan=\"3\">");
+   fprintf(cgiOut, "%d certificates signed, serial %s to %s",
+                                               count, firsthex, serialhex);
+   fprintf(cgiOut, "</th>\n");
+   fprintf(cgiOut, "</tr>\n");
+
+   for (i = 0; i < count; i++) {
+      char subject[256] = "";
+      char escsubject[6*256] = "";
+      if (! serial_from_asn1(&serial, X509_get_serialNumber(certs[i])))
+         continue;
+      serial_to_hex(&serial, serialhex, sizeof(serialhex));
+      X509_NAME_oneline(X509_get_subject_name(certs[i]), subject,
+                                                          sizeof(subject));
+      fprintf(cgiOut, "<tr>\n");
+      fprintf(cgiOut, "<td>%s</td>\n", serialhex);
+      fprintf(cgiOut, "<td>%s</td>\n",
+                 html_escape(escsubject, sizeof(escsubject), subject));
+      fprintf(cgiOut, "<th>");
+      fprintf(cgiOut, "<form action=\"getcert.cgi\" method=\"post\">\n");
+      fprintf(cgiOut, "<input type=\"hidden\" name=\"cfilename\" ");
+      fprintf(cgiOut, "value=\"%s.pem\" />\n", serialhex);
+      fprintf(cgiOut, "<input type=\"hidden\" name=\"format\" value=\"text\" />\n");
+      fprintf(cgiOut, "<input class=\"getcert\" type=\"submit\" value=\"Detail\" />\n");
+      fprintf(cgiOut, "</form>\n");
+      fprintf(cgiOut, "</th>\n");
+      fprintf(cgiOut, "</tr>\n");
+   }
+
+   if (bundlefile[0] != '\0') {
+      fprintf(cgiOut, "<tr>\n");
+      fprintf(cgiOut, "<th colspan=\"3\">");
+      fprintf(cgiOut, "<a href=\"http://%s%s/%s\">", cgiServerName,
+                         CERTEXPORTURL, strrchr(bundlefile, '/') + 1);
+      fprintf(cgiOut, "Download all certificates as one PEM file</a>");
+      fprintf(cgiOut, "</th>\n");
+      fprintf(cgiOut, "</tr>\n");
+   }
+   fprintf(cgiOut, "</table>\n");
+
+   if (stored < count)
+     fprintf(cgiOut, "<p>Error writing %d of the signed certs to the store.<p>",
+                                                             count - stored);
+   if (! idx_ok)
+     fprintf(cgiOut, "<p>Error updating the cert store index %s.<p>", CERTINDEX);
+   if (! dn_ok)
+     fprintf(cgiOut, "<p>Error updating the subject DN index %s.<p>", DNINDEX);
+   if (! san_ok)
+     fprintf(cgiOut, "<p>Error updating the SAN index %s.<p>", SANINDEX);
+
+   for (i = 0; i < count; i++) X509_free(certs[i]);
+   free(certs);
+   free(file_offs);
+   pagefoot();
+   return(0);
+}
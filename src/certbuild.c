@@ -0,0 +1,567 @@
+/* ---------------------------------------------------------- *
+ * file:	certbuild.c                                   *
+ * purpose:	builds the unsigned cert of a request, with   *
+ *              the signing options of the certsign forms in  *
+ *              a SIGN_PROFILE, or a named profile of the     *
+ *              PROFILEFILE. Used by certsign.cgi for one     *
+ *              request, and by certbatch.cgi for many.       *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cgic.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include "webcert.h"
+
+static char * mkdatestr(char *, char *);
+
+static int check_ext_presence(X509_EXTENSION *test_ext, X509 *cert);
+
+/* ---------------------------------------------------------- *
+ * cgi_load_profile(): reads the signing options of the form  *
+ * of genrequest/certverify.cgi into 'prof'.                  *
+ * ---------------------------------------------------------- */
+void cgi_load_profile(SIGN_PROFILE *prof) {
+   char	     *validlist[] = { "vd","se" };
+   int	        valid_res = 0;
+   char     startdate[11] = "";
+   char      starttime[9] = "";
+   char       enddate[11] = "";
+   char        endtime[9] = "";
+   char	 validdaystr[255] = "";
+   char	    sigalgstr[41] = "SHA-256";
+   char profilestr[PROFILE_NAMELEN] = "";
+   char	      *typelist[] = { "sv","cl","em","os","ca" };
+   int	         type_res = 0;
+   long	       valid_days = 0;
+
+   memset(prof, '\0', sizeof(SIGN_PROFILE));
+
+   if(cgiFormString("sigalg", sigalgstr, sizeof(sigalgstr)) != cgiFormSuccess)
+      int_error("Error getting the signature algorithm from genrequest/certverify.cgi forms");
+
+   if (cgiFormRadio("valid", validlist, 2, &valid_res, 0) == cgiFormNotFound )
+      int_error("Error getting the date range type from genrequest/certverify.cgi forms");
+   strcpy(prof->valid, validlist[valid_res]);
+
+   if (strcmp(validlist[valid_res], "vd") == 0) {
+      if(cgiFormString("daysvalid", validdaystr, sizeof(validdaystr)) != cgiFormSuccess)
+        int_error("Error getting expiration from genrequest/certverify.cgi form");
+
+/* -------------------------------------------------------------------------- *
+ * What happens if a negative value is given as the expiration date?          *
+ * The certificate is generated with a expiration before it becomes valid.    *
+ * We do a check here to prevent that.                                        *
+ * -------------------------------------------------------------------------- */
+      /* convert the number string to data type long, max is 10 digits */
+      valid_days = strtoul(validdaystr, NULL, 10);
+      if (valid_days <= 0)
+         int_error("Error invalid (i.e. negative or zero) value for expiration date.");
+
+      /* convert days into (long) seconds */
+      prof->valid_secs = valid_days*60*60*24;
+
+/* -------------------------------------------------------------------------- *
+ * year 2038 32bit Unix time integer overflow:                                *
+ * What happens if a very large value is given as the expiration date?        *
+ * The date rolls over to the old century (1900) and the expiration date      *
+ * becomes invalid. We do a check here to prevent that.                       *
+ * Although we store the value in type long, 32bit UNIX systems historically  *
+ * used a 32bit integer datatype for counting seconds since Jan 1, 1970.      *
+ * This will cause a range overflow when we reach the year 2038, and the sec  *
+ * counter reaches 2,147,483,647, the max value for a unsigned 32bit integer. *
+ * -------------------------------------------------------------------------- */
+#ifdef TIME_PROTECTION
+      time_t now = 0;
+      now = time(NULL);
+      long future = now + prof->valid_secs;
+      if (future > 2147483647 || future < 0)
+         int_error("Error expiration date set past 2038, causing trouble on 32bit.");
+#endif
+   }
+
+   if (strcmp(validlist[valid_res], "se") == 0) {
+      if (! (cgiFormString("startdate", startdate, sizeof(startdate)) == cgiFormSuccess ))
+         int_error("Error getting start date from previous form");
+      if (! (cgiFormString("starttime", starttime, sizeof(starttime)) == cgiFormSuccess ))
+         int_error("Error getting start time from previous form");
+      if (! (cgiFormString("enddate", enddate, sizeof(enddate)) == cgiFormSuccess ))
+         int_error("Error getting end date from previous form");
+      if (! (cgiFormString("endtime", endtime, sizeof(endtime)) == cgiFormSuccess ))
+         int_error("Error getting end time from previous form");
+
+      strncpy(prof->startdate, mkdatestr(startdate, starttime), 15);
+      strncpy(prof->enddate, mkdatestr(enddate, endtime), 15);
+   }
+
+   if (cgiFormRadio("type", typelist, 5, &type_res, 0) == cgiFormNotFound )
+      int_error("Error getting cert type(s) from previous form");
+   strcpy(prof->type, typelist[type_res]);
+
+/* ---------------------------------------------------------- *
+ * A named signing profile replaces the key usage, extended   *
+ * key usage and CRL URI settings of the form                 *
+ * ---------------------------------------------------------- */
+   if (cgiFormString("profile", profilestr, sizeof(profilestr)) == cgiFormSuccess
+       && profilestr[0] != '\0') {
+      if ((prof->profile = find_profile(profilestr)) == NULL)
+         int_error("Error unknown signing profile, see PROFILEFILE");
+      if (cgiFormString("ename", prof->ename, sizeof(prof->ename)) != cgiFormSuccess)
+         prof->ename[0] = '\0';
+   }
+   else {
+      prof->keyusage = (cgiFormCheckboxSingle("keyusage") == cgiFormSuccess);
+      if (prof->keyusage && strcmp(prof->type, "em") == 0 &&
+          cgiFormString("ename", prof->ename, sizeof(prof->ename)) != cgiFormSuccess)
+         prof->ename[0] = '\0';
+
+      if (cgiFormCheckboxSingle("extkeyusage") == cgiFormSuccess) {
+          prof->extkeyusage = 1;
+          /* get the requested extended key usage type */
+          if (cgiFormString("extkeytype", prof->extkeytype, 81) == cgiFormNotFound ) {
+              int_error("Error getting extended key usage type from previous form");
+          }
+       }
+
+      prof->addcrluri = (cgiFormCheckboxSingle("addcrluri") == cgiFormSuccess);
+   }
+
+/* ---------------------------------------------------------- *
+ *  Set digest algorithm strength, use only SHA variants      *
+ * ---------------------------------------------------------- */
+   if(strcmp(sigalgstr, "SHA-224") == 0) prof->digest = EVP_sha224();
+   else if(strcmp(sigalgstr, "SHA-256") == 0) prof->digest = EVP_sha256();
+   else if(strcmp(sigalgstr, "SHA-384") == 0) prof->digest = EVP_sha384();
+   else if(strcmp(sigalgstr, "SHA-512") == 0) prof->digest = EVP_sha512();
+   else int_error("Error received unknown sigalg string");
+}
+
+/* ---------------------------------------------------------- *
+ * build_cert(): verifies the request signature, and builds   *
+ * the unsigned cert for it with serial 'aserial', the issuer *
+ * 'cacert' and the options of 'prof'. Sign it with           *
+ * casign_cert() next.                                        *
+ * ---------------------------------------------------------- */
+X509 *build_cert(X509_REQ *certreq, X509 *cacert, const SIGN_PROFILE *prof,
+                                                const ASN1_INTEGER *aserial) {
+   EVP_PKEY     *req_pubkey;
+   X509          *newcert;
+   X509_NAME     *name;
+   X509V3_CTX    ctx;
+   char	  email_head[255] = "email:";
+
+/* ----------------------------------------------------------- *
+ * Certificate request public key verification                 *
+ * ------------------------------------------------------------*/
+   if (! (req_pubkey=X509_REQ_get_pubkey(certreq)))
+           int_error("Error unpacking public key from request");
+   if (X509_REQ_verify(certreq,req_pubkey) != 1)
+      int_error("Error verifying signature on request");
+
+/* ----------------------------------------------------------- *
+ * Build Certificate with data from request                    *
+ * ------------------------------------------------------------*/
+   if (! (newcert=X509_new()))
+      int_error("Error creating new X509 object");
+
+   if (X509_set_version(newcert, 2L) != 1)
+      int_error("Error setting certificate version");
+
+/* ----------------------------------------------------------- *
+ * set the certificate serial number here                      *
+ * ------------------------------------------------------------*/
+   if (! X509_set_serialNumber(newcert, (ASN1_INTEGER *) aserial))
+      int_error("Error setting serial number of the certificate");
+
+   if (! (name = X509_REQ_get_subject_name(certreq)))
+      int_error("Error getting subject from cert request");
+   if (X509_set_subject_name(newcert, name) != 1)
+      int_error("Error setting subject name of certificate");
+   if (! (name = X509_get_subject_name(cacert)))
+      int_error("Error getting subject from CA certificate");
+   if (X509_set_issuer_name(newcert, name) != 1)
+      int_error("Error setting issuer name of certificate");
+
+   if (X509_set_pubkey(newcert, req_pubkey) != 1)
+      int_error("Error setting public key of certificate");
+   EVP_PKEY_free(req_pubkey);
+
+/* ----------------------------------------------------------- *
+ * Set X509V3 start date "now", expire date "now+valid_secs"   *
+ * ------------------------------------------------------------*/
+   if (strcmp(prof->valid, "vd") == 0) {
+      if (! (X509_gmtime_adj(X509_get_notBefore(newcert),0)))
+         int_error("Error setting beginning time of certificate");
+
+      if(! (X509_gmtime_adj(X509_get_notAfter(newcert), prof->valid_secs)))
+         int_error("Error setting expiration time of certificate");
+   }
+
+/* ----------------------------------------------------------- *
+ * Set X509V3 start and expire date if it was specifically set *
+ * ------------------------------------------------------------*/
+   if (strcmp(prof->valid, "se") == 0) {
+      if (! ASN1_TIME_set_string(X509_get_notBefore(newcert), prof->startdate))
+         int_error("Error start date is invalid, it should be YYYYMMDDHHMMSSZ");
+
+      if (! ASN1_TIME_set_string(X509_get_notAfter(newcert), prof->enddate))
+         int_error("Error end date is invalid, it should be YYYYMMDDHHMMSSZ");
+   }
+
+/* ----------------------------------------------------------- *
+ * Add X509V3 extensions                                       *
+ * ------------------------------------------------------------*/
+   STACK_OF(X509_EXTENSION) *ext_list = NULL;
+   X509_EXTENSION *ext;
+   int i;
+
+   X509V3_set_ctx(&ctx, cacert, newcert, NULL, NULL, 0);
+
+   /* if the certificte request contains extensions, we add them first */
+   if ((ext_list = X509_REQ_get_extensions(certreq)) != NULL) {
+     /* add each requested extension to the cert, except the ones */
+     /* a named profile defines, the signing policy wins          */
+     for (i=0; i<sk_X509_EXTENSION_num(ext_list); i++) {
+        ext = sk_X509_EXTENSION_value(ext_list, i);
+
+        if ((prof->profile == NULL ||
+             X509v3_get_ext_by_OBJ(prof->profile->exts,
+                        X509_EXTENSION_get_object(ext), -1) < 0) &&
+            ! X509_add_ext(newcert, ext, -1))
+          int_error("Error adding X509 extension to certificate");
+
+        X509_EXTENSION_free(ext);
+     }
+   }
+
+   /* a named profile: copies of its extensions, decoded once */
+   if (prof->profile) {
+     for (i=0; i<sk_X509_EXTENSION_num(prof->profile->exts); i++) {
+        ext = sk_X509_EXTENSION_value(prof->profile->exts, i);
+
+        /* extension duplicates: check if the extension is already present */
+        if (check_ext_presence(ext, newcert) == 0) {
+          if (! X509_add_ext(newcert, ext, -1))
+            int_error("Error adding signing profile extension to certificate");
+        }
+     }
+
+     if (prof->ename[0] != '\0') {
+        strncat(email_head, prof->ename, sizeof(email_head) - strlen(email_head) - 1);
+        if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                      "subjectAltName", email_head)))
+          int_error("Error creating X509 e-mail extension object");
+
+        if (check_ext_presence(ext, newcert) == 0) {
+          if (! X509_add_ext(newcert, ext, -1))
+             int_error("Error adding X509 subjectAltName extension to certificate");
+        }
+        X509_EXTENSION_free(ext);
+     }
+   }
+
+   /* Unless we sign a CA cert, always add the CA:FALSE constraint */
+   if (strcmp(prof->type, "ca") != 0) {
+      if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                                  "basicConstraints", "critical,CA:FALSE"))) {
+         int_error("Error creating X509 extension object");
+      }
+      /* extension duplicates: check if the extension is already present */
+      if (check_ext_presence(ext, newcert) == 0) {
+        /* try to add it to the certificate */
+        if (! X509_add_ext(newcert, ext, -1))
+          int_error("Error adding X509 extension to certificate");
+      }
+      X509_EXTENSION_free(ext);
+   /* a CA cert is requested, we add the CA:TRUE constraint */
+   } else {
+      if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                                  "basicConstraints", "critical,CA:TRUE"))) {
+         int_error("Error creating X509 basicConstraints extension object");
+      }
+      /* extension duplicates: check if the extension is already present */
+      if (check_ext_presence(ext, newcert) == 0) {
+         if (! X509_add_ext(newcert, ext, -1))
+            int_error("Error adding X509 basicConstraints extension to certificate");
+      }
+      X509_EXTENSION_free(ext);
+   }
+
+   /* If enabled, add the following key usage extension */
+   if (prof->keyusage) {
+      if (strcmp(prof->type, "sv") == 0) {
+         if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                        "keyUsage", "digitalSignature,keyEncipherment"))) {
+            int_error("Error creating X509 keyUsage extension object");
+         }
+   
+         /* extension duplicates: check if the extension is already present */
+         if (check_ext_presence(ext, newcert) == 0) {
+            if (! X509_add_ext(newcert, ext, -1))
+               int_error("Error adding X509 keyUsage extension to certificate");
+         }
+         X509_EXTENSION_free(ext);
+      }
+   
+      if (strcmp(prof->type, "cl") == 0) {
+        if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                        "keyUsage", "digitalSignature"))) {
+            int_error("Error creating X509 keyUsage extension object");
+        }
+
+        /* extension duplicates: check if the extension is already present */
+        if (check_ext_presence(ext, newcert) == 0) {
+          if (! X509_add_ext(newcert, ext, -1))
+            int_error("Error adding X509 keyUsage extension to certificate");
+        }
+        X509_EXTENSION_free(ext);
+      }
+   
+      if (strcmp(prof->type, "em") == 0) {
+        if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                        "keyUsage", "digitalSignature,keyEncipherment"))) {
+           int_error("Error creating X509 keyUsage extension object");
+        }
+        /* extension duplicates: check if the extension is already present */
+        if (check_ext_presence(ext, newcert) == 0) {
+          if (! X509_add_ext(newcert, ext, -1))
+            int_error("Error adding X509 extension to certificate");
+        }
+        X509_EXTENSION_free(ext);
+      }
+   
+      if (strcmp(prof->type, "os") == 0) {
+        if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                        "keyUsage", "digitalSignature"))) {
+           int_error("Error creating X509 keyUsage extension object");
+        }
+        /* extension duplicates: check if the extension is already present */
+        if (check_ext_presence(ext, newcert) == 0) {
+          if (! X509_add_ext(newcert, ext, -1))
+           int_error("Error adding X509 keyUsage extension to certificate");
+        }
+        X509_EXTENSION_free(ext);
+      }
+   
+      if (strcmp(prof->type, "ca") == 0) {
+        if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                       "keyUsage", "keyCertSign,cRLSign"))) {
+           int_error("Error creating X509 keyUsage extension object");
+        }
+        /* extension duplicates: check if the extension is already present */
+        if (check_ext_presence(ext, newcert) == 0) {
+          if (! X509_add_ext(newcert, ext, -1))
+             int_error("Error adding X509 extension to certificate");
+        }
+        X509_EXTENSION_free(ext);
+      }
+   
+      if (strcmp(prof->type, "em") == 0) {
+        if (prof->ename[0] != '\0') {
+          strncat(email_head, prof->ename, sizeof(email_head) - strlen(email_head) - 1);
+          if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                        "subjectAltName", email_head)))
+            int_error("Error creating X509 e-mail extension object");
+   
+          /* extension duplicates: check if the extension is already present */
+          if (check_ext_presence(ext, newcert) == 0) {
+            if (! X509_add_ext(newcert, ext, -1))
+               int_error("Error adding X509 subjectAltName extension to certificate");
+          }
+          X509_EXTENSION_free(ext);
+        } else
+         int_error("Error - No e-mail address given.");
+      }
+   }
+
+   /* Always add subjectKeyIdentifier */
+   if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                  "subjectKeyIdentifier", "hash"))) {
+       int_error("Error creating X509 subjectKeyIdentifier extension object");
+   }
+
+   /* extension duplicates: check if the extension is already present */
+   if (check_ext_presence(ext, newcert) == 0) {
+     if (! X509_add_ext(newcert, ext, -1))
+        int_error("Error adding X509 subjectKeyIdentifier extension to certificate");
+   }
+   X509_EXTENSION_free(ext);
+
+   /* Always add authorityKeyIdentifier */
+   if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                  "authorityKeyIdentifier", "keyid, issuer:always"))) {
+      int_error("Error creating X509 authorityKeyIdentifier extension object");
+   }
+
+   /* extension duplicates: check if the extension is already present */
+   if (check_ext_presence(ext, newcert) == 0) {
+     if (! X509_add_ext(newcert, ext, -1))
+        int_error("Error adding X509 extension to certificate");
+   }
+
+   /* Add cRLDistributionPoints, URI see webcert.h */
+   if (prof->addcrluri) {
+      if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                  "crlDistributionPoints", CRLURI))) {
+         int_error("Error creating X509 cRLDistributionPoints extension object");
+      }
+
+      /* extension duplicates: check if the extension is already present */
+      if (check_ext_presence(ext, newcert) == 0) {
+         if (! X509_add_ext(newcert, ext, -1))
+            int_error("Error adding X509 extension to certificate");
+      }
+      X509_EXTENSION_free(ext);
+   }
+
+  
+   /* ----------------------------------------------------------- *
+    * If extended key usage has been requested,we add it here.    * 
+    * http://tools.ietf.org/html/rfc5280#section-4.2.1.12         * 
+    * http://www.openssl.org/docs/apps/x509v3_config.html         * 
+    * ----------------------------------------------------------- */
+   if (prof->extkeyusage) {
+ 
+     if (strcmp(prof->extkeytype, "tlsws") == 0) {
+       if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                      "extendedKeyUsage", "serverAuth"))) {
+          int_error("Error creating X509 extendedKeyUsage extension object");
+       }
+     }
+     if (strcmp(prof->extkeytype, "tlscl") == 0) {
+       if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                      "extendedKeyUsage", "clientAuth"))) {
+          int_error("Error creating X509 extendedKeyUsage extension object");
+       }
+     }
+     if (strcmp(prof->extkeytype, "cs") == 0) {
+       if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                      "extendedKeyUsage", "codeSigning"))) {
+          int_error("Error creating X509 extendedKeyUsage extension object");
+       }
+     }
+     if (strcmp(prof->extkeytype, "ep") == 0) {
+       if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                      "extendedKeyUsage", "emailProtection"))) {
+          int_error("Error creating X509 extendedKeyUsage extension object");
+       }
+     }
+     if (strcmp(prof->extkeytype, "ts") == 0) {
+       if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                      "extendedKeyUsage", "timeStamping"))) {
+          int_error("Error creating X509 extendedKeyUsage extension object");
+       }
+     }
+     if (strcmp(prof->extkeytype, "ocsp") == 0) {
+       if (! (ext = X509V3_EXT_conf(NULL, &ctx,
+                      "extendedKeyUsage", "OCSPSigning"))) {
+          int_error("Error creating X509 extendedKeyUsage extension object");
+       }
+     }
+     /* extension duplicates: check if the extension is already present */
+     if (check_ext_presence(ext, newcert) == 0) {
+       if (! X509_add_ext(newcert, ext, -1))
+           int_error("Error adding X509 extendedKeyUsage extension to certificate");
+     }
+     X509_EXTENSION_free(ext);
+   }
+
+   return newcert;
+}
+
+/* ---------------------------------------------------------- *
+ * mkdatestr builds a string "YYYYMMDDHHMMSSZ" from the forms *
+ * input strings date = YYYY-MM-DD (i.e. 2012-11-24), and     *
+ * time = HH:MM:SS (i.e. 21:45:33)                            *
+ * -----------------------------------------------------------*/
+static char * mkdatestr(char *date, char *time) {
+  static char datestr[16] = "";
+  char *err[16];
+  char *tmp;
+  long yr = 0; // year
+  long mo = 0; // month
+  long dy = 0; // day
+  long hr = 0; // hour
+  long mi = 0; // minutes
+  long sc = 0; // seconds
+
+  tmp = strtok(date, "-");
+  if (strlen(tmp) != 0)
+    yr = strtol(tmp, err, 10);
+
+  if (strlen(*err) != 0)
+    int_error("Error in date string: cannot extract year digits.");
+
+#ifdef TIME_PROTECTION
+  /* year 2038 bug workaround: we protect us from the integer overflow */
+  if (yr < 1970 || yr > 2037)
+    int_error("Error in date range: year is < 1970 or > 2037.");
+#endif
+
+  tmp = strtok(NULL, "-");
+  if (strlen(tmp) != 0)
+    mo = strtol(tmp, err, 10);
+
+  if (strlen(*err) != 0)
+    int_error("Error in date string: cannot extract month digits.");
+
+  if (mo < 1 || mo > 12)
+    int_error("Error in date range: month is < 1 or > 12.");
+
+  tmp = strtok(NULL, "-");
+  if (strlen(tmp) != 0)
+    dy = strtol(tmp, err, 10);
+
+  if (strlen(*err) != 0)
+    int_error("Error in date string: cannot extract day digits.");
+
+  if (dy < 1 || dy > 31)
+    int_error("Error in date range: day is < 1 or > 31.");
+
+  tmp = strtok(time, ":");
+  if (strlen(tmp) != 0)
+    hr = strtol(tmp, err, 10);
+
+  if (strlen(*err) != 0)
+    int_error("Error in time string: cannot extract the hour digits.");
+
+  if (hr < 0 || hr > 23)
+    int_error("Error in time range: hours are < 0 or > 23.");
+
+  tmp = strtok(NULL, ":");
+  if (strlen(tmp) != 0)
+    mi = strtol(tmp, err, 10);
+
+  if (strlen(*err) != 0)
+    int_error("Error in time string: cannot extract the minute digits.");
+
+  if (mi < 0 || mi > 59)
+    int_error("Error in time range: minutes are < 0 or > 59.");
+
+  tmp = strtok(NULL, ":");
+  if (strlen(tmp) != 0)
+   sc = strtol(tmp, err, 10);
+
+  if (strlen(*err) != 0)
+    int_error("Error in time string: cannot extract the second digits.");
+
+  if (sc < 0 || sc > 59)
+    int_error("Error in time range: seconds are < 0 or > 59.");
+
+  snprintf(datestr, sizeof(datestr), "%04ld%02ld%02ld%02ld%02ld%02ldZ", yr, mo, dy, hr, mi, sc);
+  return datestr;
+}
+
+/* ---------------------------------------------------------- *
+ * check_ext_presence() check if extension test_ext exists in *
+ * the certificate 'cert'. Returns '1' if found, '0' if not.  *
+ * The OID is compared, extensions without a NID are kept.    *
+ * -----------------------------------------------------------*/
+static int check_ext_presence(X509_EXTENSION *test_ext, X509 *cert) {
+  return (X509_get_ext_by_OBJ(cert,
+                   X509_EXTENSION_get_object(test_ext), -1) >= 0);
+}
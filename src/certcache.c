@@ -0,0 +1,184 @@
+/* ---------------------------------------------------------- *
+ * file:	certcache.c                                   *
+ * purpose:	certsearch result cache. The matches of a     *
+ *              search are saved as the ordered list of their *
+ *              index record positions, in one file per query *
+ *              in SEARCHCACHE. The file is valid for as long *
+ *              as the index generation and file are the same *
+ *              so page moves and sort flips skip the search. *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * A cache file: header, the canonical query key, zero padded *
+ * to 8 bytes, then the uint32 record positions, in serial    *
+ * order. The file name is the hash of the key, a query run   *
+ * again against a newer index replaces its stale file.       *
+ * ---------------------------------------------------------- */
+#define SEARCHCACHE_MAGIC   "WCSRC\0\0\0"
+#define SEARCHCACHE_VERSION 1
+
+typedef struct searchcache_hdr_st {
+  char          magic[8];      /* SEARCHCACHE_MAGIC               */
+  uint32_t      version;       /* SEARCHCACHE_VERSION             */
+  uint32_t      keylen;        /* key bytes, without the padding  */
+  uint64_t      generation;    /* CERTIDX_HDR generation          */
+  uint64_t      inode;         /* CERT_INDEX stamp[0] of the file */
+  uint64_t      idxcount;      /* # of index records              */
+  uint64_t      count;         /* # of positions that follow      */
+} SEARCHCACHE_HDR;
+
+#define SEARCHCACHE_KEYPAD(n)  (((n) + 7) & ~(size_t) 7)
+
+/* ---------------------------------------------------------- *
+ * searchcache_file(): the cache file path of a key, named by *
+ * the 64 bit FNV-1a hash of the key in hex.                  *
+ * ---------------------------------------------------------- */
+static void searchcache_file(const char *cachedir, const char *key,
+                                              char *buf, size_t buflen) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *p;
+
+  for (p = (const unsigned char *) key; *p; p++) {
+    h ^= *p;
+    h *= 0x100000001b3ULL;
+  }
+  snprintf(buf, buflen, "%s/%016llx.src", cachedir, (unsigned long long) h);
+}
+
+/* ---------------------------------------------------------- *
+ * load_searchcache(): maps the cached result of a query, if  *
+ * it was made from the index 'idx' as it is now. An index    *
+ * from a store scan (no stamp) has no generation, no cache.  *
+ * returns 1 for a hit, 0 for a miss.                         *
+ * ---------------------------------------------------------- */
+int load_searchcache(SEARCH_CACHE *sc, const char *cachedir,
+                              const char *key, const CERT_INDEX *idx) {
+  const SEARCHCACHE_HDR *hdr;
+  char cachefile[512] = "";
+  size_t keylen = strlen(key);
+  struct stat st;
+  int fd;
+
+  memset(sc, '\0', sizeof(SEARCH_CACHE));
+  if (idx->hdr == NULL || idx->stamp[0] == 0) return 0;
+
+  searchcache_file(cachedir, key, cachefile, sizeof(cachefile));
+  if ((fd = open(cachefile, O_RDONLY)) < 0) return 0;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(SEARCHCACHE_HDR)) {
+    close(fd);
+    return 0;
+  }
+  sc->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (sc->map == MAP_FAILED) {
+    sc->map = NULL;
+    return 0;
+  }
+  sc->maplen = st.st_size;
+
+  /* the same query, against the same index file and generation */
+  hdr = (const SEARCHCACHE_HDR *) sc->map;
+  if (memcmp(hdr->magic, SEARCHCACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != SEARCHCACHE_VERSION ||
+      hdr->keylen != keylen ||
+      hdr->generation != idx->hdr->generation ||
+      hdr->inode != idx->stamp[0] ||
+      hdr->idxcount != idx->count ||
+      sizeof(SEARCHCACHE_HDR) + SEARCHCACHE_KEYPAD(keylen)
+        + hdr->count * sizeof(uint32_t) > sc->maplen ||
+      memcmp((const char *) (hdr + 1), key, keylen) != 0) {
+    free_searchcache(sc);
+    return 0;
+  }
+
+  sc->list  = (const uint32_t *) ((const char *) (hdr + 1)
+                                          + SEARCHCACHE_KEYPAD(keylen));
+  sc->count = hdr->count;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * free_searchcache(): releases the cache file mapping.       *
+ * ---------------------------------------------------------- */
+void free_searchcache(SEARCH_CACHE *sc) {
+  if (sc->map) munmap((void *) sc->map, sc->maplen);
+  memset(sc, '\0', sizeof(SEARCH_CACHE));
+}
+
+/* ---------------------------------------------------------- *
+ * searchcache_expire(): removes the cache files that were    *
+ * not written for SEARCHCACHE_TTL seconds, queries nobody is *
+ * paging through anymore.                                    *
+ * ---------------------------------------------------------- */
+static void searchcache_expire(const char *cachedir) {
+  char path[512];
+  struct dirent *ent;
+  struct stat st;
+  time_t now = time(NULL);
+  DIR *dir;
+
+  if ((dir = opendir(cachedir)) == NULL) return;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strstr(ent->d_name, ".src") == NULL) continue;
+    snprintf(path, sizeof(path), "%s/%s", cachedir, ent->d_name);
+    if (stat(path, &st) == 0 && st.st_mtime + SEARCHCACHE_TTL < now)
+      unlink(path);
+  }
+  closedir(dir);
+}
+
+/* ---------------------------------------------------------- *
+ * save_searchcache(): saves the result of a query, the list  *
+ * of 'count' index positions. The file is written to a temp  *
+ * file and renamed, a reader never sees a partial file. The  *
+ * cache dir is created if needed. returns 1, or 0 for errors *
+ * ---------------------------------------------------------- */
+int save_searchcache(const char *cachedir, const char *key,
+          const CERT_INDEX *idx, const uint32_t *list, uint64_t count) {
+  static const char zero[8];
+  SEARCHCACHE_HDR hdr;
+  char cachefile[512] = "", tmpfile[540] = "";
+  size_t keylen = strlen(key);
+  FILE *fp;
+
+  if (idx->hdr == NULL || idx->stamp[0] == 0) return 0;
+  mkdir(cachedir, 0755);
+  searchcache_expire(cachedir);
+
+  memset(&hdr, '\0', sizeof(hdr));
+  memcpy(hdr.magic, SEARCHCACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version    = SEARCHCACHE_VERSION;
+  hdr.keylen     = keylen;
+  hdr.generation = idx->hdr->generation;
+  hdr.inode      = idx->stamp[0];
+  hdr.idxcount   = idx->count;
+  hdr.count      = count;
+
+  searchcache_file(cachedir, key, cachefile, sizeof(cachefile));
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", cachefile, (int) getpid());
+  if ((fp = fopen(tmpfile, "w")) == NULL) return 0;
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      fwrite(key, 1, keylen, fp) != keylen ||
+      fwrite(zero, 1, SEARCHCACHE_KEYPAD(keylen) - keylen, fp)
+                                   != SEARCHCACHE_KEYPAD(keylen) - keylen ||
+      (count > 0 && fwrite(list, sizeof(uint32_t), count, fp) != count)) {
+    fclose(fp);
+    unlink(tmpfile);
+    return 0;
+  }
+  if (fclose(fp) != 0 || rename(tmpfile, cachefile) != 0) {
+    unlink(tmpfile);
+    return 0;
+  }
+  return 1;
+}
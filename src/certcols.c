@@ -0,0 +1,323 @@
+/* ---------------------------------------------------------- *
+ * file:	certcols.c                                    *
+ * purpose:	columnar copy of the cert store index for the *
+ *              date range and state searches. The columns    *
+ *              are packed int64 arrays, filtered by SSE4.2   *
+ *              or AVX2 kernels into selection bitmaps, with  *
+ *              a scalar fallback for other CPUs.             *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The column file COLINDEX: header, then the columns, each   *
+ * stride records long: notbefore, notafter, revoked, state,  *
+ * serial. stride is a multiple of 8, the int64 columns stay  *
+ * 64 byte aligned, and one bitmap byte covers 8 positions.   *
+ * ---------------------------------------------------------- */
+#define CERTCOLS_MAGIC   "WCCOL\0\0\0"
+#define CERTCOLS_VERSION 2
+
+typedef struct certcols_hdr_st {
+  char          magic[8];      /* CERTCOLS_MAGIC                  */
+  uint32_t      version;       /* CERTCOLS_VERSION                */
+  uint32_t      reserved;
+  uint64_t      count;         /* number of records per column    */
+  uint64_t      stride;        /* count rounded up to 8           */
+  uint64_t      stamp[3];      /* CERT_INDEX stamp of the source  */
+  uint64_t      generation;    /* and its CERTIDX_HDR generation  */
+} CERTCOLS_HDR;
+
+/* ---------------------------------------------------------- *
+ * certcols_size(): the column file size for 'stride' records *
+ * ---------------------------------------------------------- */
+static size_t certcols_size(uint64_t stride) {
+  return sizeof(CERTCOLS_HDR) + stride * (3 * sizeof(int64_t) + 1
+                                                 + sizeof(CERT_SERIAL));
+}
+
+/* ---------------------------------------------------------- *
+ * certcols_setup(): points the columns into the file image.  *
+ * ---------------------------------------------------------- */
+static void certcols_setup(CERT_COLS *cols) {
+  const CERTCOLS_HDR *hdr = (const CERTCOLS_HDR *) cols->map;
+  const unsigned char *p = (const unsigned char *) cols->map + sizeof(*hdr);
+
+  cols->count     = hdr->count;
+  cols->notbefore = (const int64_t *) p;
+  cols->notafter  = cols->notbefore + hdr->stride;
+  cols->revoked   = cols->notafter + hdr->stride;
+  cols->state     = (const char *) (cols->revoked + hdr->stride);
+  cols->serial    = (const CERT_SERIAL *) (cols->state + hdr->stride);
+}
+
+/* ---------------------------------------------------------- *
+ * certcols_build(): gathers the columns of the index records *
+ * into a new file image, allocated in cols->map.             *
+ * returns 1 for success, or 0 if out of memory.              *
+ * ---------------------------------------------------------- */
+static int certcols_build(CERT_COLS *cols, const CERT_INDEX *idx) {
+  uint64_t stride = (idx->count + 7) & ~7ULL;
+  CERTCOLS_HDR *hdr;
+  int64_t *notbefore, *notafter, *revoked;
+  char *state;
+  CERT_SERIAL *serial;
+  uint64_t i;
+
+  cols->maplen = certcols_size(stride);
+  if ((cols->map = calloc(1, cols->maplen)) == NULL) return 0;
+  cols->mapped = 0;
+
+  hdr = (CERTCOLS_HDR *) cols->map;
+  memcpy(hdr->magic, CERTCOLS_MAGIC, sizeof(hdr->magic));
+  hdr->version = CERTCOLS_VERSION;
+  hdr->count   = idx->count;
+  hdr->stride  = stride;
+  memcpy(hdr->stamp, idx->stamp, sizeof(hdr->stamp));
+  if (idx->hdr) hdr->generation = idx->hdr->generation;
+
+  notbefore = (int64_t *) (hdr + 1);
+  notafter  = notbefore + stride;
+  revoked   = notafter + stride;
+  state     = (char *) (revoked + stride);
+  serial    = (CERT_SERIAL *) (state + stride);
+
+  for (i = 0; i < idx->count; i++) {
+    notbefore[i] = idx->recs[i].notbefore;
+    notafter[i]  = idx->recs[i].notafter;
+    revoked[i]   = idx->recs[i].revoked;
+    state[i]     = idx->recs[i].state;
+    serial[i]    = idx->recs[i].serial;
+  }
+  certcols_setup(cols);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * certcols_save(): writes the built columns to a temp file,  *
+ * renamed over the column file, as rebuild_certindex() does. *
+ * ---------------------------------------------------------- */
+static void certcols_save(const CERT_COLS *cols, const char *colfile) {
+  char tmpfile[256] = "";
+  FILE *fp = NULL;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", colfile, (int) getpid());
+  if ((fp = fopen(tmpfile, "w")) == NULL) return;
+  if (fwrite(cols->map, cols->maplen, 1, fp) != 1) {
+    fclose(fp);
+    unlink(tmpfile);
+    return;
+  }
+  if (fclose(fp) != 0 || rename(tmpfile, colfile) != 0) unlink(tmpfile);
+}
+
+/* ---------------------------------------------------------- *
+ * load_certcols(): maps the column file, if it was built for *
+ * the index as it is now, same stamp and generation. A       *
+ * revocation updates the index in place, the stamp can stay, *
+ * the generation does not. Otherwise the columns are         *
+ * gathered from the index records and saved for the next     *
+ * request. colfile NULL, or an index without a stamp (a scan *
+ * of the store), builds them in memory only.                 *
+ * returns 1 for success, or 0 for errors.                    *
+ * ---------------------------------------------------------- */
+int load_certcols(CERT_COLS *cols, const char *colfile, const CERT_INDEX *idx) {
+  const CERTCOLS_HDR *hdr;
+  struct stat st;
+  int fd;
+
+  memset(cols, '\0', sizeof(CERT_COLS));
+  if (colfile == NULL || idx->hdr == NULL || idx->stamp[0] == 0)
+    return certcols_build(cols, idx);
+
+  if ((fd = open(colfile, O_RDONLY)) >= 0) {
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(CERTCOLS_HDR)) {
+      cols->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (cols->map == MAP_FAILED) cols->map = NULL;
+      cols->maplen = st.st_size;
+      cols->mapped = 1;
+    }
+    close(fd);
+  }
+
+  if (cols->map) {
+    hdr = (const CERTCOLS_HDR *) cols->map;
+    if (memcmp(hdr->magic, CERTCOLS_MAGIC, sizeof(hdr->magic)) == 0 &&
+        hdr->version == CERTCOLS_VERSION &&
+        hdr->count == idx->count &&
+        memcmp(hdr->stamp, idx->stamp, sizeof(hdr->stamp)) == 0 &&
+        hdr->generation == idx->hdr->generation &&
+        cols->maplen >= certcols_size(hdr->stride)) {
+      certcols_setup(cols);
+      return 1;
+    }
+    free_certcols(cols);
+  }
+
+  /* missing or stale: the index has changed since the last build */
+  if (! certcols_build(cols, idx)) return 0;
+  certcols_save(cols, colfile);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * free_certcols(): releases the column mapping or memory.    *
+ * ---------------------------------------------------------- */
+void free_certcols(CERT_COLS *cols) {
+  if (cols->map && cols->mapped) munmap(cols->map, cols->maplen);
+  else free(cols->map);
+  memset(cols, '\0', sizeof(CERT_COLS));
+}
+
+/* ---------------------------------------------------------- *
+ * The range kernels: set bit i of the bitmap if lo <= col[i] *
+ * <= hi, 8 positions per bitmap byte, bit 0 the lowest. With *
+ * 'and' set, the result is ANDed into the existing bits, so  *
+ * several predicates narrow down the same selection. Each    *
+ * kernel does whole bytes, range_tail() does the remainder.  *
+ * ---------------------------------------------------------- */
+static void range_tail(const int64_t *col, uint64_t from, uint64_t count,
+                      int64_t lo, int64_t hi, unsigned char *bits, int and) {
+  unsigned char m = 0;
+  uint64_t i;
+
+  if (from >= count) return;
+  for (i = from; i < count; i++)
+    if (col[i] >= lo && col[i] <= hi) m |= 1 << (i & 7);
+  bits[from >> 3] = and ? (bits[from >> 3] & m) : m;
+}
+
+static uint64_t range_scalar(const int64_t *col, uint64_t count,
+                      int64_t lo, int64_t hi, unsigned char *bits, int and) {
+  uint64_t i, n = count & ~7ULL;
+  unsigned char m;
+  int j;
+
+  for (i = 0; i < n; i += 8) {
+    for (m = 0, j = 0; j < 8; j++)
+      m |= (col[i+j] >= lo && col[i+j] <= hi) << j;
+    bits[i >> 3] = and ? (bits[i >> 3] & m) : m;
+  }
+  return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* SSE4.2 has the signed 64 bit compare, 2 positions at a time */
+__attribute__((target("sse4.2")))
+static uint64_t range_sse42(const int64_t *col, uint64_t count,
+                      int64_t lo, int64_t hi, unsigned char *bits, int and) {
+  const __m128i vlo = _mm_set1_epi64x(lo);
+  const __m128i vhi = _mm_set1_epi64x(hi);
+  uint64_t i, n = count & ~7ULL;
+  unsigned char m;
+  __m128i v, out;
+  int j;
+
+  for (i = 0; i < n; i += 8) {
+    for (m = 0, j = 0; j < 8; j += 2) {
+      v = _mm_loadu_si128((const __m128i *) (col + i + j));
+      /* outside: lo > v or v > hi */
+      out = _mm_or_si128(_mm_cmpgt_epi64(vlo, v), _mm_cmpgt_epi64(v, vhi));
+      m |= (~_mm_movemask_pd(_mm_castsi128_pd(out)) & 3) << j;
+    }
+    bits[i >> 3] = and ? (bits[i >> 3] & m) : m;
+  }
+  return n;
+}
+
+/* AVX2: 4 positions per compare, one bitmap byte per 2 loads */
+__attribute__((target("avx2")))
+static uint64_t range_avx2(const int64_t *col, uint64_t count,
+                      int64_t lo, int64_t hi, unsigned char *bits, int and) {
+  const __m256i vlo = _mm256_set1_epi64x(lo);
+  const __m256i vhi = _mm256_set1_epi64x(hi);
+  uint64_t i, n = count & ~7ULL;
+  __m256i a, b, oa, ob;
+  unsigned char m;
+
+  for (i = 0; i < n; i += 8) {
+    a  = _mm256_loadu_si256((const __m256i *) (col + i));
+    b  = _mm256_loadu_si256((const __m256i *) (col + i + 4));
+    oa = _mm256_or_si256(_mm256_cmpgt_epi64(vlo, a), _mm256_cmpgt_epi64(a, vhi));
+    ob = _mm256_or_si256(_mm256_cmpgt_epi64(vlo, b), _mm256_cmpgt_epi64(b, vhi));
+    m  = ~(_mm256_movemask_pd(_mm256_castsi256_pd(oa)) |
+           _mm256_movemask_pd(_mm256_castsi256_pd(ob)) << 4);
+    bits[i >> 3] = and ? (bits[i >> 3] & m) : m;
+  }
+  return n;
+}
+#endif
+
+typedef uint64_t (*range_kernel)(const int64_t *col, uint64_t count,
+                      int64_t lo, int64_t hi, unsigned char *bits, int and);
+
+/* ---------------------------------------------------------- *
+ * range_select(): picks the widest kernel this CPU can run,  *
+ * once per process.                                          *
+ * ---------------------------------------------------------- */
+static range_kernel range_select(void) {
+  static range_kernel kernel = NULL;
+
+  if (kernel) return kernel;
+  kernel = range_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) kernel = range_avx2;
+  else if (__builtin_cpu_supports("sse4.2")) kernel = range_sse42;
+#endif
+  return kernel;
+}
+
+/* ---------------------------------------------------------- *
+ * certcols_range(): selection bitmap of lo <= col[i] <= hi   *
+ * for the count positions of a column, see the kernels above *
+ * col and bits must start at a multiple of 8 positions.      *
+ * ---------------------------------------------------------- */
+void certcols_range(const int64_t *col, uint64_t count, int64_t lo,
+                     int64_t hi, unsigned char *bits, int and) {
+  uint64_t n = range_select()(col, count, lo, hi, bits, and);
+
+  range_tail(col, n, count, lo, hi, bits, and);
+}
+
+/* ---------------------------------------------------------- *
+ * certcols_state(): selection bitmap of the positions whose  *
+ * state is (match = 1) or is not (match = 0) the given one.  *
+ * A plain byte loop, the compiler vectorizes it at -O3.      *
+ * ---------------------------------------------------------- */
+void certcols_state(const char *col, uint64_t count, char state,
+                     int match, unsigned char *bits, int and) {
+  uint64_t i;
+  unsigned char m;
+  int j;
+
+  for (i = 0; i < count; i += 8) {
+    for (m = 0, j = 0; j < 8 && i + j < count; j++)
+      m |= ((col[i+j] == state) == match) << j;
+    bits[i >> 3] = and ? (bits[i >> 3] & m) : m;
+  }
+}
+
+/* ---------------------------------------------------------- *
+ * certcols_count(): # of set bits among the first count.     *
+ * ---------------------------------------------------------- */
+uint64_t certcols_count(const unsigned char *bits, uint64_t count) {
+  uint64_t i, n = 0, w;
+
+  for (i = 0; i + 64 <= count; i += 64) {
+    memcpy(&w, bits + (i >> 3), sizeof(w));
+    n += __builtin_popcountll(w);
+  }
+  for (; i < count; i++)
+    n += (bits[i >> 3] >> (i & 7)) & 1;
+  return n;
+}
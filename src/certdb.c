@@ -0,0 +1,1171 @@
+/* ---------------------------------------------------------- *
+ * file:	certdb.c                                      *
+ * purpose:	the CA database INDEXDB of the issued and     *
+ *              revoked certs, a single file with B-trees of  *
+ *              fixed pages. The records are keyed by serial, *
+ *              with secondary keys on subject and expiry.    *
+ *              Pages are copy-on-write: a commit writes the  *
+ *              changed pages to new places, syncs them, and  *
+ *              then the meta page with the new tree roots.   *
+ *              Readers keep the meta they opened with, they  *
+ *              never wait for a writer, nor it for them. A   *
+ *              writer works on its snapshot, and only takes  *
+ *              the writer lock for the commit. index.txt is  *
+ *              the import and export format, certdbconv.c.   *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/rand.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The file: pages 0 and 1 hold the meta, written in turn, a  *
+ * reader takes the valid one with the higher txnid. A torn   *
+ * meta fails its hash, the other one is the last commit.     *
+ * Tree pages have a node header and sorted 32 byte keys, the *
+ * leaves point to the records in heap pages, the branches to *
+ * the child pages, their first key is the subtree minimum.   *
+ * Pages replaced by a commit go to the free list, they are   *
+ * reused once no reader can hold an older meta, see          *
+ * cadb_start(). Heap pages are only reclaimed by compaction. *
+ * ---------------------------------------------------------- */
+#define CADB_MAGIC      "WCCADB\0\0"
+#define CADB_VERSION    1
+#define CADB_PAGESIZE   4096
+
+#define CADB_SERIAL     0      /* serial -> record offset           */
+#define CADB_SUBJECT    1      /* subject hash + serial             */
+#define CADB_EXPIRY     2      /* notAfter epoch + serial           */
+#define CADB_TREES      3
+
+#define CADB_LEAF       1
+#define CADB_BRANCH     2
+#define CADB_HEAP       3
+#define CADB_FREE       4
+
+#define CADB_KEYLEN     32
+
+typedef struct cadb_meta_st {
+  char          magic[8];      /* CADB_MAGIC                      */
+  uint32_t      version;       /* CADB_VERSION                    */
+  uint32_t      unique_subject;/* the DB_ATTR of the database     */
+  uint64_t      txnid;         /* commit #, the higher meta wins  */
+  uint64_t      root[CADB_TREES]; /* tree root pages, 0 is empty  */
+  uint64_t      npages;        /* pages in the file               */
+  uint64_t      freelist;      /* first page of the free list     */
+  uint64_t      heap;          /* heap page of the next record    */
+  uint64_t      heapused;      /* bytes used of that heap page    */
+  uint64_t      count;         /* # of records                    */
+  uint64_t      dbid;          /* random, kept by compaction      */
+  uint64_t      revgen;        /* # of puts of a revoked record   */
+  CERT_SERIAL   revlast;       /* the serial of the last of them  */
+  uint32_t      reserved;
+  uint64_t      sum;           /* FNV-1a hash of the fields above */
+} CADB_META;
+
+typedef struct cadb_node_st {
+  uint16_t      type;          /* CADB_LEAF, _BRANCH, _HEAP, _FREE*/
+  uint16_t      count;         /* # of entries, or of free pages  */
+  uint32_t      reserved;
+  uint64_t      next;          /* free list: its next page        */
+} CADB_NODE;
+
+typedef struct cadb_ent_st {
+  unsigned char key[CADB_KEYLEN];
+  uint64_t      val;           /* leaf: record offset, branch: page */
+} CADB_ENT;
+
+#define CADB_MAXENT   ((CADB_PAGESIZE - sizeof(CADB_NODE)) / sizeof(CADB_ENT))
+#define CADB_MAXFREE  ((CADB_PAGESIZE - sizeof(CADB_NODE)) / sizeof(uint64_t))
+#define CADB_ENTS(p)  ((CADB_ENT *) ((p) + sizeof(CADB_NODE)))
+
+/* record: uint16 length, serial, type, exp_date, rev_date, name */
+#define CADB_RECHDR   (2 + SERIAL_LEN + 1)
+
+/* ---------------------------------------------------------- *
+ * The write transaction: the copies of the changed pages in  *
+ * a hash table by page number, the pages they replaced, the  *
+ * free pages of its snapshot, and the records that were put, *
+ * to apply them again if another commit came first.          *
+ * ---------------------------------------------------------- */
+typedef struct cadb_dirty_st {
+  uint64_t      pgno;          /* 0 is an empty slot              */
+  unsigned char *page;
+} CADB_DIRTY;
+
+typedef struct cadb_txn_st {
+  int           fd;            /* O_RDWR with the writer lock, -1 */
+  int           reuse;         /* 1 if free pages may be reused   */
+  uint64_t      base;          /* txnid of the snapshot           */
+  uint64_t      ino;           /* inode of the snapshot file      */
+  CADB_DIRTY   *dirty;
+  size_t        ndirty, dirtycap;
+  uint64_t     *freed;         /* pages replaced in this txn      */
+  size_t        nfreed, freedcap;
+  size_t        nlistpg;       /* the first freed, the free list  */
+  uint64_t     *avail;         /* free pages of the snapshot      */
+  size_t        navail;
+  unsigned char *log;          /* the encoded records of the puts */
+  size_t        loglen, logcap;
+} CADB_TXN;
+
+struct ca_db_st {
+  DB_ATTR       attributes;
+  char          path[512];
+  int           fd;            /* O_RDONLY, flock shared, or -1   */
+  unsigned char *map;
+  size_t        maplen;
+  CADB_META     meta;          /* the snapshot, or the txn's meta */
+  CADB_TXN     *txn;
+};
+
+typedef int (*cadb_visit)(CA_DB *db, const unsigned char *key,
+                                              uint64_t val, void *arg);
+
+static uint64_t cadb_fnv(const unsigned char *p, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len-- > 0) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static uint64_t cadb_metasum(const CADB_META *meta) {
+  return cadb_fnv((const unsigned char *) meta, offsetof(CADB_META, sum));
+}
+
+static void cadb_corrupt(CA_DB *db) {
+  snprintf(error_str, sizeof(error_str),
+           "Error: the CA database %s is corrupt", db->path);
+  int_error(error_str);
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_put64(): big-endian, so memcmp() of keys is numeric.  *
+ * ---------------------------------------------------------- */
+static void cadb_put64(unsigned char *p, uint64_t v) {
+  int i;
+
+  for (i = 7; i >= 0; i--, v >>= 8) p[i] = v & 0xff;
+}
+
+static void cadb_key_serial(unsigned char *key, const CERT_SERIAL *serial) {
+  memset(key, '\0', CADB_KEYLEN);
+  memcpy(key, serial->b, SERIAL_LEN);
+}
+
+static void cadb_key_subject(unsigned char *key, const char *name,
+                                              const CERT_SERIAL *serial) {
+  memset(key, '\0', CADB_KEYLEN);
+  cadb_put64(key, cadb_fnv((const unsigned char *) name, strlen(name)));
+  if (serial) memcpy(key + 8, serial->b, SERIAL_LEN);
+}
+
+static void cadb_key_expiry(unsigned char *key, int64_t epoch,
+                                              const CERT_SERIAL *serial) {
+  memset(key, '\0', CADB_KEYLEN);
+  cadb_put64(key, (uint64_t) epoch ^ 0x8000000000000000ULL);
+  if (serial) memcpy(key + 8, serial->b, SERIAL_LEN);
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_dirty_xxx(): the txn's page copies, open addressing.  *
+ * get returns the copy or NULL, new adds a zeroed page.      *
+ * ---------------------------------------------------------- */
+static unsigned char *cadb_dirty_get(CADB_TXN *txn, uint64_t pgno) {
+  size_t i;
+
+  if (txn->dirtycap == 0) return NULL;
+  i = (pgno * 0x9e3779b97f4a7c15ULL >> 32) & (txn->dirtycap - 1);
+  while (txn->dirty[i].pgno) {
+    if (txn->dirty[i].pgno == pgno) return txn->dirty[i].page;
+    i = (i + 1) & (txn->dirtycap - 1);
+  }
+  return NULL;
+}
+
+static void cadb_dirty_slot(CADB_DIRTY *tab, size_t cap, uint64_t pgno,
+                                                   unsigned char *page) {
+  size_t i = (pgno * 0x9e3779b97f4a7c15ULL >> 32) & (cap - 1);
+
+  while (tab[i].pgno) i = (i + 1) & (cap - 1);
+  tab[i].pgno = pgno;
+  tab[i].page = page;
+}
+
+static unsigned char *cadb_dirty_new(CADB_TXN *txn, uint64_t pgno) {
+  CADB_DIRTY *tab;
+  unsigned char *page;
+  size_t cap, i;
+
+  if (txn->ndirty * 2 >= txn->dirtycap) {
+    cap = txn->dirtycap ? txn->dirtycap * 2 : 64;
+    if ((tab = calloc(cap, sizeof(CADB_DIRTY))) == NULL)
+      int_error("Error cannot allocate memory for the CA database pages");
+    for (i = 0; i < txn->dirtycap; i++)
+      if (txn->dirty[i].pgno)
+        cadb_dirty_slot(tab, cap, txn->dirty[i].pgno, txn->dirty[i].page);
+    free(txn->dirty);
+    txn->dirty = tab;
+    txn->dirtycap = cap;
+  }
+  if ((page = calloc(1, CADB_PAGESIZE)) == NULL)
+    int_error("Error cannot allocate memory for the CA database pages");
+  cadb_dirty_slot(txn->dirty, txn->dirtycap, pgno, page);
+  txn->ndirty++;
+  return page;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_page(): a page of the snapshot, or the txn's copy.    *
+ * A page number outside of the file stops the CGI.           *
+ * ---------------------------------------------------------- */
+static const unsigned char *cadb_page(CA_DB *db, uint64_t pgno) {
+  unsigned char *page;
+
+  if (db->txn && (page = cadb_dirty_get(db->txn, pgno)) != NULL) return page;
+  if (pgno < 2 || pgno >= db->meta.npages ||
+      (pgno + 1) * CADB_PAGESIZE > db->maplen) cadb_corrupt(db);
+  return db->map + pgno * CADB_PAGESIZE;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_alloc(): a new zeroed page for the txn, from the free *
+ * list if it may be reused, or else at the end of the file.  *
+ * ---------------------------------------------------------- */
+static uint64_t cadb_alloc(CA_DB *db, unsigned char **page, uint16_t type) {
+  CADB_TXN *txn = db->txn;
+  uint64_t pgno;
+
+  if (txn->reuse && txn->navail > 0) pgno = txn->avail[--txn->navail];
+  else pgno = db->meta.npages++;
+  *page = cadb_dirty_new(txn, pgno);
+  ((CADB_NODE *) *page)->type = type;
+  return pgno;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_free(): a page of the snapshot that is free with the  *
+ * commit, it can be reused by the txns after it.             *
+ * cadb_touch(): the txn's writable copy of a page, made on   *
+ * first use at a new place. The old page is freed with the   *
+ * commit. returns the page number of the copy.               *
+ * ---------------------------------------------------------- */
+static void cadb_free(CADB_TXN *txn, uint64_t pgno) {
+  uint64_t *nfreed;
+
+  if (txn->nfreed == txn->freedcap) {
+    txn->freedcap = txn->freedcap ? txn->freedcap * 2 : 64;
+    if ((nfreed = realloc(txn->freed, txn->freedcap * sizeof(uint64_t))) == NULL)
+      int_error("Error cannot allocate memory for the CA database pages");
+    txn->freed = nfreed;
+  }
+  txn->freed[txn->nfreed++] = pgno;
+}
+
+static uint64_t cadb_touch(CA_DB *db, uint64_t pgno, unsigned char **page) {
+  CADB_TXN *txn = db->txn;
+  const unsigned char *old;
+
+  if ((*page = cadb_dirty_get(txn, pgno)) != NULL) return pgno;
+  old = cadb_page(db, pgno);
+  cadb_free(txn, pgno);
+  pgno = cadb_alloc(db, page, 0);
+  memcpy(*page, old, CADB_PAGESIZE);
+  return pgno;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_search(): binary search of a node. For a leaf, the    *
+ * first entry with a key >= 'key', for a branch the last one *
+ * with a key <= 'key', the child that covers it. *found is 1 *
+ * if the key is there.                                       *
+ * ---------------------------------------------------------- */
+static int cadb_search(const unsigned char *page, const unsigned char *key,
+                                                             int *found) {
+  const CADB_NODE *node = (const CADB_NODE *) page;
+  const CADB_ENT *ent = CADB_ENTS(page);
+  int lo = 0, hi = node->count, mid, c;
+
+  *found = 0;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if ((c = memcmp(ent[mid].key, key, CADB_KEYLEN)) == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  if (node->type == CADB_BRANCH && lo > 0) lo--;
+  return lo;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_insert(): puts key and val into the subtree at pgno,  *
+ * on copies of the pages of the path, a key that is there    *
+ * gets the new val. A full page is split in halves, the new  *
+ * right one is returned in *split, else it is 0.             *
+ * returns the page number of the subtree copy.               *
+ * ---------------------------------------------------------- */
+static uint64_t cadb_insert(CA_DB *db, uint64_t pgno, const unsigned char *key,
+                                             uint64_t val, uint64_t *split) {
+  unsigned char *page, *rpage;
+  CADB_NODE *node, *rnode;
+  CADB_ENT *ent;
+  uint64_t child, right;
+  int i, found, half;
+
+  *split = 0;
+  pgno = cadb_touch(db, pgno, &page);
+  node = (CADB_NODE *) page;
+  ent  = CADB_ENTS(page);
+  if ((node->type != CADB_LEAF && node->type != CADB_BRANCH) ||
+      node->count == 0 || node->count >= CADB_MAXENT) cadb_corrupt(db);
+  i = cadb_search(page, key, &found);
+
+  if (node->type == CADB_LEAF) {
+    if (found) {
+      ent[i].val = val;
+      return pgno;
+    }
+    memmove(&ent[i + 1], &ent[i], (node->count - i) * sizeof(CADB_ENT));
+    memcpy(ent[i].key, key, CADB_KEYLEN);
+    ent[i].val = val;
+    node->count++;
+  }
+  else {
+    child = cadb_insert(db, ent[i].val, key, val, &right);
+    ent[i].val = child;
+    if (memcmp(key, ent[i].key, CADB_KEYLEN) < 0)
+      memcpy(ent[i].key, key, CADB_KEYLEN);
+    if (right == 0) return pgno;
+    memmove(&ent[i + 2], &ent[i + 1], (node->count - i - 1) * sizeof(CADB_ENT));
+    memcpy(ent[i + 1].key, CADB_ENTS(cadb_page(db, right))[0].key, CADB_KEYLEN);
+    ent[i + 1].val = right;
+    node->count++;
+  }
+  if (node->count < CADB_MAXENT) return pgno;
+
+  *split = cadb_alloc(db, &rpage, node->type);
+  rnode = (CADB_NODE *) rpage;
+  half = node->count / 2;
+  rnode->count = node->count - half;
+  memcpy(CADB_ENTS(rpage), &ent[half], rnode->count * sizeof(CADB_ENT));
+  node->count = half;
+  return pgno;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_tree_put(): inserts or updates a key of a tree, a     *
+ * split of the root adds a level.                            *
+ * ---------------------------------------------------------- */
+static void cadb_tree_put(CA_DB *db, int tree, const unsigned char *key,
+                                                           uint64_t val) {
+  unsigned char *page;
+  CADB_ENT *ent;
+  uint64_t root = db->meta.root[tree], left, right;
+
+  if (root == 0) {
+    root = cadb_alloc(db, &page, CADB_LEAF);
+    ((CADB_NODE *) page)->count = 1;
+    memcpy(CADB_ENTS(page)[0].key, key, CADB_KEYLEN);
+    CADB_ENTS(page)[0].val = val;
+  }
+  else if ((root = cadb_insert(db, root, key, val, &right)) && right) {
+    left = root;
+    root = cadb_alloc(db, &page, CADB_BRANCH);
+    ((CADB_NODE *) page)->count = 2;
+    ent = CADB_ENTS(page);
+    memcpy(ent[0].key, CADB_ENTS(cadb_page(db, left))[0].key, CADB_KEYLEN);
+    ent[0].val = left;
+    memcpy(ent[1].key, CADB_ENTS(cadb_page(db, right))[0].key, CADB_KEYLEN);
+    ent[1].val = right;
+  }
+  db->meta.root[tree] = root;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_tree_get(): the val of a key, returns 1 if found.     *
+ * ---------------------------------------------------------- */
+static int cadb_tree_get(CA_DB *db, int tree, const unsigned char *key,
+                                                          uint64_t *val) {
+  const unsigned char *page;
+  const CADB_NODE *node;
+  uint64_t pgno = db->meta.root[tree];
+  int i, found, depth = 0;
+
+  while (pgno) {
+    page = cadb_page(db, pgno);
+    node = (const CADB_NODE *) page;
+    if (node->count > CADB_MAXENT || ++depth > 16) cadb_corrupt(db);
+    i = cadb_search(page, key, &found);
+    if (node->type == CADB_LEAF) {
+      if (! found || i >= node->count) return 0;
+      *val = CADB_ENTS(page)[i].val;
+      return 1;
+    }
+    if (node->type != CADB_BRANCH || node->count == 0) cadb_corrupt(db);
+    pgno = CADB_ENTS(page)[i].val;
+  }
+  return 0;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_tree_scan(): calls 'fn' for the keys of the subtree   *
+ * from 'lo' to 'hi' in order, NULL is open. A 'fn' that      *
+ * returns 0 ends the scan. returns 0 if it ended, 1 if not.  *
+ * ---------------------------------------------------------- */
+static int cadb_tree_scan(CA_DB *db, uint64_t pgno, const unsigned char *lo,
+                  const unsigned char *hi, cadb_visit fn, void *arg) {
+  const unsigned char *page = cadb_page(db, pgno);
+  const CADB_NODE *node = (const CADB_NODE *) page;
+  const CADB_ENT *ent = CADB_ENTS(page);
+  int i = 0, first, found;
+
+  if (node->count > CADB_MAXENT) cadb_corrupt(db);
+  if (lo) i = cadb_search(page, lo, &found);
+  for (first = i; i < node->count; i++) {
+    if (hi && (node->type == CADB_LEAF || i > first) &&
+        memcmp(ent[i].key, hi, CADB_KEYLEN) > 0) return 0;
+    if (node->type == CADB_LEAF) {
+      if (! fn(db, ent[i].key, ent[i].val, arg)) return 0;
+    }
+    else if (node->type != CADB_BRANCH) cadb_corrupt(db);
+    else if (! cadb_tree_scan(db, ent[i].val, lo, hi, fn, arg)) return 0;
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_rec_encode(): a record into its heap format in 'buf'. *
+ * returns the length, a field without its NUL stops the CGI. *
+ * cadb_rec_decode(): a record from its heap format, at most  *
+ * 'max' bytes. returns the length, or 0 if it is not valid.  *
+ * ---------------------------------------------------------- */
+static uint16_t cadb_rec_encode(const CADB_REC *rec, unsigned char *buf) {
+  const char *field[3] = { rec->exp_date, rec->rev_date, rec->name };
+  size_t size[3] = { sizeof(rec->exp_date), sizeof(rec->rev_date),
+                     sizeof(rec->name) }, len;
+  uint16_t reclen = CADB_RECHDR;
+  int i;
+
+  memcpy(buf + 2, rec->serial.b, SERIAL_LEN);
+  buf[2 + SERIAL_LEN] = rec->type;
+  for (i = 0; i < 3; i++) {
+    if ((len = strnlen(field[i], size[i])) == size[i])
+      int_error("Error a CA database record field is too long");
+    memcpy(buf + reclen, field[i], len + 1);
+    reclen += len + 1;
+  }
+  memcpy(buf, &reclen, 2);
+  return reclen;
+}
+
+static uint16_t cadb_rec_decode(const unsigned char *p, size_t max,
+                                                       CADB_REC *rec) {
+  char *field[3] = { rec->exp_date, rec->rev_date, rec->name };
+  size_t size[3] = { sizeof(rec->exp_date), sizeof(rec->rev_date),
+                     sizeof(rec->name) }, len, pos;
+  uint16_t reclen;
+  int i;
+
+  if (max < CADB_RECHDR) return 0;
+  memcpy(&reclen, p, 2);
+  if (reclen < CADB_RECHDR + 3 || reclen > max) return 0;
+
+  memcpy(rec->serial.b, p + 2, SERIAL_LEN);
+  rec->type = p[2 + SERIAL_LEN];
+  for (pos = CADB_RECHDR, i = 0; i < 3; i++) {
+    len = strnlen((const char *) p + pos, reclen - pos);
+    if (len == reclen - pos || len >= size[i]) return 0;
+    memcpy(field[i], p + pos, len + 1);
+    pos += len + 1;
+  }
+  return reclen;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_rec_read(): decodes the record at a heap offset.      *
+ * ---------------------------------------------------------- */
+static void cadb_rec_read(CA_DB *db, uint64_t off, CADB_REC *rec) {
+  const unsigned char *page;
+  size_t pos = off % CADB_PAGESIZE;
+
+  page = cadb_page(db, off / CADB_PAGESIZE);
+  if (((const CADB_NODE *) page)->type != CADB_HEAP ||
+      pos < sizeof(CADB_NODE) ||
+      cadb_rec_decode(page + pos, CADB_PAGESIZE - pos, rec) == 0)
+    cadb_corrupt(db);
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_rec_write(): appends an encoded record to the heap    *
+ * page, a new one when it is full. The free tail of the page *
+ * is written in place, no snapshot points there. returns the *
+ * offset of the record.                                      *
+ * ---------------------------------------------------------- */
+static uint64_t cadb_rec_write(CA_DB *db, const unsigned char *buf,
+                                                       uint16_t reclen) {
+  const unsigned char *old;
+  unsigned char *page;
+  uint64_t off;
+
+  if (db->meta.heap == 0 || db->meta.heapused + reclen > CADB_PAGESIZE) {
+    db->meta.heap = cadb_alloc(db, &page, CADB_HEAP);
+    db->meta.heapused = sizeof(CADB_NODE);
+  }
+  else if ((page = cadb_dirty_get(db->txn, db->meta.heap)) == NULL) {
+    old  = cadb_page(db, db->meta.heap);
+    page = cadb_dirty_new(db->txn, db->meta.heap);
+    memcpy(page, old, CADB_PAGESIZE);
+  }
+  memcpy(page + db->meta.heapused, buf, reclen);
+  off = db->meta.heap * CADB_PAGESIZE + db->meta.heapused;
+  db->meta.heapused += reclen;
+  return off;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_written(): 1 if a meta page was ever written. A file  *
+ * without one is left from a first commit that did not end.  *
+ * ---------------------------------------------------------- */
+static int cadb_written(CA_DB *db) {
+  int i;
+
+  for (i = 0; i < 2 && (i + 1) * CADB_PAGESIZE <= db->maplen; i++)
+    if (memcmp(db->map + i * CADB_PAGESIZE, CADB_MAGIC, 8) == 0) return 1;
+  return 0;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_snapshot(): maps the file and takes its current meta. *
+ * A missing or empty file is an empty database. The meta is  *
+ * checked on a copy, a writer may change the page meanwhile, *
+ * and the map grows once if the meta is of a commit that     *
+ * came after the fstat(), its pages were synced before it.   *
+ * ---------------------------------------------------------- */
+static void cadb_snapshot(CA_DB *db) {
+  CADB_META m, best;
+  struct stat st;
+  size_t size = 0;
+  int i, found, tries = 0;
+
+  do {
+    if (db->fd >= 0) {
+      if (fstat(db->fd, &st) != 0)
+        int_error("Error cannot stat the CA database file");
+      size = st.st_size - st.st_size % CADB_PAGESIZE;
+    }
+    if (size != db->maplen) {
+      if (db->map) munmap(db->map, db->maplen);
+      db->map = NULL;
+      db->maplen = 0;
+      if (size > 0) {
+        db->map = mmap(NULL, size, PROT_READ, MAP_SHARED, db->fd, 0);
+        if (db->map == MAP_FAILED) {
+          db->map = NULL;
+          int_error("Error cannot map the CA database file");
+        }
+        db->maplen = size;
+      }
+    }
+
+    found = 0;
+    for (i = 0; i < 2 && (i + 1) * CADB_PAGESIZE <= db->maplen; i++) {
+      memcpy(&m, db->map + i * CADB_PAGESIZE, sizeof(m));
+      if (memcmp(m.magic, CADB_MAGIC, sizeof(m.magic)) != 0 ||
+          m.version != CADB_VERSION || m.sum != cadb_metasum(&m)) continue;
+      if (! found || m.txnid > best.txnid) best = m;
+      found = 1;
+    }
+  } while (found && best.npages * CADB_PAGESIZE > db->maplen && ++tries < 2);
+
+  if (found && best.npages * CADB_PAGESIZE > db->maplen) cadb_corrupt(db);
+  if (found) {
+    db->meta = best;
+    db->attributes.unique_subject = db->meta.unique_subject;
+  }
+  else if (cadb_written(db)) cadb_corrupt(db);
+  else {
+    memset(&db->meta, '\0', sizeof(db->meta));
+    memcpy(db->meta.magic, CADB_MAGIC, sizeof(db->meta.magic));
+    db->meta.version = CADB_VERSION;
+    db->meta.unique_subject = db->attributes.unique_subject;
+    db->meta.npages = 2;
+  }
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_reader(): opens the read fd of the file at the path,  *
+ * with the shared flock() it holds while open.               *
+ * ---------------------------------------------------------- */
+static void cadb_reader(CA_DB *db) {
+  if ((db->fd = open(db->path, O_RDONLY|O_CLOEXEC)) < 0) {
+    if (errno == ENOENT) return;
+    int_error("Error cannot open the CA database file");
+  }
+  while (flock(db->fd, LOCK_SH) != 0)
+    if (errno != EINTR) int_error("Error cannot lock the CA database file");
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_refresh(): the snapshot of the latest commit. If the  *
+ * path has a new file, of certdb_compact() or a first write, *
+ * the read fd and the map move to it.                        *
+ * ---------------------------------------------------------- */
+static void cadb_refresh(CA_DB *db) {
+  struct stat st, pst;
+
+  if (stat(db->path, &pst) == 0 &&
+      (db->fd < 0 || fstat(db->fd, &st) != 0 ||
+       st.st_ino != pst.st_ino || st.st_dev != pst.st_dev)) {
+    if (db->map) munmap(db->map, db->maplen);
+    db->map = NULL;
+    db->maplen = 0;
+    if (db->fd >= 0) close(db->fd);
+    db->fd = -1;
+    cadb_reader(db);
+  }
+  cadb_snapshot(db);
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_clear(): drops the pages of the txn, not its log.     *
+ * ---------------------------------------------------------- */
+static void cadb_clear(CADB_TXN *txn) {
+  size_t i;
+
+  for (i = 0; i < txn->dirtycap; i++)
+    if (txn->dirty[i].pgno) free(txn->dirty[i].page);
+  free(txn->dirty);
+  free(txn->freed);
+  free(txn->avail);
+  txn->dirty = NULL;
+  txn->freed = txn->avail = NULL;
+  txn->ndirty = txn->dirtycap = txn->nfreed = txn->freedcap = txn->navail = 0;
+  txn->nlistpg = 0;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_end(): drops the txn and its writer lock, the handle  *
+ * goes back to the latest commit.                            *
+ * ---------------------------------------------------------- */
+static void cadb_end(CA_DB *db) {
+  CADB_TXN *txn = db->txn;
+
+  if (txn == NULL) return;
+  cadb_clear(txn);
+  free(txn->log);
+  if (txn->fd >= 0) close(txn->fd);
+  free(txn);
+  db->txn = NULL;
+  cadb_snapshot(db);
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_start(): sets up the txn on the current snapshot. The *
+ * free pages are only reused if the flock() shows no other   *
+ * reader, one could be on an older meta that still uses them *
+ * The test comes after the snapshot, and a commit before the *
+ * lock is back voids it. A failed LOCK_EX drops the LOCK_SH, *
+ * so the snapshot is taken again.                            *
+ * ---------------------------------------------------------- */
+static void cadb_start(CA_DB *db) {
+  CADB_TXN *txn = db->txn;
+  const unsigned char *page;
+  const CADB_NODE *node;
+  struct stat st;
+  uint64_t pgno, *pages;
+  size_t cap = 0;
+  int i;
+
+  cadb_clear(txn);
+  txn->reuse = 0;
+  txn->ino = 0;
+  cadb_snapshot(db);
+  txn->base = db->meta.txnid;
+  if (db->fd >= 0) {
+    txn->reuse = (flock(db->fd, LOCK_EX|LOCK_NB) == 0);
+    while (flock(db->fd, LOCK_SH) != 0)
+      if (errno != EINTR) int_error("Error cannot lock the CA database file");
+    if (fstat(db->fd, &st) == 0) txn->ino = st.st_ino;
+    cadb_snapshot(db);
+    if (db->meta.txnid != txn->base) txn->reuse = 0;
+    txn->base = db->meta.txnid;
+  }
+
+  /* the free list, its own pages are free with the commit, */
+  /* another txn on this snapshot may still be reading them   */
+  for (pgno = db->meta.freelist; pgno; pgno = node->next) {
+    page = cadb_page(db, pgno);
+    node = (const CADB_NODE *) page;
+    if (node->type != CADB_FREE || node->count > CADB_MAXFREE ||
+        txn->navail + txn->nfreed > db->meta.npages) cadb_corrupt(db);
+    if (txn->navail + node->count > cap) {
+      cap = (txn->navail + node->count) * 2;
+      if ((pages = realloc(txn->avail, cap * sizeof(uint64_t))) == NULL)
+        int_error("Error cannot allocate memory for the CA database txn");
+      txn->avail = pages;
+    }
+    for (i = 0; i < node->count; i++)
+      txn->avail[txn->navail++] = ((const uint64_t *) CADB_ENTS(page))[i];
+    cadb_free(txn, pgno);
+  }
+  txn->nlistpg = txn->nfreed;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_begin(): starts the write txn of the handle, on the   *
+ * latest commit.                                             *
+ * ---------------------------------------------------------- */
+static void cadb_begin(CA_DB *db) {
+  if (db->txn) return;
+  if ((db->txn = calloc(1, sizeof(CADB_TXN))) == NULL)
+    int_error("Error cannot allocate memory for the CA database txn");
+  db->txn->fd = -1;
+  cadb_refresh(db);
+  cadb_start(db);
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_lock(): takes the fcntl() writer lock of the file for *
+ * the commit. Compaction may have put a new file in place,   *
+ * the lock holder must have the current one.                 *
+ * ---------------------------------------------------------- */
+static void cadb_lock(CA_DB *db) {
+  CADB_TXN *txn = db->txn;
+  struct flock fl;
+  struct stat st, pst;
+
+  for (;;) {
+    if ((txn->fd = open(db->path, O_RDWR|O_CREAT|O_CLOEXEC, 0660)) < 0)
+      int_error("Error cannot open the CA database file for writing");
+    memset(&fl, '\0', sizeof(fl));
+    fl.l_type   = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_len    = 1;
+    while (fcntl(txn->fd, F_SETLKW, &fl) != 0)
+      if (errno != EINTR) int_error("Error cannot lock the CA database file");
+    if (fstat(txn->fd, &st) == 0 && stat(db->path, &pst) == 0 &&
+        st.st_ino == pst.st_ino && st.st_dev == pst.st_dev) return;
+    close(txn->fd);
+  }
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_open(): opens the CA database file for reading, the *
+ * snapshot of its last commit. A new database gets the       *
+ * unique_subject of 'db_attr', an existing one has its own.  *
+ * returns the handle, errors stop the CGI.                   *
+ * ---------------------------------------------------------- */
+CA_DB *certdb_open(const char *dbfile, DB_ATTR *db_attr) {
+  CA_DB *db;
+
+  if ((db = calloc(1, sizeof(CA_DB))) == NULL)
+    int_error("Error: cannot allocate memory for new database");
+  if (strlen(dbfile) >= sizeof(db->path))
+    int_error("Error: the CA database file name is too long");
+  strcpy(db->path, dbfile);
+  if (db_attr) db->attributes = *db_attr;
+  else db->attributes.unique_subject = UNIQUE_SUBJECT;
+
+  cadb_reader(db);
+  cadb_snapshot(db);
+  return db;
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_close(): drops an uncommitted txn, and the handle.  *
+ * ---------------------------------------------------------- */
+void certdb_close(CA_DB *db) {
+  if (db == NULL) return;
+  cadb_end(db);
+  if (db->map) munmap(db->map, db->maplen);
+  if (db->fd >= 0) close(db->fd);
+  free(db);
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_unique_subject(): the DB_ATTR of the database.      *
+ * certdb_count(): the # of records.                          *
+ * ---------------------------------------------------------- */
+int certdb_unique_subject(CA_DB *db) {
+  return db->attributes.unique_subject;
+}
+
+uint64_t certdb_count(CA_DB *db) {
+  return db->meta.count;
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_revgen(): the # of puts that revoked a cert, or     *
+ * changed a revoked one, and in *dbid the id of the database *
+ * they count for, in *last the serial of the latest. A cache *
+ * of the revoked records is current if both are the same.   *
+ * ---------------------------------------------------------- */
+uint64_t certdb_revgen(CA_DB *db, uint64_t *dbid, CERT_SERIAL *last) {
+  *dbid = db->meta.dbid;
+  *last = db->meta.revlast;
+  return db->meta.revgen;
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_get(): looks up the record of a serial. returns 1   *
+ * and the record in *rec, or 0 if there is none.             *
+ * ---------------------------------------------------------- */
+int certdb_get(CA_DB *db, const CERT_SERIAL *serial, CADB_REC *rec) {
+  unsigned char key[CADB_KEYLEN];
+  uint64_t off;
+
+  cadb_key_serial(key, serial);
+  if (! cadb_tree_get(db, CADB_SERIAL, key, &off)) return 0;
+  cadb_rec_read(db, off, rec);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_last(): the highest serial in the database. returns *
+ * 1, or 0 if it is empty.                                    *
+ * ---------------------------------------------------------- */
+int certdb_last(CA_DB *db, CERT_SERIAL *serial) {
+  const unsigned char *page;
+  const CADB_NODE *node;
+  uint64_t pgno = db->meta.root[CADB_SERIAL];
+  int depth = 0;
+
+  while (pgno) {
+    page = cadb_page(db, pgno);
+    node = (const CADB_NODE *) page;
+    if (node->count == 0 || node->count > CADB_MAXENT || ++depth > 16)
+      cadb_corrupt(db);
+    if (node->type == CADB_LEAF) {
+      memcpy(serial->b, CADB_ENTS(page)[node->count - 1].key, SERIAL_LEN);
+      return 1;
+    }
+    pgno = CADB_ENTS(page)[node->count - 1].val;
+  }
+  return 0;
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_scan_xxx(): call 'cb' with the records in order, of *
+ * all serials, of a subject, or with a notAfter in a range.  *
+ * A 'cb' that returns 0 ends the scan. The secondary keys of *
+ * a record stay if it gets a new subject or expiry, the scan *
+ * checks the record against them.                            *
+ * ---------------------------------------------------------- */
+typedef struct cadb_scan_st {
+  certdb_cb     cb;
+  void         *arg;
+  const char   *name;
+  CADB_REC      rec;
+} CADB_SCAN;
+
+static int cadb_scan_rec(CA_DB *db, const unsigned char *key, uint64_t val,
+                                                              void *arg) {
+  CADB_SCAN *scan = arg;
+
+  cadb_rec_read(db, val, &scan->rec);
+  return scan->cb(&scan->rec, scan->arg);
+}
+
+static int cadb_scan_key(CA_DB *db, const unsigned char *key, uint64_t val,
+                                                              void *arg) {
+  CADB_SCAN *scan = arg;
+  CERT_SERIAL serial;
+  int64_t epoch;
+
+  memcpy(serial.b, key + 8, SERIAL_LEN);
+  if (! certdb_get(db, &serial, &scan->rec)) return 1;
+  if (scan->name) {
+    if (strcmp(scan->rec.name, scan->name) != 0) return 1;
+  }
+  else {
+    unsigned char ekey[CADB_KEYLEN];
+    if (! dbtime_to_epoch(scan->rec.exp_date, &epoch)) return 1;
+    cadb_key_expiry(ekey, epoch, &serial);
+    if (memcmp(ekey, key, CADB_KEYLEN) != 0) return 1;
+  }
+  return scan->cb(&scan->rec, scan->arg);
+}
+
+int certdb_scan(CA_DB *db, certdb_cb cb, void *arg) {
+  CADB_SCAN scan = { cb, arg, NULL };
+
+  if (db->meta.root[CADB_SERIAL] == 0) return 1;
+  return cadb_tree_scan(db, db->meta.root[CADB_SERIAL], NULL, NULL,
+                                                  cadb_scan_rec, &scan);
+}
+
+int certdb_scan_subject(CA_DB *db, const char *name, certdb_cb cb, void *arg) {
+  CADB_SCAN scan = { cb, arg, name };
+  unsigned char lo[CADB_KEYLEN], hi[CADB_KEYLEN];
+
+  if (db->meta.root[CADB_SUBJECT] == 0) return 1;
+  cadb_key_subject(lo, name, NULL);
+  memcpy(hi, lo, CADB_KEYLEN);
+  memset(hi + 8, 0xff, CADB_KEYLEN - 8);
+  return cadb_tree_scan(db, db->meta.root[CADB_SUBJECT], lo, hi,
+                                                  cadb_scan_key, &scan);
+}
+
+int certdb_scan_expiry(CA_DB *db, int64_t from, int64_t to, certdb_cb cb,
+                                                              void *arg) {
+  CADB_SCAN scan = { cb, arg, NULL };
+  unsigned char lo[CADB_KEYLEN], hi[CADB_KEYLEN];
+
+  if (db->meta.root[CADB_EXPIRY] == 0) return 1;
+  cadb_key_expiry(lo, from, NULL);
+  cadb_key_expiry(hi, to, NULL);
+  memset(hi + 8, 0xff, CADB_KEYLEN - 8);
+  return cadb_tree_scan(db, db->meta.root[CADB_EXPIRY], lo, hi,
+                                                  cadb_scan_key, &scan);
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_apply(): puts an encoded record into the trees of the *
+ * txn. A put that revokes, or changes a revoked record, is   *
+ * counted in revgen, see certdb_revgen().                    *
+ * returns 1 for success, -1 for a subject clash.             *
+ * ---------------------------------------------------------- */
+static int cadb_valid(const CADB_REC *rec, void *arg) {
+  if (rec->type != DB_TYPE_VAL) return 1;
+  *(int *) arg = 1;
+  return 0;
+}
+
+static int cadb_apply(CA_DB *db, const CADB_REC *rec,
+                              const unsigned char *buf, uint16_t reclen) {
+  unsigned char key[CADB_KEYLEN];
+  CADB_REC old;
+  uint64_t off;
+  int64_t epoch, oldepoch;
+  int exists, clash = 0;
+
+  exists = certdb_get(db, &rec->serial, &old);
+  if (rec->type == DB_TYPE_REV || (exists && old.type == DB_TYPE_REV)) {
+    db->meta.revgen++;
+    db->meta.revlast = rec->serial;
+  }
+  if (! exists && rec->type == DB_TYPE_VAL && db->attributes.unique_subject) {
+    certdb_scan_subject(db, rec->name, cadb_valid, &clash);
+    if (clash) return -1;
+  }
+
+  off = cadb_rec_write(db, buf, reclen);
+  cadb_key_serial(key, &rec->serial);
+  cadb_tree_put(db, CADB_SERIAL, key, off);
+  if (! exists) db->meta.count++;
+
+  if (! exists || strcmp(old.name, rec->name) != 0) {
+    cadb_key_subject(key, rec->name, &rec->serial);
+    cadb_tree_put(db, CADB_SUBJECT, key, 0);
+  }
+  if (dbtime_to_epoch(rec->exp_date, &epoch) &&
+      (! exists || ! dbtime_to_epoch(old.exp_date, &oldepoch) ||
+       epoch != oldepoch)) {
+    cadb_key_expiry(key, epoch, &rec->serial);
+    cadb_tree_put(db, CADB_EXPIRY, key, 0);
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_put(): inserts a record, or replaces the one of its *
+ * serial, in the write txn, which starts with the first put. *
+ * With unique_subject, a new valid record must not have the  *
+ * subject of another valid one.                              *
+ * returns 1 for success, -1 for a subject clash.             *
+ * ---------------------------------------------------------- */
+int certdb_put(CA_DB *db, const CADB_REC *rec) {
+  unsigned char buf[CADB_RECHDR + sizeof(CADB_REC)], *log;
+  CADB_TXN *txn;
+  uint16_t reclen;
+  int ret;
+
+  cadb_begin(db);
+  txn = db->txn;
+  reclen = cadb_rec_encode(rec, buf);
+  if ((ret = cadb_apply(db, rec, buf, reclen)) != 1) return ret;
+
+  if (txn->loglen + reclen > txn->logcap) {
+    txn->logcap = (txn->loglen + reclen) * 2;
+    if ((log = realloc(txn->log, txn->logcap)) == NULL)
+      int_error("Error cannot allocate memory for the CA database txn");
+    txn->log = log;
+  }
+  memcpy(txn->log + txn->loglen, buf, reclen);
+  txn->loglen += reclen;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * cadb_replay(): the txn was built on a snapshot that is not *
+ * the latest commit anymore, its puts are applied again on   *
+ * the latest. returns 1, or -1 for a subject clash.          *
+ * ---------------------------------------------------------- */
+static int cadb_replay(CA_DB *db) {
+  CADB_TXN *txn = db->txn;
+  CADB_REC rec;
+  uint16_t reclen;
+  size_t pos;
+
+  cadb_start(db);
+  for (pos = 0; pos < txn->loglen; pos += reclen) {
+    if ((reclen = cadb_rec_decode(txn->log + pos, txn->loglen - pos, &rec)) == 0)
+      int_error("Error in the CA database txn log");
+    if (cadb_apply(db, &rec, txn->log + pos, reclen) != 1) return -1;
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_commit(): makes the txn the current database state, *
+ * under the writer lock. The changed pages and the new free  *
+ * list are written and synced first, then the meta in the    *
+ * slot of the older one. 'durable' syncs the meta too, else  *
+ * a crash may lose the commit, but never tears it.           *
+ * returns 1, 0 for errors, or -1 for a subject clash.        *
+ * ---------------------------------------------------------- */
+int certdb_commit(CA_DB *db, int durable) {
+  CADB_TXN *txn = db->txn;
+  CADB_META meta;
+  CADB_NODE *node;
+  unsigned char *page, metapage[CADB_PAGESIZE];
+  uint64_t *list, *lpages, next = 0;
+  size_t nlist, nlpages, skip, i, j, n;
+  struct stat st;
+  int ok = 1;
+
+  if (txn == NULL) return 1;
+
+  /* a commit since the snapshot, or a new file: the puts again */
+  if (txn->fd < 0) cadb_lock(db);
+  meta = db->meta;
+  cadb_refresh(db);
+  if (db->meta.txnid != txn->base || fstat(txn->fd, &st) != 0 ||
+      (txn->ino != 0 && st.st_ino != txn->ino)) {
+    if (cadb_replay(db) != 1) {
+      cadb_end(db);
+      return -1;
+    }
+  }
+  else db->meta = meta;
+
+  /* With reuse, the unused free pages and the replaced ones go    */
+  /* into list pages taken from the unused ones, each one leaves   */
+  /* the list. Without, the old list and its pages stay as they    */
+  /* are, new pages at the file end with the replaced ones go      */
+  /* in front of it. The list grows only by the pages of the txn.  */
+  if (txn->reuse) skip = 0;
+  else {
+    skip = txn->nlistpg;
+    txn->navail = 0;
+    next = db->meta.freelist;
+  }
+  nlist = txn->navail + txn->nfreed - skip;
+  if ((lpages = malloc((nlist / CADB_MAXFREE + 1) * sizeof(uint64_t))) == NULL) {
+    cadb_end(db);
+    return 0;
+  }
+  for (nlpages = 0; nlpages * CADB_MAXFREE < txn->navail + txn->nfreed - skip;
+                                                                  nlpages++)
+    lpages[nlpages] = cadb_alloc(db, &page, CADB_FREE);
+  txn->reuse = 0;
+
+  nlist = txn->navail + txn->nfreed - skip;
+  if ((list = malloc((nlist + 1) * sizeof(uint64_t))) == NULL) {
+    free(lpages);
+    cadb_end(db);
+    return 0;
+  }
+  memcpy(list, txn->avail, txn->navail * sizeof(uint64_t));
+  memcpy(list + txn->navail, txn->freed + skip,
+                             (txn->nfreed - skip) * sizeof(uint64_t));
+  for (i = 0, j = 0; j < nlpages; i += n, j++) {
+    n = (nlist - i < CADB_MAXFREE) ? nlist - i : CADB_MAXFREE;
+    page = cadb_dirty_get(txn, lpages[j]);
+    node = (CADB_NODE *) page;
+    node->count = n;
+    node->next  = next;
+    memcpy(CADB_ENTS(page), list + i, n * sizeof(uint64_t));
+    next = lpages[j];
+  }
+  free(list);
+  free(lpages);
+  db->meta.freelist = next;
+
+  for (i = 0; ok && i < txn->dirtycap; i++) {
+    if (txn->dirty[i].pgno == 0) continue;
+    ok = (pwrite(txn->fd, txn->dirty[i].page, CADB_PAGESIZE,
+                 txn->dirty[i].pgno * CADB_PAGESIZE) == CADB_PAGESIZE);
+  }
+  if (ok) ok = (fdatasync(txn->fd) == 0);
+
+  if (ok && db->meta.dbid == 0 &&
+      RAND_bytes((unsigned char *) &db->meta.dbid, sizeof(uint64_t)) != 1)
+    ok = 0;
+  if (ok) {
+    db->meta.txnid++;
+    db->meta.sum = cadb_metasum(&db->meta);
+    memset(metapage, '\0', sizeof(metapage));
+    memcpy(metapage, &db->meta, sizeof(db->meta));
+    ok = (pwrite(txn->fd, metapage, CADB_PAGESIZE,
+                 (db->meta.txnid % 2) * CADB_PAGESIZE) == CADB_PAGESIZE);
+    if (ok && durable) ok = (fdatasync(txn->fd) == 0);
+  }
+  cadb_end(db);
+  return ok;
+}
+
+/* ---------------------------------------------------------- *
+ * certdb_compact(): copies the records of the database into  *
+ * a new file, and renames it over the old one. The writer    *
+ * lock of the old file is held to the end, a waiting writer  *
+ * then finds the new file. The free and heap pages of old    *
+ * commits are left behind. returns 1, or 0 for errors.       *
+ * ---------------------------------------------------------- */
+static int cadb_copy(const CADB_REC *rec, void *arg) {
+  return (certdb_put(arg, rec) == 1);
+}
+
+int certdb_compact(const char *dbfile) {
+  CA_DB *db, *dst;
+  char tmpfile[512+16];
+  int ok;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", dbfile, (int) getpid());
+  unlink(tmpfile);
+  db = certdb_open(dbfile, NULL);
+  cadb_begin(db);
+  cadb_lock(db);
+  cadb_refresh(db);
+
+  dst = certdb_open(tmpfile, &db->attributes);
+  cadb_begin(dst);
+  ok = certdb_scan(db, cadb_copy, dst);
+  /* the CRL cache is still current for the new file */
+  dst->meta.dbid    = db->meta.dbid;
+  dst->meta.revgen  = db->meta.revgen;
+  dst->meta.revlast = db->meta.revlast;
+  if (ok) ok = (certdb_commit(dst, 1) == 1);
+  certdb_close(dst);
+
+  if (! ok || rename(tmpfile, dbfile) != 0) {
+    unlink(tmpfile);
+    ok = 0;
+  }
+  certdb_close(db);
+  return ok;
+}
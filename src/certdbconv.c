@@ -0,0 +1,195 @@
+/* ---------------------------------------------------------- *
+ * file:	certdbconv.c                                  *
+ * purpose:	command line tool for the CA database INDEXDB *
+ *              "import" adds the rows of an openssl ca style *
+ *              index.txt, and unique_subject of its .attr if *
+ *              INDEXDB is new. A row of a serial that is in  *
+ *              INDEXDB replaces it, so it can be re-run.     *
+ *              "export" writes INDEXDB as index.txt and its  *
+ *              .attr, for openssl ca and other tools.        *
+ *              "compact" rewrites INDEXDB without the pages  *
+ *              that old commits left behind.                 *
+ *              usage: certdbconv import|export [indexfile]   *
+ *                     certdbconv compact                     *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <openssl/conf.h>
+#include <openssl/err.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * handle_error(): the tool has no html page, int_error() in  *
+ * the shared code ends up here.                              *
+ * ---------------------------------------------------------- */
+void handle_error(const char *file, int lineno, const char *msg) {
+  fprintf(stderr, "certdbconv: %s (%s line %d)\n", msg, file, lineno);
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+/* ---------------------------------------------------------- *
+ * conv_attr(): unique_subject of the index file's .attr, the *
+ * UNIQUE_SUBJECT default if it has none.                     *
+ * ---------------------------------------------------------- */
+static int conv_attr(const char *indexfile) {
+  char attrfile[512];
+  CONF *conf;
+  char *p;
+  int unique = UNIQUE_SUBJECT;
+
+  snprintf(attrfile, sizeof(attrfile), "%s.attr", indexfile);
+  if (access(attrfile, R_OK) != 0) return unique;
+  if ((conf = app_load_config(attrfile)) == NULL) return unique;
+  if ((p = NCONF_get_string(conf, NULL, "unique_subject")) != NULL) {
+    if (strcmp(p, "yes") == 0) unique = 1;
+    else if (strcmp(p, "no") == 0) unique = 0;
+  }
+  ERR_clear_error();
+  NCONF_free(conf);
+  return unique;
+}
+
+/* ---------------------------------------------------------- *
+ * conv_import(): puts the index file rows into INDEXDB, one  *
+ * durable commit for all. returns the # of rows.             *
+ * ---------------------------------------------------------- */
+static int conv_import(const char *indexfile) {
+  DB_ATTR db_attr;
+  CA_DB *db;
+  CADB_REC rec;
+  TXT_DB *txt;
+  BIO *in;
+  char **row;
+  int i, rows;
+
+  if ((in = BIO_new_file(indexfile, "r")) == NULL)
+    int_error("Error: cannot open the index file for reading");
+  if ((txt = TXT_DB_read(in, DB_NUMBER)) == NULL)
+    int_error("Error: cannot read the index file");
+  BIO_free_all(in);
+
+  db_attr.unique_subject = conv_attr(indexfile);
+  db = certdb_open(INDEXDB, &db_attr);
+
+  rows = sk_OPENSSL_PSTRING_num(txt->data);
+  for (i = 0; i < rows; i++) {
+    row = (char **) sk_OPENSSL_PSTRING_value(txt->data, i);
+    memset(&rec, '\0', sizeof(rec));
+    if (! serial_from_hex(&rec.serial, row[DB_serial])) {
+      snprintf(error_str, sizeof(error_str),
+               "Error: bad serial \"%s\" in row %d", row[DB_serial], i + 1);
+      int_error(error_str);
+    }
+    rec.type = row[DB_type][0];
+    if (OPENSSL_strlcpy(rec.exp_date, row[DB_exp_date], sizeof(rec.exp_date))
+                                                  >= sizeof(rec.exp_date) ||
+        OPENSSL_strlcpy(rec.rev_date, row[DB_rev_date], sizeof(rec.rev_date))
+                                                  >= sizeof(rec.rev_date) ||
+        OPENSSL_strlcpy(rec.name, row[DB_name], sizeof(rec.name))
+                                                  >= sizeof(rec.name)) {
+      snprintf(error_str, sizeof(error_str),
+               "Error: a field of row %d is too long", i + 1);
+      int_error(error_str);
+    }
+    if (certdb_put(db, &rec) != 1) {
+      snprintf(error_str, sizeof(error_str), "Error: row %d, a valid "
+        "certificate for %s exists and unique_subject = yes", i + 1, rec.name);
+      int_error(error_str);
+    }
+  }
+  if (certdb_commit(db, 1) != 1)
+    int_error("Error: cannot write the CA database file");
+  certdb_close(db);
+  TXT_DB_free(txt);
+  return rows;
+}
+
+/* ---------------------------------------------------------- *
+ * conv_export(): writes the INDEXDB records as index.txt     *
+ * rows in serial order, the file field is "unknown" as with  *
+ * openssl ca. returns 1, or 0 for errors, which end the scan *
+ * ---------------------------------------------------------- */
+static int conv_row(const CADB_REC *rec, void *arg) {
+  char hex[SERIAL_HEXLEN];
+
+  serial_to_hex(&rec->serial, hex, sizeof(hex));
+  return (fprintf(arg, "%c\t%s\t%s\t%s\tunknown\t%s\n", rec->type,
+                  rec->exp_date, rec->rev_date,
+                  strcmp(hex, "0") == 0 ? "00" : hex, rec->name) > 0);
+}
+
+/* ---------------------------------------------------------- *
+ * conv_replace(): closes, syncs and renames a written temp   *
+ * file over 'file'. returns 1 for success, 0 for errors.     *
+ * ---------------------------------------------------------- */
+static int conv_replace(FILE *fp, int ok, const char *tmpfile,
+                                                    const char *file) {
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) ok = 0;
+  if (fclose(fp) != 0) ok = 0;
+  if (! ok || rename(tmpfile, file) != 0) {
+    unlink(tmpfile);
+    return 0;
+  }
+  return 1;
+}
+
+static int conv_export(const char *indexfile) {
+  char attrfile[512], tmpfile[512+8];
+  CA_DB *db;
+  FILE *fp;
+  int rows, ok;
+
+  db = certdb_open(INDEXDB, NULL);
+  rows = (int) certdb_count(db);
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", indexfile);
+  if ((fp = fopen(tmpfile, "w")) == NULL)
+    int_error("Error: cannot write the index file");
+  ok = certdb_scan(db, conv_row, fp);
+  if (! conv_replace(fp, ok, tmpfile, indexfile))
+    int_error("Error: cannot write the index file");
+
+  snprintf(attrfile, sizeof(attrfile), "%s.attr", indexfile);
+  snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", attrfile);
+  if ((fp = fopen(tmpfile, "w")) == NULL)
+    int_error("Error: cannot write the index .attr file");
+  ok = (fprintf(fp, "unique_subject = %s\n",
+                certdb_unique_subject(db) ? "yes" : "no") > 0);
+  if (! conv_replace(fp, ok, tmpfile, attrfile))
+    int_error("Error: cannot write the index .attr file");
+
+  certdb_close(db);
+  return rows;
+}
+
+int main(int argc, char *argv[]) {
+  const char *indexfile = INDEXFILE;
+  const char *cmd = "";
+
+  if (argc == 2 || (argc == 3 && strcmp(argv[1], "compact") != 0)) {
+    cmd = argv[1];
+    if (argc == 3) indexfile = argv[2];
+  }
+
+  if (strcmp(cmd, "import") == 0)
+    printf("%d rows of %s imported into %s.\n", conv_import(indexfile),
+                                                  indexfile, INDEXDB);
+  else if (strcmp(cmd, "export") == 0)
+    printf("%d records of %s exported to %s.\n", conv_export(indexfile),
+                                                  INDEXDB, indexfile);
+  else if (strcmp(cmd, "compact") == 0) {
+    if (! certdb_compact(INDEXDB))
+      int_error("Error: cannot compact the CA database");
+    printf("%s compacted.\n", INDEXDB);
+  }
+  else {
+    fprintf(stderr, "usage: certdbconv import|export [indexfile]\n"
+                    "       certdbconv compact\n");
+    return 2;
+  }
+  return 0;
+}
@@ -26,7 +26,6 @@ int cgiMain() {
    EVP_PKEY		*cert_privkey       = NULL;
    BIO			*inbio              = NULL;
    BIO			*outbio             = NULL;
-   char 		certfilepath[255]   = "";
    char 		certnamestr[81]     = "";
    char 		certfilestr[81]     = "[n/a]";
    FILE 		*cacertfile         = NULL;
@@ -221,16 +220,15 @@ int cgiMain() {
  * read the certstore certificate and define a BIO output stream              *
  * ---------------------------------------------------------------------------*/
 
-   if (strcmp(certfilestr, "cacert.pem") == 0) 
-      snprintf(certfilepath, sizeof(certfilepath), "%s", CACERT);
-   else
-      snprintf(certfilepath, sizeof(certfilepath), "%s/%s", CACERTSTORE,
-                                                                certfilestr);
-   if (! (certfile = fopen(certfilepath, "r")))
-      int_error("Error cant read cert store certificate file");
-
-   if (! (cert = PEM_read_X509(certfile,NULL,NULL,NULL)))
-      int_error("Error loading cert into memory");
+   if (strcmp(certfilestr, "cacert.pem") == 0) {
+      if (! (certfile = fopen(CACERT, "r")))
+         int_error("Error cant read cert store certificate file");
+      if (! (cert = PEM_read_X509(certfile,NULL,NULL,NULL)))
+         int_error("Error loading cert into memory");
+      fclose(certfile);
+   }
+   else if (! (cert = read_storecert(certfilestr)))
+      int_error("Error cant load the certificate from the cert store");
 
    outbio = BIO_new(BIO_s_file());
 
@@ -0,0 +1,394 @@
+/* ---------------------------------------------------------- *
+ * file:	certfile.c                                    *
+ * purpose:	cert store file access for the issued certs.  *
+ *              Either one <serial>.pem file per cert in the  *
+ *              CACERTSTORE directory, or with ARCHIVE_STORE  *
+ *              set, the packed append-only DER archive file  *
+ *              CERTARCHIVE, located by the index file_off.   *
+ *              With SHARDED_STORE, the PEM files are in two  *
+ *              levels of shard dirs, see storecert_path().   *
+ *              With DER_STORE, new certs are <serial>.der    *
+ *              files. Reads probe each file for its format,  *
+ *              so a store can have both PEM and DER files.   *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The archive file CERTARCHIVE: header, then one entry per   *
+ * cert, each an entry header with the serial and DER length, *
+ * the DER bytes, and zero padding to the next 8 byte offset. *
+ * The header 'end' is moved past an entry once it is written *
+ * completely, readers and the next writer only trust up to   *
+ * there. Entries are only ever appended, a replaced cert     *
+ * leaves the old entry behind, the index has the newest one. *
+ * ---------------------------------------------------------- */
+#define CERTARC_MAGIC   "WCARC\0\0\0"
+#define CERTARC_VERSION 1
+
+typedef struct certarc_hdr_st {
+  char          magic[8];      /* CERTARC_MAGIC                   */
+  uint32_t      version;       /* CERTARC_VERSION                 */
+  uint32_t      reserved;
+  uint64_t      end;           /* end of the last complete entry  */
+  uint64_t      pad;
+} CERTARC_HDR;
+
+typedef struct certarc_ent_st {
+  CERT_SERIAL   serial;        /* big-endian, left zero padded    */
+  uint32_t      len;           /* # of DER bytes that follow      */
+} CERTARC_ENT;
+
+#define CERTARC_ALIGN(n)  (((n) + 7) & ~(uint64_t) 7)
+
+/* ---------------------------------------------------------- *
+ * load_certarchive(): maps the archive file read-only.       *
+ * returns 1 for success, or 0 for errors.                    *
+ * ---------------------------------------------------------- */
+int load_certarchive(CERT_ARCHIVE *arc, const char *arcfile) {
+  struct stat st;
+  int fd;
+
+  memset(arc, '\0', sizeof(CERT_ARCHIVE));
+  if ((fd = open(arcfile, O_RDONLY)) < 0) return 0;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(CERTARC_HDR)) {
+    close(fd);
+    return 0;
+  }
+
+  arc->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (arc->map == MAP_FAILED) {
+    arc->map = NULL;
+    return 0;
+  }
+  arc->maplen = st.st_size;
+
+  if (memcmp(arc->map, CERTARC_MAGIC, 8) != 0 ||
+      ((const CERTARC_HDR *) arc->map)->version != CERTARC_VERSION) {
+    free_certarchive(arc);
+    return 0;
+  }
+  /* the entries up to the committed end, as of this mapping */
+  arc->end = ((const CERTARC_HDR *) arc->map)->end;
+  if (arc->end > arc->maplen) arc->end = arc->maplen;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * free_certarchive(): releases the archive file mapping.     *
+ * ---------------------------------------------------------- */
+void free_certarchive(CERT_ARCHIVE *arc) {
+  if (arc->map) munmap((void *) arc->map, arc->maplen);
+  memset(arc, '\0', sizeof(CERT_ARCHIVE));
+}
+
+/* ---------------------------------------------------------- *
+ * certarchive_der(): the DER bytes of the entry at 'off', if *
+ * it is a complete entry before the archive end, its serial  *
+ * matches (serial NULL skips that check). returns a pointer  *
+ * into the mapping with *len set, or NULL.                   *
+ * ---------------------------------------------------------- */
+const unsigned char *certarchive_der(const CERT_ARCHIVE *arc, uint64_t off,
+                                 const CERT_SERIAL *serial, long *len) {
+  const CERTARC_ENT *ent;
+
+  if (off < sizeof(CERTARC_HDR) || off % 8 != 0 ||
+      off + sizeof(CERTARC_ENT) > arc->end) return NULL;
+  ent = (const CERTARC_ENT *) (arc->map + off);
+  if (off + sizeof(CERTARC_ENT) + ent->len > arc->end) return NULL;
+  if (serial && ! serial_eq(&ent->serial, serial)) return NULL;
+
+  *len = ent->len;
+  return arc->map + off + sizeof(CERTARC_ENT);
+}
+
+/* ---------------------------------------------------------- *
+ * certarchive_next(): walks the archive entries in file      *
+ * order. Pass 0 for the first entry. returns the offset of   *
+ * the entry after 'off', or 0 at the end of the archive.     *
+ * ---------------------------------------------------------- */
+uint64_t certarchive_next(const CERT_ARCHIVE *arc, uint64_t off) {
+  const CERTARC_ENT *ent;
+  long len;
+
+  if (off == 0) off = sizeof(CERTARC_HDR);
+  else {
+    ent = (const CERTARC_ENT *) (arc->map + off);
+    off = CERTARC_ALIGN(off + sizeof(CERTARC_ENT) + ent->len);
+  }
+  if (certarchive_der(arc, off, NULL, &len) == NULL) return 0;
+  return off;
+}
+
+/* ---------------------------------------------------------- *
+ * certarchive_find(): the newest entry of a serial, found by *
+ * walking the whole archive. Only used when the cert index   *
+ * has no offset for it. returns the offset, or 0 if missing. *
+ * ---------------------------------------------------------- */
+uint64_t certarchive_find(const CERT_ARCHIVE *arc, const CERT_SERIAL *serial) {
+  uint64_t off, found = 0;
+
+  for (off = certarchive_next(arc, 0); off; off = certarchive_next(arc, off))
+    if (serial_eq(&((const CERTARC_ENT *) (arc->map + off))->serial, serial))
+      found = off;
+  return found;
+}
+
+/* ---------------------------------------------------------- *
+ * append_certarchive(): appends one DER cert to the archive, *
+ * creating the file if needed. Writers are serialized by the *
+ * exclusive lock. The entry goes to the committed end, over  *
+ * any torn append of a crashed writer, then the end in the   *
+ * header moves. returns 1 and the entry offset in *off, or 0 *
+ * ---------------------------------------------------------- */
+int append_certarchive(const char *arcfile, const unsigned char *der,
+                       long len, const CERT_SERIAL *serial, uint64_t *off) {
+  static const unsigned char zero[8];
+  CERTARC_HDR hdr;
+  CERTARC_ENT ent;
+  unsigned char *buf;
+  size_t buflen;
+  int fd, ret = 0;
+
+  if (len <= 0 || len > UINT32_MAX) return 0;
+  if ((fd = open(arcfile, O_RDWR|O_CREAT, 0644)) < 0) return 0;
+  if (flock(fd, LOCK_EX) != 0) goto end;
+
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+    /* a new archive */
+    memset(&hdr, '\0', sizeof(hdr));
+    memcpy(hdr.magic, CERTARC_MAGIC, sizeof(hdr.magic));
+    hdr.version = CERTARC_VERSION;
+    hdr.end     = sizeof(hdr);
+  }
+  else if (memcmp(hdr.magic, CERTARC_MAGIC, sizeof(hdr.magic)) != 0 ||
+           hdr.version != CERTARC_VERSION) goto end;
+  *off = hdr.end;
+
+  /* one write per entry: header, DER and padding */
+  memset(&ent, '\0', sizeof(ent));
+  ent.serial = *serial;
+  ent.len    = len;
+  buflen = CERTARC_ALIGN(sizeof(ent) + len);
+  if ((buf = malloc(buflen)) == NULL) goto end;
+  memcpy(buf, &ent, sizeof(ent));
+  memcpy(buf + sizeof(ent), der, len);
+  memcpy(buf + sizeof(ent) + len, zero, buflen - sizeof(ent) - len);
+  if (pwrite(fd, buf, buflen, *off) == buflen) {
+    hdr.end = *off + buflen;
+    ret = (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+  }
+  free(buf);
+
+end:
+  close(fd);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * storecert_path(): the path of a store file "<SERIAL>.pem". *
+ * Sharded, the 1st level dir is the last serial byte, the    *
+ * 2nd level the byte before, "013A.pem" is in "3A/01/". The  *
+ * low order bytes are used, sequential serials share their   *
+ * leading bytes. Short serials get a "00" for missing bytes. *
+ * returns buf, or NULL if the name is not a serial.          *
+ * ---------------------------------------------------------- */
+char *storecert_path(const char *storedir, const char *certfilestr,
+                                   int sharded, char *buf, size_t buflen) {
+  CERT_SERIAL serial;
+  unsigned char lo, hi;
+
+  if (! sharded) {
+    snprintf(buf, buflen, "%s/%s", storedir, certfilestr);
+    return buf;
+  }
+  if (! serial_from_hex(&serial, certfilestr)) return NULL;
+  lo = serial.b[SERIAL_LEN-1];
+  hi = serial.b[SERIAL_LEN-2];
+  snprintf(buf, buflen, "%s/%02X/%02X/%s", storedir, lo, hi, certfilestr);
+  return buf;
+}
+
+/* ---------------------------------------------------------- *
+ * storecert_mkdirs(): creates the 2 shard dirs of a sharded  *
+ * file path, if needed. An existing dir is no error.         *
+ * ---------------------------------------------------------- */
+void storecert_mkdirs(const char *path) {
+  char dir[512];
+  char *p;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  if ((p = strrchr(dir, '/')) == NULL) return;
+  *p = '\0';
+  if ((p = strrchr(dir, '/')) == NULL) return;
+  *p = '\0';
+  mkdir(dir, 0755);
+  *p = '/';
+  mkdir(dir, 0755);
+}
+
+/* ---------------------------------------------------------- *
+ * read_certfile(): reads one cert from a PEM or DER file. A  *
+ * DER cert starts with the SEQUENCE tag 0x30, a PEM file has *
+ * text there, the first byte is enough to tell. As with the  *
+ * PEM_read_X509() 'x' argument, *x is reused if not NULL.    *
+ * The decoders free *x only for bad cert data, not for an    *
+ * empty file or one without a cert: for any error, *x is     *
+ * freed and set to NULL here. returns the cert, or NULL.     *
+ * ---------------------------------------------------------- */
+X509 *read_certfile(FILE *fp, X509 **x) {
+  X509 *cert = NULL;
+  int c;
+
+  if ((c = getc(fp)) != EOF) {
+    ungetc(c, fp);
+    if (c == 0x30) cert = d2i_X509_fp(fp, x);
+    else cert = PEM_read_X509(fp, x, NULL, NULL);
+  }
+  if (cert == NULL && x != NULL) {
+    X509_free(*x);
+    *x = NULL;
+  }
+  return cert;
+}
+
+#ifndef ARCHIVE_STORE
+/* ---------------------------------------------------------- *
+ * storecert_open(): opens a store file by name. Sharded, a   *
+ * file not yet migrated is still found at the top level.     *
+ * returns the open file, or NULL if it does not exist.       *
+ * ---------------------------------------------------------- */
+static FILE *storecert_open(const char *name) {
+  char certfilepath[512] = "";
+#ifdef SHARDED_STORE
+  FILE *fp = NULL;
+
+  if (storecert_path(CACERTSTORE, name, 1, certfilepath, sizeof(certfilepath)))
+    fp = fopen(certfilepath, "r");
+  if (fp) return fp;
+#endif
+  storecert_path(CACERTSTORE, name, 0, certfilepath, sizeof(certfilepath));
+  return fopen(certfilepath, "r");
+}
+#endif
+
+/* ---------------------------------------------------------- *
+ * read_storecert(): loads an issued cert by its store file   *
+ * name "<SERIALHEX>.pem". In the archive, the offset comes   *
+ * from the cert index, and the DER is decoded straight from  *
+ * the mapping. Otherwise <SERIALHEX>.pem or .der is opened,  *
+ * the DER_STORE format first. returns the cert, or NULL.     *
+ * ---------------------------------------------------------- */
+X509 *read_storecert(const char *certfilestr) {
+#ifdef ARCHIVE_STORE
+  const unsigned char *der;
+  const CERT_REC *rec;
+  CERT_INDEX idx;
+  CERT_ARCHIVE arc;
+  CERT_SERIAL serial;
+  uint64_t off = 0;
+  X509 *cert = NULL;
+  long len;
+
+  if (! serial_from_hex(&serial, certfilestr)) return NULL;
+  if (! load_certarchive(&arc, CERTARCHIVE)) return NULL;
+
+  if (load_certindex(&idx, CERTINDEX)) {
+    if ((rec = find_certindex(&idx, &serial)) != NULL) off = rec->file_off;
+    free_certindex(&idx);
+  }
+  if ((der = certarchive_der(&arc, off, &serial, &len)) == NULL &&
+      (off = certarchive_find(&arc, &serial)) != 0)
+    der = certarchive_der(&arc, off, &serial, &len);
+
+  if (der) cert = d2i_X509(NULL, &der, len);
+  free_certarchive(&arc);
+  return cert;
+#else
+  char name[256] = "";
+  X509 *cert = NULL;
+  FILE *fp;
+  size_t stem;
+
+  /* the cert name stays "<serial>.pem", the file may be DER */
+  stem = strcspn(certfilestr, ".");
+  if (stem + 5 > sizeof(name)) return NULL;
+  memcpy(name, certfilestr, stem);
+#ifdef DER_STORE
+  strcpy(name + stem, ".der");
+  if ((fp = storecert_open(name)) == NULL) {
+    strcpy(name + stem, ".pem");
+    fp = storecert_open(name);
+  }
+#else
+  strcpy(name + stem, ".pem");
+  if ((fp = storecert_open(name)) == NULL) {
+    strcpy(name + stem, ".der");
+    fp = storecert_open(name);
+  }
+#endif
+  if (fp == NULL) return NULL;
+  cert = read_certfile(fp, NULL);
+  fclose(fp);
+  return cert;
+#endif
+}
+
+/* ---------------------------------------------------------- *
+ * write_storecert(): saves a newly issued cert to the store. *
+ * *off is set to the archive offset for the index, or 0 for  *
+ * a file. returns 1 for success, 0 for errors.               *
+ * ---------------------------------------------------------- */
+int write_storecert(X509 *cert, uint64_t *off) {
+#ifdef ARCHIVE_STORE
+  CERT_SERIAL serial;
+  unsigned char *der = NULL;
+  int len, ret;
+
+  *off = 0;
+  if (! serial_from_asn1(&serial, X509_get_serialNumber(cert))) return 0;
+  if ((len = i2d_X509(cert, &der)) <= 0) return 0;
+  ret = append_certarchive(CERTARCHIVE, der, len, &serial, off);
+  OPENSSL_free(der);
+  return ret;
+#else
+  char certfilestr[512] = "";
+  char hex[SERIAL_HEXLEN+4] = "";
+  CERT_SERIAL serial;
+  FILE *fp;
+  int ret;
+
+  *off = 0;
+  if (! serial_from_asn1(&serial, X509_get_serialNumber(cert))) return 0;
+  serial_to_hex(&serial, hex, SERIAL_HEXLEN);
+#ifdef DER_STORE
+  strcat(hex, ".der");
+#else
+  strcat(hex, ".pem");
+#endif
+#ifdef SHARDED_STORE
+  storecert_path(CACERTSTORE, hex, 1, certfilestr, sizeof(certfilestr));
+  storecert_mkdirs(certfilestr);
+#else
+  storecert_path(CACERTSTORE, hex, 0, certfilestr, sizeof(certfilestr));
+#endif
+  if ((fp = fopen(certfilestr, "w")) == NULL) return 0;
+#ifdef DER_STORE
+  ret = i2d_X509_fp(fp, cert);
+#else
+  ret = PEM_write_X509(fp, cert);
+#endif
+  if (fclose(fp) != 0) ret = 0;
+  return ret;
+#endif
+}
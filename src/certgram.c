@@ -0,0 +1,357 @@
+/* ---------------------------------------------------------- *
+ * file:	certgram.c                                    *
+ * purpose:	inverted trigram index of the subject values  *
+ *              CN, O, OU and emailAddress, for the certsearch*
+ *              DN substring search. A compacted base file    *
+ *              with sorted posting lists, plus an append-only*
+ *              log of the certs signed since the last merge. *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The base file DNINDEX: header, the serials of the indexed  *
+ * certs (doc id = position), the gram directory sorted by    *
+ * gram, and the posting lists of ascending doc ids.          *
+ * ---------------------------------------------------------- */
+#define DNGRAM_MAGIC    "WCDNG\0\0\0"
+#define DNGRAM_VERSION  1
+
+typedef struct dngram_hdr_st {
+  char          magic[8];      /* DNGRAM_MAGIC                    */
+  uint32_t      version;       /* DNGRAM_VERSION                  */
+  uint32_t      keys;          /* # of gram directory entries     */
+  uint64_t      docs;          /* # of certs in the serial table  */
+  uint64_t      postings;      /* # of doc ids in all lists       */
+} DNGRAM_HDR;
+
+typedef struct dngram_key_st {
+  uint32_t      gram;          /* attr << 24 | 3 lowercase bytes  */
+  uint32_t      count;         /* # of doc ids in the list        */
+  uint64_t      off;           /* list start in the postings      */
+} DNGRAM_KEY;
+
+/* ---------------------------------------------------------- *
+ * dngram_attr(): the attribute # of an indexed RDN type, by  *
+ * its short name as used in the index subject strings.       *
+ * returns 1..4, or 0 if the attribute is not indexed.        *
+ * ---------------------------------------------------------- */
+int dngram_attr(const char *sn) {
+  static const char *attrs[] = { "CN", "O", "OU", "emailAddress" };
+  int i;
+
+  for (i = 0; i < sizeof(attrs)/sizeof(attrs[0]); i++)
+    if (strcmp(sn, attrs[i]) == 0) return i + 1;
+  return 0;
+}
+
+/* ---------------------------------------------------------- *
+ * dngram_key(): the gram key of three value bytes.           *
+ * ---------------------------------------------------------- */
+static uint32_t dngram_key(int attr, const char *p) {
+  return (uint32_t) attr << 24 | (uint32_t) tolower((unsigned char) p[0]) << 16
+         | (uint32_t) tolower((unsigned char) p[1]) << 8
+         | (uint32_t) tolower((unsigned char) p[2]);
+}
+
+/* ---------------------------------------------------------- *
+ * rdn_next(): splits the next "sn=value" off an index subject*
+ * "C=JP, O=Org\, Inc, CN=host", resolving the RFC2253 escapes*
+ * the same way as certsearch. returns the rest, NULL at end. *
+ * ---------------------------------------------------------- */
+static const char *rdn_next(const char *p, char *sn, size_t snlen,
+                                           char *value, size_t vallen) {
+  size_t i = 0;
+
+  if (*p == '\0') return NULL;
+
+  while (*p && *p != '=') {
+    if (i < snlen - 1) sn[i++] = *p;
+    p++;
+  }
+  sn[i] = '\0';
+  if (*p == '=') p++;
+
+  for (i = 0; *p; p++) {
+    if (*p == '\\' && p[1]) p++;
+    else if ((p[0] == ',' && p[1] == ' ') ||
+             (p[0] == ' ' && p[1] == '+' && p[2] == ' ')) break;
+    if (i < vallen - 1) value[i++] = *p;
+  }
+  value[i] = '\0';
+
+  /* skip the separator */
+  while (*p == ',' || *p == ' ' || *p == '+') p++;
+  return p;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static int key_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = ((const DNGRAM_KEY *) b)->gram;
+  return (x > y) - (x < y);
+}
+
+/* ---------------------------------------------------------- *
+ * dngram_rebuild(): writes a new base file for the serial    *
+ * sorted cert records, and empties the log. The (gram, doc)  *
+ * pairs are sorted once, that gives the lists in doc order.  *
+ * returns 1 for success, or 0 for errors.                    *
+ * ---------------------------------------------------------- */
+int dngram_rebuild(const char *gramfile, const CERT_REC *recs, uint64_t count) {
+  char sn[32], value[sizeof(recs->subject)], tmpfile[256], logfile[256];
+  uint64_t *pairs = NULL, npairs = 0, maxpairs = 0, i, j;
+  const char *p;
+  DNGRAM_HDR hdr;
+  DNGRAM_KEY key;
+  uint32_t doc;
+  FILE *fp = NULL;
+  int attr, fd, ret = 0;
+  size_t len;
+
+  for (i = 0; i < count; i++) {
+    p = recs[i].subject;
+    while ((p = rdn_next(p, sn, sizeof(sn), value, sizeof(value))) != NULL) {
+      if ((attr = dngram_attr(sn)) == 0 || (len = strlen(value)) < 3)
+        continue;
+      if (npairs + len > maxpairs) {
+        uint64_t *tmp;
+        maxpairs = (maxpairs + len) * 2;
+        if ((tmp = realloc(pairs, maxpairs * sizeof(uint64_t))) == NULL)
+          goto end;
+        pairs = tmp;
+      }
+      for (j = 0; j + 3 <= len; j++)
+        pairs[npairs++] = (uint64_t) dngram_key(attr, value + j) << 32 | i;
+    }
+  }
+  if (npairs > 0) qsort(pairs, npairs, sizeof(uint64_t), u64_cmp);
+
+  /* drop repeated grams of the same cert, count the directory */
+  memset(&hdr, '\0', sizeof(hdr));
+  for (i = 0, j = 0; i < npairs; i++) {
+    if (j > 0 && pairs[j-1] == pairs[i]) continue;
+    if (j == 0 || pairs[j-1] >> 32 != pairs[i] >> 32) hdr.keys++;
+    pairs[j++] = pairs[i];
+  }
+  npairs = j;
+
+  memcpy(hdr.magic, DNGRAM_MAGIC, sizeof(hdr.magic));
+  hdr.version  = DNGRAM_VERSION;
+  hdr.docs     = count;
+  hdr.postings = npairs;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", gramfile, (int) getpid());
+  if ((fp = fopen(tmpfile, "w")) == NULL) goto end;
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) goto fail;
+  for (i = 0; i < count; i++)
+    if (fwrite(&recs[i].serial, sizeof(CERT_SERIAL), 1, fp) != 1) goto fail;
+
+  for (i = 0; i < npairs; i = j) {
+    for (j = i; j < npairs && pairs[j] >> 32 == pairs[i] >> 32; j++);
+    key.gram  = pairs[i] >> 32;
+    key.count = j - i;
+    key.off   = i;
+    if (fwrite(&key, sizeof(key), 1, fp) != 1) goto fail;
+  }
+  for (i = 0; i < npairs; i++) {
+    doc = (uint32_t) pairs[i];
+    if (fwrite(&doc, sizeof(doc), 1, fp) != 1) goto fail;
+  }
+
+  if (fclose(fp) != 0 || rename(tmpfile, gramfile) != 0) {
+    unlink(tmpfile);
+    goto end;
+  }
+
+  /* the base has all certs now, a stale log entry only adds a candidate */
+  snprintf(logfile, sizeof(logfile), "%s.log", gramfile);
+  if ((fd = open(logfile, O_WRONLY|O_TRUNC)) >= 0) close(fd);
+  ret = 1;
+  goto end;
+
+fail:
+  fclose(fp);
+  unlink(tmpfile);
+end:
+  free(pairs);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * dngram_add(): appends the serial of a newly signed cert to *
+ * the log, it is merged into the base by the next rebuild.   *
+ * returns 1 for success, or 0 for errors.                    *
+ * ---------------------------------------------------------- */
+int dngram_add(const char *gramfile, const CERT_SERIAL *serial) {
+  char logfile[256];
+  int fd, ret;
+
+  snprintf(logfile, sizeof(logfile), "%s.log", gramfile);
+  if ((fd = open(logfile, O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0) return 0;
+  ret = (write(fd, serial, sizeof(CERT_SERIAL)) == sizeof(CERT_SERIAL));
+  close(fd);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * dngram_mark(): sets the bit of a serial's record position. *
+ * ---------------------------------------------------------- */
+static void dngram_mark(unsigned char *bits, const CERT_REC *recs,
+                        uint64_t count, const CERT_SERIAL *serial) {
+  uint64_t pos = seek_certrecs(recs, count, serial);
+
+  if (pos < count && serial_eq(&recs[pos].serial, serial))
+    bits[pos >> 3] |= 1 << (pos & 7);
+}
+
+/* ---------------------------------------------------------- *
+ * dngram_map(): maps a file read-only, returns NULL on error *
+ * ---------------------------------------------------------- */
+static const unsigned char *dngram_map(const char *file, size_t *len) {
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) < 0) return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+  *len = st.st_size;
+  return map;
+}
+
+/* ---------------------------------------------------------- *
+ * dngram_query(): finds the candidate certs for a substring  *
+ * search of 'value' in the RDN 'sn'. The posting lists of    *
+ * all grams in the value are intersected, shortest first.    *
+ * Candidates are a superset (the grams are case folded and   *
+ * may occur apart, a cut off subject is always one), the     *
+ * caller verifies each one. A missing, stale or oversized    *
+ * log base is rebuilt from recs first.                       *
+ * returns a bitmap over the record positions, to be freed,   *
+ * or NULL if the index cannot answer: the caller then scans. *
+ * ---------------------------------------------------------- */
+unsigned char *dngram_query(const char *gramfile, const CERT_REC *recs,
+              uint64_t count, const char *sn, const char *value) {
+  const unsigned char *map = NULL, *logmap = NULL;
+  size_t maplen = 0, loglen = 0, vlen = strlen(value);
+  const DNGRAM_HDR *hdr = NULL;
+  const CERT_SERIAL *serials;
+  const DNGRAM_KEY *keys, *lists[sizeof(((CERT_REC *) 0)->subject)], *tmp;
+  const uint32_t *postings;
+  uint32_t *cand = NULL, gram;
+  uint64_t ncand, nlogs = 0, i, j, n;
+  unsigned char *bits = NULL;
+  char logfile[256];
+  int attr, nlists = 0, nomatch = 0, tries, l, m;
+
+  if ((attr = dngram_attr(sn)) == 0 || vlen < 3 ||
+      vlen >= sizeof(lists)/sizeof(lists[0])) return NULL;
+
+  snprintf(logfile, sizeof(logfile), "%s.log", gramfile);
+
+  /* ---------------------------------------------------------- *
+   * map base and log, they must add up to the index count      *
+   * ---------------------------------------------------------- */
+  for (tries = 0; tries < 2; tries++) {
+    maplen = loglen = 0;
+    map = dngram_map(gramfile, &maplen);
+    logmap = dngram_map(logfile, &loglen);
+    nlogs = loglen / sizeof(CERT_SERIAL);
+    hdr = (const DNGRAM_HDR *) map;
+
+    if (map && maplen >= sizeof(DNGRAM_HDR) &&
+        memcmp(hdr->magic, DNGRAM_MAGIC, sizeof(hdr->magic)) == 0 &&
+        hdr->version == DNGRAM_VERSION &&
+        maplen == sizeof(DNGRAM_HDR) + hdr->docs * sizeof(CERT_SERIAL)
+                  + hdr->keys * sizeof(DNGRAM_KEY)
+                  + hdr->postings * sizeof(uint32_t) &&
+        hdr->docs + nlogs == count && nlogs <= DNGRAM_MERGE) break;
+
+    if (map) munmap((void *) map, maplen);
+    if (logmap) munmap((void *) logmap, loglen);
+    map = logmap = NULL;
+    if (tries > 0 || ! dngram_rebuild(gramfile, recs, count)) return NULL;
+  }
+
+  serials  = (const CERT_SERIAL *) (map + sizeof(DNGRAM_HDR));
+  keys     = (const DNGRAM_KEY *) (serials + hdr->docs);
+  postings = (const uint32_t *) (keys + hdr->keys);
+
+  if ((bits = calloc(count / 8 + 1, 1)) == NULL) goto end;
+
+  /* ---------------------------------------------------------- *
+   * look up the distinct grams of the value, shortest first    *
+   * ---------------------------------------------------------- */
+  for (i = 0; i + 3 <= vlen; i++) {
+    gram = dngram_key(attr, value + i);
+    tmp = bsearch(&gram, keys, hdr->keys, sizeof(DNGRAM_KEY), key_cmp);
+    if (tmp == NULL) {                /* no cert in the base matches */
+      nomatch = 1;
+      break;
+    }
+    for (l = 0; l < nlists && lists[l] != tmp; l++);
+    if (l == nlists) lists[nlists++] = tmp;
+  }
+  for (l = 1; l < nlists && ! nomatch; l++)
+    for (m = l; m > 0 && lists[m-1]->count > lists[m]->count; m--) {
+      tmp = lists[m]; lists[m] = lists[m-1]; lists[m-1] = tmp;
+    }
+
+  /* ---------------------------------------------------------- *
+   * intersect: keep the candidates found in each further list  *
+   * ---------------------------------------------------------- */
+  if (nlists > 0 && ! nomatch) {
+    ncand = lists[0]->count;
+    if ((cand = malloc(ncand * sizeof(uint32_t))) == NULL) goto fail;
+    memcpy(cand, postings + lists[0]->off, ncand * sizeof(uint32_t));
+
+    for (l = 1; l < nlists && ncand > 0; l++) {
+      const uint32_t *list = postings + lists[l]->off;
+      for (i = 0, j = 0, n = 0; i < ncand && j < lists[l]->count; ) {
+        if (cand[i] < list[j]) i++;
+        else if (cand[i] > list[j]) j++;
+        else { cand[n++] = cand[i]; i++; j++; }
+      }
+      ncand = n;
+    }
+
+    for (i = 0; i < ncand; i++)
+      if (cand[i] < hdr->docs)
+        dngram_mark(bits, recs, count, &serials[cand[i]]);
+  }
+
+  /* the certs signed since the last rebuild are all candidates */
+  for (i = 0; i < nlogs; i++)
+    dngram_mark(bits, recs, count, (const CERT_SERIAL *) logmap + i);
+
+  /* the grams of a cut off subject miss its end, check the cert */
+  for (i = 0; i < count; i++)
+    if (certrec_truncated(&recs[i])) bits[i >> 3] |= 1 << (i & 7);
+  goto end;
+
+fail:
+  free(bits);
+  bits = NULL;
+end:
+  free(cand);
+  if (map) munmap((void *) map, maplen);
+  if (logmap) munmap((void *) logmap, loglen);
+  return bits;
+}
@@ -0,0 +1,192 @@
+/* ---------------------------------------------------------- *
+ * file:	certimport.c                                  *
+ * purpose:	command line tool, imports the PEM and DER    *
+ *              files of a cert store directory into the      *
+ *              packed archive file. The DER bytes are copied *
+ *              as they are in the file, lossless. Certs that *
+ *              are already in the archive are skipped, so it *
+ *              can be re-run.                                *
+ *              usage: certimport [storedir [archivefile]]    *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * handle_error(): the tool has no html page, int_error() in  *
+ * the shared code ends up here.                              *
+ * ---------------------------------------------------------- */
+void handle_error(const char *file, int lineno, const char *msg) {
+  fprintf(stderr, "certimport: %s (%s line %d)\n", msg, file, lineno);
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+typedef struct import_file_st {
+  CERT_SERIAL   serial;
+  char          name[256];
+} IMPORT_FILE;
+
+static int import_file_cmp(const void *a, const void *b) {
+  return serial_cmp(&((const IMPORT_FILE *) a)->serial,
+                    &((const IMPORT_FILE *) b)->serial);
+}
+
+static int serial_ptr_cmp(const void *a, const void *b) {
+  return serial_cmp((const CERT_SERIAL *) a, (const CERT_SERIAL *) b);
+}
+
+/* ---------------------------------------------------------- *
+ * archive_serials(): the serials already in the archive, as  *
+ * a sorted array. returns the count, 0 for a new archive.    *
+ * ---------------------------------------------------------- */
+static int archive_serials(const char *arcfile, CERT_SERIAL **serials) {
+  CERT_ARCHIVE arc;
+  uint64_t off;
+  int n = 0, max = 0;
+
+  *serials = NULL;
+  if (! load_certarchive(&arc, arcfile)) return 0;
+  for (off = certarchive_next(&arc, 0); off; off = certarchive_next(&arc, off)) {
+    if (n == max) {
+      max = max ? max * 2 : 1024;
+      if ((*serials = realloc(*serials, max * sizeof(CERT_SERIAL))) == NULL)
+        int_error("Error out of memory reading the archive serials");
+    }
+    (*serials)[n++] = *(const CERT_SERIAL *) (arc.map + off);
+  }
+  free_certarchive(&arc);
+  if (n > 1) qsort(*serials, n, sizeof(CERT_SERIAL), serial_ptr_cmp);
+  return n;
+}
+
+/* ---------------------------------------------------------- *
+ * read_der(): the raw bytes of a DER file of DER_STORE, the  *
+ * same OPENSSL_malloc() buffer PEM_read() returns for a PEM. *
+ * returns 1 for success, 0 for errors.                       *
+ * ---------------------------------------------------------- */
+static int read_der(FILE *fp, unsigned char **data, long *len) {
+  if (fseek(fp, 0, SEEK_END) != 0 || (*len = ftell(fp)) <= 0) return 0;
+  rewind(fp);
+  if ((*data = OPENSSL_malloc(*len)) == NULL) return 0;
+  return (fread(*data, 1, *len, fp) == (size_t) *len);
+}
+
+/* ---------------------------------------------------------- *
+ * import_pem(): appends the DER of one PEM or DER file. The  *
+ * first byte tells the format, like read_certfile(). The     *
+ * cert is parsed to check it, and that the serial matches    *
+ * the name. returns 1 for success, 0 if it was not imported. *
+ * ---------------------------------------------------------- */
+static int import_pem(const char *path, const char *arcfile,
+                                           const CERT_SERIAL *serial) {
+  char *name = NULL, *header = NULL;
+  unsigned char *data = NULL;
+  const unsigned char *p;
+  CERT_SERIAL certserial;
+  X509 *cert = NULL;
+  long len = 0;
+  uint64_t off;
+  FILE *fp;
+  int ret = 0, c;
+
+  if ((fp = fopen(path, "r")) == NULL) return 0;
+  if ((c = getc(fp)) != EOF) ungetc(c, fp);
+  if ((c == 0x30) ? read_der(fp, &data, &len) :
+      (PEM_read(fp, &name, &header, &data, &len) &&
+       strcmp(name, PEM_STRING_X509) == 0)) {
+    p = data;
+    if ((cert = d2i_X509(NULL, &p, len)) != NULL &&
+        serial_from_asn1(&certserial, X509_get_serialNumber(cert)) &&
+        serial_eq(&certserial, serial))
+      ret = append_certarchive(arcfile, data, len, serial, &off);
+  }
+  fclose(fp);
+  X509_free(cert);
+  OPENSSL_free(name);
+  OPENSSL_free(header);
+  OPENSSL_free(data);
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  const char *storedir = (argc > 1) ? argv[1] : CACERTSTORE;
+  const char *arcfile  = (argc > 2) ? argv[2] : CERTARCHIVE;
+  char **files = NULL;
+  const char *base;
+  IMPORT_FILE *list = NULL;
+  CERT_SERIAL *have = NULL;
+  char path[512];
+  int filecount, havecount, i, n = 0;
+  int imported = 0, skipped = 0, failed = 0;
+
+  if (argc > 3) {
+    fprintf(stderr, "usage: certimport [storedir [archivefile]]\n");
+    return 2;
+  }
+
+  /* ---------------------------------------------------------- *
+   * list the store files, in serial order like the hexsort     *
+   * ---------------------------------------------------------- */
+  if ((filecount = list_certstore(storedir, &files)) < 0)
+    int_error("Error cannot read the cert store directory");
+  if ((list = calloc(filecount + 1, sizeof(IMPORT_FILE))) == NULL)
+    int_error("Error out of memory for the cert store file list");
+  for (i = 0; i < filecount; i++) {
+    base = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+    if (serial_from_hex(&list[n].serial, base) &&
+        strlen(files[i]) < sizeof(list[n].name)) {
+      strcpy(list[n].name, files[i]);
+      n++;
+    }
+    else {
+      fprintf(stderr, "certimport: skipping %s, not a serial name\n",
+                                                                files[i]);
+      failed++;
+    }
+    free(files[i]);
+  }
+  free(files);
+  qsort(list, n, sizeof(IMPORT_FILE), import_file_cmp);
+
+  havecount = archive_serials(arcfile, &have);
+
+  /* ---------------------------------------------------------- *
+   * append the certs that are not in the archive yet           *
+   * ---------------------------------------------------------- */
+  for (i = 0; i < n; i++) {
+    /* a cert stored both as .pem and .der is imported once */
+    if ((i > 0 && serial_eq(&list[i].serial, &list[i-1].serial)) ||
+        (havecount > 0 && bsearch(&list[i].serial, have, havecount,
+                                  sizeof(CERT_SERIAL), serial_ptr_cmp))) {
+      skipped++;
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", storedir, list[i].name);
+    if (import_pem(path, arcfile, &list[i].serial)) imported++;
+    else {
+      fprintf(stderr, "certimport: cannot import %s\n", path);
+      failed++;
+    }
+  }
+  free(list);
+  free(have);
+
+  printf("%d certs imported into %s, %d already there, %d failed.\n",
+                                    imported, arcfile, skipped, failed);
+
+#ifdef ARCHIVE_STORE
+  /* the index has the archive offsets, it needs a rebuild now */
+  if (imported > 0 && rebuild_certindex(CERTINDEX) < 0)
+    int_error("Error rebuilding the cert store index");
+#else
+  if (imported > 0)
+    printf("To use it, set ARCHIVE_STORE in webcert.h, recompile, and remove %s.\n",
+                                                                 CERTINDEX);
+#endif
+  return (failed > 0);
+}
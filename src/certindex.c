@@ -0,0 +1,826 @@
+/* ---------------------------------------------------------- *
+ * file:	certindex.c                                   *
+ * purpose:	persistent binary metadata index of the cert  *
+ *              store. One fixed-size record per certificate, *
+ *              kept in serial number order, so listing and   *
+ *              search never need to open a PEM file.         *
+ * -----------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * certrec_dn(): prints a subject RFC2253-escaped, with ", "  *
+ * separators, so certsearch can split it back into single    *
+ * RDN values. returns the memory BIO, or NULL for errors.    *
+ * ---------------------------------------------------------- */
+static BIO *certrec_dn(X509 *cert) {
+  BIO *membio;
+
+  if ((membio = BIO_new(BIO_s_mem())) == NULL) return NULL;
+  X509_NAME_print_ex(membio, X509_get_subject_name(cert), 0,
+     ASN1_STRFLGS_ESC_2253|ASN1_STRFLGS_ESC_CTRL|
+     ASN1_STRFLGS_UTF8_CONVERT|XN_FLAG_SEP_CPLUS_SPC);
+  return membio;
+}
+
+/* ---------------------------------------------------------- *
+ * certrec_fill(): creates the index record data for a cert.  *
+ * A subject longer than the record is cut off, see           *
+ * certrec_truncated() and certrec_subject().                 *
+ * ---------------------------------------------------------- */
+static void certrec_fill(CERT_REC *rec, X509 *cert) {
+  BIO *membio = NULL;
+  int len = 0;
+
+  memset(rec, '\0', sizeof(CERT_REC));
+
+  if (! serial_from_asn1(&rec->serial, X509_get_serialNumber(cert)))
+    int_error("Error serial number is negative or exceeds 20 bytes");
+
+  rec->state        = DB_TYPE_VAL;
+  rec->subject_hash = (uint32_t) X509_NAME_hash(X509_get_subject_name(cert));
+  asn1_to_epoch(X509_get_notBefore(cert), &rec->notbefore);
+  asn1_to_epoch(X509_get_notAfter(cert), &rec->notafter);
+  rec->revoked      = 0;
+  rec->file_off     = 0; /* a PEM file starts at 0, or archive offset */
+
+  if ((membio = certrec_dn(cert)) == NULL) return;
+  len = BIO_read(membio, rec->subject, sizeof(rec->subject)-1);
+  if (len > 0) rec->subject[len] = '\0';
+  BIO_free(membio);
+}
+
+/* ---------------------------------------------------------- *
+ * certrec_cmp(): serial order, used by bsearch() and qsort() *
+ * ---------------------------------------------------------- */
+static int certrec_cmp(const void *a, const void *b) {
+  return serial_cmp(&((const CERT_REC *) a)->serial,
+                    &((const CERT_REC *) b)->serial);
+}
+
+/* ---------------------------------------------------------- *
+ * certidx_scan_fill(): scan_certstore() callback, creates    *
+ * the index record of every cert found in the store, taking  *
+ * the revocation state from the revocation table in 'arg'.   *
+ * ---------------------------------------------------------- */
+static int certidx_scan_fill(X509 *cert, const char *fname, uint64_t off,
+                                               void *result, void *arg) {
+  CERT_REC *rec = (CERT_REC *) result;
+
+  certrec_fill(rec, cert);
+  rec->file_off = off;
+  if (revmap_get((const REV_MAP *) arg, &rec->serial, &rec->revoked))
+    rec->state = DB_TYPE_REV;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * scan_certrecs(): creates the index records of all certs in *
+ * the store, using the multi-threaded scan engine, and marks *
+ * the revoked certs from INDEXDB. The records come back in   *
+ * *recs sorted by serial, to be freed with free().           *
+ * returns the number of records, or -1 for errors.           *
+ * ---------------------------------------------------------- */
+int scan_certrecs(CERT_REC **recs) {
+  REV_MAP *revmap = NULL;
+  void *results = NULL;
+  int count, i;
+
+  /* INDEXDB is read once, the workers only do hash lookups */
+  revmap = load_revmap(INDEXDB);
+  count = scan_issued(certidx_scan_fill, revmap,
+                                          sizeof(CERT_REC), &results);
+  free_revmap(revmap);
+  *recs = (CERT_REC *) results;
+  if (count < 0) return -1;
+
+  /* hexsort file order is serial order, unless a file was renamed */
+  for (i = 1; i < count; i++)
+    if (certrec_cmp(&(*recs)[i-1], &(*recs)[i]) > 0) break;
+  if (i < count) qsort(*recs, count, sizeof(CERT_REC), certrec_cmp);
+  return count;
+}
+
+/* ---------------------------------------------------------- *
+ * certidx_lock(): opens the index file and takes the writer  *
+ * lock. A writer may have renamed a new file over the one we *
+ * opened while we waited, the lock must be on the one at the *
+ * path. oflags O_CREAT makes a missing file, empty. returns  *
+ * the fd, or -1 for errors.                                  *
+ * ---------------------------------------------------------- */
+static int certidx_lock(const char *idxfile, int oflags) {
+  struct stat st, pst;
+  int fd;
+
+  for (;;) {
+    if ((fd = open(idxfile, O_RDWR|oflags, 0644)) < 0) return -1;
+    while (flock(fd, LOCK_EX) != 0) {
+      if (errno != EINTR) {
+        close(fd);
+        return -1;
+      }
+    }
+    if (fstat(fd, &st) == 0 && stat(idxfile, &pst) == 0 &&
+        st.st_ino == pst.st_ino && st.st_dev == pst.st_dev) return fd;
+    close(fd);
+  }
+}
+
+/* ---------------------------------------------------------- *
+ * rebuild_certindex(): creates the index file from scratch,  *
+ * parsing all certs in the store once, and marking the       *
+ * revoked certs from INDEXDB. The new index is written to    *
+ * a temp file and renamed, readers never see a partial file. *
+ * The writer lock is held from the scan to the rename, so an *
+ * update waits for the new file. A missing index is created  *
+ * empty to hold the lock, and removed again if the rebuild   *
+ * fails. returns the number of records, or -1 for errors.    *
+ * ---------------------------------------------------------- */
+int rebuild_certindex(const char *idxfile) {
+  CERT_REC *recs = NULL;
+  CERTIDX_HDR hdr;
+  char tmpfile[256] = "";
+  FILE *fp = NULL;
+  struct stat st;
+  uint64_t generation;
+  int count, fd, empty;
+
+  if ((fd = certidx_lock(idxfile, O_CREAT)) < 0) return -1;
+  empty = (fstat(fd, &st) == 0 && st.st_size == 0);
+  if ((count = scan_certrecs(&recs)) < 0) goto fail;
+  generation = certindex_generation(idxfile);
+
+  /* ---------------------------------------------------------- *
+   * write header and records into temp file, then rename it    *
+   * ---------------------------------------------------------- */
+  memset(&hdr, '\0', sizeof(hdr));
+  memcpy(hdr.magic, CERTIDX_MAGIC, sizeof(hdr.magic));
+  hdr.version = CERTIDX_VERSION;
+  hdr.recsize = sizeof(CERT_REC);
+  hdr.count   = count;
+  /* a rebuilt index continues the generations of the old one */
+  hdr.generation = generation + 1;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", idxfile, (int) getpid());
+  if ((fp = fopen(tmpfile, "w")) == NULL) goto fail;
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      (count > 0 && fwrite(recs, sizeof(CERT_REC), count, fp) != count)) {
+    fclose(fp);
+    unlink(tmpfile);
+    goto fail;
+  }
+  if (fclose(fp) != 0 || rename(tmpfile, idxfile) != 0) {
+    unlink(tmpfile);
+    goto fail;
+  }
+  free(recs);
+  close(fd);
+  return count;
+
+fail:
+  if (empty) unlink(idxfile);
+  free(recs);
+  close(fd);
+  return -1;
+}
+
+/* ---------------------------------------------------------- *
+ * load_certindex(): maps the index file read-only. If the    *
+ * index does not exist yet, it is built from the cert store. *
+ * returns 1 for success, or 0 for errors.                    *
+ * ---------------------------------------------------------- */
+int load_certindex(CERT_INDEX *idx, const char *idxfile) {
+  struct stat st;
+  int fd;
+
+  memset(idx, '\0', sizeof(CERT_INDEX));
+
+  if ((fd = open(idxfile, O_RDONLY)) < 0) {
+    if (errno != ENOENT || rebuild_certindex(idxfile) < 0) return 0;
+    if ((fd = open(idxfile, O_RDONLY)) < 0) return 0;
+  }
+
+  /* the empty file of a first rebuild_certindex(), wait for it */
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    flock(fd, LOCK_SH);
+    close(fd);
+    if ((fd = open(idxfile, O_RDONLY)) < 0) return 0;
+  }
+
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(CERTIDX_HDR)) {
+    close(fd);
+    return 0;
+  }
+
+  idx->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (idx->map == MAP_FAILED) {
+    idx->map = NULL;
+    return 0;
+  }
+  idx->maplen = st.st_size;
+  idx->hdr = (const CERTIDX_HDR *) idx->map;
+  idx->stamp[0] = st.st_ino;
+  idx->stamp[1] = st.st_size;
+  idx->stamp[2] = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+
+  if (memcmp(idx->hdr->magic, CERTIDX_MAGIC, sizeof(idx->hdr->magic)) != 0 ||
+      idx->hdr->version != CERTIDX_VERSION ||
+      idx->hdr->recsize != sizeof(CERT_REC)) {
+    free_certindex(idx);
+    return 0;
+  }
+
+  idx->recs  = (const CERT_REC *) (idx->map + sizeof(CERTIDX_HDR));
+  idx->count = idx->hdr->count;
+
+  /* a writer may have appended after our fstat(), stay inside the map */
+  if (sizeof(CERTIDX_HDR) + idx->count * sizeof(CERT_REC) > idx->maplen)
+    idx->count = (idx->maplen - sizeof(CERTIDX_HDR)) / sizeof(CERT_REC);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * free_certindex(): releases the index file mapping.         *
+ * ---------------------------------------------------------- */
+void free_certindex(CERT_INDEX *idx) {
+  if (idx->map) munmap((void *) idx->map, idx->maplen);
+  memset(idx, '\0', sizeof(CERT_INDEX));
+}
+
+/* ---------------------------------------------------------- *
+ * find_certindex(): binary search for a serial in the index. *
+ * returns the record pointer, or NULL if it does not exist.  *
+ * ---------------------------------------------------------- */
+const CERT_REC *find_certindex(const CERT_INDEX *idx,
+                                            const CERT_SERIAL *serial) {
+  CERT_REC key;
+
+  key.serial = *serial;
+  return bsearch(&key, idx->recs, idx->count, sizeof(CERT_REC), certrec_cmp);
+}
+
+/* ---------------------------------------------------------- *
+ * seek_certrecs(): binary search in serial sorted records,   *
+ * returns the position of the first serial >= the given one, *
+ * or count if all serials are lower.                         *
+ * ---------------------------------------------------------- */
+uint64_t seek_certrecs(const CERT_REC *recs, uint64_t count,
+                                            const CERT_SERIAL *serial) {
+  uint64_t lo = 0, hi = count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (serial_cmp(&recs[mid].serial, serial) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/* ---------------------------------------------------------- *
+ * certrec_walk(): steps from position 'from' in direction    *
+ * dir (+1/-1), skips 'skip' selected records and collects up *
+ * to max of the following ones. returns the # collected.     *
+ * ---------------------------------------------------------- */
+static int certrec_walk(const CERT_REC *recs, uint64_t count, int64_t from,
+                        int dir, certrec_sel sel, uint64_t skip,
+                        const CERT_REC **out, int max) {
+  int n = 0;
+
+  /* without a filter, every record counts: skip by arithmetic */
+  if (sel == NULL) {
+    from += dir * (int64_t) skip;
+    skip = 0;
+  }
+
+  for (; from >= 0 && from < (int64_t) count && n < max; from += dir) {
+    if (sel && ! sel(&recs[from])) continue;
+    if (skip > 0) { skip--; continue; }
+    out[n++] = &recs[from];
+  }
+  return n;
+}
+
+/* ---------------------------------------------------------- *
+ * page_certrecs(): fills one page of a listing from serial   *
+ * sorted records, filtered by sel (NULL for all). pg has the *
+ * pagesize, the current pagenumber and the total from the    *
+ * previous page (0 if unknown, then it is counted once).     *
+ * move is "first", "next" or "prev" relative to the cursor   *
+ * serial of the last or first record shown, "last", or      *
+ * "page" for a jump to pagenumber. Only next, prev and last  *
+ * are keyset lookups, a page jump of a filtered list has to  *
+ * skip the records before it. returns 1, or 0 if the page    *
+ * does not exist.                                            *
+ * ---------------------------------------------------------- */
+int page_certrecs(CERT_PAGE *pg, const CERT_REC *recs, uint64_t count,
+                  certrec_sel sel, int asc, const char *move,
+                  const CERT_SERIAL *cursor) {
+  int      dir   = asc ? 1 : -1;
+  int64_t  start = asc ? 0 : (int64_t) count - 1;
+  int64_t  end   = asc ? (int64_t) count - 1 : 0;
+  int64_t  from  = start;
+  uint64_t pos, i, skip = 0;
+  int      want, n, match, reverse = 0;
+  const CERT_REC *tmp;
+
+  if (pg->pagesize < 1 || pg->pagesize > MAXPAGESIZE)
+    pg->pagesize = MAXCERTDISPLAY;
+
+  if (sel == NULL) pg->total = count;
+  else if (pg->total == 0 || pg->total > count)
+    for (pg->total = 0, i = 0; i < count; i++)
+      if (sel(&recs[i])) pg->total++;
+
+  pg->pagecounter = (pg->total + pg->pagesize - 1) / pg->pagesize;
+  if (pg->pagecounter < 1) pg->pagecounter = 1;
+  want = pg->pagesize;
+
+  if (move == NULL || *move == '\0') move = "first";
+  if (strcmp(move, "page") == 0 &&
+      (pg->pagenumber < 1 || pg->pagenumber > pg->pagecounter)) return 0;
+  if (pg->pagenumber < 1) pg->pagenumber = 1;
+  if (pg->pagenumber > pg->pagecounter) pg->pagenumber = pg->pagecounter;
+
+  if ((strcmp(move, "next") == 0 || strcmp(move, "prev") == 0) && cursor) {
+    /* locate the cursor, the record itself may be gone by now */
+    pos = seek_certrecs(recs, count, cursor);
+    match = (pos < count && serial_eq(&recs[pos].serial, cursor));
+
+    if ((strcmp(move, "next") == 0) == asc)
+      from = pos + match;          /* records after the cursor serial  */
+    else
+      from = (int64_t) pos - 1;    /* records before the cursor serial */
+
+    if (strcmp(move, "next") == 0) pg->pagenumber++;
+    else { pg->pagenumber--; reverse = 1; }
+  }
+  else if (strcmp(move, "last") == 0) {
+    from = end;
+    want = pg->total - (uint64_t) (pg->pagecounter - 1) * pg->pagesize;
+    if (want <= 0) want = pg->pagesize;
+    pg->pagenumber = pg->pagecounter;
+    reverse = 1;
+  }
+  else if (strcmp(move, "page") == 0) {
+    skip = (uint64_t) (pg->pagenumber - 1) * pg->pagesize;
+  }
+  else if (strcmp(move, "first") == 0) pg->pagenumber = 1;
+  else return 0;
+
+  /* collect one record more, it tells if the list continues */
+  n = certrec_walk(recs, count, from, reverse ? -dir : dir, sel, skip,
+                                                     pg->recs, want + 1);
+  pg->lines = (n > want) ? want : n;
+
+  if (reverse) {
+    /* a short walk back reached the list start: show page one */
+    if (n <= want && strcmp(move, "prev") == 0)
+      return page_certrecs(pg, recs, count, sel, asc, "first", NULL);
+
+    for (i = 0; i < (uint64_t) pg->lines / 2; i++) {
+      tmp = pg->recs[i];
+      pg->recs[i] = pg->recs[pg->lines - 1 - i];
+      pg->recs[pg->lines - 1 - i] = tmp;
+    }
+    pg->has_prev = (n > want);
+    pg->has_next = (strcmp(move, "prev") == 0);
+  }
+  else {
+    pg->has_prev = (from != start || skip > 0);
+    pg->has_next = (n > want);
+  }
+
+  /* the page # is only a hint carried between requests, keep it sane */
+  if (! pg->has_prev) pg->pagenumber = 1;
+  if (! pg->has_next && pg->has_prev) pg->pagenumber = pg->pagecounter;
+  if (pg->pagenumber < 1) pg->pagenumber = 1;
+  if (pg->pagenumber > pg->pagecounter) pg->pagenumber = pg->pagecounter;
+
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * page_certlist(): page_certrecs() for a search result that  *
+ * is a list of 'count' record positions in serial order, as  *
+ * from the search cache. The list has only matches, a page   *
+ * is a slice of it: no filter, and a page jump is arithmetic.*
+ * The cursor is found by a binary search over the list.      *
+ * returns 1, or 0 if the page does not exist.                *
+ * ---------------------------------------------------------- */
+int page_certlist(CERT_PAGE *pg, const CERT_REC *recs, const uint32_t *list,
+                  uint64_t count, int asc, const char *move,
+                  const CERT_SERIAL *cursor) {
+  uint64_t lo = 0, hi = count, mid;
+  int64_t  first = 0;               /* display position of the page */
+  int      i, match;
+
+  if (pg->pagesize < 1 || pg->pagesize > MAXPAGESIZE)
+    pg->pagesize = MAXCERTDISPLAY;
+
+  pg->total = count;
+  pg->pagecounter = (pg->total + pg->pagesize - 1) / pg->pagesize;
+  if (pg->pagecounter < 1) pg->pagecounter = 1;
+
+  if (move == NULL || *move == '\0') move = "first";
+  if (strcmp(move, "page") == 0 &&
+      (pg->pagenumber < 1 || pg->pagenumber > pg->pagecounter)) return 0;
+  if (pg->pagenumber < 1) pg->pagenumber = 1;
+  if (pg->pagenumber > pg->pagecounter) pg->pagenumber = pg->pagecounter;
+
+  if ((strcmp(move, "next") == 0 || strcmp(move, "prev") == 0) && cursor) {
+    /* list position of the first serial >= the cursor */
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (serial_cmp(&recs[list[mid]].serial, cursor) < 0) lo = mid + 1;
+      else hi = mid;
+    }
+    match = (lo < count && serial_eq(&recs[list[lo]].serial, cursor));
+
+    /* in display order, desc shows the list backwards */
+    if (strcmp(move, "next") == 0) {
+      first = asc ? (int64_t) (lo + match) : (int64_t) (count - lo);
+      pg->pagenumber++;
+    }
+    else {
+      first = asc ? (int64_t) lo - pg->pagesize
+                  : (int64_t) (count - lo - match) - pg->pagesize;
+      pg->pagenumber--;
+      /* less than a page before the cursor: show page one */
+      if (first < 0) {
+        first = 0;
+        pg->pagenumber = 1;
+      }
+    }
+  }
+  else if (strcmp(move, "last") == 0) {
+    pg->pagenumber = pg->pagecounter;
+    first = (int64_t) (pg->pagecounter - 1) * pg->pagesize;
+  }
+  else if (strcmp(move, "page") == 0) {
+    first = (int64_t) (pg->pagenumber - 1) * pg->pagesize;
+  }
+  else if (strcmp(move, "first") == 0) pg->pagenumber = 1;
+  else return 0;
+
+  for (pg->lines = 0, i = 0; i < pg->pagesize && first + i < (int64_t) count; i++)
+    pg->recs[pg->lines++] = &recs[list[asc ? first + i : count - 1 - (first + i)]];
+  pg->has_prev = (first > 0);
+  pg->has_next = (first + pg->lines < (int64_t) count);
+
+  /* the page # is only a hint carried between requests, keep it sane */
+  if (! pg->has_prev) pg->pagenumber = 1;
+  if (! pg->has_next && pg->has_prev) pg->pagenumber = pg->pagecounter;
+  if (pg->pagenumber < 1) pg->pagenumber = 1;
+  if (pg->pagenumber > pg->pagecounter) pg->pagenumber = pg->pagecounter;
+
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * certidx_open_locked(): opens the index file for update and *
+ * takes the exclusive writer lock. Builds a missing index.   *
+ * ---------------------------------------------------------- */
+static int certidx_open_locked(const char *idxfile, CERTIDX_HDR *hdr) {
+  int fd;
+
+  /* a failed rebuild removes its empty file again, build it here */
+  while ((fd = certidx_lock(idxfile, 0)) < 0) {
+    if (errno != ENOENT || rebuild_certindex(idxfile) < 0) return -1;
+  }
+
+  if (pread(fd, hdr, sizeof(CERTIDX_HDR), 0) != sizeof(CERTIDX_HDR) ||
+      memcmp(hdr->magic, CERTIDX_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->recsize != sizeof(CERT_REC)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* ---------------------------------------------------------- *
+ * certidx_locate(): binary search on the open index file.    *
+ * Returns the record position of the serial if it exists, or *
+ * the position where it needs to be inserted. *found is set. *
+ * ---------------------------------------------------------- */
+static uint64_t certidx_locate(int fd, const CERTIDX_HDR *hdr,
+                               const CERT_SERIAL *serial, int *found) {
+  uint64_t lo = 0, hi = hdr->count, mid;
+  CERT_REC rec;
+  int cmp;
+
+  *found = 0;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (pread(fd, &rec, sizeof(rec),
+        sizeof(CERTIDX_HDR) + mid * sizeof(CERT_REC)) != sizeof(rec))
+      return hdr->count;
+    cmp = serial_cmp(&rec.serial, serial);
+    if (cmp == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (cmp < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/* ---------------------------------------------------------- *
+ * update_certindex(): adds a newly signed certificate to the *
+ * index, or replaces an existing record with the same serial.*
+ * Sequential serials append at the end, in place. Any other  *
+ * position rewrites the file via temp file and rename().     *
+ * file_off is the archive offset of the cert, 0 for a file.  *
+ * returns 1 for success, or 0 for errors.                    *
+ * ---------------------------------------------------------- */
+int update_certindex(const char *idxfile, X509 *cert, uint64_t file_off) {
+  CERTIDX_HDR hdr;
+  CERT_REC rec;
+  uint64_t pos;
+  int fd, found;
+  int ret = 0;
+
+  certrec_fill(&rec, cert);
+  rec.file_off = file_off;
+  if ((fd = certidx_open_locked(idxfile, &hdr)) < 0) return 0;
+
+  pos = certidx_locate(fd, &hdr, &rec.serial, &found);
+
+  hdr.generation++;
+  if (found || pos == hdr.count) {
+    /* replace in place, or append: write the record before the count */
+    if (pwrite(fd, &rec, sizeof(rec),
+        sizeof(CERTIDX_HDR) + pos * sizeof(CERT_REC)) != sizeof(rec))
+      goto end;
+    if (! found) hdr.count++;
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) goto end;
+    ret = 1;
+  }
+  else {
+    /* out of order serial: copy the file with the new record inserted */
+    char tmpfile[256] = "";
+    CERT_REC buf[256];
+    uint64_t i = 0, n;
+    int tfd;
+
+    snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", idxfile, (int) getpid());
+    if ((tfd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) goto end;
+
+    hdr.count++;
+    if (write(tfd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto fail;
+    while (i < hdr.count - 1) {
+      if (i == pos && write(tfd, &rec, sizeof(rec)) != sizeof(rec)) goto fail;
+      n = hdr.count - 1 - i;
+      if (n > sizeof(buf)/sizeof(buf[0])) n = sizeof(buf)/sizeof(buf[0]);
+      if (i < pos && i + n > pos) n = pos - i;
+      if (pread(fd, buf, n * sizeof(CERT_REC), sizeof(CERTIDX_HDR)
+                  + i * sizeof(CERT_REC)) != n * sizeof(CERT_REC)) goto fail;
+      if (write(tfd, buf, n * sizeof(CERT_REC)) != n * sizeof(CERT_REC))
+        goto fail;
+      i += n;
+    }
+    if (close(tfd) != 0 || rename(tmpfile, idxfile) != 0) {
+      unlink(tmpfile);
+      goto end;
+    }
+    ret = 1;
+    goto end;
+fail:
+    close(tfd);
+    unlink(tmpfile);
+  }
+
+end:
+  close(fd);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * update_certindex_batch(): adds the certs of a batch to the *
+ * index as one update, with one generation. Serials after    *
+ * the last record are appended in place, a batch with other  *
+ * serials is merged into a new file, via temp file, rename() *
+ * returns 1 for success, or 0 for errors.                    *
+ * ---------------------------------------------------------- */
+int update_certindex_batch(const char *idxfile, X509 **certs,
+                                   const uint64_t *file_offs, int count) {
+  CERTIDX_HDR hdr;
+  CERT_REC *recs, last;
+  int fd, i;
+  int ret = 0;
+
+  if (count <= 0) return 1;
+  if ((recs = malloc(count * sizeof(CERT_REC))) == NULL) return 0;
+  for (i = 0; i < count; i++) {
+    certrec_fill(&recs[i], certs[i]);
+    recs[i].file_off = file_offs ? file_offs[i] : 0;
+  }
+  qsort(recs, count, sizeof(CERT_REC), certrec_cmp);
+  if ((fd = certidx_open_locked(idxfile, &hdr)) < 0) {
+    free(recs);
+    return 0;
+  }
+
+  if (hdr.count == 0 ||
+      (pread(fd, &last, sizeof(last), sizeof(CERTIDX_HDR) + (hdr.count - 1)
+                                       * sizeof(CERT_REC)) == sizeof(last) &&
+       serial_cmp(&last.serial, &recs[0].serial) < 0)) {
+    /* append: write the records before the count, like a single one */
+    if (pwrite(fd, recs, count * sizeof(CERT_REC), sizeof(CERTIDX_HDR)
+               + hdr.count * sizeof(CERT_REC)) == count * sizeof(CERT_REC)) {
+      hdr.count += count;
+      hdr.generation++;
+      ret = (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+    }
+  }
+  else {
+    /* merge: copy the file with the batch records put in place */
+    char tmpfile[256] = "";
+    CERT_REC buf[256];
+    uint64_t pos = 0, n, k, newcount = hdr.count;
+    int j = 0, cmp, tfd;
+
+    snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", idxfile, (int) getpid());
+    if ((tfd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) goto end;
+
+    hdr.generation++;
+    if (write(tfd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto fail;
+    while (pos < hdr.count || j < count) {
+      n = hdr.count - pos;
+      if (n > sizeof(buf)/sizeof(buf[0])) n = sizeof(buf)/sizeof(buf[0]);
+      if (n > 0 && pread(fd, buf, n * sizeof(CERT_REC), sizeof(CERTIDX_HDR)
+                 + pos * sizeof(CERT_REC)) != n * sizeof(CERT_REC)) goto fail;
+      for (k = 0; k < n || (n == 0 && j < count); ) {
+        cmp = (j == count) ? -1 : (k == n) ? 1 :
+                             serial_cmp(&buf[k].serial, &recs[j].serial);
+        if (cmp < 0) {
+          if (write(tfd, &buf[k++], sizeof(CERT_REC)) != sizeof(CERT_REC))
+            goto fail;
+          continue;
+        }
+        if (write(tfd, &recs[j++], sizeof(CERT_REC)) != sizeof(CERT_REC))
+          goto fail;
+        /* a batch record replaces the record of the same serial */
+        if (cmp == 0) k++;
+        else newcount++;
+      }
+      pos += n;
+    }
+    hdr.count = newcount;
+    if (pwrite(tfd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) goto fail;
+    if (close(tfd) != 0 || rename(tmpfile, idxfile) != 0) {
+      unlink(tmpfile);
+      goto end;
+    }
+    ret = 1;
+    goto end;
+fail:
+    close(tfd);
+    unlink(tmpfile);
+  }
+
+end:
+  close(fd);
+  free(recs);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * revoke_certindex(): flags the record of a cert as revoked  *
+ * at revocation time 'when'. returns 1 for success, 0 errors *
+ * ---------------------------------------------------------- */
+int revoke_certindex(const char *idxfile, X509 *cert, time_t when) {
+  CERTIDX_HDR hdr;
+  CERT_REC rec;
+  int fd, found;
+
+  certrec_fill(&rec, cert);
+  if ((fd = certidx_open_locked(idxfile, &hdr)) < 0) return 0;
+
+  certidx_locate(fd, &hdr, &rec.serial, &found);
+  close(fd);
+
+  /* cert was not indexed yet, add it first */
+  if (! found && ! update_certindex(idxfile, cert, 0)) return 0;
+
+  return revoke_certrec(idxfile, &rec.serial, when);
+}
+
+/* ---------------------------------------------------------- *
+ * revoke_certrec(): flags the existing record of a serial as *
+ * revoked at time 'when'. returns 1 for success, 0 if there  *
+ * is no record for the serial, or for errors.                *
+ * ---------------------------------------------------------- */
+int revoke_certrec(const char *idxfile, const CERT_SERIAL *serial,
+                                                          time_t when) {
+  CERTIDX_HDR hdr;
+  CERT_REC rec;
+  uint64_t pos;
+  int fd, found;
+  int ret = 0;
+
+  if ((fd = certidx_open_locked(idxfile, &hdr)) < 0) return 0;
+  pos = certidx_locate(fd, &hdr, serial, &found);
+
+  if (found && pread(fd, &rec, sizeof(rec), sizeof(CERTIDX_HDR)
+                          + pos * sizeof(CERT_REC)) == sizeof(rec)) {
+    rec.state   = DB_TYPE_REV;
+    rec.revoked = (int64_t) when;
+    hdr.generation++;
+    if (pwrite(fd, &rec, sizeof(rec), sizeof(CERTIDX_HDR)
+                          + pos * sizeof(CERT_REC)) == sizeof(rec) &&
+        pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) ret = 1;
+  }
+  close(fd);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * current_certindex(): checks if the index has the record of *
+ * a cert with the same subject and dates already, so a store *
+ * file that was only rewritten needs no update. The state is *
+ * not compared, it comes from INDEXDB and not the cert.      *
+ * returns 1 if the record is current, 0 if it is not.        *
+ * ---------------------------------------------------------- */
+int current_certindex(const CERT_INDEX *idx, X509 *cert) {
+  const CERT_REC *old;
+  CERT_REC rec;
+
+  certrec_fill(&rec, cert);
+  if ((old = find_certindex(idx, &rec.serial)) == NULL) return 0;
+  return (old->subject_hash == rec.subject_hash &&
+          old->notbefore == rec.notbefore &&
+          old->notafter == rec.notafter &&
+          strcmp(old->subject, rec.subject) == 0);
+}
+
+/* ---------------------------------------------------------- *
+ * certindex_generation(): reads the generation counter from  *
+ * the index header, without mapping the file. Cheap enough  *
+ * to check a cache on every request. returns 0 if the index  *
+ * does not exist (yet).                                      *
+ * ---------------------------------------------------------- */
+uint64_t certindex_generation(const char *idxfile) {
+  CERTIDX_HDR hdr;
+  int fd;
+
+  if ((fd = open(idxfile, O_RDONLY)) < 0) return 0;
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      memcmp(hdr.magic, CERTIDX_MAGIC, sizeof(hdr.magic)) != 0)
+    hdr.generation = 0;
+  close(fd);
+  return hdr.generation;
+}
+
+/* ---------------------------------------------------------- *
+ * certrec_filename(): builds the store file name of a record *
+ * i.e. "<SERIALHEX>.pem", the BN_bn2hex() format certsign.c  *
+ * ---------------------------------------------------------- */
+char *certrec_filename(const CERT_REC *rec, char *buf, size_t buflen) {
+  char hex[SERIAL_HEXLEN];
+
+  serial_to_hex(&rec->serial, hex, sizeof(hex));
+  snprintf(buf, buflen, "%s.pem", hex);
+  return buf;
+}
+
+/* ---------------------------------------------------------- *
+ * certrec_subject(): the full subject of a record, in the    *
+ * format of the index. A subject cut off in the record is    *
+ * read from the cert in the store. returns a malloc()'ed     *
+ * string, or NULL for errors.                                *
+ * ---------------------------------------------------------- */
+char *certrec_subject(const CERT_REC *rec) {
+  char certfilestr[SERIAL_HEXLEN+4];
+  char *subject = NULL, *data;
+  BIO *membio;
+  X509 *cert;
+  long len;
+
+  if (! certrec_truncated(rec)) return strdup(rec->subject);
+
+  certrec_filename(rec, certfilestr, sizeof(certfilestr));
+  if ((cert = read_storecert(certfilestr)) == NULL) return NULL;
+  if ((membio = certrec_dn(cert)) != NULL &&
+      (len = BIO_get_mem_data(membio, &data)) >= 0 &&
+      (subject = malloc(len + 1)) != NULL) {
+    memcpy(subject, data, len);
+    subject[len] = '\0';
+  }
+  BIO_free(membio);
+  X509_free(cert);
+  return subject;
+}
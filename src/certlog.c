@@ -0,0 +1,395 @@
+/* ---------------------------------------------------------- *
+ * file:	certlog.c                                     *
+ * purpose:	issuance journal ISSUELOG with group commit.  *
+ *              A new cert is appended to the journal and     *
+ *              fsynced after its unsynced INDEXDB commit,    *
+ *              before the store and the serial file are      *
+ *              written, which are not synced either. A cert  *
+ *              whose commit failed is never journaled.       *
+ *              Concurrent issuers share one fdatasync(): the *
+ *              first one to wait syncs all the records that  *
+ *              were appended up to then. A checkpoint brings *
+ *              the files up to date from the journal, syncs  *
+ *              the file system and empties the journal, see  *
+ *              issuelog_checkpoint().                        *
+ * -----------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <openssl/x509.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The journal: header, then one record per issued cert, its  *
+ * DER padded to 8 bytes. A torn record at the end fails its  *
+ * hash, the records after the last good one are dropped.     *
+ * The header bootid tells a restart from a crash of the OS,  *
+ * the unsynced store files may be lost then.                 *
+ * ---------------------------------------------------------- */
+#define ISSUELOG_MAGIC    "WCILOG\0\0"
+#define ISSUELOG_VERSION  1
+#define ISSUELOG_RECMAGIC 0x43524c49
+
+typedef struct issuelog_hdr_st {
+  char          magic[8];      /* ISSUELOG_MAGIC                  */
+  uint32_t      version;       /* ISSUELOG_VERSION                */
+  uint32_t      reserved;
+  uint64_t      end;           /* end of the appended records     */
+  uint64_t      synced;        /* end of the records on disk      */
+  char          bootid[40];    /* boot the records were made in   */
+} ISSUELOG_HDR;
+
+typedef struct issuelog_rec_st {
+  uint32_t      magic;         /* ISSUELOG_RECMAGIC               */
+  uint32_t      len;           /* DER bytes, without the padding  */
+  uint64_t      sum;           /* FNV-1a hash of the DER          */
+} ISSUELOG_REC;
+
+#define ISSUELOG_PAD(n)  (((n) + 7) & ~(size_t) 7)
+
+/* ---------------------------------------------------------- *
+ * The journal fd holds the lock bytes: appends take the      *
+ * LOCK_APPEND byte, the syncing issuer LOCK_SYNC, and the    *
+ * issuers share LOCK_APPLY until their files are written, a  *
+ * checkpoint takes it exclusive.                             *
+ * ---------------------------------------------------------- */
+#define LOCK_APPEND 0
+#define LOCK_SYNC   1
+#define LOCK_APPLY  2
+
+static int ilog_fd = -1;
+
+static int issuelog_lock(int which, short type) {
+  struct flock fl;
+
+  memset(&fl, '\0', sizeof(fl));
+  fl.l_type   = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start  = which;
+  fl.l_len    = 1;
+  while (fcntl(ilog_fd, F_SETLKW, &fl) != 0)
+    if (errno != EINTR) return 0;
+  return 1;
+}
+
+static uint64_t issuelog_sum(const unsigned char *p, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len-- > 0) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* ---------------------------------------------------------- *
+ * issuelog_bootid(): the kernel boot id, empty if unknown.   *
+ * ---------------------------------------------------------- */
+static void issuelog_bootid(char *buf, size_t buflen) {
+  FILE *fp;
+
+  memset(buf, '\0', buflen);
+  if ((fp = fopen("/proc/sys/kernel/random/boot_id", "r")) == NULL) return;
+  if (fgets(buf, buflen, fp) == NULL) buf[0] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  fclose(fp);
+}
+
+static int issuelog_hdr(ISSUELOG_HDR *hdr) {
+  return (pread(ilog_fd, hdr, sizeof(ISSUELOG_HDR), 0) == sizeof(ISSUELOG_HDR) &&
+          memcmp(hdr->magic, ISSUELOG_MAGIC, sizeof(hdr->magic)) == 0 &&
+          hdr->version == ISSUELOG_VERSION);
+}
+
+/* ---------------------------------------------------------- *
+ * issuelog_certs(): reads the good records of the journal.   *
+ * returns the # of certs in *certs, or -1 for errors.        *
+ * ---------------------------------------------------------- */
+static int issuelog_certs(X509 ***certs) {
+  ISSUELOG_REC rec;
+  unsigned char *der = NULL;
+  const unsigned char *p;
+  struct stat st;
+  uint64_t off = sizeof(ISSUELOG_HDR);
+  X509 *cert, **list;
+  int count = 0;
+
+  *certs = NULL;
+  if (fstat(ilog_fd, &st) != 0) return -1;
+  while (off + sizeof(rec) <= st.st_size) {
+    if (pread(ilog_fd, &rec, sizeof(rec), off) != sizeof(rec) ||
+        rec.magic != ISSUELOG_RECMAGIC ||
+        off + sizeof(rec) + rec.len > st.st_size) break;
+    if ((der = realloc(der, rec.len ? rec.len : 1)) == NULL) break;
+    if (pread(ilog_fd, der, rec.len, off + sizeof(rec)) != rec.len ||
+        issuelog_sum(der, rec.len) != rec.sum) break;
+
+    p = der;
+    if ((cert = d2i_X509(NULL, &p, rec.len)) == NULL) break;
+    if ((list = realloc(*certs, (count + 1) * sizeof(X509 *))) == NULL) {
+      X509_free(cert);
+      break;
+    }
+    *certs = list;
+    (*certs)[count++] = cert;
+    off += sizeof(rec) + ISSUELOG_PAD(rec.len);
+  }
+  free(der);
+  return count;
+}
+
+/* ---------------------------------------------------------- *
+ * issuelog_serial(): raises SERIALFILE to the highest serial *
+ * of the journal and INDEXDB, if its DBLOG value is below    *
+ * it, an unsynced lease lost in an OS crash.                 *
+ * ---------------------------------------------------------- */
+#ifndef RAND_SERIAL
+static void issuelog_serial(X509 **certs, int count, CA_DB *db) {
+  BIGNUM *max = NULL, *bn = NULL, *cur = NULL;
+  CERT_SERIAL last;
+  int i;
+
+  if ((max = BN_new()) == NULL) return;
+  for (i = 0; i < count; i++) {
+    if ((bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(certs[i]), bn)) &&
+        BN_cmp(bn, max) > 0) BN_copy(max, bn);
+  }
+  if (certdb_last(db, &last) &&
+      (bn = BN_bin2bn(last.b, SERIAL_LEN, bn)) && BN_cmp(bn, max) > 0)
+    BN_copy(max, bn);
+
+  if (dblog_lock(1)) {
+    if ((cur = dblog_serial(SERIALFILE)) == NULL || BN_cmp(cur, max) < 0)
+      dblog_put_serial(SERIALFILE, max, 0);
+    dblog_unlock();
+  }
+  BN_free(cur);
+  BN_free(bn);
+  BN_free(max);
+}
+#endif
+
+/* ---------------------------------------------------------- *
+ * issuelog_replay(): adds the journaled certs that INDEXDB   *
+ * or the store miss, of a crashed issuer or lost in an OS    *
+ * crash. They are committed to 'db' first, the store gets    *
+ * only the certs of the commit. A journaled cert was in an   *
+ * INDEXDB commit, one already there keeps its record, e.g.   *
+ * revoked. A subject clash leaves it out of both. returns    *
+ * the count of the rejected certs, errors stop the CGI.      *
+ * ---------------------------------------------------------- */
+int issuelog_replay(CA_DB *db, X509 **certs, int count) {
+  CERT_SERIAL serial;
+  CADB_REC rec;
+  char hex[SERIAL_HEXLEN+4];
+  uint64_t off;
+  int i, ret, rejected = 0;
+
+  for (i = 0; i < count; i++) {
+    if (! serial_from_asn1(&serial, X509_get_serialNumber(certs[i])) ||
+        certdb_get(db, &serial, &rec)) continue;
+    make_index_rec(certs[i], DB_TYPE_VAL, NULL, &rec);
+    if (certdb_put(db, &rec) != 1) rejected++;
+  }
+  if ((ret = certdb_commit(db, 0)) == -1)
+    int_error("Error a journaled cert clashes with a committed subject");
+  if (ret != 1)
+    int_error("Error cannot write CA certificate database file");
+
+  for (i = 0; i < count; i++) {
+    if (! serial_from_asn1(&serial, X509_get_serialNumber(certs[i])) ||
+        ! certdb_get(db, &serial, &rec)) continue;
+    serial_to_hex(&serial, hex, SERIAL_HEXLEN);
+    strcat(hex, ".pem");
+    X509 *stored = read_storecert(hex);
+    if (stored == NULL) {
+      if (! write_storecert(certs[i], &off) ||
+          ! update_certindex(CERTINDEX, certs[i], off))
+        int_error("Error restoring a journaled cert to the store");
+    }
+    X509_free(stored);
+  }
+  return rejected;
+}
+
+/* ---------------------------------------------------------- *
+ * issuelog_checkpoint(): with LOCK_APPLY exclusive, no cert  *
+ * is between commit and its file writes. The journaled certs *
+ * are replayed into INDEXDB and the store, the serial file   *
+ * is raised, syncfs() makes it all durable, and the journal  *
+ * is emptied.                                                *
+ * ---------------------------------------------------------- */
+static void issuelog_checkpoint(const char *bootid) {
+  ISSUELOG_HDR hdr;
+  X509 **certs = NULL;
+  CA_DB *db = NULL;
+  DB_ATTR db_attr = { UNIQUE_SUBJECT };
+  int count, i;
+
+  if ((count = issuelog_certs(&certs)) < 0)
+    int_error("Error reading the issuance journal ISSUELOG");
+
+  if ((db = certdb_open(INDEXDB, &db_attr)) == NULL)
+    int_error("Error cannot load CA certificate database file");
+  issuelog_replay(db, certs, count);
+#ifndef RAND_SERIAL
+  issuelog_serial(certs, count, db);
+#endif
+  certdb_close(db);
+  for (i = 0; i < count; i++) X509_free(certs[i]);
+  free(certs);
+
+  if (syncfs(ilog_fd) != 0)
+    int_error("Error syncing the CA files for the journal checkpoint");
+
+  memset(&hdr, '\0', sizeof(hdr));
+  memcpy(hdr.magic, ISSUELOG_MAGIC, sizeof(hdr.magic));
+  hdr.version = ISSUELOG_VERSION;
+  hdr.end     = sizeof(hdr);
+  hdr.synced  = sizeof(hdr);
+  snprintf(hdr.bootid, sizeof(hdr.bootid), "%s", bootid);
+  if (pwrite(ilog_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      ftruncate(ilog_fd, sizeof(hdr)) != 0 || fdatasync(ilog_fd) != 0)
+    int_error("Error resetting the issuance journal ISSUELOG");
+}
+
+/* ---------------------------------------------------------- *
+ * issuelog_begin(): opens the journal and joins the issuers  *
+ * with LOCK_APPLY shared. The first issuer after a reboot,   *
+ * or of a new or unreadable journal, runs the checkpoint, it *
+ * has to be before the serial number of the new cert is got *
+ * from a serial file that may have lost its last update.     *
+ * ---------------------------------------------------------- */
+void issuelog_begin() {
+  ISSUELOG_HDR hdr;
+  char bootid[40];
+
+  if (ilog_fd >= 0) return;
+  if ((ilog_fd = open(ISSUELOG, O_RDWR|O_CREAT|O_CLOEXEC, 0660)) < 0)
+    int_error("Error cannot open the issuance journal ISSUELOG");
+  issuelog_bootid(bootid, sizeof(bootid));
+
+  if (! issuelog_lock(LOCK_APPLY, F_RDLCK))
+    int_error("Error locking the issuance journal ISSUELOG");
+  if (issuelog_hdr(&hdr) && strcmp(hdr.bootid, bootid) == 0) return;
+
+  /* no shared lock can be raised to exclusive while others wait */
+  issuelog_lock(LOCK_APPLY, F_UNLCK);
+  if (! issuelog_lock(LOCK_APPLY, F_WRLCK))
+    int_error("Error locking the issuance journal ISSUELOG");
+  if (! issuelog_hdr(&hdr) || strcmp(hdr.bootid, bootid) != 0)
+    issuelog_checkpoint(bootid);
+  issuelog_lock(LOCK_APPLY, F_UNLCK);
+  if (! issuelog_lock(LOCK_APPLY, F_RDLCK))
+    int_error("Error locking the issuance journal ISSUELOG");
+}
+
+/* ---------------------------------------------------------- *
+ * issuelog_commit(): makes new certs durable in the journal, *
+ * after their INDEXDB commit and before any store file or a  *
+ * response is written. The records are added in one write,   *
+ * then the group sync: whoever holds LOCK_SYNC syncs all the *
+ * records appended so far, the issuers that wait behind it   *
+ * find theirs synced and skip the fsync.                     *
+ * returns 1 for success, 0 for errors.                       *
+ * ---------------------------------------------------------- */
+int issuelog_commit(X509 **certs, int count) {
+  ISSUELOG_HDR hdr;
+  ISSUELOG_REC rec;
+  unsigned char *buf = NULL, *der;
+  size_t buflen = 0, pos = 0;
+  uint64_t myend, target;
+  int i, len, ret = 0;
+
+  issuelog_begin();
+
+  /* all the records of the call in one buffer */
+  for (i = 0; i < count; i++) {
+    der = NULL;
+    if ((len = i2d_X509(certs[i], &der)) <= 0) goto end;
+    if (pos + sizeof(rec) + ISSUELOG_PAD(len) > buflen) {
+      unsigned char *nbuf;
+      buflen = (pos + sizeof(rec) + ISSUELOG_PAD(len)) * 2;
+      if ((nbuf = realloc(buf, buflen)) == NULL) {
+        OPENSSL_free(der);
+        goto end;
+      }
+      buf = nbuf;
+    }
+    memset(&rec, '\0', sizeof(rec));
+    rec.magic = ISSUELOG_RECMAGIC;
+    rec.len   = len;
+    rec.sum   = issuelog_sum(der, len);
+    memcpy(buf + pos, &rec, sizeof(rec));
+    memcpy(buf + pos + sizeof(rec), der, len);
+    memset(buf + pos + sizeof(rec) + len, '\0', ISSUELOG_PAD(len) - len);
+    pos += sizeof(rec) + ISSUELOG_PAD(len);
+    OPENSSL_free(der);
+  }
+
+  /* append at the end of the last good record */
+  if (! issuelog_lock(LOCK_APPEND, F_WRLCK)) goto end;
+  if (! issuelog_hdr(&hdr) ||
+      pwrite(ilog_fd, buf, pos, hdr.end) != pos) {
+    issuelog_lock(LOCK_APPEND, F_UNLCK);
+    goto end;
+  }
+  hdr.end += pos;
+  myend = hdr.end;
+  i = (pwrite(ilog_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+  issuelog_lock(LOCK_APPEND, F_UNLCK);
+  if (! i) goto end;
+
+  /* group sync: one fdatasync() for all records appended so far */
+  if (! issuelog_lock(LOCK_SYNC, F_WRLCK)) goto end;
+  if (issuelog_hdr(&hdr) && hdr.synced >= myend) ret = 1;
+  else if (issuelog_lock(LOCK_APPEND, F_WRLCK)) {
+    target = issuelog_hdr(&hdr) ? hdr.end : 0;
+    issuelog_lock(LOCK_APPEND, F_UNLCK);
+
+    if (target >= myend && fdatasync(ilog_fd) == 0 &&
+        issuelog_lock(LOCK_APPEND, F_WRLCK)) {
+      if (issuelog_hdr(&hdr)) {
+        if (hdr.synced < target) hdr.synced = target;
+        ret = (pwrite(ilog_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+      }
+      issuelog_lock(LOCK_APPEND, F_UNLCK);
+    }
+  }
+  issuelog_lock(LOCK_SYNC, F_UNLCK);
+
+end:
+  free(buf);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * issuelog_done(): the committed certs are written to their  *
+ * files, the issuer leaves LOCK_APPLY. If the journal grew   *
+ * past ISSUELOG_CHECKPOINT, it waits for the other issuers   *
+ * to finish and runs the checkpoint.                         *
+ * ---------------------------------------------------------- */
+void issuelog_done() {
+  struct stat st;
+  char bootid[40];
+
+  if (ilog_fd < 0) return;
+  issuelog_lock(LOCK_APPLY, F_UNLCK);
+
+  if (fstat(ilog_fd, &st) == 0 && st.st_size > ISSUELOG_CHECKPOINT &&
+      issuelog_lock(LOCK_APPLY, F_WRLCK)) {
+    /* another issuer may have run it while we waited */
+    if (fstat(ilog_fd, &st) == 0 && st.st_size > ISSUELOG_CHECKPOINT) {
+      issuelog_bootid(bootid, sizeof(bootid));
+      issuelog_checkpoint(bootid);
+    }
+    issuelog_lock(LOCK_APPLY, F_UNLCK);
+  }
+  close(ilog_fd);
+  ilog_fd = -1;
+}
@@ -0,0 +1,237 @@
+/* ---------------------------------------------------------- *
+ * file:	certprof.c                                    *
+ * purpose:	named signing profiles. PROFILEFILE lists the *
+ *              profiles in its [profiles] section as "name = *
+ *              section", each section has the X509V3 exts of *
+ *              the profile in openssl.cnf syntax. They are   *
+ *              compiled once into their DER in PROFILECACHE, *
+ *              the CGIs decode that instead of parsing the   *
+ *              config, until PROFILEFILE changes. A process  *
+ *              loads them once, each cert gets copies.       *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/conf.h>
+#include <openssl/x509v3.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The cache file: header, then per profile an entry with the *
+ * DER of its extension list, zero padded to 8 bytes. It is   *
+ * valid for the PROFILEFILE inode, size and mtime it has.    *
+ * ---------------------------------------------------------- */
+#define PROFCACHE_MAGIC   "WCPRF\0\0\0"
+#define PROFCACHE_VERSION 1
+
+typedef struct profcache_hdr_st {
+  char          magic[8];      /* PROFCACHE_MAGIC                 */
+  uint32_t      version;       /* PROFCACHE_VERSION               */
+  uint32_t      count;         /* # of profile entries that follow*/
+  uint64_t      stamp[3];      /* PROFILEFILE inode, size, mtime  */
+} PROFCACHE_HDR;
+
+typedef struct profcache_ent_st {
+  char          name[PROFILE_NAMELEN];
+  uint32_t      len;           /* DER bytes, without the padding  */
+  uint32_t      reserved;
+} PROFCACHE_ENT;
+
+#define PROFCACHE_PAD(n)  (((n) + 7) & ~(size_t) 7)
+
+static CERT_PROFILE profiles[PROFILE_MAX];
+static int profile_count = -1;
+
+/* ---------------------------------------------------------- *
+ * profile_stamp(): inode, size and mtime of PROFILEFILE.     *
+ * returns 1, or 0 if there is no profile file.               *
+ * ---------------------------------------------------------- */
+static int profile_stamp(uint64_t *stamp) {
+  struct stat st;
+
+  if (stat(PROFILEFILE, &st) != 0) return 0;
+  stamp[0] = st.st_ino;
+  stamp[1] = st.st_size;
+  stamp[2] = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * profcache_load(): decodes the profiles from PROFILECACHE,  *
+ * if it was made from PROFILEFILE as it is now. returns the  *
+ * # of profiles, or -1 for a missing, stale or bad cache.    *
+ * ---------------------------------------------------------- */
+static int profcache_load(const uint64_t *stamp) {
+  const unsigned char *map, *p, *end;
+  const PROFCACHE_HDR *hdr;
+  const PROFCACHE_ENT *ent;
+  struct stat st;
+  int fd, count = 0;
+
+  if ((fd = open(PROFILECACHE, O_RDONLY)) < 0) return -1;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(PROFCACHE_HDR)) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+
+  hdr = (const PROFCACHE_HDR *) map;
+  end = map + st.st_size;
+  if (memcmp(hdr->magic, PROFCACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != PROFCACHE_VERSION || hdr->count > PROFILE_MAX ||
+      memcmp(hdr->stamp, stamp, sizeof(hdr->stamp)) != 0) goto stale;
+
+  for (p = map + sizeof(PROFCACHE_HDR); count < hdr->count; count++) {
+    ent = (const PROFCACHE_ENT *) p;
+    if (end - p < sizeof(PROFCACHE_ENT) ||
+        end - p - sizeof(PROFCACHE_ENT) < PROFCACHE_PAD(ent->len) ||
+        memchr(ent->name, '\0', sizeof(ent->name)) == NULL) goto stale;
+    p += sizeof(PROFCACHE_ENT);
+
+    memcpy(profiles[count].name, ent->name, sizeof(ent->name));
+    if ((profiles[count].exts =
+           d2i_X509_EXTENSIONS(NULL, &p, ent->len)) == NULL) goto stale;
+    p = (const unsigned char *) (ent + 1) + PROFCACHE_PAD(ent->len);
+  }
+  munmap((void *) map, st.st_size);
+  return count;
+
+stale:
+  while (count > 0)
+    sk_X509_EXTENSION_pop_free(profiles[--count].exts, X509_EXTENSION_free);
+  munmap((void *) map, st.st_size);
+  return -1;
+}
+
+/* ---------------------------------------------------------- *
+ * profcache_save(): writes the compiled profiles to a temp   *
+ * file and renames it to PROFILECACHE. A failure only costs  *
+ * the next process the compile, it is not an error.          *
+ * ---------------------------------------------------------- */
+static void profcache_save(const uint64_t *stamp, int count) {
+  static const unsigned char zero[8];
+  char tmpfile[512] = "";
+  unsigned char *der;
+  PROFCACHE_HDR hdr;
+  PROFCACHE_ENT ent;
+  FILE *fp;
+  int i, len, ok = 1;
+
+  memset(&hdr, '\0', sizeof(hdr));
+  memcpy(hdr.magic, PROFCACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version = PROFCACHE_VERSION;
+  hdr.count   = count;
+  memcpy(hdr.stamp, stamp, sizeof(hdr.stamp));
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", PROFILECACHE, (int) getpid());
+  if ((fp = fopen(tmpfile, "w")) == NULL) return;
+  ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+
+  for (i = 0; ok && i < count; i++) {
+    der = NULL;
+    if ((len = i2d_X509_EXTENSIONS(profiles[i].exts, &der)) <= 0) {
+      ok = 0;
+      break;
+    }
+    memset(&ent, '\0', sizeof(ent));
+    memcpy(ent.name, profiles[i].name, sizeof(ent.name));
+    ent.len = len;
+    ok = (fwrite(&ent, sizeof(ent), 1, fp) == 1 &&
+          fwrite(der, 1, len, fp) == len &&
+          fwrite(zero, 1, PROFCACHE_PAD(len) - len, fp) == PROFCACHE_PAD(len) - len);
+    OPENSSL_free(der);
+  }
+  if (fclose(fp) != 0 || ! ok || rename(tmpfile, PROFILECACHE) != 0)
+    unlink(tmpfile);
+}
+
+/* ---------------------------------------------------------- *
+ * profile_compile(): parses the profiles of PROFILEFILE with *
+ * the openssl X509V3 config code. An error in the file stops *
+ * the CGI, a profile is not silently left out.               *
+ * returns the # of profiles.                                 *
+ * ---------------------------------------------------------- */
+static int profile_compile() {
+  STACK_OF(CONF_VALUE) *list;
+  CONF_VALUE *val;
+  X509V3_CTX ctx;
+  CONF *conf;
+  long errline = -1;
+  int i, count = 0;
+
+  if ((conf = NCONF_new(NULL)) == NULL)
+    int_error("Error creating the signing profile config object");
+  if (NCONF_load(conf, PROFILEFILE, &errline) <= 0) {
+    snprintf(error_str, sizeof(error_str),
+             "Error: file \"%s\" problem on line %ld", PROFILEFILE, errline);
+    int_error(error_str);
+  }
+
+  /* the exts do not depend on the cert, keyid and hash exts can't be set */
+  X509V3_set_ctx(&ctx, NULL, NULL, NULL, NULL, 0);
+  X509V3_set_nconf(&ctx, conf);
+
+  if ((list = NCONF_get_section(conf, "profiles")) == NULL)
+    int_error("Error: the signing profile file has no [profiles] section");
+  if (sk_CONF_VALUE_num(list) > PROFILE_MAX)
+    int_error("Error: the signing profile file has more than PROFILE_MAX profiles");
+
+  for (i = 0; i < sk_CONF_VALUE_num(list); i++, count++) {
+    val = sk_CONF_VALUE_value(list, i);
+    if (strlen(val->name) >= PROFILE_NAMELEN)
+      int_error("Error: a signing profile name exceeds PROFILE_NAMELEN");
+    strcpy(profiles[count].name, val->name);
+    profiles[count].exts = NULL;
+    if (! X509V3_EXT_add_nconf_sk(conf, &ctx, val->value, &profiles[count].exts)) {
+      snprintf(error_str, sizeof(error_str),
+            "Error in the extensions of signing profile \"%s\"", val->name);
+      int_error(error_str);
+    }
+    /* a profile without extensions still has its (empty) list */
+    if (profiles[count].exts == NULL &&
+        (profiles[count].exts = sk_X509_EXTENSION_new_null()) == NULL)
+      int_error("Error creating the signing profile extension list");
+  }
+  NCONF_free(conf);
+  return count;
+}
+
+/* ---------------------------------------------------------- *
+ * load_profiles(): the signing profiles of PROFILEFILE, from *
+ * PROFILECACHE, or compiled and cached. Loaded once for the  *
+ * process. returns the profile array, its size in *count, 0  *
+ * if there is no PROFILEFILE.                                *
+ * ---------------------------------------------------------- */
+const CERT_PROFILE *load_profiles(int *count) {
+  uint64_t stamp[3];
+
+  if (profile_count < 0) {
+    if (! profile_stamp(stamp)) profile_count = 0;
+    else if ((profile_count = profcache_load(stamp)) < 0) {
+      profile_count = profile_compile();
+      profcache_save(stamp, profile_count);
+    }
+  }
+  *count = profile_count;
+  return profiles;
+}
+
+/* ---------------------------------------------------------- *
+ * find_profile(): the signing profile 'name', NULL if there  *
+ * is none.                                                   *
+ * ---------------------------------------------------------- */
+const CERT_PROFILE *find_profile(const char *name) {
+  const CERT_PROFILE *prof;
+  int count, i;
+
+  prof = load_profiles(&count);
+  for (i = 0; i < count; i++)
+    if (strcmp(prof[i].name, name) == 0) return &prof[i];
+  return NULL;
+}
@@ -18,6 +18,7 @@ int cgiMain() {
    X509 *cert  = NULL;
    char formreq[REQLEN] = "";
    char formkey[KEYLEN] = "";
+   char certfilestr[81] = "";
    static char  title[] = "Certificate Renewal";
 
   /* ---------------------------------------------------------- *
@@ -32,27 +33,41 @@ int cgiMain() {
   BIO_set_fp(outbio, cgiOut, BIO_NOCLOSE);
 
   /* ---------------------------------------------------------- *
-   * check if cert data was handed to certverify.cgi,           *
+   * check if cert data was handed to certverify.cgi, or if the *
+   * certstore.cgi listing sent us the cert file name to load,  *
    * or if someone called us directly without a request         *
    * -----------------------------------------------------------*/
-   if (! (cgiFormString("cert-renew", formreq, REQLEN) == cgiFormSuccess ))
-         int_error("Error no certificate data received from certstore.cgi");
+   BIO *certbio  = NULL;
+   if (cgiFormString("cert-renew", formreq, REQLEN) == cgiFormSuccess ) {
+    /* ---------------------------------------------------------- *
+     * Is the cert data plausible or is it garbage?               *
+     * ---------------------------------------------------------- */
+     // cert_validate(formreq);
 
-  /* ---------------------------------------------------------- *
-   * Is the cert data plausible or is it garbage?               *
-   * ---------------------------------------------------------- */
-   // cert_validate(formreq);
+    /* ---------------------------------------------------------- *
+     * input seems OK, write the request to a temporary mem BIO   *
+     * ---------------------------------------------------------- */
+     certbio = BIO_new_mem_buf(formreq, -1);
+   }
+   else if (cgiFormString("cfilename", certfilestr, sizeof(certfilestr)) == cgiFormSuccess ) {
+    /* ---------------------------------------------------------- *
+     * Reject "../.." or '/' in the name, we only read the store  *
+     * ---------------------------------------------------------- */
+     if ( strstr(certfilestr, "..") ||
+          strchr(certfilestr, '/')  ||
+          (! strstr(certfilestr, ".pem")) )
+       int_error("Error incorrect data in >cfilename<");
 
-  /* ---------------------------------------------------------- *
-   * input seems OK, write the request to a temporary mem BIO   *
-   * ---------------------------------------------------------- */
-   BIO *certbio  = NULL;
-   certbio = BIO_new_mem_buf(formreq, -1);
+     if (! (cert = read_storecert(certfilestr)))
+       int_error("Error cant load the Certificate from the cert store");
+   }
+   else
+     int_error("Error no certificate data received from certstore.cgi");
 
   /* ---------------------------------------------------------- *
    * Try to read the PEM request with openssl lib functions     *
    * ---------------------------------------------------------- */
-   if(! (cert = PEM_read_bio_X509(certbio, NULL, NULL, NULL)))
+   if(! cert && ! (cert = PEM_read_bio_X509(certbio, NULL, NULL, NULL)))
       int_error("Error cant read request content with PEM function");
 
   /* ---------------------------------------------------------- *
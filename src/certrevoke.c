@@ -6,6 +6,7 @@
  * -----------------------------------------------------------*/
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <cgic.h>
 #include <openssl/crypto.h>
 #include <openssl/x509.h>
@@ -31,13 +32,10 @@ static const char *crl_reasons[] = {
 };
 
 
-int check_index(X509 *x509, CA_DB *db);
-int do_revoke(X509 *x509, CA_DB *db, const char *value);
 
 int cgiMain() {
 
   char formkey[REQLEN]   = "";
-  char certfilepath[255] = "";
   char certnamestr[81]   = "";
   char certfilestr[81]   = "[n/a]";
   FILE *certfile         = NULL;
@@ -68,17 +66,19 @@ int cgiMain() {
     int_error("Error incorrect data in >cfilename<");
 
 /* ---------------------------------------------------------- *
- * check if its the CA cert, or open the requested filename   *
+ * check if its the CA cert, or load the requested store cert *
  * -----------------------------------------------------------*/
+  X509 *cert;
   if (strcmp(certfilestr, "cacert.pem") == 0) {
     if (! (certfile = fopen(CACERT, "r")))
       int_error("Error can't open CA certificate file");
+    if (! (cert = PEM_read_X509(certfile,NULL,NULL,NULL)))
+      int_error("Error loading cert into memory");
+    fclose(certfile);
     strncpy(title, "Display Root CA Certificate", sizeof(title));
   } else {
-     snprintf(certfilepath, sizeof(certfilepath), "%s/%s", CACERTSTORE,
-		      						certfilestr);
-    if (! (certfile = fopen(certfilepath, "r")))
-      int_error("Error cant open Certificate file");
+    if (! (cert = read_storecert(certfilestr)))
+      int_error("Error cant load the Certificate from the cert store");
   }
 
 /* ---------------------------------------------------------- *
@@ -87,13 +87,6 @@ int cgiMain() {
   strncpy(certnamestr, certfilestr, sizeof(certnamestr));
   strtok(certnamestr, ".");
 
-/* ---------------------------------------------------------- *
- * decode the certificate                                     *
- * -----------------------------------------------------------*/
-  X509 *cert;
-  if (! (cert = PEM_read_X509(certfile,NULL,NULL,NULL)))
-    int_error("Error loading cert into memory");
-
 /* ---------------------------------------------------------- *
  * Check if we already got the key, otherwise we ask for it   *
  * -----------------------------------------------------------*/
@@ -249,11 +242,11 @@ int cgiMain() {
     }
     else {
     /* ---------------------------------------------------------- *
-     * Revocation authorized - Add cert as revoked to index.db,   *
+     * Revocation authorized - Add cert as revoked to INDEXDB,    *
      * create and publish a new CRL file with all revocations.    *
      * -----------------------------------------------------------*/
       CA_DB *db = NULL;
-      DB_ATTR db_attr;
+      DB_ATTR db_attr = { UNIQUE_SUBJECT };
 
     /* ---------------------------------------------------------- *
      * Get the revocation reason code from the calling cgi form   *
@@ -263,9 +256,9 @@ int cgiMain() {
       //int_error(crl_reasons[reason]);
 
     /* ---------------------------------------------------------- *
-     * Get all revoked certificates from revocation DB index.txt  *
+     * Open the CA database INDEXDB with the revoked certificates *
      * ---------------------------------------------------------- */
-      if((db = load_index(INDEXFILE, &db_attr)) == NULL)
+      if((db = certdb_open(INDEXDB, &db_attr)) == NULL)
         int_error("Error cannot load CRL certificate database file");
 
     /* ---------------------------------------------------------- *
@@ -280,16 +273,23 @@ int cgiMain() {
         do_revoke(cert, db, crl_reasons[reason]); 
 
       /* ---------------------------------------------------------- *
-       * Save updated list of revoked certificates to index.txt     *
+       * Commit the revocation to the CA database INDEXDB           *
        * ---------------------------------------------------------- */
-        if((save_index(INDEXFILE, db)) != 1)
+        if((certdb_commit(db, 1)) != 1)
           int_error("Error cannot write CRL certificate database file");
 
       /* ---------------------------------------------------------- *
-       * Create new CRL file from index.txt, overwrite the old one  *
+       * Flag the cert as revoked in the cert store metadata index  *
+       * ---------------------------------------------------------- */
+        if(! revoke_certindex(CERTINDEX, cert, time(NULL)))
+          int_error("Error cannot update the certificate store index file");
+
+      /* ---------------------------------------------------------- *
+       * Create new CRL file from INDEXDB, overwrite the old one    *
        * -----------------------------------------------------------*/
         cgi_gencrl(CRLFILE);
       }
+      certdb_close(db);
 
     /* ---------------------------------------------------------- *
      * Revocation completed - confirm revocation to html output   *
@@ -0,0 +1,580 @@
+/* ---------------------------------------------------------- *
+ * file:	certsan.c                                     *
+ * purpose:	index of the subjectAltName dNSName and       *
+ *              iPAddress values of all certs. DNS names are  *
+ *              stored label-reversed, "api.example.com" as   *
+ *              "com.example.api", in a sorted key table: a   *
+ *              flattened trie, each domain is a key range.   *
+ *              New certs go to a log, merged when it grows.  *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The base file SANINDEX: header, the key entries sorted by  *
+ * key and serial, and the key string pool they point into.   *
+ * The log SANINDEX.log has one "key serialhex" per line.     *
+ * IP addresses are stored as "#" + the inet_ntop() text.     *
+ * ---------------------------------------------------------- */
+#define SANIDX_MAGIC    "WCSAN\0\0\0"
+#define SANIDX_VERSION  1
+#define SANKEY_LEN      256
+
+typedef struct sanidx_hdr_st {
+  char          magic[8];      /* SANIDX_MAGIC                    */
+  uint32_t      version;       /* SANIDX_VERSION                  */
+  uint32_t      reserved;
+  uint64_t      count;         /* # of key entries                */
+  uint64_t      poolsize;      /* # of bytes in the string pool   */
+} SANIDX_HDR;
+
+typedef struct sanidx_ent_st {
+  CERT_SERIAL   serial;
+  uint32_t      off;           /* key start in the string pool    */
+  uint32_t      len;           /* key length, no '\0' terminator  */
+} SANIDX_ENT;
+
+/* in-memory key of a rebuild or merge */
+typedef struct san_key_st {
+  const char   *key;
+  size_t        len;
+  CERT_SERIAL   serial;
+} SAN_KEY;
+
+/* per-cert result slot of the rebuild store scan */
+typedef struct san_scan_st {
+  CERT_SERIAL   serial;
+  char         *keys;          /* "key\0key\0...", malloc()ed     */
+  size_t        keyslen;
+} SAN_SCAN;
+
+/* ---------------------------------------------------------- *
+ * san_dnskey(): lowercases a DNS name and reverses its       *
+ * labels, "*.Example.com." becomes "com.example.*".          *
+ * returns the key length, or 0 if the name does not fit.     *
+ * ---------------------------------------------------------- */
+static size_t san_dnskey(const char *name, size_t len, char *key) {
+  size_t start, end, i, out = 0;
+
+  while (len > 0 && name[len-1] == '.') len--;
+  if (len == 0 || len >= SANKEY_LEN) return 0;
+
+  /* copy the labels from the last one to the first one */
+  for (end = len; end > 0; end = (start > 0) ? start - 1 : 0) {
+    for (start = end; start > 0 && name[start-1] != '.'; start--);
+    if (out > 0) key[out++] = '.';
+    for (i = start; i < end; i++) key[out++] = tolower((unsigned char) name[i]);
+  }
+  key[out] = '\0';
+  return out;
+}
+
+/* ---------------------------------------------------------- *
+ * san_ipkey(): the key of a 4 or 16 byte IP address.         *
+ * ---------------------------------------------------------- */
+static size_t san_ipkey(const unsigned char *ip, int iplen, char *key) {
+  key[0] = '#';
+  if (inet_ntop(iplen == 4 ? AF_INET : AF_INET6, ip, key+1,
+                                         SANKEY_LEN-1) == NULL) return 0;
+  return strlen(key);
+}
+
+/* ---------------------------------------------------------- *
+ * san_certkeys(): collects the keys of all DNS and IP SANs   *
+ * of a cert into a malloc()ed "key\0key\0" buffer. returns   *
+ * the buffer length, 0 if the cert has no such SAN.          *
+ * ---------------------------------------------------------- */
+static size_t san_certkeys(X509 *cert, char **keys) {
+  GENERAL_NAMES *gens = NULL;
+  const GENERAL_NAME *gen;
+  char key[SANKEY_LEN], *tmp;
+  size_t len, total = 0;
+  int i;
+
+  *keys = NULL;
+  gens = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL);
+  if (gens == NULL) return 0;
+
+  for (i = 0; i < sk_GENERAL_NAME_num(gens); i++) {
+    gen = sk_GENERAL_NAME_value(gens, i);
+    len = 0;
+    if (gen->type == GEN_DNS)
+      len = san_dnskey((const char *) ASN1_STRING_get0_data(gen->d.dNSName),
+                       ASN1_STRING_length(gen->d.dNSName), key);
+    else if (gen->type == GEN_IPADD &&
+             (ASN1_STRING_length(gen->d.iPAddress) == 4 ||
+              ASN1_STRING_length(gen->d.iPAddress) == 16))
+      len = san_ipkey(ASN1_STRING_get0_data(gen->d.iPAddress),
+                      ASN1_STRING_length(gen->d.iPAddress), key);
+    if (len == 0) continue;
+
+    if ((tmp = realloc(*keys, total + len + 1)) == NULL) break;
+    *keys = tmp;
+    memcpy(*keys + total, key, len + 1);
+    total += len + 1;
+  }
+  GENERAL_NAMES_free(gens);
+  return total;
+}
+
+/* ---------------------------------------------------------- *
+ * san_scan_fill(): scan_certstore() callback of the rebuild. *
+ * ---------------------------------------------------------- */
+static int san_scan_fill(X509 *cert, const char *fname, uint64_t off,
+                                             void *result, void *arg) {
+  SAN_SCAN *res = (SAN_SCAN *) result;
+
+  if (! serial_from_asn1(&res->serial, X509_get_serialNumber(cert)))
+    return 0;
+  res->keyslen = san_certkeys(cert, &res->keys);
+  return (res->keyslen > 0);
+}
+
+/* ---------------------------------------------------------- *
+ * san_keycmp(): orders keys bytewise, shorter first on a tie *
+ * ---------------------------------------------------------- */
+static int san_keycmp(const char *a, size_t alen, const char *b, size_t blen) {
+  int ret = memcmp(a, b, alen < blen ? alen : blen);
+
+  if (ret != 0) return ret;
+  return (alen > blen) - (alen < blen);
+}
+
+static int san_key_cmp(const void *a, const void *b) {
+  const SAN_KEY *x = (const SAN_KEY *) a, *y = (const SAN_KEY *) b;
+  int ret = san_keycmp(x->key, x->len, y->key, y->len);
+
+  return ret ? ret : serial_cmp(&x->serial, &y->serial);
+}
+
+/* ---------------------------------------------------------- *
+ * san_write(): sorts the keys and writes them as a new base  *
+ * file via temp file and rename(). returns 1, or 0 on errors *
+ * ---------------------------------------------------------- */
+static int san_write(const char *sanfile, SAN_KEY *keys, uint64_t count) {
+  char tmpfile[256];
+  SANIDX_HDR hdr;
+  SANIDX_ENT ent;
+  uint64_t i, n = 0;
+  FILE *fp;
+
+  if (count > 0) qsort(keys, count, sizeof(SAN_KEY), san_key_cmp);
+
+  /* drop duplicates, i.e. a logged cert that is in the base already */
+  memset(&hdr, '\0', sizeof(hdr));
+  for (i = 0; i < count; i++) {
+    if (n > 0 && san_key_cmp(&keys[n-1], &keys[i]) == 0) continue;
+    keys[n++] = keys[i];
+    hdr.poolsize += keys[i].len;
+  }
+  memcpy(hdr.magic, SANIDX_MAGIC, sizeof(hdr.magic));
+  hdr.version = SANIDX_VERSION;
+  hdr.count   = n;
+  if (hdr.poolsize > UINT32_MAX) return 0;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", sanfile, (int) getpid());
+  if ((fp = fopen(tmpfile, "w")) == NULL) return 0;
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) goto fail;
+
+  for (i = 0, ent.off = 0; i < n; i++) {
+    ent.serial = keys[i].serial;
+    ent.len    = keys[i].len;
+    if (fwrite(&ent, sizeof(ent), 1, fp) != 1) goto fail;
+    ent.off += ent.len;
+  }
+  for (i = 0; i < n; i++)
+    if (keys[i].len > 0 && fwrite(keys[i].key, keys[i].len, 1, fp) != 1)
+      goto fail;
+
+  if (fclose(fp) != 0 || rename(tmpfile, sanfile) != 0) {
+    unlink(tmpfile);
+    return 0;
+  }
+  return 1;
+
+fail:
+  fclose(fp);
+  unlink(tmpfile);
+  return 0;
+}
+
+/* ---------------------------------------------------------- *
+ * san_rebuild(): creates the SAN index from scratch with a   *
+ * scan of all issued certs in the store, and empties the     *
+ * log. Called with the log lock held on logfd.               *
+ * returns the number of keys, or -1 for errors.              *
+ * ---------------------------------------------------------- */
+static int san_rebuild(const char *sanfile, int logfd) {
+  SAN_SCAN *res = NULL;
+  SAN_KEY *keys = NULL;
+  uint64_t nkeys = 0, maxkeys = 0;
+  void *results = NULL;
+  const char *p;
+  int count, i, ret = -1;
+
+  if ((count = scan_issued(san_scan_fill, NULL,
+                                 sizeof(SAN_SCAN), &results)) < 0) return -1;
+  res = (SAN_SCAN *) results;
+
+  for (i = 0; i < count; i++)
+    for (p = res[i].keys; p < res[i].keys + res[i].keyslen; p += strlen(p)+1) {
+      if (nkeys == maxkeys) {
+        SAN_KEY *tmp;
+        maxkeys = maxkeys ? maxkeys * 2 : 1024;
+        if ((tmp = realloc(keys, maxkeys * sizeof(SAN_KEY))) == NULL) goto end;
+        keys = tmp;
+      }
+      keys[nkeys].key    = p;
+      keys[nkeys].len    = strlen(p);
+      keys[nkeys].serial = res[i].serial;
+      nkeys++;
+    }
+
+  if (san_write(sanfile, keys, nkeys) && ftruncate(logfd, 0) == 0)
+    ret = nkeys;
+
+end:
+  for (i = 0; i < count; i++) free(res[i].keys);
+  free(results);
+  free(keys);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * sanidx_rebuild(): san_rebuild() under the log lock.        *
+ * ---------------------------------------------------------- */
+int sanidx_rebuild(const char *sanfile) {
+  char logfile[256];
+  int fd, ret;
+
+  snprintf(logfile, sizeof(logfile), "%s.log", sanfile);
+  if ((fd = open(logfile, O_RDWR|O_CREAT, 0644)) < 0) return -1;
+  flock(fd, LOCK_EX);
+  ret = san_rebuild(sanfile, fd);
+  close(fd);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * san_map(): maps a file read-only, returns NULL on errors.  *
+ * ---------------------------------------------------------- */
+static const unsigned char *san_map(int fd, size_t *len) {
+  struct stat st;
+  void *map;
+
+  *len = 0;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) return NULL;
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) return NULL;
+  *len = st.st_size;
+  return map;
+}
+
+/* ---------------------------------------------------------- *
+ * san_base(): maps and checks the base file, returns NULL if *
+ * it is missing or damaged. Sets the entries and the pool.   *
+ * ---------------------------------------------------------- */
+static const SANIDX_HDR *san_base(const char *sanfile, size_t *len,
+                   const SANIDX_ENT **ents, const char **pool) {
+  const SANIDX_HDR *hdr;
+  int fd;
+
+  if ((fd = open(sanfile, O_RDONLY)) < 0) return NULL;
+  hdr = (const SANIDX_HDR *) san_map(fd, len);
+  close(fd);
+  if (hdr == NULL) return NULL;
+
+  if (*len < sizeof(SANIDX_HDR) ||
+      memcmp(hdr->magic, SANIDX_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != SANIDX_VERSION ||
+      *len != sizeof(SANIDX_HDR) + hdr->count * sizeof(SANIDX_ENT)
+              + hdr->poolsize) {
+    munmap((void *) hdr, *len);
+    return NULL;
+  }
+  *ents = (const SANIDX_ENT *) (hdr + 1);
+  *pool = (const char *) (*ents + hdr->count);
+  return hdr;
+}
+
+/* ---------------------------------------------------------- *
+ * san_logline(): splits a "key serialhex\n" log line at p,   *
+ * returns the next line, or NULL at the end or a torn line.  *
+ * ---------------------------------------------------------- */
+static const char *san_logline(const char *p, const char *end,
+                   const char **key, size_t *keylen, CERT_SERIAL *serial) {
+  const char *nl = memchr(p, '\n', end - p);
+  const char *sp;
+
+  if (nl == NULL) return NULL;
+  if ((sp = memchr(p, ' ', nl - p)) == NULL ||
+      ! serial_from_hex(serial, sp+1)) {
+    *keylen = 0;                       /* skip a damaged line */
+    return nl + 1;
+  }
+  *key = p;
+  *keylen = sp - p;
+  return nl + 1;
+}
+
+/* ---------------------------------------------------------- *
+ * san_merge(): writes base and log keys into a new base file *
+ * and empties the log. Called with the log lock held.        *
+ * ---------------------------------------------------------- */
+static int san_merge(const char *sanfile, int logfd) {
+  const SANIDX_HDR *hdr = NULL;
+  const SANIDX_ENT *ents = NULL;
+  const char *pool = NULL, *p, *end, *key;
+  const unsigned char *logmap;
+  size_t maplen = 0, loglen, keylen;
+  SAN_KEY *keys = NULL;
+  uint64_t n = 0, i, max;
+  CERT_SERIAL serial;
+  int ret = 0;
+
+  if ((hdr = san_base(sanfile, &maplen, &ents, &pool)) == NULL)
+    return (san_rebuild(sanfile, logfd) >= 0);
+
+  logmap = san_map(logfd, &loglen);
+  max = hdr->count + loglen / 4;
+  if ((keys = malloc((max + 1) * sizeof(SAN_KEY))) == NULL) goto end;
+
+  for (i = 0; i < hdr->count; i++, n++) {
+    keys[n].key    = pool + ents[i].off;
+    keys[n].len    = ents[i].len;
+    keys[n].serial = ents[i].serial;
+  }
+  for (p = (const char *) logmap, end = p + loglen; p && p < end && n < max; ) {
+    if ((p = san_logline(p, end, &key, &keylen, &serial)) == NULL) break;
+    if (keylen == 0) continue;
+    keys[n].key    = key;
+    keys[n].len    = keylen;
+    keys[n].serial = serial;
+    n++;
+  }
+
+  if (san_write(sanfile, keys, n) && ftruncate(logfd, 0) == 0) ret = 1;
+
+end:
+  free(keys);
+  if (logmap) munmap((void *) logmap, loglen);
+  munmap((void *) hdr, maplen);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * sanidx_add(): appends the SAN keys of a newly signed cert  *
+ * to the log, and merges the log into the base once it has   *
+ * SANIDX_MERGE lines. returns 1 for success, or 0 for errors.*
+ * ---------------------------------------------------------- */
+int sanidx_add(const char *sanfile, X509 *cert) {
+  char logfile[256], serialhex[SERIAL_HEXLEN], *keys = NULL;
+  CERT_SERIAL serial;
+  struct stat st;
+  size_t keyslen;
+  const char *p;
+  FILE *fp;
+  int fd, ret = 1;
+
+  if (! serial_from_asn1(&serial, X509_get_serialNumber(cert))) return 0;
+  serial_to_hex(&serial, serialhex, sizeof(serialhex));
+  if ((keyslen = san_certkeys(cert, &keys)) == 0) return 1;
+
+  snprintf(logfile, sizeof(logfile), "%s.log", sanfile);
+  if ((fd = open(logfile, O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0) {
+    free(keys);
+    return 0;
+  }
+  flock(fd, LOCK_EX);
+
+  if ((fp = fdopen(dup(fd), "a")) == NULL) ret = 0;
+  else {
+    for (p = keys; p < keys + keyslen; p += strlen(p) + 1)
+      fprintf(fp, "%s %s\n", p, serialhex);
+    if (fclose(fp) != 0) ret = 0;
+  }
+
+  /* a log line has ~32 bytes, merge when it got SANIDX_MERGE lines */
+  if (ret && fstat(fd, &st) == 0 && st.st_size / 32 >= SANIDX_MERGE) {
+    close(fd);
+    if ((fd = open(logfile, O_RDWR)) >= 0) {
+      flock(fd, LOCK_EX);
+      ret = san_merge(sanfile, fd);
+    }
+  }
+  if (fd >= 0) close(fd);
+  free(keys);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * SAN_QUERY: a parsed lookup. A host name matches its exact  *
+ * key and the wildcard key of its parent domain, a "*.domain"*
+ * query matches every key in the domain's range (subtree).   *
+ * ---------------------------------------------------------- */
+typedef struct san_query_st {
+  char          exact[SANKEY_LEN];  /* exact key, or the domain prefix */
+  size_t        exactlen;
+  char          wild[SANKEY_LEN];   /* "parent.*" key of a host name   */
+  size_t        wildlen;
+  int           subtree;
+} SAN_QUERY;
+
+static int san_parse(const char *name, SAN_QUERY *q) {
+  unsigned char ip[16];
+  char *dot;
+
+  memset(q, '\0', sizeof(SAN_QUERY));
+
+  if (inet_pton(AF_INET, name, ip) == 1)
+    q->exactlen = san_ipkey(ip, 4, q->exact);
+  else if (inet_pton(AF_INET6, name, ip) == 1)
+    q->exactlen = san_ipkey(ip, 16, q->exact);
+  else if (strncmp(name, "*.", 2) == 0) {
+    /* "com.example." is the range of everything below example.com */
+    if ((q->exactlen = san_dnskey(name+2, strlen(name+2), q->exact)) == 0 ||
+        q->exactlen + 1 >= SANKEY_LEN) return 0;
+    q->exact[q->exactlen++] = '.';
+    q->exact[q->exactlen] = '\0';
+    q->subtree = 1;
+  }
+  else {
+    if ((q->exactlen = san_dnskey(name, strlen(name), q->exact)) == 0)
+      return 0;
+    /* a wildcard covers exactly one label: "com.example.*" */
+    if ((dot = strrchr(q->exact, '.')) != NULL &&
+        dot - q->exact + 2 < SANKEY_LEN) {
+      q->wildlen = dot - q->exact + 1;
+      memcpy(q->wild, q->exact, q->wildlen);
+      q->wild[q->wildlen++] = '*';
+      q->wild[q->wildlen] = '\0';
+    }
+  }
+  return (q->exactlen > 0);
+}
+
+static int san_match(const SAN_QUERY *q, const char *key, size_t len) {
+  if (q->subtree)
+    return (len >= q->exactlen && memcmp(key, q->exact, q->exactlen) == 0);
+  return (san_keycmp(key, len, q->exact, q->exactlen) == 0 ||
+          (q->wildlen && san_keycmp(key, len, q->wild, q->wildlen) == 0));
+}
+
+/* ---------------------------------------------------------- *
+ * san_seek(): position of the first entry with key >= 'key'. *
+ * ---------------------------------------------------------- */
+static uint64_t san_seek(const SANIDX_ENT *ents, uint64_t count,
+                      const char *pool, const char *key, size_t len) {
+  uint64_t lo = 0, hi = count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (san_keycmp(pool + ents[mid].off, ents[mid].len, key, len) < 0)
+      lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static int serial_qcmp(const void *a, const void *b) {
+  return serial_cmp((const CERT_SERIAL *) a, (const CERT_SERIAL *) b);
+}
+
+/* ---------------------------------------------------------- *
+ * sanidx_query(): finds the certs with a SAN covering 'name':*
+ * a host name or IP address, or "*.domain" for all names in  *
+ * the domain. Only the matching key ranges of the base are   *
+ * read, plus the log. A missing base is built once. Returns  *
+ * the # of serials in *serials, sorted and unique, to be     *
+ * freed with free(), or -1 for errors.                       *
+ * ---------------------------------------------------------- */
+int sanidx_query(const char *sanfile, const char *name, CERT_SERIAL **serials) {
+  const SANIDX_HDR *hdr = NULL;
+  const SANIDX_ENT *ents = NULL;
+  const char *pool = NULL, *p, *end, *key;
+  const unsigned char *logmap = NULL;
+  size_t maplen = 0, loglen = 0, keylen, max = 0;
+  char logfile[256];
+  CERT_SERIAL serial, *tmp;
+  SAN_QUERY q;
+  uint64_t i;
+  int fd, pass, n = 0;
+
+  *serials = NULL;
+  if (! san_parse(name, &q)) return -1;
+
+  if ((hdr = san_base(sanfile, &maplen, &ents, &pool)) == NULL) {
+    if (sanidx_rebuild(sanfile) < 0 ||
+        (hdr = san_base(sanfile, &maplen, &ents, &pool)) == NULL) return -1;
+  }
+
+  snprintf(logfile, sizeof(logfile), "%s.log", sanfile);
+  if ((fd = open(logfile, O_RDONLY)) >= 0) {
+    logmap = san_map(fd, &loglen);
+    close(fd);
+  }
+
+  /* ---------------------------------------------------------- *
+   * walk the key range of the exact key, then the wildcard key *
+   * ---------------------------------------------------------- */
+  for (pass = 0; pass < 2; pass++) {
+    const char *qkey = pass ? q.wild : q.exact;
+    size_t qlen = pass ? q.wildlen : q.exactlen;
+
+    if (qlen == 0) continue;
+    for (i = san_seek(ents, hdr->count, pool, qkey, qlen); i < hdr->count &&
+         (q.subtree ? san_match(&q, pool + ents[i].off, ents[i].len)
+         : san_keycmp(pool + ents[i].off, ents[i].len, qkey, qlen) == 0); i++) {
+      if (n == max) {
+        max = max ? max * 2 : 64;
+        if ((tmp = realloc(*serials, max * sizeof(CERT_SERIAL))) == NULL)
+          goto fail;
+        *serials = tmp;
+      }
+      (*serials)[n++] = ents[i].serial;
+    }
+  }
+
+  /* the log is short, every line is checked */
+  for (p = (const char *) logmap, end = p + loglen; p && p < end; ) {
+    if ((p = san_logline(p, end, &key, &keylen, &serial)) == NULL) break;
+    if (keylen == 0 || ! san_match(&q, key, keylen)) continue;
+    if (n == max) {
+      max = max ? max * 2 : 64;
+      if ((tmp = realloc(*serials, max * sizeof(CERT_SERIAL))) == NULL)
+        goto fail;
+      *serials = tmp;
+    }
+    (*serials)[n++] = serial;
+  }
+
+  /* sort by serial, one cert can match with several names */
+  if (n > 1) {
+    qsort(*serials, n, sizeof(CERT_SERIAL), serial_qcmp);
+    for (i = 1, max = 1; i < n; i++)
+      if (! serial_eq(&(*serials)[max-1], &(*serials)[i]))
+        (*serials)[max++] = (*serials)[i];
+    n = max;
+  }
+  goto end;
+
+fail:
+  free(*serials);
+  *serials = NULL;
+  n = -1;
+end:
+  if (logmap) munmap((void *) logmap, loglen);
+  munmap((void *) hdr, maplen);
+  return n;
+}
@@ -0,0 +1,528 @@
+/* ---------------------------------------------------------- *
+ * file:	certscan.c                                    *
+ * purpose:	multi-threaded scan engine for the cert store *
+ *              directory or archive. The PEM files or DER    *
+ *              entries are spread over a pool of worker      *
+ *              threads, each one parsing into its own        *
+ *              reusable X509 object. The results are merged  *
+ *              back in serial (hexsort) order. A sharded     *
+ *              store directory is also listed in parallel,   *
+ *              one shard per worker at a time.               *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * CERT_SCAN: shared state of one scan run. The workers take  *
+ * chunks of CERTSCAN_CHUNK files from 'next' under the lock. *
+ * Each file owns a fixed result slot, no merging lock needed *
+ * 'files' are paths relative to 'dir', i.e. "3A/01/013A.pem" *
+ * in a sharded store. For an archive scan, 'files' is NULL   *
+ * and filecount is the number of archive entries to parse.   *
+ * ---------------------------------------------------------- */
+typedef struct cert_scan_st {
+  const char      *dir;
+  char           **files;
+  const CERT_ARCHIVE *arc;    /* or the archive entries at offs  */
+  uint64_t        *offs;
+  int              filecount;
+  int              next;
+  pthread_mutex_t  lock;
+  size_t           ressize;
+  unsigned char   *results;   /* filecount * ressize bytes       */
+  unsigned char   *hits;      /* filecount flags, 1 = match      */
+  certscan_cb      match;
+  void            *arg;
+} CERT_SCAN;
+
+/* ---------------------------------------------------------- *
+ * certscan_select(): scandir filter for <serial>.pem files,  *
+ * and the <serial>.der files of DER_STORE                    *
+ * ---------------------------------------------------------- */
+static int certscan_select(const struct dirent *entry) {
+  if(entry->d_name[0]=='.') return 0;
+  if(strstr(entry->d_name, ".pem") != NULL) return 1;
+  if(strstr(entry->d_name, ".der") != NULL) return 1;
+  return 0;
+}
+
+/* ---------------------------------------------------------- *
+ * CERTSCAN_KEY: a store file with its name decoded once into *
+ * the fixed-width serial, so sorting is a memcmp() per pair. *
+ * ---------------------------------------------------------- */
+typedef struct certscan_key_st {
+  CERT_SERIAL     serial;
+  char           *file;
+} CERTSCAN_KEY;
+
+static int certscan_key_cmp(const void *a, const void *b) {
+  int cmp = serial_cmp(&((const CERTSCAN_KEY *) a)->serial,
+                       &((const CERTSCAN_KEY *) b)->serial);
+  if (cmp) return cmp;
+  return strcmp(((const CERTSCAN_KEY *) a)->file,
+                ((const CERTSCAN_KEY *) b)->file);
+}
+
+/* ---------------------------------------------------------- *
+ * certscan_base(): the file name part of a store file path   *
+ * ---------------------------------------------------------- */
+static const char *certscan_base(const char *path) {
+  const char *p = strrchr(path, '/');
+
+  return p ? p + 1 : path;
+}
+
+/* ---------------------------------------------------------- *
+ * hexsort(): sorts the store files in serial order. The hex  *
+ * file names are converted to CERT_SERIAL once per file, any *
+ * serial width up to 20 bytes sorts correctly. Names that do *
+ * not decode sort first. A cert stored both as .der and .pem *
+ * is kept once, the .der sorts first. The dropped names are  *
+ * freed. returns the new # of files, or -1 for errors.       *
+ * ---------------------------------------------------------- */
+static int hexsort(char **files, int filecount) {
+  CERTSCAN_KEY *keys;
+  const char *a, *b;
+  int i, n = 0;
+
+  if (filecount < 2) return filecount;
+  if ((keys = malloc(filecount * sizeof(CERTSCAN_KEY))) == NULL) return -1;
+
+  for (i = 0; i < filecount; i++) {
+    serial_from_hex(&keys[i].serial, certscan_base(files[i]));
+    keys[i].file = files[i];
+  }
+  qsort(keys, filecount, sizeof(CERTSCAN_KEY), certscan_key_cmp);
+  for (i = 0; i < filecount; i++) {
+    if (n > 0) {
+      a = certscan_base(files[n-1]);
+      b = certscan_base(keys[i].file);
+      if (strcspn(a, ".") == strcspn(b, ".") &&
+          strncmp(a, b, strcspn(a, ".")) == 0) {
+        free(keys[i].file);
+        continue;
+      }
+    }
+    files[n++] = keys[i].file;
+  }
+
+  free(keys);
+  return n;
+}
+
+/* ---------------------------------------------------------- *
+ * certscan_worker(): thread main, parses and matches certs.  *
+ * The X509 object is reused for every file of this thread,   *
+ * read_certfile() or d2i_X509() decode into it instead of    *
+ * allocating. Archive entries are decoded from the mapping.  *
+ * A DER file is passed on by its cert name "<serial>.pem".   *
+ * ---------------------------------------------------------- */
+static void *certscan_worker(void *ptr) {
+  CERT_SCAN *scan = (CERT_SCAN *) ptr;
+  char certfilestr[512] = "";
+  char hex[SERIAL_HEXLEN] = "";
+  const unsigned char *der;
+  CERT_SERIAL serial;
+  X509 *cert = NULL;
+  FILE *fp = NULL;
+  int start, end, i;
+  long len;
+
+  for (;;) {
+    pthread_mutex_lock(&scan->lock);
+    start = scan->next;
+    scan->next += CERTSCAN_CHUNK;
+    pthread_mutex_unlock(&scan->lock);
+
+    if (start >= scan->filecount) break;
+    end = start + CERTSCAN_CHUNK;
+    if (end > scan->filecount) end = scan->filecount;
+
+    for (i = start; i < end; i++) {
+      if (scan->arc) {
+        if ((der = certarchive_der(scan->arc, scan->offs[i], NULL, &len)) == NULL)
+          continue;
+        if (cert == NULL && (cert = X509_new()) == NULL) continue;
+        if (d2i_X509(&cert, &der, len) == NULL) continue;
+        /* the name the cert would have as a PEM file in the store */
+        serial_from_asn1(&serial, X509_get_serialNumber(cert));
+        serial_to_hex(&serial, hex, sizeof(hex));
+        snprintf(certfilestr, sizeof(certfilestr), "%s.pem", hex);
+
+        if (scan->match(cert, certfilestr, scan->offs[i],
+                       scan->results + (size_t) i * scan->ressize, scan->arg))
+          scan->hits[i] = 1;
+        continue;
+      }
+
+      snprintf(certfilestr, sizeof(certfilestr), "%s/%s",
+                              scan->dir, scan->files[i]);
+      if ((fp = fopen(certfilestr, "r")) == NULL) continue;
+
+      /* a failed read frees the object, get a new one next time */
+      if (cert == NULL && (cert = X509_new()) == NULL) {
+        fclose(fp);
+        continue;
+      }
+      if (read_certfile(fp, &cert) == NULL) {
+        fclose(fp);
+        continue;
+      }
+      fclose(fp);
+
+      snprintf(certfilestr, sizeof(certfilestr), "%.*s.pem",
+               (int) strcspn(certscan_base(scan->files[i]), "."),
+               certscan_base(scan->files[i]));
+      if (scan->match(cert, certfilestr, 0,
+                       scan->results + (size_t) i * scan->ressize, scan->arg))
+        scan->hits[i] = 1;
+    }
+  }
+
+  if (cert) X509_free(cert);
+  return NULL;
+}
+
+/* ---------------------------------------------------------- *
+ * certscan_threads(): number of workers for a store size.    *
+ * One per online CPU, capped by CERTSCAN_MAXTHREADS, and no  *
+ * more than there are file chunks to hand out.               *
+ * ---------------------------------------------------------- */
+static int certscan_threads(int filecount) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int chunks = (filecount + CERTSCAN_CHUNK - 1) / CERTSCAN_CHUNK;
+  int n;
+
+  n = (cpus > 0) ? (int) cpus : 1;
+  if (n > CERTSCAN_MAXTHREADS) n = CERTSCAN_MAXTHREADS;
+  if (n > chunks) n = chunks;
+  if (n < 1) n = 1;
+  return n;
+}
+
+/* ---------------------------------------------------------- *
+ * certscan_run(): runs the workers over the prepared items,  *
+ * and compacts the matched result slots. The caller sets up  *
+ * and frees the item list. returns the # of results, or -1.  *
+ * ---------------------------------------------------------- */
+static int certscan_run(CERT_SCAN *scan, void **results) {
+  pthread_t threads[CERTSCAN_MAXTHREADS];
+  int nthreads, started = 0;
+  int count = 0;
+  int i;
+
+  scan->results = malloc((size_t) scan->filecount * scan->ressize);
+  scan->hits    = calloc(scan->filecount, 1);
+  if (scan->results == NULL || scan->hits == NULL) {
+    count = -1;
+    goto end;
+  }
+  pthread_mutex_init(&scan->lock, NULL);
+
+  nthreads = certscan_threads(scan->filecount);
+  for (i = 1; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, certscan_worker, scan) != 0) break;
+    started++;
+  }
+  /* the calling thread is worker #0, it also takes over if none started */
+  certscan_worker(scan);
+  for (i = 1; i <= started; i++) pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&scan->lock);
+
+  /* ---------------------------------------------------------- *
+   * merge: compact the matched slots, they are in serial order *
+   * ---------------------------------------------------------- */
+  for (i = 0; i < scan->filecount; i++) {
+    if (! scan->hits[i]) continue;
+    if (count != i)
+      memcpy(scan->results + (size_t) count * scan->ressize,
+             scan->results + (size_t) i * scan->ressize, scan->ressize);
+    count++;
+  }
+
+  if (count > 0) {
+    *results = scan->results;
+    scan->results = NULL;
+  }
+
+end:
+  free(scan->results);
+  free(scan->hits);
+  return count;
+}
+
+/* ---------------------------------------------------------- *
+ * certscan_names(): the names of a scandir() result, with an *
+ * optional path prefix, appended to the list in *names. The  *
+ * dirents are freed. returns the new # of names, -1 for OOM. *
+ * With a count of -1 from a previous error, it only frees.   *
+ * ---------------------------------------------------------- */
+static int certscan_names(struct dirent **ents, int n, const char *prefix,
+                                                 char ***names, int count) {
+  char **tmp;
+  char path[512];
+  int i, ret = count;
+
+  if (count >= 0 && n > 0) {
+    if ((tmp = realloc(*names, (count + n) * sizeof(char *))) == NULL) ret = -1;
+    else *names = tmp;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (ret >= 0) {
+      snprintf(path, sizeof(path), "%s%s", prefix, ents[i]->d_name);
+      if (((*names)[ret] = strdup(path)) == NULL) ret = -1;
+      else ret++;
+    }
+    free(ents[i]);
+  }
+  free(ents);
+  return ret;
+}
+
+#ifdef SHARDED_STORE
+/* ---------------------------------------------------------- *
+ * certscan_shardsel(): scandir filter for the shard dirs, 2  *
+ * hex digits, i.e. "3A", see storecert_path() in certfile.c  *
+ * ---------------------------------------------------------- */
+static int certscan_shardsel(const struct dirent *entry) {
+  return (strlen(entry->d_name) == 2 && isxdigit((unsigned char) entry->d_name[0])
+                                 && isxdigit((unsigned char) entry->d_name[1]));
+}
+
+/* ---------------------------------------------------------- *
+ * CERT_SHARDS: shared state of a parallel sharded listing.   *
+ * The workers take one first level shard at a time, and list *
+ * its second level dirs into the shard's own name list.      *
+ * ---------------------------------------------------------- */
+typedef struct cert_shards_st {
+  const char      *dir;
+  struct dirent  **shards;
+  int              shardcount;
+  int              next;
+  pthread_mutex_t  lock;
+  char          ***names;     /* per shard list of paths         */
+  int             *counts;    /* per shard # of paths, -1 error  */
+} CERT_SHARDS;
+
+static void *certscan_shardworker(void *ptr) {
+  CERT_SHARDS *sh = (CERT_SHARDS *) ptr;
+  struct dirent **subs, **ents;
+  char path[512], prefix[16];
+  int i, j, nsubs, n;
+
+  for (;;) {
+    pthread_mutex_lock(&sh->lock);
+    i = sh->next++;
+    pthread_mutex_unlock(&sh->lock);
+    if (i >= sh->shardcount) break;
+
+    snprintf(path, sizeof(path), "%s/%s", sh->dir, sh->shards[i]->d_name);
+    if ((nsubs = scandir(path, &subs, certscan_shardsel, NULL)) < 0) continue;
+
+    for (j = 0; j < nsubs; j++) {
+      /* the shard dir names are 2 hex digits, see certscan_shardsel() */
+      snprintf(prefix, sizeof(prefix), "%.2s/%.2s/",
+                              sh->shards[i]->d_name, subs[j]->d_name);
+      snprintf(path, sizeof(path), "%s/%s", sh->dir, prefix);
+      if ((n = scandir(path, &ents, certscan_select, NULL)) >= 0)
+        sh->counts[i] = certscan_names(ents, n, prefix, &sh->names[i],
+                                                           sh->counts[i]);
+      free(subs[j]);
+    }
+    free(subs);
+  }
+  return NULL;
+}
+#endif
+
+/* ---------------------------------------------------------- *
+ * list_certstore(): lists the PEM files of the store 'dir', *
+ * as paths relative to 'dir', to be freed by the caller.     *
+ * With SHARDED_STORE, the files in the shard dirs are listed *
+ * too, the shards spread over the worker threads. Files left *
+ * at the top level, i.e. before a migration, are included.   *
+ * returns the # of paths in *files, or -1 for errors.        *
+ * ---------------------------------------------------------- */
+int list_certstore(const char *dir, char ***files) {
+  struct dirent **ents;
+  int count, n;
+
+  *files = NULL;
+  if ((n = scandir(dir, &ents, certscan_select, NULL)) < 0) return -1;
+  if ((count = certscan_names(ents, n, "", files, 0)) < 0) return -1;
+
+#ifdef SHARDED_STORE
+  {
+    pthread_t threads[CERTSCAN_MAXTHREADS];
+    CERT_SHARDS sh;
+    int nthreads, started = 0, i, j;
+
+    memset(&sh, '\0', sizeof(sh));
+    sh.dir = dir;
+    if ((sh.shardcount = scandir(dir, &sh.shards, certscan_shardsel, NULL)) < 0)
+      return -1;
+    sh.names  = calloc(sh.shardcount + 1, sizeof(char **));
+    sh.counts = calloc(sh.shardcount + 1, sizeof(int));
+    if (sh.names && sh.counts) {
+      pthread_mutex_init(&sh.lock, NULL);
+      nthreads = certscan_threads(sh.shardcount * CERTSCAN_CHUNK);
+      for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, certscan_shardworker, &sh) != 0)
+          break;
+        started++;
+      }
+      certscan_shardworker(&sh);
+      for (i = 1; i <= started; i++) pthread_join(threads[i], NULL);
+      pthread_mutex_destroy(&sh.lock);
+    }
+    else count = -1;
+
+    /* concatenate the shard lists, hexsort orders them after */
+    for (i = 0; i < sh.shardcount; i++) {
+      if (sh.names && sh.counts) {
+        if (sh.counts[i] < 0) count = -1;
+        for (j = 0; j < sh.counts[i]; j++) {
+          char **tmp;
+          if (count >= 0 && (tmp = realloc(*files, (count + 1) * sizeof(char *)))) {
+            *files = tmp;
+            (*files)[count++] = sh.names[i][j];
+          }
+          else free(sh.names[i][j]);
+        }
+        free(sh.names[i]);
+      }
+      free(sh.shards[i]);
+    }
+    free(sh.shards);
+    free(sh.names);
+    free(sh.counts);
+  }
+#endif
+  return count;
+}
+
+/* ---------------------------------------------------------- *
+ * scan_certstore(): parses all PEM files in 'dir' on a pool  *
+ * of worker threads. match() is called once per certificate *
+ * with a 'ressize' result slot to fill, it returns 1 to keep *
+ * the result. match() runs concurrently, it must not touch   *
+ * shared state without its own locking. The kept results are *
+ * returned in *results in hexsort order of the files, to be  *
+ * freed with free(). returns the # of results, -1 for errors *
+ * ---------------------------------------------------------- */
+int scan_certstore(const char *dir, certscan_cb match, void *arg,
+                                         size_t ressize, void **results) {
+  CERT_SCAN scan;
+  int count = -1;
+  int i, n;
+
+  *results = NULL;
+  memset(&scan, '\0', sizeof(scan));
+  scan.dir     = dir;
+  scan.ressize = ressize;
+  scan.match   = match;
+  scan.arg     = arg;
+
+  if ((scan.filecount = list_certstore(dir, &scan.files)) < 0) {
+    free(scan.files);
+    return -1;
+  }
+
+  if ((n = hexsort(scan.files, scan.filecount)) >= 0) {
+    scan.filecount = n;
+    count = (n > 0) ? certscan_run(&scan, results) : 0;
+  }
+
+  for (i = 0; i < scan.filecount; i++) free(scan.files[i]);
+  free(scan.files);
+  return count;
+}
+
+/* ---------------------------------------------------------- *
+ * CERTSCAN_ENT: an archive entry, for sorting them by serial *
+ * ---------------------------------------------------------- */
+typedef struct certscan_ent_st {
+  CERT_SERIAL     serial;
+  uint64_t        off;
+} CERTSCAN_ENT;
+
+static int certscan_ent_cmp(const void *a, const void *b) {
+  const CERTSCAN_ENT *x = (const CERTSCAN_ENT *) a;
+  const CERTSCAN_ENT *y = (const CERTSCAN_ENT *) b;
+  int cmp = serial_cmp(&x->serial, &y->serial);
+
+  if (cmp) return cmp;
+  return (x->off > y->off) - (x->off < y->off);
+}
+
+/* ---------------------------------------------------------- *
+ * scan_certarchive(): the same as scan_certstore(), over the *
+ * entries of the archive file. A serial that was appended    *
+ * more than once is only parsed in its newest entry, the     *
+ * results come in serial order. match() gets the entry off.  *
+ * ---------------------------------------------------------- */
+int scan_certarchive(const char *arcfile, certscan_cb match, void *arg,
+                                         size_t ressize, void **results) {
+  CERT_ARCHIVE arc;
+  CERT_SCAN scan;
+  CERTSCAN_ENT *ents = NULL, *tmp;
+  uint64_t off;
+  int n = 0, max = 0, count = -1, i;
+
+  *results = NULL;
+  if (! load_certarchive(&arc, arcfile)) return -1;
+
+  /* the walk only touches the entry headers */
+  for (off = certarchive_next(&arc, 0); off; off = certarchive_next(&arc, off)) {
+    if (n == max) {
+      max = max ? max * 2 : 1024;
+      if ((tmp = realloc(ents, max * sizeof(CERTSCAN_ENT))) == NULL) goto end;
+      ents = tmp;
+    }
+    ents[n].serial = *(const CERT_SERIAL *) (arc.map + off);
+    ents[n].off    = off;
+    n++;
+  }
+  if (n > 1) qsort(ents, n, sizeof(CERTSCAN_ENT), certscan_ent_cmp);
+
+  memset(&scan, '\0', sizeof(scan));
+  scan.arc     = &arc;
+  scan.ressize = ressize;
+  scan.match   = match;
+  scan.arg     = arg;
+  if ((scan.offs = malloc((n ? n : 1) * sizeof(uint64_t))) == NULL) goto end;
+
+  /* keep the last, newest entry of each serial */
+  for (i = 0; i < n; i++) {
+    if (i + 1 < n && serial_eq(&ents[i].serial, &ents[i+1].serial)) continue;
+    scan.offs[scan.filecount++] = ents[i].off;
+  }
+  count = (scan.filecount > 0) ? certscan_run(&scan, results) : 0;
+  free(scan.offs);
+
+end:
+  free(ents);
+  free_certarchive(&arc);
+  return count;
+}
+
+/* ---------------------------------------------------------- *
+ * scan_issued(): scans the issued certs of the cert store in *
+ * the configured layout, the PEM directory or the archive.   *
+ * ---------------------------------------------------------- */
+int scan_issued(certscan_cb match, void *arg, size_t ressize, void **results) {
+#ifdef ARCHIVE_STORE
+  return scan_certarchive(CERTARCHIVE, match, arg, ressize, results);
+#else
+  return scan_certstore(CACERTSTORE, match, arg, ressize, results);
+#endif
+}
@@ -1,22 +1,18 @@
 /* ---------------------------------------------------------- *
  * file:         certsearch.c                                 *
  * purpose:      display a selection of local certificates    *
-                 certsearch.cgi?search=[dn|exp|ena|rev|ser]   * 
+                 certsearch.cgi?search=[dn|san|exp|ena|rev|ser|nrv]*
+ *               search can be given several times, the certs *
+ *               must match all of the selected criteria.     *
  * ---------------------------------------------------------- */
-/* defines needed for strptime() function */
-#define _XOPEN_SOURCE
-#define __USE_XOPEN
-#define __USE_GNU
-#define _GNU_SOURCE
-
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <ctype.h>
 #include <time.h>
 #include <sys/types.h>
-#include <dirent.h>
 #include <errno.h>
 #include <cgic.h>
 #include <openssl/x509.h>
@@ -24,19 +20,13 @@
 #include <openssl/pem.h>
 #include "webcert.h"
 
-         char      search[4]         = "";
+         int       preds             = 0;   /* PRED_* bits of the query     */
          char      field[25]         = "";
          char      dnvalue[21]       = "";
+         char      sanvalue[256]     = "";
          char      membio_buf[128]   = "";
-         BIO       *membio           = NULL;
-         ASN1_TIME *start_date       = NULL;
-         ASN1_TIME *expiration_date  = NULL;
-         ASN1_TIME *revocation_date  = NULL;
   struct tm        start_tm;
-  struct tm        end_tm;
-  struct tm        enable_tm;
   struct tm        expiration_tm;
-  struct tm        revoked_tm;
          char      exp_startdate[11] = "";
          char      exp_starttime[6]  = "";
          char      exp_startstr[17]  = "";
@@ -55,231 +45,303 @@
          char      rev_enddate[11]   = "";
          char      rev_endtime[6]    = "";
          char      rev_endstr[17]    = "";
-         char      startserstr[13]   = "1";  /* default seto to 1 */
-         char      endserstr[13]     = "10"; /* default set to 10 */
-         BIGNUM    *startserialbn    = NULL;
-         BIGNUM    *endserialbn      = NULL;
-         BIGNUM    *certserialbn     = NULL;
-         ASN1_INTEGER *certserial    = NULL;
-         ASN1_INTEGER *startserial   = NULL;
-         ASN1_INTEGER *endserial     = NULL;
-         X509      *cert             = NULL;
-         X509_NAME *certsubject      = NULL;
-	 X509_NAME_ENTRY *e          = NULL;
-         char      certfilestr[277]  = "";
-         FILE      *certfile         = NULL;
+         char      startserstr[SERIAL_DECLEN] = "1";  /* default set to 1 */
+         char      endserstr[SERIAL_DECLEN]   = "10"; /* default set to 10 */
+         int64_t   exp_from          = 0;   /* the date ranges as epochs    */
+         int64_t   exp_to            = 0;
+         int64_t   ena_from          = 0;
+         int64_t   ena_to            = 0;
+         int64_t   rev_from          = 0;
+         int64_t   rev_to            = 0;
+         CERT_SERIAL startserial;
+         CERT_SERIAL endserial;
+         char      fieldsn[25]       = "";
+         int       residual          = 0;   /* preds left for rec_select()  */
+         CERT_COLS cols;
+  const  CERT_REC  *candrecs         = NULL;  /* base of candbits positions   */
+         unsigned char *candbits     = NULL;  /* index search candidate bits  */
+
+/* ---------------------------------------------------------- *
+ * the search predicates, as given in the "search" argument   *
+ * ---------------------------------------------------------- */
+#define PRED_DN   0x01
+#define PRED_SAN  0x02
+#define PRED_EXP  0x04
+#define PRED_ENA  0x08
+#define PRED_REV  0x10
+#define PRED_SER  0x20
+#define PRED_NRV  0x40
+
+static const struct { const char *name; int bit; } predtab[] = {
+  { "dn", PRED_DN }, { "san", PRED_SAN }, { "exp", PRED_EXP },
+  { "ena", PRED_ENA }, { "rev", PRED_REV }, { "ser", PRED_SER },
+  { "nrv", PRED_NRV }
+};
 
 void resubmit();
-int check_index(X509 *x509, CA_DB *db);
-int asn1_utctime_to_tm(struct tm *tm, const ASN1_UTCTIME *d);
 
-int hexsort(const struct dirent **test1, const struct dirent **test2) {
-  char *endptr;
-  return (strtol((*test1)->d_name, &endptr, 16)
-        - strtol((*test2)->d_name, &endptr, 16));
+/* ---------------------------------------------------------- *
+ * pageform(): writes a page navigation button. The page move *
+ * is keyed on the serial of the cert 'rec', if one is given. *
+ * ---------------------------------------------------------- */
+void pageform(const char *move, const CERT_REC *rec, const CERT_PAGE *page,
+                              const char *sorting, const char *label) {
+  char cursorstr[SERIAL_HEXLEN] = "";
+
+  fprintf(cgiOut, "<form action=\"certsearch.cgi\" method=\"post\">");
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
+  fprintf(cgiOut, "value=\"%llu\" />\n", (unsigned long long) page->total);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"sort\" ");
+  fprintf(cgiOut, "value=\"%s\" />\n", sorting);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagesize\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page->pagesize);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"move\" ");
+  fprintf(cgiOut, "value=\"%s\" />\n", move);
+  if(rec) {
+    serial_to_hex(&rec->serial, cursorstr, sizeof(cursorstr));
+    fprintf(cgiOut, "<input type=\"hidden\" name=\"cursor\" ");
+    fprintf(cgiOut, "value=\"%s\" />\n", cursorstr);
+  }
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"page\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page->pagenumber);
+  resubmit();
+  fprintf(cgiOut, "<input type=\"submit\" value=\"%s\" />", label);
+  fprintf(cgiOut, "</form>");
+}
+
+/* ---------------------------------------------------------- *
+ * subject_match(): checks if the RDN "fieldsn" of the stored *
+ * subject "C=JP, O=Org\, Inc, CN=host" contains the dnvalue. *
+ * RDNs are separated by an unescaped ", " or " + ".          *
+ * ---------------------------------------------------------- */
+int subject_match(const char *subject) {
+  char buf[sizeof(((CERT_REC *) 0)->subject)] = "", *value = buf;
+  const char *p = subject;
+  size_t fnlen = strlen(fieldsn);
+  int i, ret = 0;
+
+  /* a full subject from certrec_subject() can be longer */
+  if (strlen(subject) >= sizeof(buf) &&
+      (value = malloc(strlen(subject) + 1)) == NULL) return 0;
+
+  while (*p && ! ret) {
+    int match = (strncmp(p, fieldsn, fnlen) == 0 && p[fnlen] == '=');
+
+    /* skip to the value and copy it, resolving the escapes */
+    while (*p && *p != '=') p++;
+    if (*p == '=') p++;
+    for (i = 0; *p; p++) {
+      if (*p == '\\' && p[1]) { value[i++] = *(++p); continue; }
+      if ((p[0] == ',' && p[1] == ' ') ||
+          (p[0] == ' ' && p[1] == '+' && p[2] == ' ')) break;
+      value[i++] = *p;
+    }
+    value[i] = '\0';
+
+    if (match && strstr(value, dnvalue) != NULL) ret = 1;
+
+    /* skip the separator */
+    while (*p == ',' || *p == ' ' || *p == '+') p++;
+  }
+  if (value != buf) free(value);
+  return ret;
 }
 
-int file_select(const struct dirent *entry) {
-         cert                        = X509_new();
-         certsubject                 = X509_NAME_new();
-	 int i                       = 0;
-	 char buf[80]                = "";
+/* ---------------------------------------------------------- *
+ * rec_dnmatch(): subject_match() of a record. The RDNs after *
+ * the end of a cut off subject are only found in the cert.   *
+ * ---------------------------------------------------------- */
+int rec_dnmatch(const CERT_REC *rec) {
+  char *subject;
+  int ret;
+
+  if (! certrec_truncated(rec) || (subject = certrec_subject(rec)) == NULL)
+    return subject_match(rec->subject);
+  ret = subject_match(subject);
+  free(subject);
+  return ret;
+}
 
-  /* check for "." and ".." directory entries */
-  if(entry->d_name[0]=='.') return 0;
+/* ---------------------------------------------------------- *
+ * rec_cand(): checks the candidate bit of a record, set from *
+ * the index and column results before the records filter.    *
+ * ---------------------------------------------------------- */
+int rec_cand(const CERT_REC *rec) {
+  uint64_t pos = rec - candrecs;
+
+  return (candbits && (candbits[pos >> 3] & (1 << (pos & 7))));
+}
+
+/* ---------------------------------------------------------- *
+ * rec_select(): the search filter, applied to each candidate *
+ * record left by the planner. All selected predicates must   *
+ * match, they are checked cheapest first: the candidate bits,*
+ * number compares, the DN string. The predicates the planner *
+ * has fully resolved are no longer in 'residual'.            *
+ * Returns 1 for a match, 0 otherwise.                        *
+ * ---------------------------------------------------------- */
+int rec_select(const CERT_REC *rec) {
 
-  /* Check for <id>.pem file name extensions */
-  if(strstr(entry->d_name, ".pem") == NULL) return 0;
+  /* the SAN index has the exact certs, the trigram index a superset */
+  if (candbits && ! rec_cand(rec)) return 0;
 
-  /* generate the full file name and path to open it */
-  snprintf(certfilestr, sizeof(certfilestr), "%s/%s",
-                           CACERTSTORE, entry->d_name);
+  /* check if serial is between start and end serial */
+  if ((residual & PRED_SER) &&
+      (serial_cmp(&startserial, &rec->serial) > 0 ||
+       serial_cmp(&endserial, &rec->serial) < 0)) return 0;
 
-  /* if we cannot open the file, we move on  to the next */
-  if ((certfile = fopen(certfilestr, "r")) == NULL) return 0;
+  /* check the cert has not been revoked */
+  if ((residual & PRED_NRV) && rec->state == DB_TYPE_REV) return 0;
 
-  /* now we load the certificate data */
-  if (! (cert = PEM_read_X509(certfile,NULL,NULL,NULL))) return 0;
+  /* check expiration date is between start and end date */
+  if ((residual & PRED_EXP) &&
+      (rec->notafter < exp_from || rec->notafter > exp_to)) return 0;
 
-  /* if search type is dn, check if dn field contains the search value */
-  if (strcmp(search, "dn") == 0) {
+  /* check enable date is between start and end date */
+  if ((residual & PRED_ENA) &&
+      (rec->notbefore < ena_from || rec->notbefore > ena_to)) return 0;
 
-    /* get the subject information to compare the entries in it */
-    if (! (certsubject = X509_get_subject_name(cert))) return 0;
+  /* check if cert was revoked between start and end date */
+  if ((residual & PRED_REV) &&
+      (rec->revoked == 0 || rec->revoked < rev_from || rec->revoked > rev_to))
+    return 0;
 
-    /* now we cycle through all entries of the subject */
-    for (i = 0; i < X509_NAME_entry_count(certsubject); i++) {
-      e = X509_NAME_get_entry(certsubject, i);
-      OBJ_obj2txt(buf, 80, X509_NAME_ENTRY_get_object(e), 0);
+  /* check if dn field contains the search value */
+  if ((residual & PRED_DN) && ! rec_dnmatch(rec)) return 0;
 
-      /* when the search file matches the cert subject field  */
-      /* check if the field value is equal the search value   */
-      if(strstr(buf, field) != NULL)
-        if(strstr( (char *) X509_NAME_ENTRY_get_data(e), dnvalue) != NULL) return 1;
-    }
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * searchkey(): the normalized query, the search cache key.   *
+ * The predicates in a fixed order, with their parsed values: *
+ * epochs for the dates, hex serials, and the DN short name.  *
+ * Other spellings of the same search get the same key.       *
+ * ---------------------------------------------------------- */
+void searchkey(char *key, size_t keylen) {
+  char starthex[SERIAL_HEXLEN] = "", endhex[SERIAL_HEXLEN] = "";
+  size_t n = 0;
+  int i;
+
+  key[0] = '\0';
+  if (preds & PRED_DN)
+    n += snprintf(key + n, keylen - n, "dn:%s=%s;", fieldsn, dnvalue);
+  if ((preds & PRED_SAN) && n < keylen) {
+    /* host names compare case insensitive in the SAN index */
+    n += snprintf(key + n, keylen - n, "san:");
+    for (i = 0; sanvalue[i] && n < keylen - 1; i++)
+      key[n++] = tolower((unsigned char) sanvalue[i]);
+    key[n] = '\0';
+    n += snprintf(key + n, keylen - n, ";");
   }
+  if ((preds & PRED_EXP) && n < keylen)
+    n += snprintf(key + n, keylen - n, "exp:%lld-%lld;",
+                          (long long) exp_from, (long long) exp_to);
+  if ((preds & PRED_ENA) && n < keylen)
+    n += snprintf(key + n, keylen - n, "ena:%lld-%lld;",
+                          (long long) ena_from, (long long) ena_to);
+  if ((preds & PRED_REV) && n < keylen)
+    n += snprintf(key + n, keylen - n, "rev:%lld-%lld;",
+           (long long) (rev_from > 0 ? rev_from : 1), (long long) rev_to);
+  if ((preds & PRED_SER) && n < keylen) {
+    serial_to_hex(&startserial, starthex, sizeof(starthex));
+    serial_to_hex(&endserial, endhex, sizeof(endhex));
+    n += snprintf(key + n, keylen - n, "ser:%s-%s;", starthex, endhex);
+  }
+  if ((preds & PRED_NRV) && n < keylen)
+    n += snprintf(key + n, keylen - n, "nrv;");
+}
 
-  /* if search type is exp, check expiration date is between start and end date */
-  if (strcmp(search, "exp") == 0) {
-
-    /* get the certificates expiration date */
-    expiration_date = X509_get_notAfter(cert);
-
-    /* copy the certificate expiration date into a string */
-    membio = BIO_new(BIO_s_mem());
-    ASN1_TIME_print(membio, expiration_date);
-    BIO_gets(membio, membio_buf, sizeof(membio_buf));
-    BIO_free(membio);
-    //int_error(membio_buf); /* debug correct time parsing */
-
-    /* parse the expiration date string into a time struct */
-    memset (&expiration_tm, '\0', sizeof(expiration_tm));
-    strptime(membio_buf, "%h %d %T %Y %z", &expiration_tm);
-    // int_error(asctime(&expiration_tm)); /* debug correct time parsing */
-
-    /* parse the CGI start date string into the start_tm struct */
-    memset (&start_tm, '\0', sizeof(start_tm));
-    strptime(exp_startstr, "%d.%m.%Y %R", &start_tm);
-    // int_error(asctime(&start_tm)); /* debug correct time parsing */
-
-    /* parse the CGI end date string into the end_tm struct */
-    memset (&end_tm, '\0', sizeof(end_tm));
-    strptime(exp_endstr, "%d.%m.%Y %R", &end_tm);
-    // int_error(asctime(&end_tm)); /* debug correct time parsing */
-
-    /* check if expiration date >= start date and <= end date */
-    if ( difftime(mktime(&start_tm), mktime(&expiration_tm)) <=0 &&
-         difftime(mktime(&end_tm), mktime(&expiration_tm)) >= 0 ) return 1;
+/* ---------------------------------------------------------- *
+ * plan_search(): runs the query planner over the index, see  *
+ * the notes in cgiMain(). Sets candbits and residual for     *
+ * rec_select(), and returns the records left to filter.      *
+ * ---------------------------------------------------------- */
+void plan_search(const CERT_INDEX *certidx, const CERT_REC **planout,
+                                                  uint64_t *countout) {
+  const CERT_REC *planrecs;
+  uint64_t plancount, estimate;
+
+  planrecs  = certidx->recs;
+  plancount = certidx->count;
+  candrecs  = certidx->recs;
+  residual  = preds;
+  memset(&cols, '\0', sizeof(cols));
+
+  if (preds & PRED_SER) {
+    uint64_t lo = seek_certrecs(certidx->recs, certidx->count, &startserial);
+    uint64_t hi = seek_certrecs(certidx->recs, certidx->count, &endserial);
+    if (hi < certidx->count && serial_eq(&certidx->recs[hi].serial, &endserial)) hi++;
+    if (hi < lo) hi = lo;
+    planrecs  = certidx->recs + lo;
+    plancount = hi - lo;
+    residual &= ~PRED_SER;
   }
-  /* if search type is ena, check enable date is between start and end date */
-  if (strcmp(search, "ena") == 0) {
-
-    /* get the certificates enable date */
-    start_date = X509_get_notBefore(cert);
-
-    /* copy the certificate expiration date into a string */
-    membio = BIO_new(BIO_s_mem());
-    ASN1_TIME_print(membio, start_date);
-    BIO_gets(membio, membio_buf, sizeof(membio_buf));
-    BIO_free(membio);
-
-    /* parse the expiration date string into a time struct */
-    memset (&enable_tm, '\0', sizeof(enable_tm));
-    strptime(membio_buf, "%h %d %T %Y %z", &enable_tm);
-    // int_error(asctime(&enable_tm)); /* debug correct time parsing */
-
-    /* parse the CGI start date string into the start_tm struct */
-    memset (&start_tm, '\0', sizeof(start_tm));
-    strptime(ena_startstr, "%d.%m.%Y %R", &start_tm);
-    // int_error(asctime(&start_tm)); /* debug correct time parsing */
-
-    /* parse the CGI end date string into the end_tm struct */
-    memset (&end_tm, '\0', sizeof(end_tm));
-    strptime(ena_endstr, "%d.%m.%Y %R", &end_tm);
-    // int_error(asctime(&end_tm)); /* debug correct time parsing */
-
-    /* check if expiration date >= start date and <= end date */
-    if ( difftime(mktime(&start_tm), mktime(&enable_tm)) <=0 &&
-         difftime(mktime(&end_tm), mktime(&enable_tm)) >= 0 ) return 1;
+  estimate = plancount;
+
+  if ((preds & PRED_SAN) && estimate > 0) {
+    CERT_SERIAL *serials = NULL;
+    int j, n;
+
+    if ((n = sanidx_query(SANINDEX, sanvalue, &serials)) < 0)
+      int_error("Error cannot search the SAN index with the given name.");
+    if ((candbits = calloc(certidx->count / 8 + 1, 1)) == NULL)
+      int_error("Error cannot allocate memory for the search results.");
+    for (j = 0; j < n; j++) {
+      uint64_t pos = seek_certrecs(certidx->recs, certidx->count, &serials[j]);
+      if (pos < certidx->count && serial_eq(&certidx->recs[pos].serial, &serials[j]))
+        candbits[pos >> 3] |= 1 << (pos & 7);
+    }
+    free(serials);
+    if (n < estimate) estimate = n;
   }
-  /* if search type is rev, check if cert was revoked between start and end date */
-  if (strcmp(search, "rev") == 0) {
-    /* ---------------------------------------------------------- *
-     * Parse the CGI start date string into the start_tm struct   *
-     * ---------------------------------------------------------- */
-    memset (&start_tm, '\0', sizeof(start_tm));
-    strptime(rev_startstr, "%d.%m.%Y %R", &start_tm);
-    /* ---------------------------------------------------------- *
-     * Parse the CGI end date string into the end_tm struct       *
-     * ---------------------------------------------------------- */
-    memset (&end_tm, '\0', sizeof(end_tm));
-    strptime(rev_endstr, "%d.%m.%Y %R", &end_tm);
-    /* ---------------------------------------------------------- *
-     * Get all revoked certificates from revocation DB index.txt  *
-     * ---------------------------------------------------------- */
-    CA_DB *db = NULL;
-    DB_ATTR db_attr;
-
-    if((db = load_index(INDEXFILE, &db_attr)) == NULL)
-      int_error("Error cannot load CRL certificate database file");
-
-    /* ---------------------------------------------------------- *
-     * Get the certs serial number, convert it into a hex string  *
-     * -----------------------------------------------------------*/
-    BIGNUM *bn = NULL;
-    bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(cert), NULL);
-    if (!bn)
-     int_error("Cannot extract serial number from cert into BIGNUM");
-    char *serialstr = BN_bn2hex(bn);
-
-    /* ---------------------------------------------------------- *
-     * Check if the cert is revoked, looking up its serial in DB  *
-     * -----------------------------------------------------------*/
-    char *const *pp;
-    int i;
-    for (i = 0; i < sk_OPENSSL_PSTRING_num(db->db->data); i++) {
-      pp = sk_OPENSSL_PSTRING_value(db->db->data, i);
-
-      if ( (strcmp(pp[DB_serial], serialstr) == 0)
-           && (pp[DB_type][0] == DB_TYPE_REV) )  {
-
-        /* ---------------------------------------------------------- *
-         * Revoked, get the certs revocation date from the database   *
-         * -----------------------------------------------------------*/
-        char *p = strchr(pp[DB_rev_date], ',');
-        if (p) *p = '\0'; // if revocation reason is given, terminate before 
-        char *revokedstr = BUF_strdup(pp[DB_rev_date]);
-        revocation_date = ASN1_UTCTIME_new();
-        ASN1_UTCTIME_set_string(revocation_date, revokedstr);
-        //int_error(revokedstr); /* debug correct time parsing */
-
-        /* copy the certificate revocation date into a string */
-        membio = BIO_new(BIO_s_mem());
-        ASN1_TIME_print(membio, revocation_date);
-        BIO_gets(membio, membio_buf, sizeof(membio_buf));
-        BIO_free(membio);
-        //int_error(membio_buf);
-
-        /* parse the revocation date string into a time struct */
-        memset (&revoked_tm, '\0', sizeof(revoked_tm));
-        strptime(membio_buf, "%h %d %T %Y %z", &revoked_tm);
-        //int_error(asctime(&revoked_tm)); /* debug correct time parsing */
-
-        /* ---------------------------------------------------------- *
-         * Check if revocation date >= start date and <= end date     *
-         * -----------------------------------------------------------*/
-        if ( difftime(mktime(&start_tm), mktime(&revoked_tm)) <=0 &&
-             difftime(mktime(&end_tm), mktime(&revoked_tm)) >= 0 ) return 1;
-      }
+
+  /* date ranges and states: the vector kernels over the column file */
+  if ((residual & (PRED_EXP|PRED_ENA|PRED_REV|PRED_NRV)) && estimate > 0) {
+    uint64_t off = (planrecs - certidx->recs) & ~7ULL;  /* whole bitmap bytes */
+    uint64_t n   = planrecs + plancount - certidx->recs - off;
+    int and      = (candbits != NULL);
+
+    if (! load_certcols(&cols, COLINDEX, certidx))
+      int_error("Error cannot load the cert store date columns.");
+    if (! candbits && (candbits = calloc(certidx->count / 8 + 1, 1)) == NULL)
+      int_error("Error cannot allocate memory for the search results.");
+
+    if (residual & PRED_EXP) {
+      certcols_range(cols.notafter + off, n, exp_from, exp_to, candbits + off/8, and);
+      and = 1;
+    }
+    if (residual & PRED_ENA) {
+      certcols_range(cols.notbefore + off, n, ena_from, ena_to, candbits + off/8, and);
+      and = 1;
     }
-    BN_free(bn);
+    if (residual & PRED_REV) {
+      /* a valid cert has revoked 0, that is never in the range */
+      certcols_range(cols.revoked + off, n, rev_from > 0 ? rev_from : 1,
+                                               rev_to, candbits + off/8, and);
+      and = 1;
+    }
+    if (residual & PRED_NRV)
+      certcols_state(cols.state + off, n, DB_TYPE_REV, 0, candbits + off/8, and);
+
+    residual &= ~(PRED_EXP|PRED_ENA|PRED_REV|PRED_NRV);
+    estimate = certcols_count(candbits + off/8, n);
   }
-  /* if search type is ser, check if serial is between start and end serial */
-  if (strcmp(search, "ser") == 0) {
-
-    /* convert the serial strings to BIGNUM */
-    BN_dec2bn(&startserialbn, startserstr);
-    BN_dec2bn(&endserialbn, endserstr);
-
-    /* get the certificates serial number and convert it to BIGNUM */
-    if ((certserial = X509_get_serialNumber(cert)) == NULL)
-       int_error("Error: Getting certificate serial number in ASN1 format.");
-    if ((certserialbn = ASN1_INTEGER_to_BN(certserial, NULL)) == NULL)
-       int_error("Error: converting certserial number from ASN1 to BIGNUM.");
-
-    /* debugging output to see values of BIGNUM */
-    //membio = BIO_new(BIO_s_mem());
-    //BN_print(membio, endserialbn);
-    //BIO_gets(membio, membio_buf, sizeof(membio_buf));
-    //BIO_free(membio);
-    //int_error(membio_buf);
-
-    /* check if certserial >= startserial and <= endserial */
-    if ( BN_cmp(startserialbn, certserialbn) <= 0 &&
-         BN_cmp(endserialbn, certserialbn) >= 0 ) return 1;
+
+  if ((preds & PRED_DN) && estimate > SEARCH_PLANSCAN) {
+    unsigned char *dnbits;
+    uint64_t j;
+
+    dnbits = dngram_query(DNINDEX, certidx->recs, certidx->count, fieldsn, dnvalue);
+    if (dnbits && candbits) {
+      for (j = 0; j < certidx->count / 8 + 1; j++) candbits[j] &= dnbits[j];
+      free(dnbits);
+    }
+    else if (dnbits) candbits = dnbits;
   }
 
-  return 0;
+  *planout  = planrecs;
+  *countout = plancount;
 }
 
 int cgiMain() {
@@ -288,25 +350,37 @@ int cgiMain() {
   static char   subtitle[256]        = "";
          char      sorting[16]       = "desc";
          time_t    now               = time(NULL);
-         time_t    start             = time(NULL);
          time_t    expiration        = time(NULL);
-         double    available_secs    = 0;
          double    remaining_secs    = 0;
-  struct dirent    **certstore_files = NULL;
+         CERT_INDEX certidx;
+         CERT_REC   *scan_recs       = NULL;
+         int        scancount        = 0;
+  const  CERT_REC  *rec              = NULL;
+         char      certnamestr[81]   = "";
          int       pagenumber        = 1;
          int       certcounter       = 0;
          int       tempcounter       = 0;
          int       pagecounter       = 0;
          int       dispcounter       = 0;
-         int       dispmaxlines      = 0;
          int       certvalidity      = 0;
-         div_t     disp_calc;
+         CERT_PAGE page;
+         CERT_SERIAL cursor;
+         char      move[8]           = "";
+         char      cursorstr[SERIAL_HEXLEN] = "";
          div_t     oddline_calc;
-         double    percent           = 0;
-
-         cert                        = X509_new();
-         certsubject                 = X509_NAME_new();
+         int       percent           = 0;
 	 char      **form_data       = NULL;  /* string array for query data */
+         char      **searches        = NULL;  /* the selected search types   */
+  const  char      *search           = NULL;
+         char      predstr[256]      = "";
+         char      escbuf[6*256]     = "";  /* html_escape() of a value    */
+         int       k                 = 0;
+  const  CERT_REC  *planrecs         = NULL;  /* the records left to filter  */
+         uint64_t  plancount         = 0;
+         char      querykey[1024]    = "";    /* the normalized search       */
+         SEARCH_CACHE cache;                  /* the cached or new matches   */
+         uint32_t  *matches          = NULL;
+         uint64_t  i                 = 0;
 
   /* get the current time */
   now = time(NULL);
@@ -329,7 +403,7 @@ int cgiMain() {
     fprintf(cgiOut, "<tr><th colspan=\"5\">Search by Name</th></tr>\n");
     fprintf(cgiOut, "<tr>\n");
     fprintf(cgiOut, "<th class=\"cnt\" rowspan=\"2\">\n");
-    fprintf(cgiOut, "<input type=\"radio\" value=\"dn\" name=\"search\" />");
+    fprintf(cgiOut, "<input type=\"checkbox\" value=\"dn\" name=\"search\" />");
     fprintf(cgiOut, "</th>\n");
     fprintf(cgiOut, "<td class=\"type\">\n");
     fprintf(cgiOut, "Distinguished Name Field:");
@@ -361,11 +435,32 @@ int cgiMain() {
     fprintf(cgiOut, "</td>\n");
     fprintf(cgiOut, "</tr>\n");
 
+    /* Search for SAN host name or IP address */
+    fprintf(cgiOut, "<tr><th colspan=\"5\">Search by Host Name</th></tr>\n");
+    fprintf(cgiOut, "<tr>\n");
+    fprintf(cgiOut, "<th class=\"cnt\" rowspan=\"2\">\n");
+    fprintf(cgiOut, "<input type=\"checkbox\" value=\"san\" name=\"search\" />");
+    fprintf(cgiOut, "</th>\n");
+    fprintf(cgiOut, "<td class=\"type\">\n");
+    fprintf(cgiOut, "Subject Alternative Name:");
+    fprintf(cgiOut, "</td>\n");
+    fprintf(cgiOut, "<td class=\"center\" colspan=\"3\">\n");
+    fprintf(cgiOut, "<input type=\"text\" size=\"40\" name=\"sanvalue\" value=\"www.changeme.com\" />");
+    fprintf(cgiOut, "</td>");
+    fprintf(cgiOut, "</tr>\n");
+    fprintf(cgiOut, "<tr>\n");
+    fprintf(cgiOut, "<td class=\"desc\" colspan=\"4\">\n");
+    fprintf(cgiOut, "Search for certificates with a DNS name or IP address in the subject alternative names ");
+    fprintf(cgiOut, "that covers the given host, including wildcard names like *.changeme.com. ");
+    fprintf(cgiOut, "A search for *.changeme.com lists all certificates for names within that domain.");
+    fprintf(cgiOut, "</td>\n");
+    fprintf(cgiOut, "</tr>\n");
+
     /* Search for Expiration Date */
     fprintf(cgiOut, "<tr><th colspan=\"5\">Search by Expiration Date</th></tr>\n");
     fprintf(cgiOut, "<tr>\n");
     fprintf(cgiOut, "<th class=\"cnt\" rowspan=\"2\">\n");
-    fprintf(cgiOut, "<input type=\"radio\" value=\"exp\" name=\"search\" checked=\"checked\" />");
+    fprintf(cgiOut, "<input type=\"checkbox\" value=\"exp\" name=\"search\" checked=\"checked\" />");
     fprintf(cgiOut, "</th>\n");
     fprintf(cgiOut, "<td class=\"type\">\n");
     fprintf(cgiOut, "Expiration Date is<br />between Start Date:");
@@ -400,7 +495,7 @@ int cgiMain() {
     fprintf(cgiOut, "<tr><th colspan=\"5\">Search by Creation Date</th></tr>\n");
     fprintf(cgiOut, "<tr>\n");
     fprintf(cgiOut, "<th class=\"cnt\" rowspan=\"2\">\n");
-    fprintf(cgiOut, "<input type=\"radio\" value=\"ena\" name=\"search\" />");
+    fprintf(cgiOut, "<input type=\"checkbox\" value=\"ena\" name=\"search\" />");
     fprintf(cgiOut, "</th>\n");
     fprintf(cgiOut, "<td class=\"type\">\n");
     fprintf(cgiOut, "Enabled Date is<br />between Start Date:");
@@ -435,7 +530,7 @@ int cgiMain() {
     fprintf(cgiOut, "<tr><th colspan=\"5\">Search by Revocation Date</th></tr>\n");
     fprintf(cgiOut, "<tr>\n");
     fprintf(cgiOut, "<th class=\"cnt\" rowspan=\"2\">\n");
-    fprintf(cgiOut, "<input type=\"radio\" value=\"rev\" name=\"search\" />");
+    fprintf(cgiOut, "<input type=\"checkbox\" value=\"rev\" name=\"search\" />");
     fprintf(cgiOut, "</th>\n");
     fprintf(cgiOut, "<td class=\"type\">\n");
     fprintf(cgiOut, "Revocation Date is<br />between Start Date:");
@@ -470,7 +565,7 @@ int cgiMain() {
     fprintf(cgiOut, "<tr><th colspan=\"5\">Search by Serial Number</th></tr>\n");
     fprintf(cgiOut, "<tr>\n");
     fprintf(cgiOut, "<th class=\"cnt\" rowspan=\"2\">\n");
-    fprintf(cgiOut, "<input type=\"radio\" value=\"ser\" name=\"search\" />");
+    fprintf(cgiOut, "<input type=\"checkbox\" value=\"ser\" name=\"search\" />");
     fprintf(cgiOut, "</th>\n");
     fprintf(cgiOut, "<td class=\"type\">\n");
     fprintf(cgiOut, "Serial Number is<br />between Start Serial:");
@@ -494,6 +589,18 @@ int cgiMain() {
     fprintf(cgiOut, "</td>\n");
     fprintf(cgiOut, "</tr>\n");
 
+    /* Search for Certs not revoked */
+    fprintf(cgiOut, "<tr><th colspan=\"5\">Search by Revocation State</th></tr>\n");
+    fprintf(cgiOut, "<tr>\n");
+    fprintf(cgiOut, "<th class=\"cnt\">\n");
+    fprintf(cgiOut, "<input type=\"checkbox\" value=\"nrv\" name=\"search\" />");
+    fprintf(cgiOut, "</th>\n");
+    fprintf(cgiOut, "<td class=\"desc\" colspan=\"4\">\n");
+    fprintf(cgiOut, "Search for certificates that have not been revoked. ");
+    fprintf(cgiOut, "Several criteria can be checked, the certificates must match all of them.");
+    fprintf(cgiOut, "</td>\n");
+    fprintf(cgiOut, "</tr>\n");
+
     fprintf(cgiOut, "<tr>\n");
     fprintf(cgiOut, "<th colspan=\"5\">");
     fprintf(cgiOut, "<input type=\"submit\" value=\"Search Certificates\" />");
@@ -509,11 +616,13 @@ int cgiMain() {
   /* ------------------------------------------------------------------- *
    * check if we got the CGI form data                                   *
    * --------------------------------------------------------------------*/
-    if ( cgiFormString("search", search, sizeof(search))
-                                                     != cgiFormSuccess )
+    if ( cgiFormStringMultiple("search", &searches) != cgiFormSuccess
+                                              || searches[0] == NULL )
       int_error("Error retrieving CGI form search type.");
-    else {
+    for (k = 0; searches[k] != NULL; k++) {
+      search = searches[k];
       if (strcmp(search, "dn") == 0) {
+        preds |= PRED_DN;
         if ( cgiFormString("field", field, sizeof(field))
                                                      != cgiFormSuccess )
         int_error("Error retrieving CGI form DN search field information.");
@@ -521,10 +630,26 @@ int cgiMain() {
         if ( cgiFormString("dnvalue", dnvalue, sizeof(dnvalue))
                                                      != cgiFormSuccess )
         int_error("Error retrieving CGI form DN search dnvalue information.");
+        /* the stored subject uses the short names, i.e. CN for commonName */
+        if (OBJ_txt2nid(field) == NID_undef)
+          int_error("Error CGI form DN search field is unknown.");
+        strncpy(fieldsn, OBJ_nid2sn(OBJ_txt2nid(field)), sizeof(fieldsn)-1);
         snprintf(title, sizeof(title), "Search Certs by Subject");
-        snprintf(subtitle, sizeof(subtitle), "Certificates with DN %s=%s", field, dnvalue);
+        snprintf(predstr, sizeof(predstr), "with DN %s=%s", field,
+                 html_escape(escbuf, sizeof(escbuf), dnvalue));
+      }
+      else if (strcmp(search, "san") == 0) {
+        preds |= PRED_SAN;
+        if ( cgiFormString("sanvalue", sanvalue, sizeof(sanvalue))
+                                                     != cgiFormSuccess )
+        int_error("Error retrieving CGI form SAN search name.");
+        snprintf(title, sizeof(title), "Search Certs by Host Name");
+        /* at most 200 chars of the escaped name, it must fit subtitle */
+        html_escape(escbuf, 201, sanvalue);
+        snprintf(predstr, sizeof(predstr), "with a SAN covering %s", escbuf);
       }
       else if (strcmp(search, "exp") == 0) {
+        preds |= PRED_EXP;
         if ( cgiFormString("exp_startdate", exp_startdate, sizeof(exp_startdate))
                                                      != cgiFormSuccess )
         int_error("Error retrieving CGI form expiration start date.");
@@ -547,10 +672,14 @@ int cgiMain() {
         strncat(exp_endstr, exp_enddate, sizeof(exp_endstr)-1);
         strncat(exp_endstr, " ", 1); /* add a space between date and time */
         strncat(exp_endstr, exp_endtime, sizeof(exp_endstr)-strlen(exp_endstr)-1);
+        if (! formtime_to_epoch(exp_startdate, exp_starttime, &exp_from) ||
+            ! formtime_to_epoch(exp_enddate, exp_endtime, &exp_to))
+          int_error("Error parsing the search date, expected DD.MM.YYYY HH:MM.");
         snprintf(title, sizeof(title), "Search Certs by Expiration");
-        snprintf(subtitle, sizeof(subtitle), "Certificates with expiration between %s and %s", exp_startstr, exp_endstr);
+        snprintf(predstr, sizeof(predstr), "with expiration between %s and %s", exp_startstr, exp_endstr);
       }
       else if (strcmp(search, "ena") == 0) {
+        preds |= PRED_ENA;
         if ( cgiFormString("ena_startdate", ena_startdate, sizeof(ena_startdate))
                                                      != cgiFormSuccess )
         int_error("Error retrieving CGI form enable start date.");
@@ -573,10 +702,14 @@ int cgiMain() {
         strncat(ena_endstr, ena_enddate, sizeof(ena_endstr)-1);
         strncat(ena_endstr, " ", 1); /* add a space between date and time */
         strncat(ena_endstr, ena_endtime, sizeof(ena_endstr)-strlen(ena_endstr)-1);
+        if (! formtime_to_epoch(ena_startdate, ena_starttime, &ena_from) ||
+            ! formtime_to_epoch(ena_enddate, ena_endtime, &ena_to))
+          int_error("Error parsing the search date, expected DD.MM.YYYY HH:MM.");
         snprintf(title, sizeof(title), "Search Certs by Start Date");
-        snprintf(subtitle, sizeof(subtitle), "Certificates with start date between %s and %s", ena_startstr, ena_endstr);
+        snprintf(predstr, sizeof(predstr), "with start date between %s and %s", ena_startstr, ena_endstr);
       }
       else if (strcmp(search, "rev") == 0) {
+        preds |= PRED_REV;
         if ( cgiFormString("rev_startdate", rev_startdate, sizeof(rev_startdate))
                                                      != cgiFormSuccess )
         int_error("Error retrieving CGI form enable start date.");
@@ -599,10 +732,14 @@ int cgiMain() {
         strncat(rev_endstr, rev_enddate, sizeof(rev_endstr)-1);
         strncat(rev_endstr, " ", 1); /* add a space between date and time */
         strncat(rev_endstr, rev_endtime, sizeof(rev_endstr)-strlen(rev_endstr)-1);
+        if (! formtime_to_epoch(rev_startdate, rev_starttime, &rev_from) ||
+            ! formtime_to_epoch(rev_enddate, rev_endtime, &rev_to))
+          int_error("Error parsing the search date, expected DD.MM.YYYY HH:MM.");
         snprintf(title, sizeof(title), "Search Revoked Certificates");
-        snprintf(subtitle, sizeof(subtitle), "Certificates revoked between %s and %s", rev_startstr, rev_endstr);
+        snprintf(predstr, sizeof(predstr), "revoked between %s and %s", rev_startstr, rev_endstr);
       }
       else if (strcmp(search, "ser") == 0) {
+        preds |= PRED_SER;
         if ( cgiFormString("startserial", startserstr, sizeof(startserstr))
                                                      != cgiFormSuccess )
         int_error("Error retrieving CGI form start serial value.");
@@ -610,88 +747,111 @@ int cgiMain() {
         if ( cgiFormString("endserial", endserstr, sizeof(endserstr))
                                                      != cgiFormSuccess )
         int_error("Error retrieving CGI form end serial value.");
+        /* convert the serial strings once to the index serial format */
+        if (! serial_from_dec(&startserial, startserstr))
+          int_error("Error converting the start serial number.");
+        if (! serial_from_dec(&endserial, endserstr))
+          int_error("Error converting the end serial number.");
         snprintf(title, sizeof(title), "Search Certs by Serial Number");
-        snprintf(subtitle, sizeof(subtitle), "Certificates with serial number between %s and %s", startserstr, endserstr);
+        snprintf(predstr, sizeof(predstr), "with serial number between %s and %s", startserstr, endserstr);
+      }
+      else if (strcmp(search, "nrv") == 0) {
+        preds |= PRED_NRV;
+        snprintf(title, sizeof(title), "Search Certs not Revoked");
+        snprintf(predstr, sizeof(predstr), "not revoked");
       }
       else int_error("Error CGI form retrieving a valid search type.");
+
+      /* join the criteria: "Certificates with DN CN=x, not revoked" */
+      snprintf(subtitle + strlen(subtitle), sizeof(subtitle) - strlen(subtitle),
+               "%s%s", k ? ", " : "Certificates ", predstr);
     }
+    if (k > 1) snprintf(title, sizeof(title), "Search Certs by Multiple Criteria");
+    cgiStringArrayFree(searches);
 
 /* -------------------------------------------------------------------------- *
- * We got CGI arguments, first we get a list of .pem files from the cert dir  *
+ * We got CGI arguments, we filter the records of the cert store index. They  *
+ * are sorted by serial, so the result list comes out in hexsort order. If    *
+ * the index is not available, the store is scanned with the threaded engine. *
  * ---------------------------------------------------------------------------*/
-  certcounter = scandir(CACERTSTORE, &certstore_files, file_select, hexsort);
-  // It can happen that our search does not return any certs. This is not an error.
-  //if(certcounter<=0) int_error("Error: No certificate files found.");
+  if (! load_certindex(&certidx, CERTINDEX)) {
+    if ((scancount = scan_certrecs(&scan_recs)) < 0)
+      int_error("Error cannot scan the certificate store directory");
+    certidx.recs  = scan_recs;
+    certidx.count = scancount;
+  }
 
 /* -------------------------------------------------------------------------- *
- * calculate how many pages we get with MAXCERTDISPLAY                         *
+ * The query planner: the indexed predicates narrow the records down before   *
+ * the filter runs, most selective first. A serial range is a slice of the    *
+ * serial sorted records, found by two binary searches. The SAN index has the *
+ * exact certs, the trigram index a superset, their candidate bits are ANDed. *
+ * The trigram query is skipped if only a few candidates are left, checking   *
+ * their subjects directly is cheaper. Date ranges and revocation states are  *
+ * filtered in bulk over the column file, by the SIMD range kernels.          *
+ * The matches are saved in the search cache, keyed by the normalized query.  *
+ * As long as the index generation stays the same, the page moves and sort   *
+ * flips of the same search are served from the cached list, without a scan. *
  * ---------------------------------------------------------------------------*/
-
-  if(certcounter<=MAXCERTDISPLAY) pagecounter = 1;
-  else {
-    disp_calc = div(certcounter, MAXCERTDISPLAY);
-    /* if the count of certs divided by MAXCERTDISPLAY has no remainder */
-    if(disp_calc.rem == 0) pagecounter = disp_calc.quot;
-    /* with a remainder, we must prepare an extra page for the rest */
-    else pagecounter = disp_calc.quot +1;
+  searchkey(querykey, sizeof(querykey));
+  if (! load_searchcache(&cache, SEARCHCACHE, querykey, &certidx)) {
+    plan_search(&certidx, &planrecs, &plancount);
+
+    /* the whole result, in serial order, for this and the next pages */
+    if (certidx.hdr && certidx.count <= UINT32_MAX) {
+      if ((matches = malloc((plancount + 1) * sizeof(uint32_t))) == NULL)
+        int_error("Error cannot allocate memory for the search results.");
+      for (i = 0; i < plancount; i++)
+        if (rec_select(&planrecs[i]))
+          matches[cache.count++] = planrecs - certidx.recs + i;
+      cache.list = matches;
+      save_searchcache(SEARCHCACHE, querykey, &certidx, matches, cache.count);
+    }
   }
 
 /* -------------------------------------------------------------------------- *
- * Check if we have been subsequently called with a pagenumber & sort request *
+ * Check if we have been subsequently called with a page move & sort request. *
+ * Paging is keyset based: the "cursor" is the serial of the last (next) or   *
+ * first (prev) cert shown. A cached result list is paged by slicing it. Else *
+ * the filter only runs from the cursor until the page is full, and the total *
+ * # of matches is counted once and carried in "certcounter".                 *
  * ---------------------------------------------------------------------------*/
-
-  if(cgiFormInteger("page", &pagenumber, 1) == cgiFormSuccess)
-    if(pagenumber > pagecounter || pagenumber <=0)
-      int_error("Error: Page does not exist.");
-
   if(cgiFormString("sort", sorting, sizeof(sorting)) != cgiFormSuccess)
       strncpy(sorting, "desc", sizeof(sorting));
+  if(strcmp(sorting, "asc") != 0) strncpy(sorting, "desc", sizeof(sorting));
 
-/* -------------------------------------------------------------------------- *
- * now we know how many certs we have in total and we can build the page(s).  *
- * For every MAXCERTDISPLAY certs we start a new page and cycle through by    *
- * calling ourself with the requested certs in range.                         *
- * ---------------------------------------------------------------------------*/
-
-  if(strcmp(sorting, "asc") == 0) {
-
-    if(certcounter <= MAXCERTDISPLAY) {
-       dispmaxlines = certcounter;
-       tempcounter = 0;
-    }
-    else
-      if(pagenumber == pagecounter &&
-             ( pagecounter * MAXCERTDISPLAY) - certcounter != 0) {
-
-        tempcounter = (pagecounter * MAXCERTDISPLAY) - MAXCERTDISPLAY;
-        dispmaxlines = certcounter - ((pagecounter-1) * MAXCERTDISPLAY);
-      }
-      else {
+  memset(&page, '\0', sizeof(page));
+  cgiFormInteger("pagesize", &page.pagesize, MAXCERTDISPLAY);
+  if(page.pagesize < 1 || page.pagesize > MAXPAGESIZE)
+    int_error("Error: Page size is out of range.");
+  cgiFormInteger("certcounter", &certcounter, 0);
+  if(certcounter > 0) page.total = certcounter;
 
-        tempcounter = (pagenumber * MAXCERTDISPLAY) - MAXCERTDISPLAY;
-        dispmaxlines = MAXCERTDISPLAY;
-      }
-  }
+  if(cgiFormString("move", move, sizeof(move)) != cgiFormSuccess)
+    strncpy(move, "first", sizeof(move));
 
-  if(strcmp(sorting, "desc") == 0) {
-
-    if(certcounter <= MAXCERTDISPLAY) {
-       dispmaxlines = certcounter;
-       tempcounter = certcounter;
-    }
-    else
-      if(pagenumber == pagecounter &&
-             ( pagecounter * MAXCERTDISPLAY) - certcounter != 0) {
+  /* a page # without a move comes from the goto form */
+  if(cgiFormInteger("page", &page.pagenumber, 1) == cgiFormSuccess &&
+     strcmp(move, "first") == 0) strncpy(move, "page", sizeof(move));
 
-        tempcounter = certcounter - ((pagecounter-1) * MAXCERTDISPLAY);
-        dispmaxlines = certcounter - ((pagecounter-1) * MAXCERTDISPLAY);
-      }
-      else {
+  if(cgiFormString("cursor", cursorstr, sizeof(cursorstr)) == cgiFormSuccess
+     && ! serial_from_hex(&cursor, cursorstr))
+    int_error("Error: Invalid page cursor serial.");
 
-       tempcounter = certcounter - (pagenumber*MAXCERTDISPLAY) + MAXCERTDISPLAY;
-       dispmaxlines = MAXCERTDISPLAY;
-      }
+  // It can happen that our search does not return any certs. This is not an error.
+  if(cache.list) {
+    if(! page_certlist(&page, certidx.recs, cache.list, cache.count,
+                       strcmp(sorting, "asc") == 0, move,
+                       cursorstr[0] ? &cursor : NULL))
+      int_error("Error: Page does not exist.");
   }
+  else if(! page_certrecs(&page, planrecs, plancount, rec_select,
+                     strcmp(sorting, "asc") == 0, move,
+                     cursorstr[0] ? &cursor : NULL))
+      int_error("Error: Page does not exist.");
+  certcounter = page.total;
+  pagenumber = page.pagenumber;
+  pagecounter = page.pagecounter;
 
 /* -------------------------------------------------------------------------- *
  * start the html output                                                      *
@@ -701,10 +861,8 @@ int cgiMain() {
 
   //debugging only:
   //printf("Number of certs: %d\n", certcounter);
-  //printf("Num tempcounter: %d\n", tempcounter);
   //printf("Number of pages: %d\n", pagecounter);
-  //printf("Div Quotient: %d\n", disp_calc.quot);
-  //printf("Div Remainder: %d\n", disp_calc.rem);
+  //printf("Page size: %d\n", page.pagesize);
   //fprintf(cgiOut, "</BODY></HTML>\n");
   //exit(0);
 
@@ -739,20 +897,18 @@ int cgiMain() {
     fprintf(cgiOut, "</tr>\n");
   }
 
-  for(dispcounter=0; dispcounter < dispmaxlines; dispcounter++) {
+  for(dispcounter=0; dispcounter < page.lines; dispcounter++) {
 
     /* zero certificate values and flags */
     certvalidity = 0;
     percent = 0;
-    available_secs = 0;
     remaining_secs = 0;
-    cert = X509_new();
-    certsubject = X509_NAME_new();
-
-    if(strcmp(sorting, "desc") == 0) tempcounter--;
 
-    snprintf(certfilestr, sizeof(certfilestr), "%s/%s",
-                           CACERTSTORE, certstore_files[tempcounter]->d_name);
+    /* number the results in serial order, as the cert store list does */
+    rec = page.recs[dispcounter];
+    tempcounter = (pagenumber-1) * page.pagesize + dispcounter;
+    if(strcmp(sorting, "desc") == 0) tempcounter = certcounter - 1 - tempcounter;
+    certrec_filename(rec, certnamestr, sizeof(certnamestr));
 
     fprintf(cgiOut, "<tr>\n");
     fprintf(cgiOut, "<th rowspan=\"2\">");
@@ -765,40 +921,21 @@ int cgiMain() {
     else
       fprintf(cgiOut, "<td rowspan=\"2\" class=\"even\">");
 
-    if ( (certfile = fopen(certfilestr, "r")) != NULL) {
-      PEM_read_X509(certfile, &cert, NULL, NULL);
-
-      /* ---------------------------------------------------------- *
-       * Display the subject data. Use the UTF-8 flag to show       *
-       * Japanese Kanji. This also needs the separator flag to work *
-       * ---------------------------------------------------------- */
-      certsubject = X509_get_subject_name(cert);
-      X509_NAME_print_ex_fp(cgiOut, certsubject, 0,
-         ASN1_STRFLGS_UTF8_CONVERT|XN_FLAG_SEP_CPLUS_SPC);
-
-      /* store certificate start date for later eval */
-      start_date = X509_get_notBefore(cert);
-
-      /* store certificate expiration date for later eval */
-      expiration_date = X509_get_notAfter(cert);
-
-      /* check the start and end dates in the cert */
-      if (X509_cmp_current_time (X509_get_notBefore (cert)) >= 0)
-        /* flag the certificate as not valid yet */
-        certvalidity = 0;
-      else
-      if (X509_cmp_current_time (X509_get_notAfter (cert)) <= 0)
-        /* flag the certificate as expired */
-        certvalidity = 0;
-      else 
-        /* flag the certificate is still valid */
-        certvalidity = 1;
-
-      fclose(certfile);
-    }
+    /* display the subject data, stored UTF-8 encoded in the index */
+    fprintf(cgiOut, "%s", rec->subject);
+
+    /* check the start and end dates in the cert */
+    if (rec->notbefore >= now)
+      /* flag the certificate as not valid yet */
+      certvalidity = 0;
+    else
+    if (rec->notafter <= now)
+      /* flag the certificate as expired */
+      certvalidity = 0;
     else 
-       fprintf(cgiOut, "Error: Can't open certificate file %s for reading.",
-                                                                 certfilestr);
+      /* flag the certificate is still valid */
+      certvalidity = 1;
+
     fprintf(cgiOut, "</td>\n");
 
     if(certvalidity == 0) {
@@ -826,46 +963,11 @@ int cgiMain() {
 
     if(certvalidity == 1) {
 
-      /* ------ START get the certificate lifetime in seconds ------ */
-      /* copy the start date into a string */
-      membio = BIO_new(BIO_s_mem());
-      ASN1_TIME_print(membio, start_date);
-      BIO_gets(membio, membio_buf, sizeof(membio_buf));
-      BIO_free(membio);
-
-      /* parse the start date string into a time struct */
-      memset (&start_tm, '\0', sizeof(start_tm));
-      strptime(membio_buf, "%h %d %T %Y %z", &start_tm);
-      start = mktime(&start_tm);
-
-      /* ------ START get the certificate remaining time in seconds ------ */
-      /* copy the expiration date into a string */
-      membio = BIO_new(BIO_s_mem());
-      ASN1_TIME_print(membio, expiration_date);
-      BIO_gets(membio, membio_buf, sizeof(membio_buf));
-      BIO_free(membio);
-  
-      /* parse the expiration date string into a time struct */
-      memset (&expiration_tm, '\0', sizeof(expiration_tm));
-      strptime(membio_buf, "%h %d %T %Y %z", &expiration_tm);
-  
-      /* get the current time */
-      expiration = mktime(&expiration_tm);
-  
-      /* get the time difference between expiration time and current time */
-      remaining_secs = difftime(expiration, now);
-      /* ------ END get the certificate remaining time in seconds ------ */
+      /* ------ get the certificate remaining time in seconds ------ */
+      remaining_secs = (double) (rec->notafter - now);
 
-      /* get the time difference between start and expiration time */
-      available_secs = difftime(expiration, start);
-      /* ------ END get the certificate lifetime in seconds ------ */
-  
-      /* ------ START calculate percentage of lifetime left ------ */
-      /* remaining_secs *100                                       */
-      /* ------------------- = X, rounded down with floor()        */
-      /* available_secs                                            */
-      percent = floor((remaining_secs*100)/available_secs);
-      /* ------ END calculate percentage of lifetime left   ------ */
+      /* ------ percentage of lifetime left, integer epoch math ------ */
+      percent = lifetime_left(rec->notbefore, rec->notafter, now);
   
       /* expiration bar display column */
       fprintf(cgiOut, "<th rowspan=\"2\">");
@@ -907,7 +1009,7 @@ int cgiMain() {
     fprintf(cgiOut, "<th>");
     fprintf(cgiOut, "<form action=\"getcert.cgi\" method=\"post\">\n");
     fprintf(cgiOut, "<input type=\"hidden\" name=\"cfilename\" ");
-    fprintf(cgiOut, "value=\"%s\" />\n", certstore_files[tempcounter]->d_name);
+    fprintf(cgiOut, "value=\"%s\" />\n", certnamestr);
     fprintf(cgiOut, "<input type=\"hidden\" name=\"format\" value=\"pem\" />\n");
     fprintf(cgiOut, "<input class=\"getcert\" type=\"submit\" value=\"Detail\" />\n");
     fprintf(cgiOut, "</form>\n");
@@ -917,14 +1019,12 @@ int cgiMain() {
     fprintf(cgiOut, "<th>");
     fprintf(cgiOut, "<form action=\"getcert.cgi\" method=\"post\">\n");
     fprintf(cgiOut, "<input type=\"hidden\" name=\"cfilename\" ");
-    fprintf(cgiOut, "value=\"%s\" />\n", certstore_files[tempcounter]->d_name);
+    fprintf(cgiOut, "value=\"%s\" />\n", certnamestr);
     fprintf(cgiOut, "<input type=\"hidden\" name=\"format\" value=\"text\" />\n");
     fprintf(cgiOut, "<input class=\"getcert\" type=\"submit\" value=\"Renew\" />\n");
     fprintf(cgiOut, "</form>");
     fprintf(cgiOut, "</th>\n");
     fprintf(cgiOut, "</tr>\n");
-
-    if(strcmp(sorting, "asc") == 0) tempcounter++;
   }
 
 
@@ -945,6 +1045,8 @@ int cgiMain() {
   fprintf(cgiOut, "<form action=\"certsearch.cgi\" method=\"post\">");
   fprintf(cgiOut, "<input type=\"hidden\" name=\"sort\" ");
   fprintf(cgiOut, "value=\"desc\" />\n");
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagesize\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page.pagesize);
   resubmit();
   fprintf(cgiOut, "<input type=\"submit\" name=\"sort\"");
   fprintf(cgiOut, " value=\"Latest Certs first\" />");
@@ -955,6 +1057,8 @@ int cgiMain() {
   fprintf(cgiOut, "<form action=\"certsearch.cgi\" method=\"post\">");
   fprintf(cgiOut, "<input type=\"hidden\" name=\"sort\" ");
   fprintf(cgiOut, "value=\"asc\">\n");
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagesize\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page.pagesize);
   resubmit();
   fprintf(cgiOut, "<input type=\"submit\" name=\"sort\"");
   fprintf(cgiOut, " value=\"Oldest Certs first\">");
@@ -968,89 +1072,35 @@ int cgiMain() {
 
   // goto page 1
   fprintf(cgiOut, "<th width=\"5\">");
-  fprintf(cgiOut, "<form action=\"certsearch.cgi\" method=\"post\">");
-  resubmit();
-  fprintf(cgiOut, "<input type=\"submit\" value=\"&lt;&lt;\" />");
-  fprintf(cgiOut, "</form>");
+  pageform("first", NULL, &page, sorting, "&lt;&lt;");
   fprintf(cgiOut, "</th>\n");
 
-  // goto page before
+  // goto page before, keyed on the first cert shown
   fprintf(cgiOut, "<th width=\"5\">");
-  fprintf(cgiOut, "<form action=\"certsearch.cgi\" method=\"post\">");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", certcounter);
-  fprintf(cgiOut, "\" />\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagecounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", pagecounter);
-  fprintf(cgiOut, "\" />\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"page\" ");
-  fprintf(cgiOut, "value=\"");
-  tempcounter = 0;
-  if(pagenumber > 1) tempcounter = pagenumber - 1;
-  else tempcounter = 1;
-  fprintf(cgiOut, "%d", tempcounter);
-  fprintf(cgiOut, "\" />\n");
-  resubmit();
-  fprintf(cgiOut, "<input type=\"submit\" value=\"&lt; 1\">");
-  fprintf(cgiOut, "</form>");
+  if(page.has_prev) pageform("prev", page.recs[0], &page, sorting, "&lt; 1");
+  else pageform("first", NULL, &page, sorting, "&lt; 1");
   fprintf(cgiOut, "</th>\n");
 
-  // goto page after
+  // goto page after, keyed on the last cert shown
   fprintf(cgiOut, "<th width=\"5\">");
-  fprintf(cgiOut, "<form action=\"certsearch.cgi\" method=\"post\">");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", certcounter);
-  fprintf(cgiOut, "\" />\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagecounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", pagecounter);
-  fprintf(cgiOut, "\" />\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"page\" ");
-  fprintf(cgiOut, "value=\"");
-  tempcounter = 0;
-  if(pagecounter > pagenumber) tempcounter = pagenumber + 1;
-  else tempcounter = pagecounter;
-  fprintf(cgiOut, "%d", tempcounter);
-  fprintf(cgiOut, "\" />\n");
-  resubmit();
-  fprintf(cgiOut, "<input type=\"submit\" value=\"1 &gt;\" />");
-  fprintf(cgiOut, "</form>");
+  if(page.has_next) pageform("next", page.recs[page.lines-1], &page, sorting, "1 &gt;");
+  else pageform("last", NULL, &page, sorting, "1 &gt;");
   fprintf(cgiOut, "</th>\n");
 
   // goto last page
   fprintf(cgiOut, "<th width=\"5\">");
-  fprintf(cgiOut, "<form action=\"certsearch.cgi\" method=\"post\">");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", certcounter);
-  fprintf(cgiOut, "\" />\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagecounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", pagecounter);
-  fprintf(cgiOut, "\" />\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"page\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", pagecounter);
-  fprintf(cgiOut, "\" />\n");
-  resubmit();
-  fprintf(cgiOut, "<input type=\"submit\" value=\"&gt;&gt;\" />");
-  fprintf(cgiOut, "</form>");
+  pageform("last", NULL, &page, sorting, "&gt;&gt;");
   fprintf(cgiOut, "</th>\n");
 
   // goto page number
   fprintf(cgiOut, "<th width=\"120\">\n");
   fprintf(cgiOut, "<form class=\"setpage\" action=\"certsearch.cgi\" method=\"post\">\n");
   fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", certcounter);
-  fprintf(cgiOut, "\" />\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagecounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", pagecounter);
-  fprintf(cgiOut, "\" />\n");
+  fprintf(cgiOut, "value=\"%d\" />\n", certcounter);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"sort\" ");
+  fprintf(cgiOut, "value=\"%s\" />\n", sorting);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagesize\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page.pagesize);
   resubmit();
   fprintf(cgiOut, "<input class=\"goto\" type=\"submit\" value=\"Goto\" />\n");
   fprintf(cgiOut, "&nbsp; &nbsp;");
@@ -1067,18 +1117,34 @@ int cgiMain() {
  * ---------------------------------------------------------------------------*/
 
   pagefoot();
+  free(scan_recs);
+  free(candbits);
+  free(matches);
+  free_searchcache(&cache);
+  free_certcols(&cols);
+  free_certindex(&certidx);
 }
   return(0);
 }
 
 /* re-submit the initial search criteria */
 void resubmit() {
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"search\" ");
-  fprintf(cgiOut, "value=\"%s\" />\n", search);
+  char escbuf[6*sizeof(sanvalue)] = "";
+  int i;
+
+  for (i = 0; i < sizeof(predtab)/sizeof(predtab[0]); i++) {
+    if (! (preds & predtab[i].bit)) continue;
+    fprintf(cgiOut, "<input type=\"hidden\" name=\"search\" ");
+    fprintf(cgiOut, "value=\"%s\" />\n", predtab[i].name);
+  }
   fprintf(cgiOut, "<input type=\"hidden\" name=\"dnvalue\" ");
-  fprintf(cgiOut, "value=\"%s\" />\n", dnvalue);
+  fprintf(cgiOut, "value=\"%s\" />\n",
+                  html_escape(escbuf, sizeof(escbuf), dnvalue));
   fprintf(cgiOut, "<input type=\"hidden\" name=\"field\" ");
   fprintf(cgiOut, "value=\"%s\" />\n", field);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"sanvalue\" ");
+  fprintf(cgiOut, "value=\"%s\" />\n",
+                  html_escape(escbuf, sizeof(escbuf), sanvalue));
   fprintf(cgiOut, "<input type=\"hidden\" name=\"exp_startdate\" ");
   fprintf(cgiOut, "value=\"%s\" />\n", exp_startdate);
   fprintf(cgiOut, "<input type=\"hidden\" name=\"exp_starttime\" ");
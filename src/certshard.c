@@ -0,0 +1,122 @@
+/* ---------------------------------------------------------- *
+ * file:	certshard.c                                   *
+ * purpose:	command line tool, moves the PEM files of a   *
+ *              cert store directory into the SHARDED_STORE   *
+ *              layout of storecert_path(), or with -u back   *
+ *              to the flat layout, removing the empty shard  *
+ *              dirs. Files already in place are left alone,  *
+ *              so it can be re-run after an interruption.    *
+ *              usage: certshard [-u] [storedir]              *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * handle_error(): the tool has no html page, int_error() in  *
+ * the shared code ends up here.                              *
+ * ---------------------------------------------------------- */
+void handle_error(const char *file, int lineno, const char *msg) {
+  fprintf(stderr, "certshard: %s (%s line %d)\n", msg, file, lineno);
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+/* ---------------------------------------------------------- *
+ * shard_rmdirs(): removes the empty shard dirs after -u. Non *
+ * empty dirs stay, rmdir() fails on them.                    *
+ * ---------------------------------------------------------- */
+static void shard_rmdirs(const char *storedir) {
+  DIR *top, *sub;
+  struct dirent *d1, *d2;
+  char path[512];
+
+  if ((top = opendir(storedir)) == NULL) return;
+  while ((d1 = readdir(top)) != NULL) {
+    if (d1->d_name[0] == '.' || strlen(d1->d_name) != 2) continue;
+    snprintf(path, sizeof(path), "%s/%s", storedir, d1->d_name);
+    if ((sub = opendir(path)) == NULL) continue;
+    while ((d2 = readdir(sub)) != NULL) {
+      if (d2->d_name[0] == '.' || strlen(d2->d_name) != 2) continue;
+      snprintf(path, sizeof(path), "%s/%s/%s", storedir, d1->d_name,
+                                                        d2->d_name);
+      rmdir(path);
+    }
+    closedir(sub);
+    snprintf(path, sizeof(path), "%s/%s", storedir, d1->d_name);
+    rmdir(path);
+  }
+  closedir(top);
+}
+
+int main(int argc, char *argv[]) {
+  const char *storedir = CACERTSTORE;
+  const char *base;
+  char **files = NULL;
+  char from[512], to[512];
+  struct stat st;
+  int unshard = 0, filecount, i;
+  int moved = 0, inplace = 0, failed = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-u") == 0) unshard = 1;
+    else if (argv[i][0] != '-' && i == argc - 1) storedir = argv[i];
+    else {
+      fprintf(stderr, "usage: certshard [-u] [storedir]\n");
+      return 2;
+    }
+  }
+
+  /* ---------------------------------------------------------- *
+   * list_certstore() has both the top level and shard files,   *
+   * if certshard was built with SHARDED_STORE. Without it, the *
+   * shard files are not seen, -u needs a SHARDED_STORE build.  *
+   * ---------------------------------------------------------- */
+  if ((filecount = list_certstore(storedir, &files)) < 0)
+    int_error("Error cannot read the cert store directory");
+
+  for (i = 0; i < filecount; i++) {
+    base = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+    snprintf(from, sizeof(from), "%s/%s", storedir, files[i]);
+
+    if (storecert_path(storedir, base, ! unshard, to, sizeof(to)) == NULL) {
+      fprintf(stderr, "certshard: skipping %s, not a serial name\n", from);
+      failed++;
+    }
+    else if (strcmp(from, to) == 0) inplace++;
+    else if (stat(to, &st) == 0) {
+      /* never overwrite, i.e. a duplicate left from an old run */
+      fprintf(stderr, "certshard: skipping %s, %s exists\n", from, to);
+      failed++;
+    }
+    else {
+      if (! unshard) storecert_mkdirs(to);
+      if (rename(from, to) == 0) moved++;
+      else {
+        fprintf(stderr, "certshard: cannot move %s to %s\n", from, to);
+        failed++;
+      }
+    }
+    free(files[i]);
+  }
+  free(files);
+
+  if (unshard) shard_rmdirs(storedir);
+
+  printf("%d certs moved to the %s layout in %s, %d already there, %d failed.\n",
+           moved, unshard ? "flat" : "sharded", storedir, inplace, failed);
+#ifdef SHARDED_STORE
+  if (unshard && moved > 0)
+    printf("To use it, unset SHARDED_STORE in webcert.h and recompile.\n");
+#else
+  if (! unshard && moved > 0)
+    printf("To use it, set SHARDED_STORE in webcert.h and recompile.\n");
+#endif
+  return (failed > 0);
+}
@@ -0,0 +1,238 @@
+/* ---------------------------------------------------------- *
+ * file:	certsignd.c                                   *
+ * purpose:	command line tool, the CA signing daemon. It  *
+ *              loads CACERT and the CAKEY once, and signs    *
+ *              the certs and CRLs the CGIs send to it over   *
+ *              the SIGNSOCKET unix socket, see casign.c. One *
+ *              thread per connection, requests on it can be  *
+ *              pipelined. The socket is mode 0660, run it as *
+ *              the web server group. Runs in the foreground, *
+ *              start it from init.                           *
+ *              usage: certsignd [-v]                         *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#include "webcert.h"
+
+static int verbose = 0;
+static X509 *cacert = NULL;
+static EVP_PKEY *cakey = NULL;
+
+/* ---------------------------------------------------------- *
+ * handle_error(): the tool has no html page, int_error() in  *
+ * the shared code ends up here.                              *
+ * ---------------------------------------------------------- */
+void handle_error(const char *file, int lineno, const char *msg) {
+  fprintf(stderr, "certsignd: %s (%s line %d)\n", msg, file, lineno);
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+/* ---------------------------------------------------------- *
+ * signd_digest(): the digest of a request NID, only the SHA  *
+ * variants the CGIs offer. NULL refuses the request.         *
+ * ---------------------------------------------------------- */
+static const EVP_MD *signd_digest(uint32_t nid) {
+  switch (nid) {
+    case NID_sha224: return EVP_sha224();
+    case NID_sha256: return EVP_sha256();
+    case NID_sha384: return EVP_sha384();
+    case NID_sha512: return EVP_sha512();
+  }
+  return NULL;
+}
+
+/* ---------------------------------------------------------- *
+ * signd_crltbs(): checks a DER TBSCertList, it must have our *
+ * issuer name, and the AlgorithmIdentifier of our key and    *
+ * 'md'. Only its outer fields are read, not the entries.     *
+ * returns the CASIGN_ reply status.                          *
+ * ---------------------------------------------------------- */
+static int signd_crltbs(const EVP_MD *md, const unsigned char *der, long len) {
+  const unsigned char *p = der, *end, *elem;
+  unsigned char aid[128];
+  size_t aidlen = sizeof(aid);
+  X509_NAME *name;
+  long elen;
+  int tag, xclass, i, ret;
+
+  /* the SEQUENCE, version, signature and issuer */
+  if ((ASN1_get_object(&p, &elen, &tag, &xclass, len) & 0x80) ||
+      tag != V_ASN1_SEQUENCE || p + elen != der + len) return CASIGN_FAILED;
+  end = p + elen;
+  for (i = 0; i < 3; i++) {
+    elem = p;
+    if ((ASN1_get_object(&p, &elen, &tag, &xclass, end - p) & 0x80))
+      return CASIGN_FAILED;
+    p += elen;
+    if (i == 0 && tag != V_ASN1_INTEGER) return CASIGN_FAILED;
+    if (i == 1 && (! casign_aid(cakey, md, aid, &aidlen) ||
+        (size_t) (p - elem) != aidlen || memcmp(elem, aid, aidlen) != 0))
+      return CASIGN_REFUSED;
+  }
+  if ((name = d2i_X509_NAME(NULL, &elem, p - elem)) == NULL)
+    return CASIGN_FAILED;
+  ret = (X509_NAME_cmp(name, X509_get_subject_name(cacert)) == 0) ?
+                                             CASIGN_OK : CASIGN_REFUSED;
+  X509_NAME_free(name);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * signd_sign(): signs the DER of one request, the result is  *
+ * the signed DER in 'out', or the signature of a TBS. Only   *
+ * certs and CRLs of our issuer name are signed.              *
+ * returns the CASIGN_ reply status.                          *
+ * ---------------------------------------------------------- */
+static int signd_sign(const CASIGN_FRAME *req, const unsigned char *der,
+                                            unsigned char **out, int *outlen) {
+  const EVP_MD *md = signd_digest(req->md);
+  const unsigned char *p = der;
+  X509_NAME *issuer = X509_get_subject_name(cacert);
+  X509_CRL *crl = NULL;
+  X509 *cert = NULL;
+  int ret = CASIGN_FAILED;
+
+  *out = NULL;
+  if (md == NULL) return CASIGN_REFUSED;
+
+  if (req->op == CASIGN_CERT) {
+    if ((cert = d2i_X509(NULL, &p, req->len)) == NULL) return CASIGN_FAILED;
+    if (X509_NAME_cmp(X509_get_issuer_name(cert), issuer) != 0)
+      ret = CASIGN_REFUSED;
+    else if (X509_sign(cert, cakey, md) > 0 &&
+             (*outlen = i2d_X509(cert, out)) > 0) ret = CASIGN_OK;
+    X509_free(cert);
+  }
+  else if (req->op == CASIGN_CRL) {
+    if ((crl = d2i_X509_CRL(NULL, &p, req->len)) == NULL) return CASIGN_FAILED;
+    if (X509_NAME_cmp(X509_CRL_get_issuer(crl), issuer) != 0)
+      ret = CASIGN_REFUSED;
+    else if (X509_CRL_sign(crl, cakey, md) > 0 &&
+             (*outlen = i2d_X509_CRL(crl, out)) > 0) ret = CASIGN_OK;
+    X509_CRL_free(crl);
+  }
+  else if (req->op == CASIGN_CRLTBS) {
+    EVP_MD_CTX *ctx;
+    size_t siglen;
+
+    if ((ret = signd_crltbs(md, der, req->len)) != CASIGN_OK) return ret;
+    ret = CASIGN_FAILED;
+    if ((ctx = EVP_MD_CTX_new()) != NULL &&
+        EVP_DigestSignInit(ctx, NULL, md, NULL, cakey) > 0 &&
+        EVP_DigestSign(ctx, NULL, &siglen, der, req->len) > 0 &&
+        (*out = OPENSSL_malloc(siglen)) != NULL &&
+        EVP_DigestSign(ctx, *out, &siglen, der, req->len) > 0) {
+      *outlen = siglen;
+      ret = CASIGN_OK;
+    }
+    EVP_MD_CTX_free(ctx);
+  }
+  else ret = CASIGN_REFUSED;
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * signd_conn(): the thread of one client connection. Reads   *
+ * the requests until the client closes, a reply for each.    *
+ * ---------------------------------------------------------- */
+static void *signd_conn(void *arg) {
+  int fd = (int) (intptr_t) arg;
+  unsigned char *der, *out;
+  CASIGN_FRAME f;
+  int outlen = 0;
+
+  while (casign_read(fd, &f, &der)) {
+    f.status = signd_sign(&f, der, &out, &outlen);
+    if (verbose) printf("certsignd: %s request, %u bytes, status %d\n",
+             f.op == CASIGN_CERT ? "cert" : f.op == CASIGN_CRL ? "CRL" :
+             "CRL TBS", f.len, (int) f.status);
+    f.len = (f.status == CASIGN_OK) ? outlen : 0;
+    free(der);
+    if (! casign_write(fd, &f, out)) {
+      OPENSSL_free(out);
+      break;
+    }
+    OPENSSL_free(out);
+  }
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_un addr;
+  pthread_attr_t attr;
+  pthread_t tid;
+  FILE *fp;
+  int lfd, fd;
+
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "-v") != 0)) {
+    fprintf(stderr, "usage: certsignd [-v]\n");
+    return 2;
+  }
+  verbose = (argc == 2);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  /* ---------------------------------------------------------- *
+   * load the CA cert and key, the one key decryption we do     *
+   * ---------------------------------------------------------- */
+  if (! (fp = fopen(CACERT, "r")))
+    int_error("Error reading CA cert file");
+  if (! (cacert = PEM_read_X509(fp, NULL, NULL, NULL)))
+    int_error("Error loading CA cert into memory");
+  fclose(fp);
+  cakey = load_cakey();
+  if (X509_check_private_key(cacert, cakey) != 1)
+    int_error("Error CA private key does not match the CA cert");
+
+  /* ---------------------------------------------------------- *
+   * create the socket. A socket file left from a crash is      *
+   * replaced, one with a running certsignd behind it is not.   *
+   * ---------------------------------------------------------- */
+  memset(&addr, '\0', sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(SIGNSOCKET) >= sizeof(addr.sun_path))
+    int_error("Error SIGNSOCKET path is too long");
+  strcpy(addr.sun_path, SIGNSOCKET);
+
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+    int_error("Error cannot create the socket");
+  if (connect(lfd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+    int_error("Error certsignd is already running on SIGNSOCKET");
+  close(lfd);
+
+  unlink(SIGNSOCKET);
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+    int_error("Error cannot create the socket");
+  umask(007);
+  if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    int_error("Error cannot bind the socket to SIGNSOCKET");
+  if (listen(lfd, SOMAXCONN) != 0)
+    int_error("Error cannot listen on SIGNSOCKET");
+
+  if (verbose) printf("certsignd: signing for %s on %s\n", CACERT, SIGNSOCKET);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    if ((fd = accept(lfd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      int_error("Error accepting a connection on SIGNSOCKET");
+    }
+    if (pthread_create(&tid, &attr, signd_conn, (void *) (intptr_t) fd) != 0) {
+      fprintf(stderr, "certsignd: cannot create a connection thread\n");
+      close(fd);
+    }
+  }
+  return 0;
+}
@@ -2,21 +2,12 @@
  * file:         certstore.c                                                  *
  * purpose:      display the list of signed certificates                      *
  * -------------------------------------------------------------------------- */
-
-/* defines needed for strptime() function */
-#define _XOPEN_SOURCE
-#define __USE_XOPEN
-#define __USE_GNU
-#define _GNU_SOURCE
-
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
-#include <sys/types.h>
-#include <dirent.h>
 #include <errno.h>
 #include <cgic.h>
 #include <openssl/x509.h>
@@ -24,155 +15,106 @@
 #include <openssl/pem.h>
 #include "webcert.h"
 
-int check_index(X509 *x509, CA_DB *db);
-
-int hexsort(const struct dirent **test1, const struct dirent **test2) {
-  char *endptr;
-  return (strtol((*test1)->d_name, &endptr, 16)
-        - strtol((*test2)->d_name, &endptr, 16));
-}
-
-int file_select(const struct dirent *entry) {
-
-  /* check for "." and ".." directory entries */
-  if(entry->d_name[0]=='.') return 0;
+/* ---------------------------------------------------------- *
+ * pageform(): writes a page navigation button. The page move *
+ * is keyed on the serial of the cert 'rec', if one is given. *
+ * ---------------------------------------------------------- */
+void pageform(const char *move, const CERT_REC *rec, const CERT_PAGE *page,
+                              const char *sorting, const char *label) {
+  char cursorstr[SERIAL_HEXLEN] = "";
 
-  /* Check for <id>.pem file name extensions */
-  if(strstr(entry->d_name, ".pem") != NULL) return 1;
-  else return 0;
+  fprintf(cgiOut, "<form action=\"certstore.cgi\" method=\"post\">\n");
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"sort\" ");
+  fprintf(cgiOut, "value=\"%s\" />\n", sorting);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagesize\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page->pagesize);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"move\" ");
+  fprintf(cgiOut, "value=\"%s\" />\n", move);
+  if(rec) {
+    serial_to_hex(&rec->serial, cursorstr, sizeof(cursorstr));
+    fprintf(cgiOut, "<input type=\"hidden\" name=\"cursor\" ");
+    fprintf(cgiOut, "value=\"%s\" />\n", cursorstr);
+  }
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"page\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page->pagenumber);
+  fprintf(cgiOut, "<input type=\"submit\" value=\"%s\" />\n", label);
+  fprintf(cgiOut, "</form>\n");
 }
 
 int cgiMain() {
 
   static char      title[]           = "List of existing Certificates";
          char      sorting[16]       = "desc";
-         char      certfilestr[277]  = "";
-         FILE      *certfile         = NULL;
-         BIO       *membio           = NULL;
-         BIO       *outbio           = NULL;
-         char      membio_buf[128]   = "";
-         X509      *cert             = NULL;
-         X509_NAME *certsubject      = NULL;
-         ASN1_TIME *start_date       = NULL;
-         ASN1_TIME *expiration_date  = NULL;
-  struct tm        start_tm;
-  struct tm        expiration_tm;
+         char      certnamestr[81]   = "";
+  const  CERT_REC  *rec              = NULL;
+         CERT_INDEX certidx;
          time_t    now               = time(NULL);
-         time_t    start             = time(NULL);
-         time_t    expiration        = time(NULL);
-         double    available_secs    = 0;
          double    remaining_secs    = 0;
-  struct dirent    **certstore_files = NULL;
          int       pagenumber        = 1;
          int       certcounter       = 0;
          int       tempcounter       = 0;
          int       pagecounter       = 0;
          int       dispcounter       = 0;
-         int       dispmaxlines      = 0;
          int       certvalidity      = 0;
-         div_t     disp_calc;
          div_t     oddline_calc;
-         double    percent           = 0;
-
-         cert                       = X509_new();
-         certsubject                = X509_NAME_new();
-
-/* ---------------------------------------------------------- *
- * Get all revoked certificates from revocation DB index.txt  *
- * ---------------------------------------------------------- */
-  CA_DB *db = NULL;
-  DB_ATTR db_attr;
-  if((db = load_index(INDEXFILE, &db_attr)) == NULL)
-    int_error("Error cannot load CRL certificate database file");
+         CERT_PAGE page;
+         CERT_SERIAL cursor;
+         char      move[8]           = "";
+         char      cursorstr[SERIAL_HEXLEN] = "";
+         int       percent           = 0;
 
 /* ---------------------------------------------------------- *
- * Get the list of .pem files from the cert directory         *
+ * Map the cert store index, it has the certs in serial order *
+ * and includes the revocation state, no PEM file is opened.  *
  * ---------------------------------------------------------- */
-  certcounter = scandir(CACERTSTORE, &certstore_files, file_select, hexsort);
+  if (! load_certindex(&certidx, CERTINDEX))
+    int_error("Error cannot load the certificate store index file");
+  certcounter = certidx.count;
   if(certcounter<=0) int_error("Error: No certificate files found.");
 
-/* ----------------------------------------------------------- *
- * calculate how many pages we get with MAXCERTDISPLAY         *
- * ------------------------------------------------------------*/
-  if(certcounter<=MAXCERTDISPLAY) pagecounter = 1;
-  else {
-    disp_calc = div(certcounter, MAXCERTDISPLAY);
-    /* if the count of certs divided by MAXCERTDISPLAY has no remainder */
-    if(disp_calc.rem == 0) pagecounter = disp_calc.quot;
-    /* with a remainder, we must prepare an extra page for the rest */
-    else pagecounter = disp_calc.quot +1;
-  }
-
 /* ---------------------------------------------------------- *
- * Check if CGI was called with a pagenumber and sort request *
+ * Check if CGI was called with a page move and sort request. *
+ * Paging is keyset based: the "cursor" is the serial of the  *
+ * last (next) or first (prev) cert shown, its position is a  *
+ * binary search in the index, only the page recs are read.   *
  * ---------------------------------------------------------- */
-  if(cgiFormInteger("page", &pagenumber, 1) == cgiFormSuccess)
-    if(pagenumber > pagecounter || pagenumber <=0)
-      int_error("Error: Page does not exist.");
-
   if(cgiFormString("sort", sorting, sizeof(sorting)) != cgiFormSuccess)
       strncpy(sorting, "desc", sizeof(sorting));
+  if(strcmp(sorting, "asc") != 0) strncpy(sorting, "desc", sizeof(sorting));
 
-/* ---------------------------------------------------------- *
- * We know how many total certs exist, let's build the page.  *
- * For every MAXCERTDISPLAY certs we start a new page, and    *
- * cycle by calling ourself with the requested certs in range.*
- * ---------------------------------------------------------- */
-  if(strcmp(sorting, "asc") == 0) {
-
-    if(certcounter <= MAXCERTDISPLAY) {
-       dispmaxlines = certcounter;
-       tempcounter = 0;
-    }
-    else
-      if(pagenumber == pagecounter &&
-             ( pagecounter * MAXCERTDISPLAY) - certcounter != 0) {
-
-        tempcounter = (pagecounter * MAXCERTDISPLAY) - MAXCERTDISPLAY;
-        dispmaxlines = certcounter - ((pagecounter-1) * MAXCERTDISPLAY);
-      }
-      else {
-
-        tempcounter = (pagenumber * MAXCERTDISPLAY) - MAXCERTDISPLAY;
-        dispmaxlines = MAXCERTDISPLAY;
-      }
-  }
+  memset(&page, '\0', sizeof(page));
+  cgiFormInteger("pagesize", &page.pagesize, MAXCERTDISPLAY);
+  if(page.pagesize < 1 || page.pagesize > MAXPAGESIZE)
+    int_error("Error: Page size is out of range.");
 
-  if(strcmp(sorting, "desc") == 0) {
+  if(cgiFormString("move", move, sizeof(move)) != cgiFormSuccess)
+    strncpy(move, "first", sizeof(move));
 
-    if(certcounter <= MAXCERTDISPLAY) {
-       dispmaxlines = certcounter;
-       tempcounter = certcounter;
-    }
-    else
-      if(pagenumber == pagecounter &&
-             ( pagecounter * MAXCERTDISPLAY) - certcounter != 0) {
+  /* a page # without a move comes from the goto form */
+  if(cgiFormInteger("page", &page.pagenumber, 1) == cgiFormSuccess &&
+     strcmp(move, "first") == 0) strncpy(move, "page", sizeof(move));
 
-        tempcounter = certcounter - ((pagecounter-1) * MAXCERTDISPLAY);
-        dispmaxlines = certcounter - ((pagecounter-1) * MAXCERTDISPLAY);
-      }
-      else {
+  if(cgiFormString("cursor", cursorstr, sizeof(cursorstr)) == cgiFormSuccess
+     && ! serial_from_hex(&cursor, cursorstr))
+    int_error("Error: Invalid page cursor serial.");
 
-       tempcounter = certcounter - (pagenumber*MAXCERTDISPLAY) + MAXCERTDISPLAY;
-       dispmaxlines = MAXCERTDISPLAY;
-      }
-  }
+  if(! page_certrecs(&page, certidx.recs, certidx.count, NULL,
+                     strcmp(sorting, "asc") == 0, move,
+                     cursorstr[0] ? &cursor : NULL))
+      int_error("Error: Page does not exist.");
+  pagenumber = page.pagenumber;
+  pagecounter = page.pagecounter;
 
 /* ---------------------------------------------------------- *
  * start the html output                                      *
  * ---------------------------------------------------------- */
 
-  outbio = BIO_new(BIO_s_file());
-  BIO_set_fp(outbio, cgiOut, BIO_NOCLOSE);
-
   pagehead(title);
 
   //debugging only:
   //printf("Number of certs: %d\n", certcounter);
-  //printf("Num tempcounter: %d\n", tempcounter);
   //printf("Number of pages: %d\n", pagecounter);
-  //printf("Div Quotient: %d\n", disp_calc.quot);
-  //printf("Div Remainder: %d\n", disp_calc.rem);
+  //printf("Page size: %d\n", page.pagesize);
   //fprintf(cgiOut, "</BODY></HTML>\n");
   //exit(0);
 
@@ -196,20 +138,16 @@ int cgiMain() {
    fprintf(cgiOut, "</th>\n");
    fprintf(cgiOut, "</tr>\n");
 
-  for(dispcounter=0; dispcounter < dispmaxlines; dispcounter++) {
+  for(dispcounter=0; dispcounter < page.lines; dispcounter++) {
 
     /* zero certificate values and flags */
     certvalidity = 0;
     percent = 0;
-    available_secs = 0;
     remaining_secs = 0;
-    cert = X509_new();
-    certsubject = X509_NAME_new();
-
-    if(strcmp(sorting, "desc") == 0) tempcounter--;
 
-    snprintf(certfilestr, sizeof(certfilestr), "%s/%s",
-                           CACERTSTORE, certstore_files[tempcounter]->d_name);
+    rec = page.recs[dispcounter];
+    tempcounter = rec - certidx.recs;
+    certrec_filename(rec, certnamestr, sizeof(certnamestr));
 
     fprintf(cgiOut, "<tr>\n");
     fprintf(cgiOut, "<th rowspan=\"2\">");
@@ -222,47 +160,30 @@ int cgiMain() {
     else
       fprintf(cgiOut, "<td rowspan=\"2\" class=\"even\">");
 
-    if ( (certfile = fopen(certfilestr, "r")) != NULL) {
-      PEM_read_X509(certfile, &cert, NULL, NULL);
-      certsubject = X509_get_subject_name(cert);
-
     /* ---------------------------------------------------------- *
-     * Display the subject data. Use the UTF-8 flag to show       *
-     * Japanese Kanji. This also needs the separator flag to work *
+     * Display the subject data, the index keeps it UTF-8 encoded *
      * ---------------------------------------------------------- */
-      fprintf(cgiOut, "<div class=\"scroll\">");
-      X509_NAME_print_ex_fp(cgiOut, certsubject, 0,
-         ASN1_STRFLGS_UTF8_CONVERT|XN_FLAG_SEP_CPLUS_SPC);
+    fprintf(cgiOut, "<div class=\"scroll\">");
+    fprintf(cgiOut, "%s", rec->subject);
 
     /* ---------------------------------------------------------- *
      * Check if the cert has been revoked, if yes add a marker.   *
      * ---------------------------------------------------------- */
-      int exist = check_index(cert, db);
-      if(exist == 1) fprintf(cgiOut, "<span class=\"revoked\"> (Revoked)</span>");
+    if(rec->state == DB_TYPE_REV)
+      fprintf(cgiOut, "<span class=\"revoked\"> (Revoked)</span>");
 
-    /* ---------------------------------------------------------- *
-     * store certificate start and expiration date for later use  *
-     * ---------------------------------------------------------- */
-      start_date = X509_get_notBefore(cert);
-      expiration_date = X509_get_notAfter(cert);
-
-      /* check the start and end dates in the cert */
-      if (X509_cmp_current_time (X509_get_notBefore (cert)) >= 0)
-        /* flag the certificate as not valid yet */
-        certvalidity = 0;
-      else
-      if (X509_cmp_current_time (X509_get_notAfter (cert)) <= 0)
-        /* flag the certificate as expired */
-        certvalidity = 0;
-      else 
-        /* flag the certificate is still valid */
-        certvalidity = 1;
-
-      fclose(certfile);
-    }
+    /* check the start and end dates in the cert */
+    if (rec->notbefore >= now)
+      /* flag the certificate as not valid yet */
+      certvalidity = 0;
+    else
+    if (rec->notafter <= now)
+      /* flag the certificate as expired */
+      certvalidity = 0;
     else 
-       fprintf(cgiOut, "Error: Can't open certificate file %s for reading.",
-                                                                 certfilestr);
+      /* flag the certificate is still valid */
+      certvalidity = 1;
+
     fprintf(cgiOut, "</div></td>\n");
 
     if(certvalidity == 0) {
@@ -290,47 +211,11 @@ int cgiMain() {
 
     if(certvalidity == 1) {
 
-      /* ------ START get the certificate lifetime in seconds ------ */
-      /* copy the start date into a string */
-      membio = BIO_new(BIO_s_mem());
-      ASN1_TIME_print(membio, start_date);
-      BIO_gets(membio, membio_buf, sizeof(membio_buf));
-      BIO_free(membio);
-
-      /* parse the start date string into a time struct */
-      memset (&start_tm, '\0', sizeof(start_tm));
-      strptime(membio_buf, "%h %d %T %Y %z", &start_tm);
-      start = mktime(&start_tm);
-
-      /* ------ START get the certificate remaining time in seconds ------ */
-      /* copy the expiration date into a string */
-      membio = BIO_new(BIO_s_mem());
-      ASN1_TIME_print(membio, expiration_date);
-      BIO_gets(membio, membio_buf, sizeof(membio_buf));
-      BIO_free(membio);
-  
-      /* parse the expiration date string into a time struct */
-      memset (&expiration_tm, '\0', sizeof(expiration_tm));
-      strptime(membio_buf, "%h %d %T %Y %z", &expiration_tm);
-  
-      /* get the current time */
-      now = time(NULL);
-      expiration = mktime(&expiration_tm);
-  
-      /* get the time difference between expiration time and current time */
-      remaining_secs = difftime(expiration, now);
-      /* ------ END get the certificate remaining time in seconds ------ */
+      /* ------ get the certificate remaining time in seconds ------ */
+      remaining_secs = (double) (rec->notafter - now);
 
-      /* get the time difference between start and expiration time */
-      available_secs = difftime(expiration, start);
-      /* ------ END get the certificate lifetime in seconds ------ */
-  
-      /* ------ START calculate percentage of lifetime left ------ */
-      /* remaining_secs *100                                       */
-      /* ------------------- = X, rounded down with floor()        */
-      /* available_secs                                            */
-      percent = floor((remaining_secs*100)/available_secs);
-      /* ------ END calculate percentage of lifetime left   ------ */
+      /* ------ percentage of lifetime left, integer epoch math ------ */
+      percent = lifetime_left(rec->notbefore, rec->notafter, now);
   
       /* expiration bar display column */
       fprintf(cgiOut, "<th rowspan=\"2\">\n");
@@ -372,7 +257,7 @@ int cgiMain() {
     fprintf(cgiOut, "<th>");
     fprintf(cgiOut, "<form action=\"getcert.cgi\" method=\"post\">\n");
     fprintf(cgiOut, "<input type=\"hidden\" name=\"cfilename\" ");
-    fprintf(cgiOut, "value=\"%s\" />\n", certstore_files[tempcounter]->d_name);
+    fprintf(cgiOut, "value=\"%s\" />\n", certnamestr);
     fprintf(cgiOut, "<input type=\"hidden\" name=\"format\" value=\"text\" />\n");
     fprintf(cgiOut, "<input class=\"getcert\" type=\"submit\" value=\"Detail\" />\n");
     fprintf(cgiOut, "</form>\n");
@@ -382,16 +267,12 @@ int cgiMain() {
     fprintf(cgiOut, "<th>\n");
 
     fprintf(cgiOut, "<form action=\"certrenew.cgi\" method=\"post\">\n");
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"cert-renew\" ");
-    fprintf(cgiOut, "value=\"");
-    PEM_write_bio_X509(outbio, cert);
-    fprintf(cgiOut, "\" />\n");
+    fprintf(cgiOut, "<input type=\"hidden\" name=\"cfilename\" ");
+    fprintf(cgiOut, "value=\"%s\" />\n", certnamestr);
     fprintf(cgiOut, "<input class=\"getcert\" type=\"submit\" value=\"Renew\" />\n");
     fprintf(cgiOut, "</form>\n");
     fprintf(cgiOut, "</th>\n");
     fprintf(cgiOut, "</tr>\n");
-
-    if(strcmp(sorting, "asc") == 0) tempcounter++;
   }
 
   fprintf(cgiOut, "<tr>\n");
@@ -410,6 +291,8 @@ int cgiMain() {
   fprintf(cgiOut, "<form action=\"certstore.cgi\" method=\"post\">\n");
   fprintf(cgiOut, "<input type=\"hidden\" name=\"sort\" ");
   fprintf(cgiOut, "value=\"desc\" />\n");
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagesize\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page.pagesize);
   fprintf(cgiOut, "<input type=\"submit\" name=\"sort\"");
   fprintf(cgiOut, " value=\"Latest Certs first\" />\n");
   fprintf(cgiOut, "</form>\n");
@@ -419,6 +302,8 @@ int cgiMain() {
   fprintf(cgiOut, "<form action=\"certstore.cgi\" method=\"post\">\n");
   fprintf(cgiOut, "<input type=\"hidden\" name=\"sort\" ");
   fprintf(cgiOut, "value=\"asc\" />\n");
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagesize\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page.pagesize);
   fprintf(cgiOut, "<input type=\"submit\" name=\"sort\"");
   fprintf(cgiOut, " value=\"Oldest Certs first\" />\n");
   fprintf(cgiOut, "</form>\n");
@@ -429,86 +314,46 @@ int cgiMain() {
   fprintf(cgiOut, "&nbsp;");
   fprintf(cgiOut, "</th>\n");
 
-  if(pagenumber == 1) {
+  if(! page.has_prev) {
     fprintf(cgiOut, "<th width=\"78px\">\n");
-    fprintf(cgiOut, "Newest Page");
+    fprintf(cgiOut, "%s Page", strcmp(sorting, "asc") == 0 ? "Oldest" : "Newest");
     fprintf(cgiOut, "</th>\n");
   }
   else {
     // goto page 1
     fprintf(cgiOut, "<th width=\"5\">\n");
-    fprintf(cgiOut, "<form action=\"certstore.cgi\" method=\"post\">\n");
-    fprintf(cgiOut, "<input type=\"submit\" value=\"&lt;&lt;\" />\n");
-    fprintf(cgiOut, "</form>\n");
+    pageform("first", NULL, &page, sorting, "&lt;&lt;");
     fprintf(cgiOut, "</th>\n");
-  
-    // goto page before
+
+    // goto page before, keyed on the first cert shown
     fprintf(cgiOut, "<th width=\"5\">\n");
-    fprintf(cgiOut, "<form action=\"certstore.cgi\" method=\"post\">\n");
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
-    fprintf(cgiOut, "value=\"%d\" />\n", certcounter);
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"pagecounter\" ");
-    fprintf(cgiOut, "value=\"%d\" />\n", pagecounter);
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"page\" ");
-    fprintf(cgiOut, "value=\"");
-    tempcounter = 0;
-    if(pagenumber > 1) tempcounter = pagenumber - 1;
-    else tempcounter = 1;
-    fprintf(cgiOut, "%d", tempcounter);
-    fprintf(cgiOut, "\" />\n");
-    fprintf(cgiOut, "<input type=\"submit\" value=\"&lt; 1\" />\n");
-    fprintf(cgiOut, "</form>\n");
+    pageform("prev", page.recs[0], &page, sorting, "&lt; 1");
     fprintf(cgiOut, "</th>\n");
   }
 
-  if(pagenumber == pagecounter) {
+  if(! page.has_next) {
     fprintf(cgiOut, "<th width=\"78px\">\n");
-    fprintf(cgiOut, "Oldest Page");
+    fprintf(cgiOut, "%s Page", strcmp(sorting, "asc") == 0 ? "Newest" : "Oldest");
     fprintf(cgiOut, "</th>\n");
   }
   else {
-    // goto page after
+    // goto page after, keyed on the last cert shown
     fprintf(cgiOut, "<th width=\"5\">\n");
-    fprintf(cgiOut, "<form action=\"certstore.cgi\" method=\"post\">\n");
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
-    fprintf(cgiOut, "value=\"%d\" />\n", certcounter);
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"pagecounter\" ");
-    fprintf(cgiOut, "value=\"%d\" />\n", pagecounter);
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"page\" ");
-    fprintf(cgiOut, "value=\"");
-    tempcounter = 0;
-    if(pagecounter > pagenumber) tempcounter = pagenumber + 1;
-    else tempcounter = pagecounter;
-    fprintf(cgiOut, "%d", tempcounter);
-    fprintf(cgiOut, "\" />\n");
-    fprintf(cgiOut, "<input type=\"submit\" value=\"1 &gt;\" />\n");
-    fprintf(cgiOut, "</form>\n");
+    pageform("next", page.recs[page.lines-1], &page, sorting, "1 &gt;");
     fprintf(cgiOut, "</th>\n");
-  
+
     // goto last page
     fprintf(cgiOut, "<th width=\"5\">\n");
-    fprintf(cgiOut, "<form action=\"certstore.cgi\" method=\"post\">");
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
-    fprintf(cgiOut, "value=\"%d\" />\n", certcounter);
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"pagecounter\" ");
-    fprintf(cgiOut, "value=\"%d\" />\n", pagecounter);
-    fprintf(cgiOut, "<input type=\"hidden\" name=\"page\" ");
-    fprintf(cgiOut, "value=\"%d\" />\n", pagecounter);
-    fprintf(cgiOut, "<input type=\"submit\" value=\"&gt;&gt;\" />\n");
-    fprintf(cgiOut, "</form>\n");
+    pageform("last", NULL, &page, sorting, "&gt;&gt;");
     fprintf(cgiOut, "</th>\n");
   }
   // goto page number
   fprintf(cgiOut, "<th width=\"120\">\n");
   fprintf(cgiOut, "<form class=\"setpage\" action=\"certstore.cgi\" method=\"post\">\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"certcounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", certcounter);
-  fprintf(cgiOut, "\" />\n");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagecounter\" ");
-  fprintf(cgiOut, "value=\"");
-  fprintf(cgiOut, "%d", pagecounter);
-  fprintf(cgiOut, "\" />\n");
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"sort\" ");
+  fprintf(cgiOut, "value=\"%s\" />\n", sorting);
+  fprintf(cgiOut, "<input type=\"hidden\" name=\"pagesize\" ");
+  fprintf(cgiOut, "value=\"%d\" />\n", page.pagesize);
   fprintf(cgiOut, "<input class=\"goto\" type=\"submit\" value=\"Goto\" />\n");
   fprintf(cgiOut, "&nbsp; &nbsp;");
   fprintf(cgiOut, "<input class=\"page\" type=\"text\" name=\"page\" ");
@@ -524,6 +369,6 @@ int cgiMain() {
  * ---------------------------------------------------------------------------*/
   pagefoot();
 
-  BIO_free(outbio);
+  free_certindex(&certidx);
   return(0);
 }
@@ -0,0 +1,156 @@
+/* ---------------------------------------------------------- *
+ * file:	certtime.c                                    *
+ * purpose:	shared time layer: decodes ASN1 certificate   *
+ *              and index.txt times straight into UTC epoch   *
+ *              seconds, and parses the search form bounds.   *
+ *              No strptime(), mktime() or TZ database use.   *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <openssl/asn1.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * days_from_civil(): # of days since 1970-01-01 for a date   *
+ * of the proleptic Gregorian calendar, valid for any year.   *
+ * ---------------------------------------------------------- */
+static int64_t days_from_civil(int64_t y, int m, int d) {
+  int64_t era, yoe, doy, doe;
+
+  y -= (m <= 2);
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+/* ---------------------------------------------------------- *
+ * utc_to_epoch(): converts broken down UTC date and time to  *
+ * epoch seconds. returns 1 for success, 0 for invalid values *
+ * ---------------------------------------------------------- */
+int utc_to_epoch(int year, int mon, int day, int hour, int min, int sec,
+                                                          int64_t *epoch) {
+  static const int mdays[] = { 31,29,31,30,31,30,31,31,30,31,30,31 };
+
+  if (year < 0 || mon < 1 || mon > 12 || day < 1 || day > mdays[mon-1] ||
+      hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+    return 0;
+
+  *epoch = days_from_civil(year, mon, day) * 86400
+           + hour * 3600 + min * 60 + sec;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * digits(): reads n decimal digits, -1 if one is not a digit *
+ * ---------------------------------------------------------- */
+static int digits(const char *p, int n) {
+  int v = 0;
+
+  while (n-- > 0) {
+    if (! isdigit((unsigned char) *p)) return -1;
+    v = v * 10 + (*p++ - '0');
+  }
+  return v;
+}
+
+/* ---------------------------------------------------------- *
+ * dbtime_to_epoch(): decodes the time string formats of DER  *
+ * and index.txt: UTCTime "YYMMDDHHMMSSZ" and GeneralizedTime *
+ * "YYYYMMDDHHMMSSZ". Anything after the 'Z', i.e. a ",reason"*
+ * of index.txt, is ignored. returns 1 for success, 0 errors. *
+ * ---------------------------------------------------------- */
+int dbtime_to_epoch(const char *str, int64_t *epoch) {
+  size_t len = strcspn(str, "Z");
+  int year;
+
+  if (str[len] != 'Z') return 0;
+
+  if (len == 12) {
+    /* RFC 5280: UTCTime years 50-99 are 19xx, 00-49 are 20xx */
+    if ((year = digits(str, 2)) < 0) return 0;
+    year += (year < 50) ? 2000 : 1900;
+    str += 2;
+  }
+  else if (len == 14) {
+    if ((year = digits(str, 4)) < 0) return 0;
+    str += 4;
+  }
+  else return 0;
+
+  return utc_to_epoch(year, digits(str, 2), digits(str+2, 2),
+                digits(str+4, 2), digits(str+6, 2), digits(str+8, 2), epoch);
+}
+
+/* ---------------------------------------------------------- *
+ * asn1_to_epoch(): converts a certificate ASN1_TIME into UTC *
+ * epoch seconds. The DER forms are decoded directly, others  *
+ * (fractions, offsets) go through OpenSSL. returns 1 or 0.   *
+ * ---------------------------------------------------------- */
+int asn1_to_epoch(const ASN1_TIME *t, int64_t *epoch) {
+  char buf[32];
+  struct tm tm;
+  int len;
+
+  if (t == NULL) return 0;
+
+  len = ASN1_STRING_length(t);
+  if ((len == 13 && ASN1_STRING_type(t) == V_ASN1_UTCTIME) ||
+      (len == 15 && ASN1_STRING_type(t) == V_ASN1_GENERALIZEDTIME)) {
+    memcpy(buf, ASN1_STRING_get0_data(t), len);
+    buf[len] = '\0';
+    if (dbtime_to_epoch(buf, epoch)) return 1;
+  }
+
+  memset(&tm, '\0', sizeof(tm));
+  if (! ASN1_TIME_to_tm(t, &tm)) return 0;
+  return utc_to_epoch(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                            tm.tm_hour, tm.tm_min, tm.tm_sec, epoch);
+}
+
+/* ---------------------------------------------------------- *
+ * formtime_to_epoch(): parses the search form date and time  *
+ * "DD.MM.YYYY" and "HH:MM", both entered in UTC, into epoch  *
+ * seconds. Called once per request for each range bound.     *
+ * returns 1 for success, 0 for a malformed date or time.     *
+ * ---------------------------------------------------------- */
+int formtime_to_epoch(const char *datestr, const char *timestr,
+                                                          int64_t *epoch) {
+  int day, mon, year, hour, min;
+  char end;
+
+  /* one or two digit day, month, hour and minute, as strptime() did */
+  if (sscanf(datestr, "%2d.%2d.%4d%c", &day, &mon, &year, &end) != 3 ||
+      sscanf(timestr, "%2d:%2d%c", &hour, &min, &end) != 2)
+    return 0;
+
+  return utc_to_epoch(year, mon, day, hour, min, 0, epoch);
+}
+
+/* ---------------------------------------------------------- *
+ * epoch_to_str(): formats epoch seconds the same way as      *
+ * ASN1_TIME_print(), e.g. "Oct 16 01:53:50 2027 GMT".        *
+ * ---------------------------------------------------------- */
+char *epoch_to_str(int64_t epoch, char *buf, size_t buflen) {
+  time_t t = (time_t) epoch;
+  struct tm tm;
+
+  if (gmtime_r(&t, &tm) == NULL ||
+      strftime(buf, buflen, "%b %e %H:%M:%S %Y GMT", &tm) == 0)
+    snprintf(buf, buflen, "***n/a***");
+  return buf;
+}
+
+/* ---------------------------------------------------------- *
+ * lifetime_left(): percentage of the validity period between *
+ * notbefore and notafter that is left at 'now', 0..100, with *
+ * integer math only. Used for the expiry bars.               *
+ * ---------------------------------------------------------- */
+int lifetime_left(int64_t notbefore, int64_t notafter, int64_t now) {
+  if (now >= notafter) return 0;
+  if (now <= notbefore || notafter <= notbefore) return 100;
+  return (int) (((notafter - now) * 100) / (notafter - notbefore));
+}
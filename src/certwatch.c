@@ -0,0 +1,268 @@
+/* ---------------------------------------------------------- *
+ * file:	certwatch.c                                   *
+ * purpose:	command line tool, keeps the cert store index *
+ *              current without full rescans. It watches the  *
+ *              CACERTSTORE dir and INDEXDB with inotify: new *
+ *              or rewritten cert files are added to, or      *
+ *              replaced in the index, DN and SAN indexes,    *
+ *              and new revocations in INDEXDB are flagged.   *
+ *              Each change bumps the index generation.       *
+ *              Runs in the foreground, start it from init.   *
+ *              usage: certwatch [-v]                         *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
+#include "webcert.h"
+
+#define WATCH_STORE  (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE)
+#define WATCH_DB     (IN_CLOSE_WRITE|IN_MOVED_TO)
+
+static int verbose = 0;
+static REV_MAP *revmap = NULL;
+
+/* ---------------------------------------------------------- *
+ * handle_error(): the tool has no html page, int_error() in  *
+ * the shared code ends up here.                              *
+ * ---------------------------------------------------------- */
+void handle_error(const char *file, int lineno, const char *msg) {
+  fprintf(stderr, "certwatch: %s (%s line %d)\n", msg, file, lineno);
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+/* ---------------------------------------------------------- *
+ * WATCH_DIR: the watched store dirs, the top dir and with    *
+ * SHARDED_STORE the shard dirs, to map a watch back to its   *
+ * path. A new shard dir gets its watch when it is created.   *
+ * ---------------------------------------------------------- */
+typedef struct watch_dir_st {
+  int           wd;
+  char          path[256];
+} WATCH_DIR;
+
+static WATCH_DIR *dirs = NULL;
+static int dircount = 0;
+
+static const char *watch_path(int wd) {
+  int i;
+
+  for (i = 0; i < dircount; i++)
+    if (dirs[i].wd == wd) return dirs[i].path;
+  return NULL;
+}
+
+/* ---------------------------------------------------------- *
+ * watch_certname(): 1 for a store file name <serial>.pem, or *
+ * <serial>.der, the names the scan engine picks up.          *
+ * ---------------------------------------------------------- */
+static int watch_certname(const char *name) {
+  if (name[0] == '.') return 0;
+  return (strstr(name, ".pem") != NULL || strstr(name, ".der") != NULL);
+}
+
+/* ---------------------------------------------------------- *
+ * watch_cert(): applies one new or rewritten store file to   *
+ * the indexes. A file the index already has unchanged, i.e.  *
+ * just written by certsign.cgi, is skipped. A cert that is   *
+ * already revoked in INDEXDB is flagged right away.          *
+ * ---------------------------------------------------------- */
+static void watch_cert(const char *path) {
+  CERT_INDEX idx;
+  CERT_SERIAL serial;
+  X509 *cert = NULL;
+  int64_t revoked;
+  int current = 0;
+  FILE *fp;
+
+  if ((fp = fopen(path, "r")) == NULL) return;
+  cert = read_certfile(fp, NULL);
+  fclose(fp);
+  if (cert == NULL ||
+      ! serial_from_asn1(&serial, X509_get_serialNumber(cert))) {
+    fprintf(stderr, "certwatch: %s is not a certificate\n", path);
+    X509_free(cert);
+    return;
+  }
+
+  if (load_certindex(&idx, CERTINDEX)) {
+    current = current_certindex(&idx, cert);
+    free_certindex(&idx);
+  }
+
+  if (! current) {
+    if (! update_certindex(CERTINDEX, cert, 0))
+      fprintf(stderr, "certwatch: error updating %s for %s\n", CERTINDEX, path);
+    else if (verbose) printf("certwatch: indexed %s\n", path);
+    if (! dngram_add(DNINDEX, &serial))
+      fprintf(stderr, "certwatch: error updating %s for %s\n", DNINDEX, path);
+    if (! sanidx_add(SANINDEX, cert))
+      fprintf(stderr, "certwatch: error updating %s for %s\n", SANINDEX, path);
+    if (revmap_get(revmap, &serial, &revoked))
+      revoke_certrec(CERTINDEX, &serial, (time_t) revoked);
+  }
+  X509_free(cert);
+}
+
+/* ---------------------------------------------------------- *
+ * watch_revsync(): reloads INDEXDB, and flags the revoked    *
+ * certs that are not flagged in the index yet.               *
+ * ---------------------------------------------------------- */
+static void watch_revsync() {
+  CERT_INDEX idx;
+  int64_t revoked;
+  uint64_t i;
+  int n = 0;
+
+  free_revmap(revmap);
+  revmap = load_revmap(INDEXDB);
+  if (! load_certindex(&idx, CERTINDEX)) return;
+
+  /* revocations only update records in place, the map stays valid */
+  for (i = 0; i < idx.count; i++) {
+    if (! revmap_get(revmap, &idx.recs[i].serial, &revoked)) continue;
+    if (idx.recs[i].state == DB_TYPE_REV && idx.recs[i].revoked == revoked)
+      continue;
+    if (revoke_certrec(CERTINDEX, &idx.recs[i].serial, (time_t) revoked)) n++;
+  }
+  free_certindex(&idx);
+  if (verbose && n > 0) printf("certwatch: %d revocations indexed\n", n);
+}
+
+#ifndef ARCHIVE_STORE
+/* ---------------------------------------------------------- *
+ * watch_dir(): adds the watch for a store dir, and applies   *
+ * the cert files that are in it already. For a new shard dir *
+ * they may have been written before the watch existed. With  *
+ * 'all' 0 (at startup), only certs that are not in the index *
+ * are applied, the others were indexed by their CGI.         *
+ * ---------------------------------------------------------- */
+static void watch_dir(int fd, const char *path, int level, int all) {
+  WATCH_DIR *tmp;
+  CERT_INDEX idx;
+  CERT_SERIAL serial;
+  struct dirent *ent;
+  char sub[512];
+  int haveidx;
+  DIR *dir;
+
+  if ((tmp = realloc(dirs, (dircount + 1) * sizeof(WATCH_DIR))) == NULL)
+    int_error("Error out of memory for the watch list");
+  dirs = tmp;
+  if ((dirs[dircount].wd = inotify_add_watch(fd, path, WATCH_STORE)) < 0) {
+    fprintf(stderr, "certwatch: cannot watch %s: %s\n", path, strerror(errno));
+    return;
+  }
+  snprintf(dirs[dircount].path, sizeof(dirs[dircount].path), "%s", path);
+  dircount++;
+
+  if ((dir = opendir(path)) == NULL) return;
+  haveidx = (! all && load_certindex(&idx, CERTINDEX));
+  while ((ent = readdir(dir)) != NULL) {
+    snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+#ifdef SHARDED_STORE
+    if (level < 2 && strlen(ent->d_name) == 2 && ent->d_name[0] != '.') {
+      watch_dir(fd, sub, level + 1, all);
+      continue;
+    }
+#endif
+    if (! watch_certname(ent->d_name)) continue;
+    if (haveidx && serial_from_hex(&serial, ent->d_name) &&
+        find_certindex(&idx, &serial)) continue;
+    watch_cert(sub);
+  }
+  if (haveidx) free_certindex(&idx);
+  closedir(dir);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  char dbdir[256] = "", path[512];
+  const char *dbname, *dirpath;
+  int fd, dbwd, revsync;
+  ssize_t len;
+  char *p;
+
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "-v") != 0)) {
+    fprintf(stderr, "usage: certwatch [-v]\n");
+    return 2;
+  }
+  verbose = (argc == 2);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  if ((fd = inotify_init1(IN_CLOEXEC)) < 0)
+    int_error("Error cannot initialize inotify");
+
+  /* ---------------------------------------------------------- *
+   * a INDEXDB commit closes its write fd, compaction renames a  *
+   * new file over it, watch its dir for the close or rename    *
+   * ---------------------------------------------------------- */
+  snprintf(dbdir, sizeof(dbdir), "%s", INDEXDB);
+  if ((p = strrchr(dbdir, '/')) == NULL) int_error("Error INDEXDB has no dir");
+  *p = '\0';
+  dbname = p + 1;
+  if ((dbwd = inotify_add_watch(fd, dbdir, WATCH_DB)) < 0)
+    int_error("Error cannot watch the INDEXDB dir");
+
+  /* ---------------------------------------------------------- *
+   * catch up with the changes made while we were not running   *
+   * ---------------------------------------------------------- */
+  revmap = load_revmap(INDEXDB);
+#ifndef ARCHIVE_STORE
+  /* archive certs are only added by tools that update the index */
+  watch_dir(fd, CACERTSTORE, 0, 0);
+#endif
+  watch_revsync();
+  if (verbose) printf("certwatch: watching %s, generation %llu\n", CACERTSTORE,
+                  (unsigned long long) certindex_generation(CERTINDEX));
+
+  for (;;) {
+    if ((len = read(fd, buf, sizeof(buf))) < 0) {
+      if (errno == EINTR) continue;
+      int_error("Error reading inotify events");
+    }
+
+    /* one INDEXDB reload per batch of events is enough */
+    revsync = 0;
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (const struct inotify_event *) p;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        /* events were lost, only a full rebuild is safe now */
+        fprintf(stderr, "certwatch: event queue overflow, rebuilding %s\n",
+                                                               CERTINDEX);
+        rebuild_certindex(CERTINDEX);
+        revsync = 1;
+        continue;
+      }
+      if (ev->len == 0) continue;
+
+      if (ev->wd == dbwd) {
+        if (strcmp(ev->name, dbname) == 0) revsync = 1;
+        continue;
+      }
+      if ((dirpath = watch_path(ev->wd)) == NULL) continue;
+      snprintf(path, sizeof(path), "%s/%s", dirpath, ev->name);
+
+      if (ev->mask & IN_ISDIR) {
+#ifdef SHARDED_STORE
+        if (strlen(ev->name) == 2)
+          watch_dir(fd, path, strcmp(dirpath, CACERTSTORE) == 0 ? 1 : 2, 1);
+#endif
+        continue;
+      }
+      /* a file is complete at its close, or at its rename into place */
+      if ((ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) &&
+          watch_certname(ev->name)) watch_cert(path);
+    }
+    if (revsync) watch_revsync();
+  }
+  return 0;
+}
@@ -0,0 +1,415 @@
+/* ---------------------------------------------------------- *
+ * file:	crlcache.c                                    *
+ * purpose:	cache of the revoked entries of the CRL. The  *
+ *              revokedCertificates entries of INDEXDB are    *
+ *              kept in CRLCACHE as their DER, in serial      *
+ *              order, ready to be copied into a new CRL. It  *
+ *              is current while the revgen of INDEXDB is the *
+ *              same. One revocation more is merged into it,  *
+ *              any other change rebuilds it from INDEXDB.    *
+ *              The CRL is put together here around it, only  *
+ *              the outer TBSCertList is new DER each time.   *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/asn1.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The cache file: the header, then 'len' bytes of the DER    *
+ * entries of the revoked certs, one after the other, in the  *
+ * order of their serials. This is the content of the CRL's   *
+ * revokedCertificates SEQUENCE as it is.                     *
+ * ---------------------------------------------------------- */
+#define CRLCACHE_MAGIC   "WCCRL\0\0\0"
+#define CRLCACHE_VERSION 1
+
+typedef struct crlcache_hdr_st {
+  char          magic[8];      /* CRLCACHE_MAGIC                  */
+  uint32_t      version;       /* CRLCACHE_VERSION                */
+  uint32_t      reserved;
+  uint64_t      dbid;          /* certdb_revgen() of the INDEXDB  */
+  uint64_t      revgen;        /* the entries were made from      */
+  uint64_t      count;         /* # of entries                    */
+  uint64_t      len;           /* DER bytes that follow           */
+  uint64_t      sum;           /* FNV-1a of the above and the DER */
+} CRLCACHE_HDR;
+
+/* ---------------------------------------------------------- *
+ * crlcache_sum(): FNV-1a hash of the header fields before    *
+ * 'sum' and the DER entries. A torn rewrite fails it.        *
+ * ---------------------------------------------------------- */
+static uint64_t crlcache_sum(const CRLCACHE_HDR *hdr, const unsigned char *der) {
+  const unsigned char *p = (const unsigned char *) hdr;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < offsetof(CRLCACHE_HDR, sum); i++)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  for (i = 0; i < hdr->len; i++)
+    h = (h ^ der[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_lock(): opens the cache file with an exclusive    *
+ * flock(), held until free_crlcache(). The file is rewritten *
+ * in place, never replaced, so the lock stays on the path.   *
+ * returns the fd, or -1 for errors.                          *
+ * ---------------------------------------------------------- */
+static int crlcache_lock(const char *cachefile) {
+  int fd;
+
+  if ((fd = open(cachefile, O_RDWR|O_CREAT|O_CLOEXEC, 0640)) < 0) return -1;
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_read(): the header and entries of the cache file, *
+ * a new, torn or foreign file has none. returns 1 for a good *
+ * file, with the entries in cc, or 0.                        *
+ * ---------------------------------------------------------- */
+static int crlcache_read(CRL_CACHE *cc, CRLCACHE_HDR *hdr) {
+  struct stat st;
+
+  if (fstat(cc->fd, &st) != 0 || st.st_size < (off_t) sizeof(CRLCACHE_HDR) ||
+      pread(cc->fd, hdr, sizeof(CRLCACHE_HDR), 0) != sizeof(CRLCACHE_HDR) ||
+      memcmp(hdr->magic, CRLCACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != CRLCACHE_VERSION ||
+      (uint64_t) st.st_size != sizeof(CRLCACHE_HDR) + hdr->len) return 0;
+  if (hdr->len == 0) return (hdr->sum == crlcache_sum(hdr, NULL));
+  if ((cc->der = malloc(hdr->len)) == NULL)
+    int_error("Error cannot allocate memory for the CRL cache");
+  if (pread(cc->fd, cc->der, hdr->len, sizeof(CRLCACHE_HDR)) != (ssize_t) hdr->len ||
+      hdr->sum != crlcache_sum(hdr, cc->der)) {
+    free(cc->der);
+    cc->der = NULL;
+    return 0;
+  }
+  cc->len   = hdr->len;
+  cc->count = hdr->count;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_write(): rewrites the locked cache file in place, *
+ * the header last. It is not synced, a cache torn in a crash *
+ * fails its length or sum check and is made again.           *
+ * returns 1 for success, 0 for errors.                       *
+ * ---------------------------------------------------------- */
+static int crlcache_write(const CRL_CACHE *cc, uint64_t dbid, uint64_t revgen) {
+  CRLCACHE_HDR hdr;
+
+  memset(&hdr, '\0', sizeof(hdr));
+  if (pwrite(cc->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) return 0;
+  if (cc->len > 0 &&
+      pwrite(cc->fd, cc->der, cc->len, sizeof(hdr)) != (ssize_t) cc->len)
+    return 0;
+  if (ftruncate(cc->fd, sizeof(hdr) + cc->len) != 0) return 0;
+
+  memcpy(hdr.magic, CRLCACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version = CRLCACHE_VERSION;
+  hdr.dbid    = dbid;
+  hdr.revgen  = revgen;
+  hdr.count   = cc->count;
+  hdr.len     = cc->len;
+  hdr.sum     = crlcache_sum(&hdr, cc->der);
+  return (pwrite(cc->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_entry(): the DER of the CRL entry of a revoked    *
+ * record, its serial, revocation date and reason extensions  *
+ * from make_revoked(). returns the length, 0 for errors.     *
+ * ---------------------------------------------------------- */
+static int crlcache_entry(const CADB_REC *rec, unsigned char **der) {
+  X509_REVOKED *r;
+  BIGNUM *bn = NULL;
+  ASN1_INTEGER *serial = NULL;
+  int len = 0;
+
+  *der = NULL;
+  if ((r = X509_REVOKED_new()) == NULL)
+    int_error("Error creating X509_REVOKED object");
+  if (make_revoked(r, rec->rev_date) &&
+      (bn = BN_bin2bn(rec->serial.b, SERIAL_LEN, NULL)) != NULL &&
+      (serial = BN_to_ASN1_INTEGER(bn, NULL)) != NULL &&
+      X509_REVOKED_set_serialNumber(r, serial))
+    len = i2d_X509_REVOKED(r, der);
+  if (len < 0) len = 0;
+  X509_REVOKED_free(r);
+  ASN1_INTEGER_free(serial);
+  BN_free(bn);
+  return len;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_serial(): the length of the DER entry at 'p', and *
+ * its serial. returns 1, or 0 if it does not decode.         *
+ * ---------------------------------------------------------- */
+static int crlcache_serial(const unsigned char *p, size_t avail,
+                              CERT_SERIAL *serial, size_t *entlen) {
+  const unsigned char *q = p;
+  long len;
+  int tag, xclass;
+
+  if ((ASN1_get_object(&q, &len, &tag, &xclass, avail) & 0x80) ||
+      tag != V_ASN1_SEQUENCE || (size_t) (q - p) + len > avail) return 0;
+  *entlen = (q - p) + len;
+  if ((ASN1_get_object(&q, &len, &tag, &xclass, *entlen - (q - p)) & 0x80) ||
+      tag != V_ASN1_INTEGER || len < 1) return 0;
+  /* a positive INTEGER, with a 0 byte before a high first bit */
+  if (len > 1 && q[0] == 0) {
+    q++;
+    len--;
+  }
+  if (len > SERIAL_LEN) return 0;
+  memset(serial->b, '\0', SERIAL_LEN);
+  memcpy(serial->b + SERIAL_LEN - len, q, len);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_add(): certdb_scan() callback of the rebuild, the *
+ * revoked records come in serial order and are appended.     *
+ * returns 1, or 0 for errors, which end the scan.            *
+ * ---------------------------------------------------------- */
+typedef struct crlcache_build_st {
+  CRL_CACHE    *cc;
+  size_t        cap;
+} CRLCACHE_BUILD;
+
+static int crlcache_add(const CADB_REC *rec, void *arg) {
+  CRLCACHE_BUILD *b = arg;
+  unsigned char *der, *buf;
+  int len;
+
+  if (rec->type != DB_TYPE_REV) return 1;
+  if ((len = crlcache_entry(rec, &der)) == 0) return 0;
+  if (b->cc->len + len > b->cap) {
+    b->cap = (b->cc->len + len) * 2;
+    if ((buf = realloc(b->cc->der, b->cap)) == NULL)
+      int_error("Error cannot allocate memory for the CRL cache");
+    b->cc->der = buf;
+  }
+  memcpy(b->cc->der + b->cc->len, der, len);
+  b->cc->len += len;
+  b->cc->count++;
+  OPENSSL_free(der);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_merge(): puts the record of one serial into the   *
+ * entries. An entry it has is replaced, or removed if it is  *
+ * not revoked anymore. Only the headers of the entries in    *
+ * front of it are read. returns 1, or 0 for errors.          *
+ * ---------------------------------------------------------- */
+static int crlcache_merge(CRL_CACHE *cc, CA_DB *db, const CERT_SERIAL *serial) {
+  CERT_SERIAL s;
+  CADB_REC rec;
+  unsigned char *der = NULL, *buf;
+  size_t off = 0, entlen = 0, oldlen = 0;
+  int len = 0;
+
+  while (off < cc->len) {
+    if (! crlcache_serial(cc->der + off, cc->len - off, &s, &entlen)) return 0;
+    if (memcmp(s.b, serial->b, SERIAL_LEN) >= 0) {
+      if (memcmp(s.b, serial->b, SERIAL_LEN) == 0) oldlen = entlen;
+      break;
+    }
+    off += entlen;
+  }
+
+  if (certdb_get(db, serial, &rec) && rec.type == DB_TYPE_REV &&
+      (len = crlcache_entry(&rec, &der)) == 0) return 0;
+  if (len == 0 && oldlen == 0) return 1;
+
+  if ((buf = malloc(cc->len - oldlen + len + 1)) == NULL)
+    int_error("Error cannot allocate memory for the CRL cache");
+  memcpy(buf, cc->der, off);
+  memcpy(buf + off, der, len);
+  memcpy(buf + off + len, cc->der + off + oldlen, cc->len - off - oldlen);
+  OPENSSL_free(der);
+  free(cc->der);
+  cc->der = buf;
+  cc->len = cc->len - oldlen + len;
+  if (oldlen) cc->count--;
+  if (len) cc->count++;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * load_crlcache(): the revoked entries of 'dbfile' as they   *
+ * are now, from the cache file, merged or rebuilt as needed. *
+ * The cache lock is held until free_crlcache(), so the CRLs  *
+ * are made one at a time, in the order of their content.     *
+ * returns 1 for success, 0 for errors.                       *
+ * ---------------------------------------------------------- */
+int load_crlcache(CRL_CACHE *cc, const char *cachefile, const char *dbfile) {
+  CRLCACHE_BUILD b;
+  CRLCACHE_HDR hdr;
+  CERT_SERIAL last;
+  CA_DB *db;
+  uint64_t dbid, revgen;
+  int cached;
+
+  memset(cc, '\0', sizeof(CRL_CACHE));
+  if ((cc->fd = crlcache_lock(cachefile)) < 0) return 0;
+
+  /* the database is read under the lock, not before */
+  db = certdb_open(dbfile, NULL);
+  revgen = certdb_revgen(db, &dbid, &last);
+  cached = crlcache_read(cc, &hdr) && hdr.dbid == dbid;
+
+  if (cached && hdr.revgen == revgen) {
+    certdb_close(db);
+    return 1;
+  }
+  if (! (cached && hdr.revgen + 1 == revgen && crlcache_merge(cc, db, &last))) {
+    free(cc->der);
+    cc->der = NULL;
+    cc->len = cc->count = 0;
+    b.cc = cc;
+    b.cap = 0;
+    if (! certdb_scan(db, crlcache_add, &b)) {
+      certdb_close(db);
+      free_crlcache(cc);
+      return 0;
+    }
+  }
+  certdb_close(db);
+
+  /* a cache that cannot be written is made again next time */
+  crlcache_write(cc, dbid, revgen);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * free_crlcache(): frees the entries and drops the lock.     *
+ * ---------------------------------------------------------- */
+void free_crlcache(CRL_CACHE *cc) {
+  free(cc->der);
+  cc->der = NULL;
+  cc->len = cc->count = 0;
+  if (cc->fd >= 0) close(cc->fd);
+  cc->fd = -1;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_put(): appends a DER header and the 'len' content *
+ * bytes, if 'data' is given. returns the end of the output.  *
+ * ---------------------------------------------------------- */
+static unsigned char *crlcache_put(unsigned char *p, int constructed,
+                   int tag, int xclass, const void *data, size_t len) {
+  ASN1_put_object(&p, constructed, len, tag, xclass);
+  if (data) {
+    memcpy(p, data, len);
+    p += len;
+  }
+  return p;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_tbs(): the DER of a v2 TBSCertList with the cached *
+ * entries, the issuer, the update times, and the crlNumber   *
+ * extension. 'aid' is the DER AlgorithmIdentifier it will be *
+ * signed with, see casign_aid(). returns the OPENSSL_malloc()*
+ * DER and its length in *len, or NULL for errors.            *
+ * ---------------------------------------------------------- */
+unsigned char *crlcache_tbs(const CRL_CACHE *cc, const unsigned char *aid,
+                   size_t aidlen, const X509_NAME *issuer,
+                   const ASN1_TIME *thisupd, const ASN1_TIME *nextupd,
+                   const ASN1_INTEGER *crlnumber, size_t *len) {
+  static const unsigned char v2[] = { 0x02, 0x01, 0x01 };
+  STACK_OF(X509_EXTENSION) *exts = NULL;
+  X509_EXTENSION *ext;
+  unsigned char *name = NULL, *tu = NULL, *nu = NULL, *ex = NULL;
+  unsigned char *tbs = NULL, *p;
+  int namelen, tulen, nulen, exlen;
+  size_t body;
+
+  if ((ext = X509V3_EXT_i2d(NID_crl_number, 0, (void *) crlnumber)) == NULL ||
+      (exts = sk_X509_EXTENSION_new_null()) == NULL ||
+      ! sk_X509_EXTENSION_push(exts, ext)) {
+    X509_EXTENSION_free(ext);
+    goto end;
+  }
+  if ((namelen = i2d_X509_NAME(issuer, &name)) <= 0 ||
+      (tulen = i2d_ASN1_TIME(thisupd, &tu)) <= 0 ||
+      (nulen = i2d_ASN1_TIME(nextupd, &nu)) <= 0 ||
+      (exlen = i2d_X509_EXTENSIONS(exts, &ex)) <= 0) goto end;
+
+  /* version, signature, issuer, thisUpdate, nextUpdate,  */
+  /* the revokedCertificates if any, [0] crlExtensions    */
+  body = sizeof(v2) + aidlen + namelen + tulen + nulen
+       + ASN1_object_size(1, exlen, 0);
+  if (cc->count > 0) body += ASN1_object_size(1, cc->len, V_ASN1_SEQUENCE);
+  *len = ASN1_object_size(1, body, V_ASN1_SEQUENCE);
+  if ((tbs = OPENSSL_malloc(*len)) == NULL) goto end;
+
+  p = crlcache_put(tbs, 1, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL, NULL, body);
+  memcpy(p, v2, sizeof(v2));
+  p += sizeof(v2);
+  memcpy(p, aid, aidlen);
+  p += aidlen;
+  memcpy(p, name, namelen);
+  p += namelen;
+  memcpy(p, tu, tulen);
+  p += tulen;
+  memcpy(p, nu, nulen);
+  p += nulen;
+  if (cc->count > 0)
+    p = crlcache_put(p, 1, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL, cc->der, cc->len);
+  crlcache_put(p, 1, 0, V_ASN1_CONTEXT_SPECIFIC, ex, exlen);
+
+end:
+  sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+  OPENSSL_free(name);
+  OPENSSL_free(tu);
+  OPENSSL_free(nu);
+  OPENSSL_free(ex);
+  return tbs;
+}
+
+/* ---------------------------------------------------------- *
+ * crlcache_crl(): the DER CertificateList of a signed TBS.   *
+ * returns the OPENSSL_malloc() DER and its length in *len,   *
+ * or NULL for errors.                                        *
+ * ---------------------------------------------------------- */
+unsigned char *crlcache_crl(const unsigned char *tbs, size_t tbslen,
+                   const unsigned char *aid, size_t aidlen,
+                   const unsigned char *sig, size_t siglen, size_t *len) {
+  unsigned char *crl, *p;
+  size_t body;
+
+  /* the BIT STRING of the signature has 0 unused bits */
+  body = tbslen + aidlen + ASN1_object_size(0, siglen + 1, V_ASN1_BIT_STRING);
+  *len = ASN1_object_size(1, body, V_ASN1_SEQUENCE);
+  if ((crl = OPENSSL_malloc(*len)) == NULL) return NULL;
+
+  p = crlcache_put(crl, 1, V_ASN1_SEQUENCE, V_ASN1_UNIVERSAL, NULL, body);
+  memcpy(p, tbs, tbslen);
+  p += tbslen;
+  memcpy(p, aid, aidlen);
+  p += aidlen;
+  p = crlcache_put(p, 0, V_ASN1_BIT_STRING, V_ASN1_UNIVERSAL, NULL, siglen + 1);
+  *p++ = 0;
+  memcpy(p, sig, siglen);
+  return crl;
+}
@@ -0,0 +1,385 @@
+/* ---------------------------------------------------------- *
+ * file:	dblog.c                                       *
+ * purpose:	write-ahead journal DBLOG of the serial files *
+ *              SERIALFILE and CRLSEQNUM. An update appends   *
+ *              the new serial value as a record, the files   *
+ *              are only rewritten by the checkpoint, to a    *
+ *              synced temp file that is renamed over the old *
+ *              one. Who reads them takes the last journaled  *
+ *              value, see dblog_serial(). The certs are in   *
+ *              INDEXDB, which commits by itself, certdb.c.   *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "webcert.h"
+
+/* ---------------------------------------------------------- *
+ * The journal: header, then the records, each with its data  *
+ * padded to 8 bytes. A serial record is the new value of the *
+ * file, hex. Type 1 were the index.txt rows before INDEXDB.  *
+ * The header keeps the end of the verified records, the seq  *
+ * of the last one and the offsets of the last serial and     *
+ * crlnumber records. A lookup or an append checks only these *
+ * two records and the ones after 'end', each with the next   *
+ * seq. If they fail, the header is ahead of lost data, and   *
+ * all records are scanned, see dblog_scan(). A torn record   *
+ * at the end fails its hash, the next append overwrites it.  *
+ * Version 1 had no state in its 16 byte header, it is read   *
+ * with dblog_scan(), the first writer checkpoints it.        *
+ * ---------------------------------------------------------- */
+#define DBLOG_MAGIC     "WCDBLOG\0"
+#define DBLOG_VERSION   2
+#define DBLOG_V1HDR     16
+#define DBLOG_RECMAGIC  0x52424457
+
+#define DBLOG_SERIAL    2      /* the value of SERIALFILE           */
+#define DBLOG_CRLNUM    3      /* the value of CRLSEQNUM            */
+
+typedef struct dblog_hdr_st {
+  char          magic[8];      /* DBLOG_MAGIC                     */
+  uint32_t      version;       /* DBLOG_VERSION                   */
+  uint32_t      seq;           /* seq of the last record to end   */
+  uint64_t      end;           /* end of the verified records     */
+  uint64_t      last[2];       /* last serial, crlnumber record   */
+} DBLOG_HDR;
+
+typedef struct dblog_rec_st {
+  uint32_t      magic;         /* DBLOG_RECMAGIC                  */
+  uint32_t      type;          /* DBLOG_SERIAL or DBLOG_CRLNUM    */
+  uint32_t      len;           /* data bytes, without the padding */
+  uint32_t      seq;           /* seq of the previous record + 1  */
+  uint64_t      sum;           /* FNV-1a hash of type and data    */
+} DBLOG_REC;
+
+#define DBLOG_PAD(n)  (((n) + 7) & ~(size_t) 7)
+
+/* the header with the hex values of the last records, or "" */
+typedef struct dblog_state_st {
+  DBLOG_HDR     hdr;
+  char          value[2][SERIAL_HEXLEN+8];
+} DBLOG_STATE;
+
+static int dblog_fd = -1;
+static int dblog_depth = 0;
+static int dblog_excl = 0;
+
+static uint64_t dblog_sum(uint32_t type, const unsigned char *p, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  h = (h ^ type) * 0x100000001b3ULL;
+  while (len-- > 0) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_type(): the record type of a serial file, 0 if it is *
+ * not one of the journaled files.                            *
+ * ---------------------------------------------------------- */
+static uint32_t dblog_type(const char *serialfile) {
+  if (strcmp(serialfile, SERIALFILE) == 0) return DBLOG_SERIAL;
+  if (strcmp(serialfile, CRLSEQNUM) == 0) return DBLOG_CRLNUM;
+  return 0;
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_reset(): writes an empty journal, its header first.  *
+ * The old records after it have an older seq, they are not  *
+ * taken if the truncate is lost. returns 1, or 0 for errors. *
+ * ---------------------------------------------------------- */
+static int dblog_reset(uint32_t seq) {
+  DBLOG_HDR hdr;
+
+  memset(&hdr, '\0', sizeof(hdr));
+  memcpy(hdr.magic, DBLOG_MAGIC, sizeof(hdr.magic));
+  hdr.version = DBLOG_VERSION;
+  hdr.seq     = seq;
+  hdr.end     = sizeof(hdr);
+  return (pwrite(dblog_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+          ftruncate(dblog_fd, sizeof(hdr)) == 0 && fdatasync(dblog_fd) == 0);
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_lock(): flock() of the journal, shared to read the   *
+ * CA files with the journal, exclusive to append or for the  *
+ * checkpoint. Calls nest, an exclusive holder can read, but  *
+ * a shared one can not start writing. returns 1, 0 errors.   *
+ * dblog_unlock(): ends the outermost dblog_lock().           *
+ * ---------------------------------------------------------- */
+static void dblog_checkpoint();
+
+int dblog_lock(int exclusive) {
+  DBLOG_HDR hdr;
+  struct stat st;
+
+  if (dblog_depth > 0) {
+    if (exclusive && ! dblog_excl) return 0;
+    dblog_depth++;
+    return 1;
+  }
+  if (dblog_fd < 0 &&
+      (dblog_fd = open(DBLOG, O_RDWR|O_CREAT|O_CLOEXEC, 0660)) < 0 &&
+      (exclusive || (dblog_fd = open(DBLOG, O_RDONLY|O_CLOEXEC)) < 0))
+    return 0;
+
+  while (flock(dblog_fd, exclusive ? LOCK_EX : LOCK_SH) != 0)
+    if (errno != EINTR) return 0;
+  dblog_depth = 1;
+  dblog_excl = exclusive;
+  if (! exclusive || fstat(dblog_fd, &st) != 0) return 1;
+
+  /* a new journal gets its header from the first writer */
+  if (st.st_size < DBLOG_V1HDR) {
+    if (! dblog_reset(0)) {
+      dblog_unlock();
+      return 0;
+    }
+  }
+  /* and an old one is checkpointed into the new version */
+  else if (pread(dblog_fd, &hdr, DBLOG_V1HDR, 0) == DBLOG_V1HDR &&
+           hdr.version != DBLOG_VERSION) dblog_checkpoint();
+  return 1;
+}
+
+void dblog_unlock() {
+  if (dblog_depth == 0 || --dblog_depth > 0) return;
+  flock(dblog_fd, LOCK_UN);
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_getrec(): reads the serial record at 'off', it must  *
+ * end before 'end'. Its hex value goes to 'hex'. returns 1,  *
+ * or 0 for a bad or torn record.                             *
+ * ---------------------------------------------------------- */
+static int dblog_getrec(uint64_t off, uint64_t end, DBLOG_REC *rec,
+                                              char *hex, size_t hexlen) {
+  if (off < sizeof(DBLOG_HDR) || off > end ||
+      end - off < sizeof(DBLOG_REC) ||
+      pread(dblog_fd, rec, sizeof(DBLOG_REC), off) != sizeof(DBLOG_REC) ||
+      rec->magic != DBLOG_RECMAGIC ||
+      (rec->type != DBLOG_SERIAL && rec->type != DBLOG_CRLNUM) ||
+      rec->len == 0 || rec->len >= hexlen ||
+      end - off - sizeof(DBLOG_REC) < DBLOG_PAD(rec->len) ||
+      pread(dblog_fd, hex, rec->len, off + sizeof(DBLOG_REC)) != rec->len ||
+      dblog_sum(rec->type, (const unsigned char *) hex, rec->len) != rec->sum)
+    return 0;
+  hex[rec->len] = '\0';
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_scan(): the state of the journal from all records,   *
+ * for a version 1 journal or a header that is ahead of lost  *
+ * data. The good records end at the first bad one, a writer  *
+ * cuts off the rest and saves the header. With the lock held *
+ * returns 1 for success, 0 for errors.                       *
+ * ---------------------------------------------------------- */
+static int dblog_scan(DBLOG_STATE *st, off_t size) {
+  const unsigned char *map;
+  const DBLOG_REC *rec;
+  uint32_t version = st->hdr.version;
+  off_t off = (version == 1) ? DBLOG_V1HDR : sizeof(DBLOG_HDR);
+  int i, first = 1;
+
+  if ((version != 1 && version != DBLOG_VERSION) || size < off) return 0;
+  memset(st->hdr.last, '\0', sizeof(st->hdr.last));
+  memset(st->value, '\0', sizeof(st->value));
+
+  map = mmap(NULL, size, PROT_READ, MAP_SHARED, dblog_fd, 0);
+  if (map == MAP_FAILED) return 0;
+  while (size - off >= sizeof(DBLOG_REC)) {
+    rec = (const DBLOG_REC *) (map + off);
+    if (rec->magic != DBLOG_RECMAGIC ||
+        size - off - sizeof(DBLOG_REC) < DBLOG_PAD(rec->len) ||
+        dblog_sum(rec->type, (const unsigned char *) (rec + 1), rec->len) != rec->sum ||
+        (version != 1 && ! first && rec->seq != st->hdr.seq + 1))
+      break;
+    if (rec->type == DBLOG_SERIAL || rec->type == DBLOG_CRLNUM) {
+      if (rec->len == 0 || rec->len >= sizeof(st->value[0])) break;
+      i = rec->type - DBLOG_SERIAL;
+      st->hdr.last[i] = off;
+      memcpy(st->value[i], rec + 1, rec->len);
+      st->value[i][rec->len] = '\0';
+    }
+    st->hdr.seq = rec->seq;
+    first = 0;
+    off += sizeof(DBLOG_REC) + DBLOG_PAD(rec->len);
+  }
+  munmap((void *) map, size);
+  st->hdr.end = off;
+
+  if (dblog_excl && off < size && ftruncate(dblog_fd, off) != 0) return 0;
+  if (dblog_excl && version == DBLOG_VERSION &&
+      pwrite(dblog_fd, &st->hdr, sizeof(DBLOG_HDR), 0) != sizeof(DBLOG_HDR))
+    return 0;
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_state(): the journal state from its header, with the *
+ * records appended after the last header write. An empty or  *
+ * new file has no records. With the lock held. returns 1, or *
+ * 0 for errors.                                              *
+ * ---------------------------------------------------------- */
+static int dblog_state(DBLOG_STATE *st) {
+  DBLOG_REC rec;
+  struct stat sb;
+  char hex[sizeof(st->value[0])];
+  ssize_t n;
+  int i;
+
+  memset(st, '\0', sizeof(DBLOG_STATE));
+  if (fstat(dblog_fd, &sb) != 0) return 0;
+  if (sb.st_size < DBLOG_V1HDR) return 1;
+  n = pread(dblog_fd, &st->hdr, sizeof(DBLOG_HDR), 0);
+  if (n < DBLOG_V1HDR ||
+      memcmp(st->hdr.magic, DBLOG_MAGIC, sizeof(st->hdr.magic)) != 0) return 0;
+  if (st->hdr.version != DBLOG_VERSION || n != sizeof(DBLOG_HDR) ||
+      st->hdr.end < sizeof(DBLOG_HDR) || st->hdr.end > sb.st_size)
+    return dblog_scan(st, sb.st_size);
+
+  for (i = 0; i < 2; i++) {
+    if (st->hdr.last[i] == 0) continue;
+    if (! dblog_getrec(st->hdr.last[i], st->hdr.end, &rec, st->value[i],
+                       sizeof(st->value[i])) || rec.type != DBLOG_SERIAL + i)
+      return dblog_scan(st, sb.st_size);
+  }
+  while (dblog_getrec(st->hdr.end, sb.st_size, &rec, hex, sizeof(hex)) &&
+         rec.seq == st->hdr.seq + 1) {
+    i = rec.type - DBLOG_SERIAL;
+    st->hdr.last[i] = st->hdr.end;
+    strcpy(st->value[i], hex);
+    st->hdr.seq = rec.seq;
+    st->hdr.end += sizeof(DBLOG_REC) + DBLOG_PAD(rec.len);
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_serial(): the current value of a serial file, the    *
+ * last journaled one, or else the file content. With the     *
+ * lock held. returns the value, or NULL for errors.          *
+ * ---------------------------------------------------------- */
+BIGNUM *dblog_serial(const char *serialfile) {
+  DBLOG_STATE st;
+  BIGNUM *bn = NULL;
+  uint32_t type = dblog_type(serialfile);
+  const char *hex;
+
+  if (type == 0) return load_serial((char *) serialfile, 1, NULL);
+  if (! dblog_state(&st)) return NULL;
+  hex = st.value[type - DBLOG_SERIAL];
+  if (hex[0] == '\0') return load_serial((char *) serialfile, 1, NULL);
+  if (BN_hex2bn(&bn, hex) != (int) strlen(hex)) {
+    BN_free(bn);
+    return NULL;
+  }
+  return bn;
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_put_serial(): journals the new value of a serial     *
+ * file, a file outside of the journal is replaced instead.   *
+ * The record goes after the last good one, then the header   *
+ * with the new state, 'durable' syncs both. Past the size of *
+ * DBLOG_CHECKPOINT, the checkpoint follows. With the lock    *
+ * held exclusive. returns 1, or 0 for errors.                *
+ * ---------------------------------------------------------- */
+int dblog_put_serial(const char *serialfile, BIGNUM *value, int durable) {
+  DBLOG_STATE st;
+  DBLOG_REC rec;
+  unsigned char buf[sizeof(DBLOG_REC) + DBLOG_PAD(sizeof(st.value[0]))];
+  uint32_t type = dblog_type(serialfile);
+  uint64_t off;
+  size_t len, reclen;
+  char *hex;
+  int ret = 0;
+
+  if (type == 0) return replace_serial((char *) serialfile, value);
+  if ((hex = BN_bn2hex(value)) == NULL) return 0;
+  if ((len = strlen(hex)) >= sizeof(st.value[0]) || ! dblog_state(&st))
+    goto err;
+
+  memset(&rec, '\0', sizeof(rec));
+  rec.magic = DBLOG_RECMAGIC;
+  rec.type  = type;
+  rec.len   = len;
+  rec.seq   = st.hdr.seq + 1;
+  rec.sum   = dblog_sum(type, (const unsigned char *) hex, len);
+  reclen    = sizeof(rec) + DBLOG_PAD(len);
+  memset(buf, '\0', reclen);
+  memcpy(buf, &rec, sizeof(rec));
+  memcpy(buf + sizeof(rec), hex, len);
+
+  off = st.hdr.end;
+  st.hdr.last[type - DBLOG_SERIAL] = off;
+  st.hdr.end = off + reclen;
+  st.hdr.seq = rec.seq;
+  if (pwrite(dblog_fd, buf, reclen, off) != reclen ||
+      pwrite(dblog_fd, &st.hdr, sizeof(DBLOG_HDR), 0) != sizeof(DBLOG_HDR) ||
+      (durable && fdatasync(dblog_fd) != 0)) goto err;
+  if (st.hdr.end > DBLOG_CHECKPOINT) dblog_checkpoint();
+  ret = 1;
+
+err:
+  OPENSSL_free(hex);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_syncdir(): syncs the directory of 'file', it makes   *
+ * the renames of the checkpoint durable.                     *
+ * ---------------------------------------------------------- */
+static int dblog_syncdir(const char *file) {
+  char dir[BUFSIZ], *p;
+  int fd, ret;
+
+  snprintf(dir, sizeof(dir), "%s", file);
+  if ((p = strrchr(dir, '/')) == NULL) strcpy(dir, ".");
+  else if (p == dir) p[1] = '\0';
+  else *p = '\0';
+  if ((fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) return 0;
+  ret = (fsync(fd) == 0);
+  close(fd);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * dblog_checkpoint(): writes the serial files with their     *
+ * last journaled value, each to a synced temp file that is   *
+ * renamed over it, and empties the journal. A crash in       *
+ * between leaves the journal to replay again, the records    *
+ * apply the same to the new files. With the lock exclusive.  *
+ * ---------------------------------------------------------- */
+static void dblog_checkpoint() {
+  static const char *serialfiles[] = { SERIALFILE, CRLSEQNUM };
+  DBLOG_STATE st;
+  BIGNUM *bn = NULL;
+  int i;
+
+  if (! dblog_state(&st))
+    int_error("Error reading the CA database journal DBLOG");
+
+  /* a serial file without journal records stays as it is */
+  for (i = 0; i < 2; i++) {
+    if (st.value[i][0] == '\0') continue;
+    if (BN_hex2bn(&bn, st.value[i]) != (int) strlen(st.value[i]) ||
+        ! replace_serial((char *) serialfiles[i], bn))
+      int_error("Error writing a serial file for the DBLOG checkpoint");
+  }
+  BN_free(bn);
+  if (! dblog_syncdir(SERIALFILE))
+    int_error("Error syncing the CA directory for the DBLOG checkpoint");
+
+  if (! dblog_reset(st.hdr.seq))
+    int_error("Error resetting the CA database journal DBLOG");
+}
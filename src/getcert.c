@@ -11,14 +11,12 @@
 #include <openssl/err.h>
 #include "webcert.h"
 
-int check_index(X509 *x509, CA_DB *db);
 
 int cgiMain() {
 
    X509			*cert;
    BIO			*outbio;
    char			format[5]         = "";
-   char 		certfilepath[255] = "";
    char 		expfilepath[255]  = "";
    char 		pemfileurl[255]   = "";
    char 		derfileurl[255]   = "";
@@ -50,28 +48,26 @@ int cgiMain() {
       int_error("Error incorrect data in >cfilename<");
 
 /* -------------------------------------------------------------------------- *
- * check if should display the CA cert, or open the requested filename        *
+ * check if should display the CA cert, or load the requested store cert      *
  * ---------------------------------------------------------------------------*/
    if (strcmp(certfilestr, "cacert.pem") == 0) {
       if (! (certfile = fopen(CACERT, "r")))
          int_error("Error can't open CA certificate file");
+      if (! (cert = PEM_read_X509(certfile,NULL,NULL,NULL)))
+         int_error("Error loading cert into memory");
+      fclose(certfile);
       strncpy(title, "Display Root CA Certificate", sizeof(title));
    } else {
-      snprintf(certfilepath, sizeof(certfilepath), "%s/%s", CACERTSTORE,
-		      						certfilestr);
-      if (! (certfile = fopen(certfilepath, "r")))
-         int_error("Error cant open Certificate file");
+      if (! (cert = read_storecert(certfilestr)))
+         int_error("Error cant load the Certificate from the cert store");
    }
 
 /* -------------------------------------------------------------------------- *
- * decode the certificate and define BIO output stream                        *
+ * define BIO output stream                                                   *
  * ---------------------------------------------------------------------------*/
    outbio = BIO_new(BIO_s_file());
    BIO_set_fp(outbio, cgiOut, BIO_NOCLOSE);
 
-   if (! (cert = PEM_read_X509(certfile,NULL,NULL,NULL)))
-      int_error("Error loading cert into memory");
-
 /* -------------------------------------------------------------------------- *
  * strip off the file format extension from the file name                     *
  * ---------------------------------------------------------------------------*/
@@ -106,10 +102,11 @@ int cgiMain() {
  * Check if the cert already has a DB entry in state revoked  *
  * ---------------------------------------------------------- */
    CA_DB *db = NULL;
-   DB_ATTR db_attr;
-   if((db = load_index(INDEXFILE, &db_attr)) == NULL)
+   DB_ATTR db_attr = { UNIQUE_SUBJECT };
+   if((db = certdb_open(INDEXDB, &db_attr)) == NULL)
       int_error("Error cannot load CRL certificate database file");
    int exist = check_index(cert, db);
+   certdb_close(db);
 
 /* ---------------------------------------------------------- *
  * start the html output                                      *
@@ -6,6 +6,8 @@
  * -----------------------------------------------------------*/
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <openssl/crypto.h>
 #include <openssl/buffer.h>
 #include <openssl/ocsp.h>
@@ -97,88 +99,6 @@ CONF *app_load_config(const char *filename) {
   return NULL;
 }
 
-/* ---------------------------------------------------------- *
- * load_index(): loads a index database into a CA_DB object.  *
- * returns pointer to CA_DB object, or NULL for errors.       *
- * ---------------------------------------------------------- */
-CA_DB *load_index(const char *dbfile, DB_ATTR *db_attr) {
-  BIO *in;
-  if ((in = BIO_new_file(dbfile, "r")) == NULL)
-    int_error("Error: cannot open database file for reading");
-
-  TXT_DB *tmpdb = NULL;
-  if ((tmpdb = TXT_DB_read(in, DB_NUMBER)) == NULL)
-    int_error("Error: cannot create text DB object");
-
- /* ----------------------------------------------------------- *
-  * cat /srv/app/webCA/index.txt.attr --> unique_subject = yes  *
-  * ----------------------------------------------------------- */
-  char buf[BSIZE];
-  BIO_snprintf(buf, sizeof buf, "%s.attr", dbfile);
-
-  CONF *dbattr_conf = NULL;
-  dbattr_conf = app_load_config(buf);
-
-  CA_DB *retdb = NULL;
-  retdb = OPENSSL_malloc(sizeof(*retdb));
-  if (retdb == NULL)
-    int_error("Error: cannot allocate memory for new database");
-  retdb->db = tmpdb;
-  tmpdb = NULL;
-
-  if (db_attr) retdb->attributes = *db_attr;
-  else retdb->attributes.unique_subject = 1;
-
-  if (dbattr_conf) {
-    char *p = NCONF_get_string(dbattr_conf, NULL, "unique_subject");
-    if(strcmp(p, "yes") == 0) {
-      retdb->attributes.unique_subject =  1;
-    }
-  }
-
-  TXT_DB_free(tmpdb);
-  BIO_free_all(in);
-  return retdb;
-}
-
-/* ---------------------------------------------------------- *
- * save_index(): writes a index database to a local file.     *
- * returns 1 for success, or 0 for errors.                    *
- * ---------------------------------------------------------- */
-int save_index(const char *dbfile, CA_DB *db) {
-  char buf[2][BSIZE];
-  BIO *out;
-  int j;
-
-  j = strlen(dbfile);
-  if (j + 6 >= BSIZE)
-    int_error("file name too long");
-
-  j = BIO_snprintf(buf[1], sizeof buf[1], "%s.attr", dbfile);
-  j = BIO_snprintf(buf[0], sizeof buf[0], "%s", dbfile);
-
-  out = BIO_new_file(buf[0], "w");
-  if (out == NULL) {
-     snprintf(error_str, sizeof(error_str), "Unable to write %s.", dbfile);
-     int_error(error_str);
-  }
-
-  j = TXT_DB_write(out, db->db);
-  BIO_free(out);
-  if (j <= 0) int_error("TXT_DB_write failed to write data");
-
-  out = BIO_new_file(buf[1], "w");
-  if (out == NULL) {
-     snprintf(error_str, sizeof(error_str), "Unable to write %s.", dbfile);
-     int_error(error_str);
-  }
-
-  BIO_printf(out, "unique_subject = %s\n", db->attributes.unique_subject ? "yes" : "no");
-  BIO_free(out);
-  return 1;
-}
-
-
 /* ---------------------------------------------------------- *
  * unpack_revinfo(): extracts the revocation information and  *
  * returns 1 for success, and 0 for errors.                   *
@@ -356,44 +276,37 @@ end:
   return ret;
 }
 /* ------------------------------------------------------------- *
- * Function cgi_gencrl() generates a new CRL file from DB file   *
- * index.txt. This function is based on opensssl's apps/ca.c.    *
+ * Function cgi_gencrl() generates a new CRL file from the CA    *
+ * database INDEXDB. The revoked entries come pre-encoded from   *
+ * CRLCACHE, only the TBSCertList around them is made new, and   *
+ * signed. This function is based on opensssl's ca.c.            *
  * ------------------------------------------------------------- */
 int cgi_gencrl(char *crlfile) {
-    
+
+  /* ------------------------------------------------------------- *
+   * Get the revoked entries of INDEXDB, merged into the cache or  *
+   * rebuilt. Its lock is held until the CRL file is written.      *
+   * ------------------------------------------------------------- */
+  CRL_CACHE cc;
+  if (! load_crlcache(&cc, CRLCACHE, INDEXDB))
+    int_error("Error cannot load the revoked certificates for the CRL");
+
   /* ------------------------------------------------------------- *
-   * Load the CRL serial number from file (defined in webcert.h)   *
+   * Lease the next CRL number from CRLSEQNUM (see webcert.h)      *
    * ------------------------------------------------------------- */
   BIGNUM *crlnumber;
-  if ((crlnumber = load_serial(CRLSEQNUM, 1, NULL)) == NULL)
+  if ((crlnumber = lease_serial(CRLSEQNUM, 1, 1)) == NULL)
     int_error("Error loading CRL serial number from file");
 
-  /* ----------------------------------------------------------- *
-   * increment the serial number                                 *
-   * ------------------------------------------------------------*/
-   if (! (BN_add_word(crlnumber,1)))
-      int_error("Error incrementing CRL serial number");
-
-  // *** debug: output the serial # to screen
-  //unsigned char crlsn_str[BN_num_bytes(crlnumber)];
-  //BN_bn2bin(crlnumber, crlsn_str);
-  //snprintf(error_str, sizeof(error_str), "Check: %d", (int)crlsn_str[0]);
-  //int_error(error_str);
-
-  /* ----------------------------------------------------------- *
-   * save the serial number back to SERIALFILE                   *
-   * ------------------------------------------------------------*/
-   ASN1_INTEGER *aserial = NULL;
-   if ( save_serial(CRLSEQNUM, 0, crlnumber, &aserial) == 0 )
-      int_error("Error writing serial number to file");
+  ASN1_INTEGER *tmpser = BN_to_ASN1_INTEGER(crlnumber, NULL);
+  if (tmpser == NULL)
+    int_error("Error converting the CRL serial number");
+  BN_free(crlnumber);
 
   /* ------------------------------------------------------------- *
-   * Create a new CRL object, and set issuer from CA cert          *
+   * Load the CA cert, the CRL issuer, and the AlgorithmIdentifier *
+   * of its key, hardcoded with SHA256                             *
    * ------------------------------------------------------------- */
-  X509_CRL *crl = NULL;
-  if ((crl = X509_CRL_new()) == NULL)
-    int_error("Error creating a new CRL object");
-
   FILE  *certfile = NULL;
   if (! (certfile = fopen(CACERT, "r")))
     int_error("Error can't open CA certificate file");
@@ -403,8 +316,11 @@ int cgi_gencrl(char *crlfile) {
     int_error("Error loading CA cert into memory");
   fclose(certfile);
 
-  if (!X509_CRL_set_issuer_name(crl, X509_get_subject_name(cacert)))
-    int_error("Error setting issuer name to CRL object");
+  const EVP_MD *digest = EVP_sha256();
+  unsigned char aid[128];
+  size_t aidlen = sizeof(aid);
+  if (! casign_aid(X509_get0_pubkey(cacert), digest, aid, &aidlen))
+    int_error("Error getting the CRL signature algorithm of the CA key");
 
   /* ------------------------------------------------------------- *
    * Set the CRL current date and expiration date                  *
@@ -412,157 +328,73 @@ int cgi_gencrl(char *crlfile) {
    * ------------------------------------------------------------- */
   int crldays = 30;
   int crlhours = 0;
-   
-  ASN1_TIME *tmptm = NULL;
-  tmptm = ASN1_TIME_new();
-  if (tmptm == NULL) 
+
+  ASN1_TIME *lastupd = ASN1_TIME_new();
+  ASN1_TIME *nextupd = ASN1_TIME_new();
+  if (lastupd == NULL || nextupd == NULL)
     int_error("Error cannot get current ASN1_TIME");
 
-  X509_gmtime_adj(tmptm, 0);
-  X509_CRL_set_lastUpdate(crl, tmptm);
-  if (!X509_time_adj_ex(tmptm, crldays, crlhours * 60 * 60, NULL))
+  X509_gmtime_adj(lastupd, 0);
+  X509_gmtime_adj(nextupd, 0);
+  if (!X509_time_adj_ex(nextupd, crldays, crlhours * 60 * 60, NULL))
       int_error("Error setting CRL nextUpdate");
 
-  X509_CRL_set_nextUpdate(crl, tmptm);
-  ASN1_TIME_free(tmptm);
-
-  /* ------------------------------------------------------------- *
-   * Set CRL version 2, which supports extensions, e.g. CRL serial *
-   * ------------------------------------------------------------- */
-  if (!X509_CRL_set_version(crl, 1))
-    int_error("Error cannot set CRL version 2");
-
   /* ------------------------------------------------------------- *
-   * Read all revoked certitifcates from the internal index.txt db *
+   * Put the v2 TBSCertList together around the cached entries,    *
+   * with the CRL serial number extension                          *
    * ------------------------------------------------------------- */
-  CA_DB *db = NULL;
-  DB_ATTR db_attr;
-
-  if((db = load_index(INDEXFILE, &db_attr)) == NULL)
-    int_error("Error cannot load CRL certificate database file");
-
-  /* ------------------------------------------------------------- *
-   * Read all revoked certitifcates from the internal index.txt db *
-   * ------------------------------------------------------------- */
-  int i, j;
-  char *const *pp;
-  X509_REVOKED *r = NULL;
-  BIGNUM *certserial = NULL;
-  ASN1_INTEGER *tmpser = NULL;
-
-  for (i = 0; i < sk_OPENSSL_PSTRING_num(db->db->data); i++) {
-    pp = sk_OPENSSL_PSTRING_value(db->db->data, i);
-
-    // *** debug: cycle DB_NUMBER should show each field in index.db
-    //for (j = 0; j < DB_NUMBER; j++) { 
-    //  snprintf(error_str, sizeof(error_str), " %d = \"%s\"", j, pp[j]);
-    //} 
-    //int_error(error_str);
-
-    /* ------------------------------------------------------------- *
-     * Check if the cert entry in index.db is in state 'R' = revoked *
-     * ------------------------------------------------------------- */
-    // ***  "Debug %d=\"%c\"", i, pp[DB_type][0] -> Debug 0="R"
-    if (pp[DB_type][0] == DB_TYPE_REV) {
-      if ((r = X509_REVOKED_new()) == NULL)
-        int_error("Error creating X509_REVOKED object");
-
-      /* ------------------------------------------------------------- *
-       * Create the X509_Revoked object, using the index.db timestamp  *
-       * ------------------------------------------------------------- */
-      // *** "Debug i=%d str=%s, j=%d", i, pp[DB_rev_date], j -> Debug i=0 str=170821044339Z, j=1
-      j = make_revoked(r, pp[DB_rev_date]);
-      if (!j) break;
-
-      /* ------------------------------------------------------------- *
-       * Add the certificate serial to the X509_Revoked object         *
-       * ------------------------------------------------------------- */
-      // *** "Debug i=%d str=%s, j=%d", i, pp[DB_serial], j -> Debug i=0 str=1A, j=1
-      if (!BN_hex2bn(&certserial, pp[DB_serial])) break;
-      tmpser = BN_to_ASN1_INTEGER(certserial, NULL);
-
-      if (!tmpser) break;
-      X509_REVOKED_set_serialNumber(r, tmpser);
-
-      /* ------------------------------------------------------------- *
-       * Add the revoked cert entry to the crl object                  *
-       * ------------------------------------------------------------- */
-      X509_CRL_add0_revoked(crl, r);
-    }
-  }
-
-  BN_free(certserial);
-  TXT_DB_free(db->db);
-  OPENSSL_free(db);
-
-  /* ------------------------------------------------------------- *
-   * sort the data so it will be written in serial number order    *
-   * ------------------------------------------------------------- */
-  X509_CRL_sort(crl);
-
-  /* ------------------------------------------------------------- *
-   * Add CRL extensions                                            *
-   * ------------------------------------------------------------- */
-  X509 *x509 = NULL;
-  X509V3_CTX crlctx;
-  X509V3_set_ctx(&crlctx, x509, NULL, NULL, crl, 0);
-
-  tmpser = BN_to_ASN1_INTEGER(crlnumber, NULL);
-
-  if (tmpser)
-    X509_CRL_add1_ext_i2d(crl, NID_crl_number, tmpser, 0, 0);
-
+  unsigned char *tbs;
+  size_t tbslen;
+  if ((tbs = crlcache_tbs(&cc, aid, aidlen, X509_get_subject_name(cacert),
+                          lastupd, nextupd, tmpser, &tbslen)) == NULL)
+    int_error("Error creating the CRL TBSCertList");
+
+  ASN1_TIME_free(lastupd);
+  ASN1_TIME_free(nextupd);
   ASN1_INTEGER_free(tmpser);
 
   /* ------------------------------------------------------------- *
-   * Add CRL serial number extension                               *
+   * Sign the CRL with the CA's private key, by certsignd if it    *
+   * runs                                                          *
    * ------------------------------------------------------------- */
-  if (!BN_add_word(crlnumber, 1))
-    int_error("Error adding CRL serial extension value");
-
-  BN_free(crlnumber);
-
-  /* ------------------------------------------------------------- *
-   * Import CA private key for signing                             *
-   * --------------------------------------------------------------*/
-  FILE *key_fp;
-  EVP_PKEY *ca_privkey;
-  ca_privkey = EVP_PKEY_new();
-
-  if (!(key_fp = fopen(CAKEY, "r")))
-    int_error("Error reading CA private key file");
-
-  if (!(ca_privkey = PEM_read_PrivateKey(key_fp, NULL, NULL, PASS)))
-    int_error("Error importing key content from file");
+  unsigned char *sig;
+  size_t siglen;
+  if (!casign_crltbs(tbs, tbslen, digest, &sig, &siglen))
+    int_error("Error signing CRL with CA private key");
 
-  fclose(key_fp);
+  unsigned char *der;
+  size_t derlen;
+  if ((der = crlcache_crl(tbs, tbslen, aid, aidlen, sig, siglen,
+                                                     &derlen)) == NULL)
+    int_error("Error creating the signed CRL");
+  OPENSSL_free(tbs);
+  free(sig);
 
   /* ------------------------------------------------------------- *
-   * Sign the CRL with the CA's private key, hardcoded with SHA256 *
+   * Write the CRL data into a PEM file for download. It is        *
+   * written over the old one in place, then cut to length, never  *
+   * emptied first: readers never see a zero size file. A rename() *
+   * would need write access to the web folder.                    *
    * ------------------------------------------------------------- */
-  const EVP_MD *digest = EVP_sha256();
-  if (!X509_CRL_sign(crl, ca_privkey, digest))
-    int_error("Error signing CRL with CA private key");
+  BIO *membio = BIO_new(BIO_s_mem());
+  if (membio == NULL ||
+      ! PEM_write_bio(membio, PEM_STRING_X509_CRL, "", der, derlen))
+    int_error("Error writing PEM data into CRL file");
 
-  EVP_PKEY_free(ca_privkey);
+  char *pem;
+  long pemlen = BIO_get_mem_data(membio, &pem);
 
-  /* ------------------------------------------------------------- *
-   * Write the CRL data into a PEM file for download               *
-   * ------------------------------------------------------------- */
-  FILE *fp;
-  if (! (fp=fopen(CRLFILE, "w")))
+  int fd;
+  if ((fd = open(CRLFILE, O_WRONLY|O_CREAT, 0644)) < 0)
     int_error("Error opening CRL file for writing");
 
-  BIO *savbio = BIO_new(BIO_s_file());
-  BIO_set_fp(savbio, fp, BIO_NOCLOSE);
-
-  if (! PEM_write_bio_X509_CRL(savbio, crl))
+  if (pwrite(fd, pem, pemlen, 0) != pemlen || ftruncate(fd, pemlen) != 0 ||
+      close(fd) != 0)
     int_error("Error writing PEM data into CRL file");
-
-  BIO_free(savbio);
-  fclose(fp);
-  X509_free(x509);
-  X509_CRL_free(crl);
+  BIO_free(membio);
+  OPENSSL_free(der);
+  X509_free(cacert);
+  free_crlcache(&cc);
   return 0;
 } // end of function cgi_gencrl()
 
@@ -649,115 +481,241 @@ static char *make_revocation_str(REVINFO_TYPE rev_type, const char *rev_arg) {
 }
 
 /* ---------------------------------------------------------- *
- * do_revoke() takes a cert object, checks existence in the   *
- * CA database index.txt, and creates the certs entry line of *
- * revoked state, timestamp and revocation reason.            *
+ * make_index_rec() fills a CA database record of type 'V' or *
+ * 'R' for a cert, with the revocation date and reason of     *
+ * 'rev_str', or none if NULL. Errors stop the CGI.           *
  * -----------------------------------------------------------*/
-int do_revoke(X509 *x509, CA_DB *db, const char *value) {
-  char *row[DB_NUMBER];
+void make_index_rec(X509 *x509, char type, const char *rev_str,
+                                                        CADB_REC *rec) {
+  char *subject;
+
+  memset(rec, '\0', sizeof(*rec));
+  rec->type = type;
 
   /* ---------------------------------------------------------- *
-   * Zero out the row field array                               *
+   * Get the certs serial number, the record key                *
    * -----------------------------------------------------------*/
-  int i;
-  for (i=0; i<DB_NUMBER; i++) row[i] = NULL;
+  if (! serial_from_asn1(&rec->serial, X509_get_serialNumber(x509)))
+    int_error("Error serial number is negative or exceeds 20 bytes");
 
   /* ---------------------------------------------------------- *
-   * Set status field as type "R" revoked for DB field (0)      *
+   * Set the cert expiration date, and the revocation date and  *
+   * reason, or empty                                           *
    * -----------------------------------------------------------*/
-  row[DB_type] = OPENSSL_strdup("R");
+  const ASN1_TIME *tm = X509_get0_notAfter(x509);
+  if (tm->length >= sizeof(rec->exp_date))
+    int_error("Error invalid certificate expiration date");
+  memcpy(rec->exp_date, tm->data, tm->length);
+
+  if (rev_str && OPENSSL_strlcpy(rec->rev_date, rev_str,
+                                 sizeof(rec->rev_date)) >= sizeof(rec->rev_date))
+    int_error("Error the revocation information is too long");
 
   /* ---------------------------------------------------------- *
-   * Set the cert expiration in date field (1)                  *
+   * Get the certs subject name                                 *
    * -----------------------------------------------------------*/
-  const ASN1_TIME *tm = NULL;
-  tm = X509_get_notAfter(x509);
-  row[DB_exp_date] = OPENSSL_malloc(tm->length + 1);
-  memcpy(row[DB_exp_date], tm->data, tm->length);
-  row[DB_exp_date][tm->length] = '\0';
+  if ((subject = X509_NAME_oneline(X509_get_subject_name(x509), NULL, 0)) == NULL)
+    int_error("Memory allocation failure");
+  if (OPENSSL_strlcpy(rec->name, subject, sizeof(rec->name)) >= sizeof(rec->name))
+    int_error("Error the certificate subject exceeds CADB_NAMELEN");
+  OPENSSL_free(subject);
+}
+
+/* ---------------------------------------------------------- *
+ * insert_index_rec() adds the new record of a cert to the    *
+ * write txn. certdb_put() rejects an active duplicate        *
+ * subject if unique_subject is set, a serial that exists is  *
+ * an error.                                                  *
+ * -----------------------------------------------------------*/
+static void insert_index_rec(X509 *x509, CA_DB *db, char type,
+                                                   const char *rev_str) {
+  CADB_REC rec, old;
+  int ret;
+
+  make_index_rec(x509, type, rev_str, &rec);
+  if (certdb_get(db, &rec.serial, &old))
+    int_error("Failed to update database, the serial number exists.");
+
+  if ((ret = certdb_put(db, &rec)) != 1) {
+    if (ret < 0)
+      snprintf(error_str, sizeof(error_str), "Failed to update database, "
+        "a valid certificate for %s exists and unique_subject = yes.",
+        rec.name);
+    else
+      snprintf(error_str, sizeof(error_str), "Failed to update database.");
+    int_error(error_str);
+  }
+}
+
+/* ---------------------------------------------------------- *
+ * add_index() adds a newly signed cert to the CA database as *
+ * valid 'V' entry. With unique_subject set, the subject must *
+ * not belong to another valid cert.                          *
+ * -----------------------------------------------------------*/
+int add_index(X509 *x509, CA_DB *db) {
+  insert_index_rec(x509, db, DB_TYPE_VAL, NULL);
+  return (1);
+}
+
+/* ---------------------------------------------------------- *
+ * do_revoke() takes a cert object, checks existence in the   *
+ * CA database INDEXDB, and creates the certs record of       *
+ * revoked state, timestamp and revocation reason. A record   *
+ * in state 'V' is looked up by serial and replaced.          *
+ * -----------------------------------------------------------*/
+int do_revoke(X509 *x509, CA_DB *db, const char *value) {
+  CERT_SERIAL serial;
+  CADB_REC rec;
 
   /* ---------------------------------------------------------- *
-   * Set the revocation date and reason, add to DB field (2)    *
+   * Create the revocation date and reason string               *
    * -----------------------------------------------------------*/
   char *rev_str = NULL;
   rev_str = make_revocation_str(REV_CRL_REASON, value);
   if (!rev_str)
       int_error("Error in revocation arguments\n");
-  row[DB_rev_date] = rev_str;
 
   /* ---------------------------------------------------------- *
-   * Get the certs serial number, add it to DB field (3)        *
-   * -----------------------------------------------------------*/
-  BIGNUM *bn = NULL;
-  bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(x509), NULL);
-  if (!bn)
-    int_error("Cannot extract serial number from cert into BIGNUM");
- 
-  if (BN_is_zero(bn)) row[DB_serial] = OPENSSL_strdup("00");
-  else row[DB_serial] = BN_bn2hex(bn);
-  BN_free(bn);
-
-  /* ---------------------------------------------------------- *
-   * OpenSSL hardcodes the cert filepath field (4) as "unknown" *
+   * Check if the cert already exists in DB by using its serial *
    * -----------------------------------------------------------*/
-  row[DB_file] = OPENSSL_strdup("unknown");
+  if (! serial_from_asn1(&serial, X509_get_serialNumber(x509)))
+    int_error("Error serial number is negative or exceeds 20 bytes");
 
-  /* ---------------------------------------------------------- *
-   * Get the certs subject name, and add it to the DB field (5) *
-   * -----------------------------------------------------------*/
-  row[DB_name] = X509_NAME_oneline(X509_get_subject_name(x509), NULL, 0);
+  if (! certdb_get(db, &serial, &rec)) {
+    insert_index_rec(x509, db, DB_TYPE_REV, rev_str);
+    OPENSSL_free(rev_str);
+    return (1);
+  }
 
-  /* ---------------------------------------------------------- *
-   * If any of the above steps fail, create an error and stop   *
-   * -----------------------------------------------------------*/
-  for (i=0; i<DB_NUMBER; i++) {
-    if (row[i] == NULL) int_error("Memory allocation failure");
+  if (rec.type == DB_TYPE_REV) {
+    OPENSSL_free(rev_str);
+    int_error("Error certificate is already revoked");
   }
-  
+
   /* ---------------------------------------------------------- *
-   * Write the row strings to the CA database object            *
+   * Revoke the existing record, serial and subject stay        *
    * -----------------------------------------------------------*/
-  if (!TXT_DB_insert(db->db, row)) {
-    snprintf(error_str, sizeof(error_str), "Failed to update database, error number %ld.", db->db->error);
-    int_error(error_str);
-  }
-
+  rec.type = DB_TYPE_REV;
+  if (OPENSSL_strlcpy(rec.rev_date, rev_str, sizeof(rec.rev_date))
+                                              >= sizeof(rec.rev_date))
+    int_error("Error the revocation information is too long");
+  OPENSSL_free(rev_str);
+  if (certdb_put(db, &rec) != 1)
+    int_error("Failed to update database.");
   return (1);
 }
 
 /* ---------------------------------------------------------- *
  * check_index() checks if a certificate has an revoked entry *
- * in the CA database index.txt, returns yes=1, no=0.         *
+ * in the CA database INDEXDB, returns yes=1, no=0.           *
  * -----------------------------------------------------------*/
 int check_index(X509 *x509, CA_DB *db) {
+  CERT_SERIAL serial;
+  CADB_REC rec;
+  int ret = 0;
+
   /* ---------------------------------------------------------- *
-   * Get the certs serial number, convert it into a hex string  *
+   * Look up the cert record by its serial                      *
    * -----------------------------------------------------------*/
-  BIGNUM *bn = NULL;
-  bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(x509), NULL);
-  if (!bn)
-    int_error("Cannot extract serial number from cert into BIGNUM");
+  if (! serial_from_asn1(&serial, X509_get_serialNumber(x509)) ||
+      ! certdb_get(db, &serial, &rec)) return (ret);
 
-  char *serialstr = BN_bn2hex(bn);
-  //int_error(serialstr);
+  if (rec.type == DB_TYPE_REV) {
+    char *subjectstr = X509_NAME_oneline(X509_get_subject_name(x509), NULL, 0);
+    if (subjectstr && strcmp(rec.name, subjectstr) == 0) ret = 1;
+    OPENSSL_free(subjectstr);
+  }
+  return (ret);
+}
 
-  char *subjectstr = X509_NAME_oneline(X509_get_subject_name(x509), NULL, 0);
+/* ---------------------------------------------------------- *
+ * revmap_put(): inserts or updates a serial, linear probing. *
+ * ---------------------------------------------------------- */
+static void revmap_put(REV_MAP *map, const CERT_SERIAL *serial,
+                                                       int64_t revoked) {
+  size_t i = serial_hash(serial) & map->mask;
 
-  /* ---------------------------------------------------------- *
-   * Check if the cert already exists in DB by using its serial *
-   * -----------------------------------------------------------*/
-  char *const *pp;
-  int i;
-  for (i = 0; i < sk_OPENSSL_PSTRING_num(db->db->data); i++) {
-    pp = sk_OPENSSL_PSTRING_value(db->db->data, i);
-    if (   (strcmp(pp[DB_serial], serialstr) == 0)
-         && (strcmp(pp[DB_name], subjectstr) == 0)
-         && (pp[DB_type][0] == DB_TYPE_REV) )  {
-      // debug: int_error("Cert exists in DB and is revoked");
-      return (1);
+  while (map->slots[i].used && ! serial_eq(&map->slots[i].serial, serial))
+    i = (i + 1) & map->mask;
+
+  if (! map->slots[i].used) {
+    map->slots[i].serial = *serial;
+    map->slots[i].used = 1;
+    map->count++;
+  }
+  map->slots[i].revoked = revoked;
+}
+
+/* ---------------------------------------------------------- *
+ * revmap_add(): certdb_scan() callback, adds a revoked cert  *
+ * into the map 'arg'. returns 1 to continue the scan.        *
+ * ---------------------------------------------------------- */
+static int revmap_add(const CADB_REC *rec, void *arg) {
+  int64_t revoked;
+
+  if (rec->type != DB_TYPE_REV) return 1;
+
+  /* "YYMMDDHHMMSSZ[,reason]", the reason is ignored */
+  if (dbtime_to_epoch(rec->rev_date, &revoked))
+    revmap_put(arg, &rec->serial, revoked);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * load_revmap(): reads the CA database INDEXDB once, and     *
+ * keeps all revoked serials with their pre-parsed revocation *
+ * epoch in a serial-keyed hash table for O(1) lookups.       *
+ * returns the map, or NULL if the file cannot be read.       *
+ * ---------------------------------------------------------- */
+REV_MAP *load_revmap(const char *dbfile) {
+  CA_DB *db = NULL;
+  REV_MAP *map = NULL;
+  size_t size = 16;
+  uint64_t rows;
+
+  if (access(dbfile, R_OK) != 0) return NULL;
+  if ((db = certdb_open(dbfile, NULL)) == NULL) return NULL;
+
+  /* table size: power of 2, at most half full */
+  rows = certdb_count(db);
+  while (size < rows * 2) size <<= 1;
+
+  if ((map = OPENSSL_zalloc(sizeof(REV_MAP))) == NULL ||
+      (map->slots = OPENSSL_zalloc(size * sizeof(REV_ENT))) == NULL)
+    int_error("Error cannot allocate memory for the revocation table");
+  map->mask = size - 1;
+
+  certdb_scan(db, revmap_add, map);
+  certdb_close(db);
+  return map;
+}
+
+/* ---------------------------------------------------------- *
+ * revmap_get(): looks up a 20 byte serial in the revocation  *
+ * table. returns 1 and the revocation epoch in *revoked if   *
+ * the cert is revoked, 0 otherwise. A NULL map is empty.     *
+ * ---------------------------------------------------------- */
+int revmap_get(const REV_MAP *map, const CERT_SERIAL *serial,
+                                                      int64_t *revoked) {
+  size_t i;
+
+  if (map == NULL || map->count == 0) return 0;
+  i = serial_hash(serial) & map->mask;
+  while (map->slots[i].used) {
+    if (serial_eq(&map->slots[i].serial, serial)) {
+      if (revoked) *revoked = map->slots[i].revoked;
+      return 1;
     }
+    i = (i + 1) & map->mask;
   }
-  // debug: int_error("Cert is new");
-  BN_free(bn);
-  return (0);
+  return 0;
+}
+
+/* ---------------------------------------------------------- *
+ * free_revmap(): releases the revocation table.              *
+ * ---------------------------------------------------------- */
+void free_revmap(REV_MAP *map) {
+  if (map == NULL) return;
+  OPENSSL_free(map->slots);
+  OPENSSL_free(map);
 }
@@ -4,16 +4,23 @@
  *                                                            *
  * functions come from OpenSSL source x509.c, ca.c and apps.c *
  * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <openssl/buffer.h>
 #include "webcert.h"
 
-#define SERIAL_RAND_BITS 64
+#define SERIAL_RAND_BITS 128
+#define SERIAL_RAND_TRIES 8
 #define BSIZE		256
 
 /* ---------------------------------------------------------- *
- * rand_serial(): create random serial number (not yet used)  *
+ * rand_serial(): create random serial number, the top bit is *
+ * set, it is always above a sequential serial of SERIALFILE  *
  * returns  1 on success, and 0 for failure                   *
  * ---------------------------------------------------------- */
 int rand_serial(BIGNUM *b, ASN1_INTEGER *ai) {
@@ -134,3 +141,258 @@ err:
   if (ai != NULL) ASN1_INTEGER_free(ai);
   return(ret);
 }
+
+/* ---------------------------------------------------------- *
+ * replace_serial(): writes a serial file through a synced    *
+ * temp file renamed over it, a crash leaves the old or new   *
+ * value, no torn file. returns 1 for success, 0 for errors.  *
+ * ---------------------------------------------------------- */
+int replace_serial(char *serialfile, BIGNUM *serial) {
+  char tmpfile[BSIZE];
+  int fd, ok;
+
+  if (snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", serialfile) >= BSIZE ||
+      save_serial(serialfile, "tmp", serial, NULL) == 0) return 0;
+  if ((fd = open(tmpfile, O_RDONLY|O_CLOEXEC)) < 0) ok = 0;
+  else {
+    ok = (fsync(fd) == 0);
+    close(fd);
+  }
+  if (! ok || rename(tmpfile, serialfile) != 0) {
+    unlink(tmpfile);
+    return 0;
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * lease_serial(): hands out the next 'count' serials of the  *
+ * serialfile to this signer. The value is advanced by count  *
+ * with a DBLOG record under its exclusive lock, the serial   *
+ * file itself is rewritten by the journal checkpoint only.   *
+ * 'durable' syncs the record. SERIALFILE needs no sync, the  *
+ * ISSUELOG checkpoint after a crash raises it past the       *
+ * issued certs. The lock is held for the append only, the    *
+ * concurrent signers get separate ranges and sign in turn    *
+ * without it. A signer that dies leaves a gap in the serials *
+ * but they are never handed out twice.                       *
+ * returns the first serial of the lease, or NULL for errors. *
+ * ---------------------------------------------------------- */
+BIGNUM *lease_serial(char *serialfile, unsigned long count, int durable) {
+  BIGNUM *next = NULL, *first = NULL;
+  int ok = 0;
+
+  if (count == 0 || ! dblog_lock(1)) return NULL;
+  if ((next = dblog_serial(serialfile)) != NULL &&
+      (first = BN_dup(next)) != NULL &&
+      BN_add_word(first, 1) && BN_add_word(next, count))
+    ok = dblog_put_serial(serialfile, next, durable);
+  dblog_unlock();
+
+  BN_free(next);
+  if (! ok) {
+    BN_free(first);
+    first = NULL;
+  }
+  return first;
+}
+
+#ifdef RAND_SERIAL
+/* ---------------------------------------------------------- *
+ * rand_serials(): creates 'count' random serials, none of    *
+ * them in the CA database INDEXDB, the store index CERTINDEX *
+ * or twice in the list. CERTINDEX is a cache that can miss a *
+ * cert, INDEXDB has them all. Both lookups are B-tree or     *
+ * binary searches in the mapped files.                       *
+ * returns 1 for success, 0 for errors.                       *
+ * ---------------------------------------------------------- */
+static int rand_serials(CERT_SERIAL *serials, int count) {
+  CERT_INDEX idx;
+  CA_DB *db = NULL;
+  CADB_REC rec;
+  BIGNUM *b = NULL;
+  int i, j, tries, ret = 0;
+
+  if (! load_certindex(&idx, CERTINDEX)) return 0;
+  if ((db = certdb_open(INDEXDB, NULL)) == NULL ||
+      (b = BN_new()) == NULL) goto err;
+
+  for (i = 0; i < count; i++) {
+    for (tries = 0; ; tries++) {
+      /* repeated collisions mean a broken random source, not luck */
+      if (tries == SERIAL_RAND_TRIES || ! rand_serial(b, NULL) ||
+          BN_bn2binpad(b, serials[i].b, SERIAL_LEN) != SERIAL_LEN) goto err;
+      for (j = 0; j < i && ! serial_eq(&serials[j], &serials[i]); j++);
+      if (j == i && find_certindex(&idx, &serials[i]) == NULL &&
+          ! certdb_get(db, &serials[i], &rec)) break;
+    }
+  }
+  ret = 1;
+
+err:
+  BN_free(b);
+  if (db) certdb_close(db);
+  free_certindex(&idx);
+  return ret;
+}
+#endif
+
+/* ---------------------------------------------------------- *
+ * issue_serials(): the serials for 'count' new certs, put in *
+ * aserials[] to be freed with ASN1_INTEGER_free(). They are  *
+ * leased from SERIALFILE, or with RAND_SERIAL random ones    *
+ * checked against INDEXDB, without a shared counter.         *
+ * returns 1 for success, 0 for errors.                       *
+ * ---------------------------------------------------------- */
+int issue_serials(ASN1_INTEGER **aserials, int count) {
+  BIGNUM *b = NULL;
+  int i, ret = 0;
+
+  memset(aserials, '\0', count * sizeof(ASN1_INTEGER *));
+#ifdef RAND_SERIAL
+  CERT_SERIAL *serials;
+
+  if ((serials = calloc(count, sizeof(CERT_SERIAL))) == NULL) return 0;
+  if (rand_serials(serials, count)) {
+    for (i = 0; i < count; i++)
+      if ((b = BN_bin2bn(serials[i].b, SERIAL_LEN, b)) == NULL ||
+          (aserials[i] = BN_to_ASN1_INTEGER(b, NULL)) == NULL) break;
+    ret = (i == count);
+  }
+  free(serials);
+#else
+  if ((b = lease_serial(SERIALFILE, count, 0)) == NULL) return 0;
+  for (i = 0; i < count; i++)
+    if ((aserials[i] = BN_to_ASN1_INTEGER(b, NULL)) == NULL ||
+        ! BN_add_word(b, 1)) break;
+  ret = (i == count);
+#endif
+  BN_free(b);
+  if (! ret)
+    for (i = 0; i < count; i++) ASN1_INTEGER_free(aserials[i]);
+  return ret;
+}
+
+/* ---------------------------------------------------------- *
+ * serial_from_asn1(): converts a certificate ASN1_INTEGER    *
+ * serial into the fixed-width serial, without a BIGNUM.      *
+ * returns 1 for success, 0 for negative or oversized serials *
+ * ---------------------------------------------------------- */
+int serial_from_asn1(CERT_SERIAL *s, const ASN1_INTEGER *ai) {
+  const unsigned char *data;
+  int len;
+
+  memset(s, '\0', sizeof(CERT_SERIAL));
+  if (ai == NULL || ASN1_STRING_type(ai) == V_ASN1_NEG_INTEGER) return 0;
+
+  data = ASN1_STRING_get0_data(ai);
+  len = ASN1_STRING_length(ai);
+  while (len > 0 && *data == 0) { data++; len--; }
+  if (len > SERIAL_LEN) return 0;
+
+  memcpy(s->b + SERIAL_LEN - len, data, len);
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * serial_from_hex(): converts a hex string, e.g. a cert file *
+ * name "0A1B.pem" or index.txt serial, up to the first non-  *
+ * hex char. returns 1 for success, 0 for empty or oversized. *
+ * ---------------------------------------------------------- */
+int serial_from_hex(CERT_SERIAL *s, const char *hexstr) {
+  const char *end = hexstr;
+  int nibble, pos;
+
+  memset(s, '\0', sizeof(CERT_SERIAL));
+  while (isxdigit((unsigned char) *end)) end++;
+  if (end == hexstr) return 0;
+
+  /* fill from the last digit backwards, two nibbles per byte */
+  for (pos = 0; end > hexstr; pos++) {
+    end--;
+    nibble = isdigit((unsigned char) *end) ? *end - '0'
+                                   : toupper((unsigned char) *end) - 'A' + 10;
+    if (nibble == 0) continue;
+    if (pos >= SERIAL_LEN * 2) return 0;
+    s->b[SERIAL_LEN - 1 - pos/2] |= (pos & 1) ? nibble << 4 : nibble;
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * serial_from_dec(): converts a decimal string, as typed in  *
+ * the certsearch form, multiplying up the 20 byte value.     *
+ * returns 1 for success, 0 for bad digits or oversized.      *
+ * ---------------------------------------------------------- */
+int serial_from_dec(CERT_SERIAL *s, const char *decstr) {
+  unsigned int carry;
+  int i;
+
+  memset(s, '\0', sizeof(CERT_SERIAL));
+  if (*decstr == '\0') return 0;
+
+  for (; *decstr; decstr++) {
+    if (! isdigit((unsigned char) *decstr)) return 0;
+    carry = *decstr - '0';
+    for (i = SERIAL_LEN - 1; i >= 0; i--) {
+      carry += s->b[i] * 10;
+      s->b[i] = carry & 0xff;
+      carry >>= 8;
+    }
+    if (carry) return 0;
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * serial_to_hex(): uppercase hex with an even number of hex  *
+ * digits, the same string BN_bn2hex() creates, "0" for zero. *
+ * returns buf, or NULL if buflen is too small.               *
+ * ---------------------------------------------------------- */
+char *serial_to_hex(const CERT_SERIAL *s, char *buf, size_t buflen) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t i = 0, n = 0;
+
+  while (i < SERIAL_LEN && s->b[i] == 0) i++;
+  if (i == SERIAL_LEN) {
+    if (buflen < 2) return NULL;
+    strcpy(buf, "0");
+    return buf;
+  }
+  if (buflen < (SERIAL_LEN - i) * 2 + 1) return NULL;
+
+  for (; i < SERIAL_LEN; i++) {
+    buf[n++] = hex[s->b[i] >> 4];
+    buf[n++] = hex[s->b[i] & 0x0f];
+  }
+  buf[n] = '\0';
+  return buf;
+}
+
+/* ---------------------------------------------------------- *
+ * serial_to_dec(): decimal string by repeated division of a  *
+ * copy of the value by 10. returns buf, or NULL if too small *
+ * ---------------------------------------------------------- */
+char *serial_to_dec(const CERT_SERIAL *s, char *buf, size_t buflen) {
+  CERT_SERIAL tmp = *s;
+  char digits[SERIAL_DECLEN];
+  unsigned int rem;
+  int i, n = 0, nonzero;
+
+  do {
+    rem = 0;
+    nonzero = 0;
+    for (i = 0; i < SERIAL_LEN; i++) {
+      rem = (rem << 8) | tmp.b[i];
+      tmp.b[i] = rem / 10;
+      rem %= 10;
+      if (tmp.b[i]) nonzero = 1;
+    }
+    digits[n++] = '0' + rem;
+  } while (nonzero);
+
+  if (buflen < (size_t) n + 1) return NULL;
+  for (i = 0; i < n; i++) buf[i] = digits[n - 1 - i];
+  buf[n] = '\0';
+  return buf;
+}
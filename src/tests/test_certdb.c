@@ -0,0 +1,86 @@
+/* ---------------------------------------------------------- *
+ * file:	test_certdb.c                                 *
+ * purpose:	the size of a CA database over many commits,  *
+ *              one record each. The free list must not grow  *
+ *              with every commit: alone, the writer reuses   *
+ *              the free pages, with a reader open it adds    *
+ *              only the pages its commit replaced.           *
+ * -----------------------------------------------------------*/
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tests.h"
+
+#define PAGESIZE 4096
+
+/* ---------------------------------------------------------- *
+ * commits(): commits the records 'from' to 'to', one by one. *
+ * returns the number of file pages after them.               *
+ * ---------------------------------------------------------- */
+static long commits(const char *dbfile, int from, int to) {
+  DB_ATTR db_attr = { 0 };
+  CA_DB *db;
+  CADB_REC rec;
+  struct stat st;
+  char hex[16];
+  int i;
+
+  for (i = from; i <= to; i++) {
+    memset(&rec, '\0', sizeof(rec));
+    rec.type = DB_TYPE_VAL;
+    snprintf(hex, sizeof(hex), "%X", i);
+    serial_from_hex(&rec.serial, hex);
+    snprintf(rec.name, sizeof(rec.name), "/CN=host%d.example", i);
+    strcpy(rec.exp_date, "301231235959Z");
+
+    db = certdb_open(dbfile, &db_attr);
+    CHECK(certdb_put(db, &rec) == 1);
+    CHECK(certdb_commit(db, 0) == 1);
+    certdb_close(db);
+  }
+  if (stat(dbfile, &st) != 0) return -1;
+  return st.st_size / PAGESIZE;
+}
+
+int main(void) {
+  CA_DB *reader;
+  CADB_REC rec;
+  char dbfile[256], hex[16];
+  long pages, before;
+  int i, missing = 0;
+
+  snprintf(dbfile, sizeof(dbfile), "/tmp/test_certdb.%d.db", (int) getpid());
+  unlink(dbfile);
+
+  /* alone, about one heap page per 10 records, and the trees */
+  pages = commits(dbfile, 1, 1000);
+  CHECK(pages > 0 && pages < 1000 / 10 + 64);
+
+  /* a reader on an old snapshot stops the reuse, each commit */
+  /* adds the copies of its tree paths, not the whole list     */
+  reader = certdb_open(dbfile, NULL);
+  CHECK(certdb_count(reader) == 1000);
+  before = pages;
+  pages = commits(dbfile, 1001, 1500);
+  CHECK(pages - before < 500 * 16);
+
+  /* without it, the pages freed meanwhile are used again */
+  certdb_close(reader);
+  before = pages;
+  pages = commits(dbfile, 1501, 2000);
+  CHECK(pages - before < 64);
+
+  reader = certdb_open(dbfile, NULL);
+  CHECK(certdb_count(reader) == 2000);
+  for (i = 1; i <= 2000; i++) {
+    snprintf(hex, sizeof(hex), "%X", i);
+    serial_from_hex(&rec.serial, hex);
+    if (! certdb_get(reader, &rec.serial, &rec)) missing++;
+  }
+  CHECK(missing == 0);
+  certdb_close(reader);
+
+  unlink(dbfile);
+  printf("test_certdb: %d failures\n", failures);
+  return failures;
+}
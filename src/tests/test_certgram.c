@@ -0,0 +1,70 @@
+/* ---------------------------------------------------------- *
+ * file:	test_certgram.c                               *
+ * purpose:	dngram_query() candidates for search values   *
+ *              whose grams are all, some or none of them in  *
+ *              the trigram index. A value with a gram that   *
+ *              is not in the index has no base candidates.   *
+ * -----------------------------------------------------------*/
+#include <string.h>
+#include <unistd.h>
+#include "tests.h"
+
+static const char *subjects[] = {
+  "C=JP, O=Example, CN=example.com",
+  "C=JP, O=Example, CN=exam.org",
+  "C=JP, O=Other, CN=other.net",
+};
+#define NRECS (sizeof(subjects)/sizeof(subjects[0]))
+
+/* ---------------------------------------------------------- *
+ * query(): the candidate bits of a CN search, as a number    *
+ * with bit i set for record i. -1 if there is no bitmap.     *
+ * ---------------------------------------------------------- */
+static int query(const char *gramfile, const CERT_REC *recs, const char *value) {
+  unsigned char *bits;
+  int ret;
+
+  if ((bits = dngram_query(gramfile, recs, NRECS, "CN", value)) == NULL)
+    return -1;
+  ret = bits[0];
+  free(bits);
+  return ret;
+}
+
+int main(void) {
+  CERT_REC recs[NRECS];
+  char gramfile[256], logfile[256+4], hex[8];
+  int i;
+
+  memset(recs, '\0', sizeof(recs));
+  for (i = 0; i < NRECS; i++) {
+    snprintf(hex, sizeof(hex), "%02X", i + 1);
+    serial_from_hex(&recs[i].serial, hex);
+    strcpy(recs[i].subject, subjects[i]);
+  }
+  snprintf(gramfile, sizeof(gramfile), "/tmp/test_certgram.%d.idx", (int) getpid());
+  snprintf(logfile, sizeof(logfile), "%s.log", gramfile);
+
+  /* the first query builds the index */
+  CHECK(query(gramfile, recs, "exam") == 0x3);
+  CHECK(query(gramfile, recs, "example") == 0x1);
+  CHECK(query(gramfile, recs, "other") == 0x4);
+
+  /* "exa" and "xam" are in the index, "zzz" is not */
+  CHECK(query(gramfile, recs, "examzzz") == 0);
+  CHECK(query(gramfile, recs, "zzzexam") == 0);
+  CHECK(query(gramfile, recs, "zzz") == 0);
+
+  /* too short for a gram, the caller scans */
+  CHECK(query(gramfile, recs, "ex") == -1);
+
+  /* a cert signed after the index build is always a candidate */
+  CHECK(dngram_rebuild(gramfile, recs, NRECS - 1));
+  CHECK(dngram_add(gramfile, &recs[2].serial));
+  CHECK(query(gramfile, recs, "examzzz") == 0x4);
+
+  unlink(gramfile);
+  unlink(logfile);
+  printf("test_certgram: %d failures\n", failures);
+  return failures;
+}
@@ -0,0 +1,156 @@
+/* ---------------------------------------------------------- *
+ * file:	test_certlog.c                                *
+ * purpose:	issuelog_replay() of a journal into a CA      *
+ *              database with unique_subject. A journaled     *
+ *              cert whose subject clashes with a valid one   *
+ *              stays out of INDEXDB and the store, the other *
+ *              missing certs are added to both. An issuer    *
+ *              whose commit clashed has journaled nothing,   *
+ *              its cert does not come back when the subject  *
+ *              is free again.                                *
+ * -----------------------------------------------------------*/
+#include <string.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "tests.h"
+
+/* ---------------------------------------------------------- *
+ * The store is stubbed, it starts empty and records the      *
+ * serials of the certs that the replay writes into it.       *
+ * ---------------------------------------------------------- */
+static long stored[8];
+static int nstored = 0;
+
+X509 *read_storecert(const char *certfilestr) {
+  return NULL;
+}
+
+int write_storecert(X509 *cert, uint64_t *off) {
+  stored[nstored++] = ASN1_INTEGER_get(X509_get_serialNumber(cert));
+  *off = 0;
+  return 1;
+}
+
+int update_certindex(const char *idxfile, X509 *cert, uint64_t file_off) {
+  return 1;
+}
+
+/* ---------------------------------------------------------- *
+ * mkcert(): a self-signed cert with the serial and the CN.   *
+ * ---------------------------------------------------------- */
+static X509 *mkcert(EVP_PKEY *pkey, long serial, const char *cn) {
+  X509 *x = X509_new();
+  X509_NAME *name = X509_get_subject_name(x);
+
+  ASN1_INTEGER_set(X509_get_serialNumber(x), serial);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *) cn, -1, -1, 0);
+  X509_set_issuer_name(x, name);
+  X509_gmtime_adj(X509_getm_notBefore(x), 0);
+  X509_gmtime_adj(X509_getm_notAfter(x), 86400L * 365);
+  X509_set_pubkey(x, pkey);
+  X509_sign(x, pkey, EVP_sha256());
+  return x;
+}
+
+/* ---------------------------------------------------------- *
+ * indb(): the record type of the serial in 'db', 0 for none. *
+ * ---------------------------------------------------------- */
+static int indb(CA_DB *db, long serial) {
+  CERT_SERIAL s;
+  CADB_REC rec;
+  char hex[8];
+
+  snprintf(hex, sizeof(hex), "%02lX", serial);
+  serial_from_hex(&s, hex);
+  return certdb_get(db, &s, &rec) ? rec.type : 0;
+}
+
+/* ---------------------------------------------------------- *
+ * issue(): the order of certsign.cgi, the cert goes to the   *
+ * journal only if its INDEXDB commit succeeds. returns the   *
+ * certdb_commit() result.                                    *
+ * ---------------------------------------------------------- */
+static int issue(CA_DB *db, X509 *cert, X509 **journal, int *njournal) {
+  CADB_REC rec;
+  int ret;
+
+  make_index_rec(cert, DB_TYPE_VAL, NULL, &rec);
+  if ((ret = certdb_put(db, &rec)) == 1 &&
+      (ret = certdb_commit(db, 0)) == 1)
+    journal[(*njournal)++] = cert;
+  return ret;
+}
+
+int main(void) {
+  EVP_PKEY *pkey = EVP_EC_gen("P-256");
+  DB_ATTR db_attr = { 1 };
+  CA_DB *db, *db2;
+  CADB_REC rec;
+  X509 *certs[3], *dups[2], *journal[2];
+  char dbfile[256];
+  int i, njournal = 0;
+
+  snprintf(dbfile, sizeof(dbfile), "/tmp/test_certlog.%d.db", (int) getpid());
+  unlink(dbfile);
+
+  /* INDEXDB has the valid cert 01 of host.example */
+  certs[0] = mkcert(pkey, 1, "host.example");
+  db = certdb_open(dbfile, &db_attr);
+  make_index_rec(certs[0], DB_TYPE_VAL, NULL, &rec);
+  CHECK(certdb_put(db, &rec) == 1);
+  CHECK(certdb_commit(db, 1) == 1);
+  certdb_close(db);
+
+  /* the journal: 01, 02 of the same subject, and 03 */
+  certs[1] = mkcert(pkey, 2, "host.example");
+  certs[2] = mkcert(pkey, 3, "other.example");
+  db = certdb_open(dbfile, &db_attr);
+  CHECK(issuelog_replay(db, certs, 3) == 1);
+  certdb_close(db);
+
+  db = certdb_open(dbfile, NULL);
+  CHECK(indb(db, 1) && ! indb(db, 2) && indb(db, 3));
+  CHECK(certdb_count(db) == 2);
+  certdb_close(db);
+  CHECK(nstored == 2 && stored[0] == 1 && stored[1] == 3);
+
+  /* a second replay of the same journal changes nothing */
+  nstored = 0;
+  db = certdb_open(dbfile, &db_attr);
+  CHECK(issuelog_replay(db, certs, 3) == 1);
+  CHECK(certdb_count(db) == 2);
+  certdb_close(db);
+
+  /* two issuers put dup.example in their own snapshots, the  */
+  /* second commit clashes, then the first cert is revoked     */
+  dups[0] = mkcert(pkey, 0x11, "dup.example");
+  dups[1] = mkcert(pkey, 0x12, "dup.example");
+  db = certdb_open(dbfile, &db_attr);
+  db2 = certdb_open(dbfile, &db_attr);
+  CHECK(issue(db, dups[0], journal, &njournal) == 1);
+  CHECK(issue(db2, dups[1], journal, &njournal) == -1);
+  certdb_close(db2);
+  make_index_rec(dups[0], DB_TYPE_REV, "261016120000Z", &rec);
+  CHECK(certdb_put(db, &rec) == 1);
+  CHECK(certdb_commit(db, 0) == 1);
+  certdb_close(db);
+
+  /* the replay keeps 11 revoked, and 12 stays rejected */
+  nstored = 0;
+  db = certdb_open(dbfile, &db_attr);
+  CHECK(njournal == 1 && issuelog_replay(db, journal, njournal) == 0);
+  certdb_close(db);
+  db = certdb_open(dbfile, NULL);
+  CHECK(indb(db, 0x11) == DB_TYPE_REV && indb(db, 0x12) == 0);
+  CHECK(certdb_count(db) == 3);
+  certdb_close(db);
+  CHECK(nstored == 1 && stored[0] == 0x11);
+
+  for (i = 0; i < 2; i++) X509_free(dups[i]);
+  for (i = 0; i < 3; i++) X509_free(certs[i]);
+  EVP_PKEY_free(pkey);
+  unlink(dbfile);
+  printf("test_certlog: %d failures\n", failures);
+  return failures;
+}
@@ -0,0 +1,30 @@
+/* ---------------------------------------------------------- *
+ * file:	tests.h                                       *
+ * purpose:	shared by the test programs in tests/, each   *
+ *              one a main() that links the objects it tests. *
+ *              CHECK() reports a failed condition and counts *
+ *              it, the exit code of main() is the count.     *
+ * -----------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <openssl/err.h>
+#include "../webcert.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+  if (! (cond)) { \
+    fprintf(stderr, "%s line %d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  } \
+} while (0)
+
+/* ---------------------------------------------------------- *
+ * handle_error(): int_error() in the tested code ends here,  *
+ * an error the test did not expect ends the test program.    *
+ * ---------------------------------------------------------- */
+void handle_error(const char *file, int lineno, const char *msg) {
+  fprintf(stderr, "%s line %d: %s\n", file, lineno, msg);
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
@@ -18,7 +18,6 @@
 #include <openssl/x509_vfy.h>
 #include <openssl/txt_db.h>
 
-int check_index(X509 *x509, CA_DB *db);
 
 /* ---------------------------------------------------------- *
  * csr_validate_PEM(): a basic check for the CSR's PEM format * 
@@ -127,6 +126,34 @@ void key_validate_PEM(char * form) {
    }
 }
 
+/* ---------------------------------------------------------- *
+ * html_escape(): copies the text 'in' for output into the    *
+ * html page, with &, <, >, " and ' as entities. Stops at the *
+ * last entity that fits, the result is always a string.      *
+ * ---------------------------------------------------------- */
+char *html_escape(char *out, size_t outlen, const char *in) {
+  const char *ent;
+  char c[2] = "";
+  size_t n = 0, len;
+
+  for (; *in; in++) {
+    switch (*in) {
+      case '&':  ent = "&amp;";  break;
+      case '<':  ent = "&lt;";   break;
+      case '>':  ent = "&gt;";   break;
+      case '"':  ent = "&quot;"; break;
+      case '\'': ent = "&#39;";  break;
+      default:   c[0] = *in; ent = c;
+    }
+    len = strlen(ent);
+    if (n + len >= outlen) break;
+    memcpy(out + n, ent, len);
+    n += len;
+  }
+  out[n] = '\0';
+  return out;
+}
+
 /* ---------------------------------------------------------- *
  * X509_signature_dump() converts binary signature data into  *
  * hex bytes, separated with : and a newline after 54 chars.  *
@@ -484,6 +511,8 @@ void display_cert(X509 *ct, char ct_type[], char chain_type[], int level) {
   const X509_ALGOR      *sig_type = NULL;
   size_t                sig_bytes = 0;
   char         sig_type_str[1024] = "";
+  char                timestr[32] = "";
+  int64_t                   epoch = 0;
   long cert_version;
   int i;
 
@@ -491,10 +520,11 @@ void display_cert(X509 *ct, char ct_type[], char chain_type[], int level) {
    * Check if the cert already has a DB entry in state revoked  *
    * ---------------------------------------------------------- */
   CA_DB *db = NULL;
-  DB_ATTR db_attr;
-  if((db = load_index(INDEXFILE, &db_attr)) == NULL)
+  DB_ATTR db_attr = { UNIQUE_SUBJECT };
+  if((db = certdb_open(INDEXDB, &db_attr)) == NULL)
      int_error("Error cannot load CRL certificate database file");
   int exist = check_index(ct, db);
+  certdb_close(db);
 
   BIO *bio = BIO_new(BIO_s_file());
   bio = BIO_new_fp(cgiOut, BIO_NOCLOSE);
@@ -594,11 +624,13 @@ void display_cert(X509 *ct, char ct_type[], char chain_type[], int level) {
   fprintf(cgiOut, "<td>");
   /* display the start and end date here */
   fprintf(cgiOut, "Start Date: ");
-  if (!ASN1_TIME_print(bio ,X509_get_notBefore(ct)))
-    fprintf(cgiOut, "***n/a***");
+  if (asn1_to_epoch(X509_get_notBefore(ct), &epoch))
+    fprintf(cgiOut, "%s", epoch_to_str(epoch, timestr, sizeof(timestr)));
+  else fprintf(cgiOut, "***n/a***");
   fprintf(cgiOut, " &nbsp; End Date: ");
-  if (!ASN1_TIME_print(bio ,X509_get_notAfter(ct)))
-    fprintf(cgiOut, "***n/a***");
+  if (asn1_to_epoch(X509_get_notAfter(ct), &epoch))
+    fprintf(cgiOut, "%s", epoch_to_str(epoch, timestr, sizeof(timestr)));
+  else fprintf(cgiOut, "***n/a***");
   if(exist == 1) fprintf(cgiOut, "<span class=\"revoked\"> (Revoked)</span>");
   fprintf(cgiOut, "</td>\n");
   fprintf(cgiOut, "</tr>\n");
@@ -936,11 +968,9 @@ void display_crl_top(X509_CRL *crl, int count) {
 
   int i;
   char filename[256];
-  char filepath[1024];
   char *serialstr;
   X509_REVOKED *r;
-  FILE *certfile;
-  X509 *cert = X509_new();
+  X509 *cert = NULL;
   X509_NAME *certsubject = NULL;
   X509_EXTENSION *reason = NULL;
   const ASN1_INTEGER *ser = NULL;
@@ -965,16 +995,11 @@ void display_crl_top(X509_CRL *crl, int count) {
      * ---------------------------------------------------------- */
     snprintf(filename, sizeof(filename), "%s.pem", serialstr);
     /* ---------------------------------------------------------- *
-     * define the file path to the cert                           *
-     * ---------------------------------------------------------- */
-    snprintf(filepath, sizeof(filepath), "%s/%s", CACERTSTORE, filename);
-    /* ---------------------------------------------------------- *
-     * try to read the cert file itself                           *
+     * try to read the cert itself from the cert store            *
      * ---------------------------------------------------------- */
-    if ( (certfile = fopen(filepath, "r")) != NULL) {
-      PEM_read_X509(certfile, &cert, NULL, NULL);
+    if ((cert = read_storecert(filename)) != NULL)
       certsubject = X509_get_subject_name(cert);
-    }
+    else certsubject = NULL;
     /* ---------------------------------------------------------- *
      * try to get the CRL reason, if the extension exists         *
      * ---------------------------------------------------------- */
@@ -992,9 +1017,11 @@ void display_crl_top(X509_CRL *crl, int count) {
 
     /* subject line column */
     fprintf(cgiOut, "<td class=\"%s\">", altcol);
-    X509_NAME_print_ex_fp(cgiOut, certsubject, 0,
+    if (certsubject) X509_NAME_print_ex_fp(cgiOut, certsubject, 0,
          ASN1_STRFLGS_UTF8_CONVERT|XN_FLAG_SEP_CPLUS_SPC);
+    else fprintf(cgiOut, "N/A");
     fprintf(cgiOut, "</td>\n");
+    X509_free(cert);
 
     /* revocation date column */
     fprintf(cgiOut, "<td class=\"%s\">", altcol);
@@ -1084,6 +1111,8 @@ STACK_OF(X509_INFO) *X509_load_ca_file(int *cert_count,
 }
 
 void display_signing(X509_REQ *csr) {
+  const CERT_PROFILE *profs;
+  int profcount = 0, i;
   char startdate[11]    ="";
   char enddate[11]      ="";
   char starttime[9]     ="";
@@ -1120,11 +1149,27 @@ void display_signing(X509_REQ *csr) {
   bio = BIO_new(BIO_s_file());
   bio = BIO_new_fp(cgiOut, BIO_NOCLOSE);
 
-  fprintf(cgiOut, "<form action=\"certsign.cgi\" method=\"post\">");
-  fprintf(cgiOut, "<input type=\"hidden\" name=\"csrdata\" ");
-  fprintf(cgiOut, "value=\"");
-  PEM_write_bio_X509_REQ(bio, csr);
-  fprintf(cgiOut, "\">\n");
+  /* without a request, it is the form of a certbatch.cgi bundle */
+  if (csr) {
+    fprintf(cgiOut, "<form action=\"certsign.cgi\" method=\"post\">");
+    fprintf(cgiOut, "<input type=\"hidden\" name=\"csrdata\" ");
+    fprintf(cgiOut, "value=\"");
+    PEM_write_bio_X509_REQ(bio, csr);
+    fprintf(cgiOut, "\">\n");
+  }
+  else {
+    fprintf(cgiOut, "<form action=\"certbatch.cgi\" method=\"post\">");
+    fprintf(cgiOut, "<table>");
+    fprintf(cgiOut, "<tr><th>");
+    fprintf(cgiOut, "Paste the PEM requests, or a JSON array of PEM strings:");
+    fprintf(cgiOut, "</th></tr>\n");
+    fprintf(cgiOut, "<tr><td>");
+    fprintf(cgiOut, "<textarea name=\"csrbundle\" cols=\"64\" rows=\"20\">");
+    fprintf(cgiOut, "</textarea>");
+    fprintf(cgiOut, "</td></tr>\n");
+    fprintf(cgiOut, "</table>\n");
+    fprintf(cgiOut, "<p></p>\n");
+  }
 
   /* Add extra extensions, define validity */
   fprintf(cgiOut, "<table>");
@@ -1134,6 +1179,26 @@ void display_signing(X509_REQ *csr) {
   fprintf(cgiOut, "</th>");
   fprintf(cgiOut, "</tr>\n");
 
+  /* Select a named signing profile, if PROFILEFILE has any */
+  profs = load_profiles(&profcount);
+  if (profcount > 0) {
+    fprintf(cgiOut, "<tr>");
+    fprintf(cgiOut, "<th class=\"cnt\">");
+    fprintf(cgiOut, "</th>\n");
+    fprintf(cgiOut, "<td class=\"type\">Signing Profile:</td>\n");
+    fprintf(cgiOut, "<td>");
+    fprintf(cgiOut, "<select name=\"profile\">\n");
+    fprintf(cgiOut, "<option value=\"\" selected=\"selected\">");
+    fprintf(cgiOut, "none, use the settings below</option>\n");
+    for (i = 0; i < profcount; i++)
+      fprintf(cgiOut, "<option value=\"%s\">%s</option>\n",
+                                             profs[i].name, profs[i].name);
+    fprintf(cgiOut, "</select>");
+    fprintf(cgiOut, " replaces Key Usage, Extended Key Usage and crlDistributionPoints");
+    fprintf(cgiOut, "</td>\n");
+    fprintf(cgiOut, "</tr>\n");
+  }
+
   /* Add Key Usage */
   fprintf(cgiOut, "<tr>");
   fprintf(cgiOut, "<th class=\"cnt\">");
@@ -1260,7 +1325,8 @@ void display_signing(X509_REQ *csr) {
   fprintf(cgiOut, "\"self.location.href='certrequest.cgi'\">&nbsp;");
   fprintf(cgiOut, "&nbsp;<input type=\"button\" value=\"Print Page\" ");
   fprintf(cgiOut, "onclick=\"print(); return false;\">&nbsp;");
-  fprintf(cgiOut, "&nbsp;<input type=\"submit\" value=\"Sign Request\">");
+  fprintf(cgiOut, "&nbsp;<input type=\"submit\" value=\"%s\">",
+                                  csr ? "Sign Request" : "Sign Requests");
   fprintf(cgiOut, "</th>\n");
   fprintf(cgiOut, "</tr>\n");
   fprintf(cgiOut, "</table>\n");
@@ -4,6 +4,9 @@
  * author:      03/04/2004 Frank4DD                                           *
  * ---------------------------------------------------------------------------*/
 
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <openssl/pem.h>
 #include <openssl/x509v3.h>
 #include "openssl/asn1.h"
@@ -20,14 +23,34 @@
 #define CAKEY           "/srv/app/webCA/private/cakey.pem"
 /*********** The password for the ca's private key ****************************/
 #define PASS            "mypassword"
+/*********** local socket of the certsignd daemon that holds the ca key *******/
+#define SIGNSOCKET	"/srv/app/webCA/certsignd.sock"
 /*********** The directory where the generated certificates are stored ********/
 #define CACERTSTORE	"/srv/app/webCA/certs"
+/*********** binary metadata index of all certificates in CACERTSTORE ********/
+#define CERTINDEX	"/srv/app/webCA/certs.idx"
+/*********** trigram index of the subject DN values, its log is DNINDEX.log ***/
+#define DNINDEX 	"/srv/app/webCA/dn.idx"
+/*********** index of the SAN DNS names and IP addresses, log is SANINDEX.log */
+#define SANINDEX	"/srv/app/webCA/san.idx"
+/*********** date and state columns of CERTINDEX, for the range searches *****/
+#define COLINDEX	"/srv/app/webCA/certs.col"
+/*********** cached certsearch results, one file per query, made by the CGI ***/
+#define SEARCHCACHE	"/srv/app/webCA/cache"
+/*********** packed DER archive of the issued certs, used with ARCHIVE_STORE **/
+#define CERTARCHIVE	"/srv/app/webCA/certs.arc"
 /*********** The directory for the external, trusted CA bundles files *********/
 #define CABUNDLEDIR	"/srv/app/webCA/ca-bundles"
 /*********** The directory to write the exported certificates into ************/
 #define CERTEXPORTDIR   "/srv/www/webcert/export"
 /*********** The export directory URL to download the certificates from *******/
 #define CERTEXPORTURL   "/export"
+/*********** named signing profiles, the X509V3 extension sets of certsign ***/
+#define PROFILEFILE     "/srv/app/webCA/profiles.cnf"
+/*********** the compiled DER of the PROFILEFILE extensions, made by the CGI **/
+#define PROFILECACHE    "/srv/app/webCA/profiles.der"
+/*********** journal of the newly issued certs, synced before any other file */
+#define ISSUELOG        "/srv/app/webCA/issue.log"
 /*********** where the ca's serial file is ************************************/
 #define SERIALFILE      "/srv/app/webCA/serial"
 /*********** certificate lifetime *********************************************/
@@ -38,10 +61,18 @@
 #define CRLURI		"URI:http://fm4dd.com/sw/webcert/webcert.crl"
 #define CRLFILE		"/srv/www/webcert/webcert.crl"
 #define REVOKEY         "/srv/app/webCA/private/revocation-pub.pem"
-/*********** we store the list of revoked certs in index.txt ******************/
+/*********** we store the list of issued and revoked certs in index.db ********/
+#define INDEXDB         "/srv/app/webCA/index.db"
+/*********** index.txt is its import and export format, see certdbconv ********/
 #define INDEXFILE       "/srv/app/webCA/index.txt"
+/*********** unique_subject default of a new index.db, or index.txt.attr ******/
+#define UNIQUE_SUBJECT  0
+/*********** the DER of the revoked entries of index.db, for the next CRL *****/
+#define CRLCACHE        "/srv/app/webCA/crl.cache"
 /*********** we store the CRL sequence number in file crlnumber ***************/
 #define CRLSEQNUM       "/srv/app/webCA/crlnumber"
+/*********** write-ahead journal of the serial and crlnumber updates **********/
+#define DBLOG           "/srv/app/webCA/db.log"
 /*********** we store the CRL default expiration days and hours ***************/
 #define CRLEXPDAYS	30
 #define CRLEXPHRS	0
@@ -56,6 +87,33 @@
 /* webcert demo site runs on a unaffected 64bit system, it defaults to off. */
 //#define TIME_PROTECTION  TRUE
 
+/* Large stores can keep the issued certs in the packed archive CERTARCHIVE */
+/* instead of one PEM file per cert in CACERTSTORE. Import an existing      */
+/* store with "certimport" first, then rebuild with this set.               */
+//#define ARCHIVE_STORE  TRUE
+
+/* Very large PEM stores can spread the cert files over 2 levels of shard   */
+/* subdirectories of CACERTSTORE, named by the last and the second-last     */
+/* serial byte in hex, i.e. certs/3A/01/013A.pem. Migrate an existing store */
+/* with "certshard" first, then rebuild with this set. "certshard -u" undo. */
+//#define SHARDED_STORE  TRUE
+
+/* Store new certs as <serial>.der files, 35% smaller than PEM and without */
+/* the base64 decoding on every read. PEM is only made for the output.     */
+/* Existing PEM files are still read, the format is probed per file.       */
+//#define DER_STORE  TRUE
+
+/* "certsignd" keeps the CA key loaded, and signs the certs and CRLs of the */
+/* CGIs over SIGNSOCKET. While it is not running, the CGIs sign with CAKEY. */
+/* With this set they never do, CAKEY can be made unreadable for the web    */
+/* server user, and the CGIs fail without certsignd.                        */
+//#define SIGND_ONLY  TRUE
+
+/* Issue random 128 bit serials instead of the sequential ones of SERIALFILE */
+/* the signers then share no counter. Each is checked against the cert     */
+/* store index, it always has its top bit set, above any sequential serial. */
+//#define RAND_SERIAL  TRUE
+
 /***************** *********************************** ************************/
 /***************** no changes required below this line ************************/
 /***************** *********************************** ************************/
@@ -95,6 +153,33 @@
                              /* as protection for the PKCS12 cert bundle.    */
 
 #define MAXCERTDISPLAY	8    /* # of certs that will be shown in one webpage */
+                             /* by default, the "pagesize" CGI argument can  */
+#define MAXPAGESIZE   100    /* select any page size up to MAXPAGESIZE.      */
+
+#define CERTSCAN_MAXTHREADS 16 /* max worker threads for a cert store scan,  */
+                               /* the default is one per online CPU.         */
+#define CERTSCAN_CHUNK  64   /* # of cert files a scan worker takes at once  */
+
+#define DNGRAM_MERGE  1024   /* # of new certs in the DNINDEX log before it  */
+                             /* is merged into a rebuilt base file.          */
+#define SANIDX_MERGE  1024   /* # of SAN names in the SANINDEX log before it */
+                             /* is merged into the base file.                */
+#define SEARCH_PLANSCAN 256  /* below this # of candidates, a DN search skips */
+                             /* the trigram index and checks the subjects.   */
+#define SEARCHCACHE_TTL 3600 /* seconds a search result in SEARCHCACHE stays */
+                             /* after its last run, for the paging clicks.   */
+#define SIGND_MAXLEN 67108864 /* max DER size of a certsignd request, a CRL  */
+                             /* with many revoked certs is the big one.      */
+#define SIGND_TIMEOUT  30    /* seconds a CGI waits for a certsignd reply.   */
+#define SIGND_WINDOW   16    /* # of requests a batch keeps in flight on one */
+                             /* certsignd connection.                        */
+#define BATCH_MAXCSR 1000    /* max # of requests in one certbatch.cgi run.  */
+#define ISSUELOG_CHECKPOINT 4194304 /* ISSUELOG bytes that start a checkpoint,*/
+                             /* which syncs the CA files and empties it.     */
+#define DBLOG_CHECKPOINT 1048576 /* DBLOG bytes that start a checkpoint, it  */
+                             /* rewrites the serial files.                   */
+#define PROFILE_MAX    32    /* max # of signing profiles in PROFILEFILE.    */
+#define PROFILE_NAMELEN 32   /* max length of a signing profile name + 1.    */
 
 #define int_error(msg)  handle_error(__FILE__, __LINE__, msg)
 
@@ -123,7 +208,242 @@ typedef enum {
 } REVINFO_TYPE;
 
 typedef struct db_attr_st { int unique_subject; } DB_ATTR;
-typedef struct ca_db_st { DB_ATTR attributes; TXT_DB *db; } CA_DB;
+typedef struct ca_db_st CA_DB;           /* see certdb.c */
+
+/* ---------------------------------------------------------- *
+ * CERT_SERIAL: fixed-width certificate serial number value.  *
+ * RFC 5280 limits serials to 20 octets. Stored big-endian,   *
+ * left zero padded, so memcmp() order is numeric order.      *
+ * ---------------------------------------------------------- */
+#define SERIAL_LEN       20
+#define SERIAL_HEXLEN    (SERIAL_LEN * 2 + 1)
+#define SERIAL_DECLEN    (49 + 1) /* 2^160 has 49 decimal digits */
+
+typedef struct cert_serial_st {
+  unsigned char b[SERIAL_LEN];
+} CERT_SERIAL;
+
+static inline int serial_cmp(const CERT_SERIAL *a, const CERT_SERIAL *b) {
+  return memcmp(a->b, b->b, SERIAL_LEN);
+}
+
+static inline int serial_eq(const CERT_SERIAL *a, const CERT_SERIAL *b) {
+  return memcmp(a->b, b->b, SERIAL_LEN) == 0;
+}
+
+/* mixes all 20 bytes, sequential serials only differ at the end */
+static inline uint32_t serial_hash(const CERT_SERIAL *s) {
+  uint64_t lo, mid;
+  uint32_t hi;
+
+  memcpy(&hi, s->b, 4);
+  memcpy(&mid, s->b + 4, 8);
+  memcpy(&lo, s->b + 12, 8);
+  lo ^= mid * 0xff51afd7ed558ccdULL ^ hi;
+  lo *= 0x9e3779b97f4a7c15ULL;
+  return (uint32_t) (lo >> 32);
+}
+
+/* ---------------------------------------------------------- *
+ * CADB_REC: a cert record of the CA database INDEXDB, the    *
+ * fields of its index.txt row, see certdb.c                  *
+ * ---------------------------------------------------------- */
+#define CADB_NAMELEN     1024
+
+typedef struct cadb_rec_st {
+  CERT_SERIAL   serial;
+  char          type;          /* DB_TYPE_VAL, _REV, _EXP, _SUSP  */
+  char          exp_date[24];  /* notAfter, ASN1 time string      */
+  char          rev_date[128]; /* revtime[,reason[,extra]], or "" */
+  char          name[CADB_NAMELEN]; /* X509_NAME_oneline() subject*/
+} CADB_REC;
+
+typedef int (*certdb_cb)(const CADB_REC *rec, void *arg);
+
+/* ---------------------------------------------------------- *
+ * REV_MAP: revoked serials of INDEXDB, open addressing hash  *
+ * table keyed by the 20 byte serial, see load_revmap()       *
+ * ---------------------------------------------------------- */
+typedef struct rev_ent_st {
+  CERT_SERIAL   serial;
+  int32_t       used;
+  int64_t       revoked;       /* revocation epoch seconds UTC    */
+} REV_ENT;
+
+typedef struct rev_map_st {
+  REV_ENT      *slots;
+  size_t        mask;          /* # of slots - 1, power of 2      */
+  size_t        count;
+} REV_MAP;
+
+/* ---------------------------------------------------------- *
+ * The cert store index file CERTINDEX: one header, followed  *
+ * by fixed-size records sorted by serial. Native byte order. *
+ * Every change bumps the generation, readers can compare it  *
+ * to the one their cached data was made from.                *
+ * ---------------------------------------------------------- */
+#define CERTIDX_MAGIC    "WCIDX\0\0\0"
+#define CERTIDX_VERSION  1
+
+typedef struct certidx_hdr_st {
+  char          magic[8];      /* CERTIDX_MAGIC                   */
+  uint32_t      version;       /* CERTIDX_VERSION                 */
+  uint32_t      recsize;       /* sizeof(CERT_REC)                */
+  uint64_t      count;         /* number of records that follow   */
+  uint64_t      generation;    /* +1 for each change of the index */
+  uint64_t      reserved[4];
+} CERTIDX_HDR;
+
+typedef struct cert_rec_st {
+  CERT_SERIAL   serial;        /* big-endian, left zero padded    */
+  char          state;         /* DB_TYPE_VAL or DB_TYPE_REV      */
+  unsigned char pad[3];
+  uint32_t      subject_hash;  /* X509_NAME_hash() of the subject */
+  uint32_t      reserved;
+  int64_t       notbefore;     /* epoch seconds UTC               */
+  int64_t       notafter;      /* epoch seconds UTC               */
+  int64_t       revoked;       /* revocation epoch, 0 = valid     */
+  uint64_t      file_off;      /* cert data offset in store file  */
+  char          subject[208];  /* RFC2253 escaped, ", " separated */
+} CERT_REC;
+
+/* a subject that fills the record may have been cut off there */
+#define certrec_truncated(rec) ((rec)->subject[sizeof((rec)->subject) - 2] != '\0')
+
+typedef struct cert_index_st {
+  const unsigned char *map;    /* read-only mapping of CERTINDEX  */
+  size_t               maplen;
+  const CERTIDX_HDR   *hdr;
+  const CERT_REC      *recs;   /* sorted by serial                */
+  uint64_t             count;
+  uint64_t             stamp[3];/* inode, size, mtime ns, or 0s    */
+} CERT_INDEX;
+
+/* ---------------------------------------------------------- *
+ * CERT_COLS: the CERTINDEX fields used by the range searches *
+ * as one packed array each, from the column file COLINDEX.   *
+ * Column position i is the index record position i.          *
+ * ---------------------------------------------------------- */
+typedef struct cert_cols_st {
+  void                *map;    /* file mapping or malloc() block  */
+  size_t               maplen;
+  int                  mapped;
+  uint64_t             count;
+  const int64_t       *notbefore;
+  const int64_t       *notafter;
+  const int64_t       *revoked;/* 0 = not revoked                 */
+  const char          *state;  /* DB_TYPE_VAL or DB_TYPE_REV      */
+  const CERT_SERIAL   *serial;
+} CERT_COLS;
+
+/* ---------------------------------------------------------- *
+ * CRL_CACHE: the DER revokedCertificates entries of the CRL, *
+ * from the CRLCACHE file, whose lock 'fd' holds.             *
+ * ---------------------------------------------------------- */
+typedef struct crl_cache_st {
+  int                  fd;
+  unsigned char       *der;
+  size_t               len;
+  uint64_t             count;  /* # of entries                    */
+} CRL_CACHE;
+
+/* ---------------------------------------------------------- *
+ * SEARCH_CACHE: a cached certsearch result, mapped from its  *
+ * SEARCHCACHE file. The matches are index record positions.  *
+ * ---------------------------------------------------------- */
+typedef struct search_cache_st {
+  const void          *map;
+  size_t               maplen;
+  const uint32_t      *list;   /* positions in serial order       */
+  uint64_t             count;
+} SEARCH_CACHE;
+
+/* ---------------------------------------------------------- *
+ * CERT_PROFILE: a named signing profile of PROFILEFILE, its  *
+ * extensions decoded once, each cert gets copies of them.    *
+ * ---------------------------------------------------------- */
+typedef struct cert_profile_st {
+  char                      name[PROFILE_NAMELEN];
+  STACK_OF(X509_EXTENSION) *exts;
+} CERT_PROFILE;
+
+/* ---------------------------------------------------------- *
+ * SIGN_PROFILE: the signing options of the certsign form, it *
+ * applies to each request of a certbatch.cgi bundle the same *
+ * ---------------------------------------------------------- */
+typedef struct sign_profile_st {
+  char          type[3];       /* sv, cl, em, os or ca            */
+  char          valid[3];      /* vd: valid_secs from now on, or  */
+  long          valid_secs;    /* se: startdate until enddate     */
+  char          startdate[16]; /* YYYYMMDDHHMMSSZ                 */
+  char          enddate[16];
+  int           keyusage;      /* add keyUsage for the type       */
+  int           extkeyusage;   /* add extendedKeyUsage extkeytype */
+  char          extkeytype[81];
+  int           addcrluri;     /* add crlDistributionPoints       */
+  char          ename[248];    /* e-mail subjectAltName, type em  */
+  const EVP_MD *digest;        /* SHA-224, -256, -384 or -512     */
+  const CERT_PROFILE *profile; /* named profile, or NULL for the  */
+                               /* keyusage, extkeyusage, addcrluri*/
+} SIGN_PROFILE;
+
+/* ---------------------------------------------------------- *
+ * CASIGN_FRAME: a certsignd request or reply header, then    *
+ * 'len' DER bytes. A request has the unsigned cert or CRL,   *
+ * the reply the signed one. A CASIGN_CRLTBS request has the  *
+ * DER TBSCertList, the reply only the signature bytes.       *
+ * Requests on one connection can be pipelined, the replies   *
+ * come back in the request order.                            *
+ * ---------------------------------------------------------- */
+#define CASIGN_MAGIC    0x47534357  /* "WCSG" */
+#define CASIGN_CERT     1           /* op: sign a cert            */
+#define CASIGN_CRL      2           /* op: sign a CRL             */
+#define CASIGN_CRLTBS   3           /* op: sign a CRL's TBS DER   */
+#define CASIGN_OK       0           /* status: signed             */
+#define CASIGN_REFUSED  1           /* status: bad issuer, digest */
+#define CASIGN_FAILED   2           /* status: decode, sign error */
+
+typedef struct casign_frame_st {
+  uint32_t      magic;         /* CASIGN_MAGIC                    */
+  uint16_t      op;            /* CASIGN_CERT, _CRL or _CRLTBS    */
+  uint16_t      status;        /* reply status, 0 in a request    */
+  uint32_t      md;            /* digest NID, i.e. NID_sha256     */
+  uint32_t      len;           /* DER bytes that follow           */
+} CASIGN_FRAME;
+
+/* ---------------------------------------------------------- *
+ * CERT_ARCHIVE: a read-only mapping of the archive file.     *
+ * ---------------------------------------------------------- */
+typedef struct cert_archive_st {
+  const unsigned char *map;
+  size_t               maplen;
+  uint64_t             end;    /* end of the complete entries     */
+} CERT_ARCHIVE;
+
+/* ---------------------------------------------------------- *
+ * CERT_PAGE: one page of a keyset paginated cert listing.    *
+ * Pages are addressed by the serial of the first or last rec *
+ * shown (the cursor), so only the page records are touched.  *
+ * ---------------------------------------------------------- */
+typedef struct cert_page_st {
+  const CERT_REC *recs[MAXPAGESIZE+1]; /* page recs in display order */
+  int           lines;         /* # of records on this page       */
+  int           pagesize;      /* records per page                */
+  int           pagenumber;    /* 1 .. pagecounter                */
+  int           pagecounter;   /* total # of pages                */
+  uint64_t      total;         /* total # of matching records     */
+  int           has_prev;      /* there are records before, after */
+  int           has_next;
+} CERT_PAGE;
+
+typedef int (*certrec_sel)(const CERT_REC *rec);
+
+/* ---------------------------------------------------------- *
+ * certscan_cb: per-certificate callback of scan_certstore(). *
+ * Fills the result slot, returns 1 to keep it, 0 to skip it. *
+ * 'off' is the entry offset of an archive scan, 0 for files. *
+ * ---------------------------------------------------------- */
+typedef int (*certscan_cb)(X509 *cert, const char *fname, uint64_t off, void *result, void *arg);
 
 /* ---------------------------------------------------------- *
  * Shared function declarations                               *
@@ -137,10 +457,195 @@ void handle_error(const char *file, int lineno, const char *msg);
  * ---------------------------------------------------------- */
 BIGNUM *load_serial(char *serialfile, int create, ASN1_INTEGER **retai);
 int save_serial(char *serialfile, char *suffix, BIGNUM *serial, ASN1_INTEGER **retai);
+int replace_serial(char *serialfile, BIGNUM *serial);
+BIGNUM *lease_serial(char *serialfile, unsigned long count, int durable);
+int issue_serials(ASN1_INTEGER **aserials, int count);
 int rotate_serial(const char *serialfile, const char *new_suffix, const char *old_suffix);
-CA_DB *load_index(const char *dbfile, DB_ATTR *db_attr);
-int save_index(const char *dbfile, CA_DB *db);
+int serial_from_asn1(CERT_SERIAL *s, const ASN1_INTEGER *ai);
+int serial_from_hex(CERT_SERIAL *s, const char *hexstr);
+int serial_from_dec(CERT_SERIAL *s, const char *decstr);
+char *serial_to_hex(const CERT_SERIAL *s, char *buf, size_t buflen);
+char *serial_to_dec(const CERT_SERIAL *s, char *buf, size_t buflen);
+CONF *app_load_config(const char *filename);
 int make_revoked(X509_REVOKED *rev, const char *str);
+void make_index_rec(X509 *x509, char type, const char *rev_str, CADB_REC *rec);
+int add_index(X509 *x509, CA_DB *db);
+int check_index(X509 *x509, CA_DB *db);
+int do_revoke(X509 *x509, CA_DB *db, const char *value);
+REV_MAP *load_revmap(const char *dbfile);
+int revmap_get(const REV_MAP *map, const CERT_SERIAL *serial, int64_t *revoked);
+void free_revmap(REV_MAP *map);
+
+/* ---------------------------------------------------------- *
+ * certindex.c: cert store metadata index (CERTINDEX file)    *
+ * ---------------------------------------------------------- */
+int load_certindex(CERT_INDEX *idx, const char *idxfile);
+void free_certindex(CERT_INDEX *idx);
+int rebuild_certindex(const char *idxfile);
+int update_certindex(const char *idxfile, X509 *cert, uint64_t file_off);
+int update_certindex_batch(const char *idxfile, X509 **certs,
+                  const uint64_t *file_offs, int count);
+int revoke_certindex(const char *idxfile, X509 *cert, time_t when);
+int revoke_certrec(const char *idxfile, const CERT_SERIAL *serial, time_t when);
+int current_certindex(const CERT_INDEX *idx, X509 *cert);
+uint64_t certindex_generation(const char *idxfile);
+const CERT_REC *find_certindex(const CERT_INDEX *idx, const CERT_SERIAL *serial);
+char *certrec_filename(const CERT_REC *rec, char *buf, size_t buflen);
+char *certrec_subject(const CERT_REC *rec);
+int scan_certrecs(CERT_REC **recs);
+uint64_t seek_certrecs(const CERT_REC *recs, uint64_t count, const CERT_SERIAL *serial);
+int page_certrecs(CERT_PAGE *pg, const CERT_REC *recs, uint64_t count,
+                  certrec_sel sel, int asc, const char *move,
+                  const CERT_SERIAL *cursor);
+int page_certlist(CERT_PAGE *pg, const CERT_REC *recs, const uint32_t *list,
+                  uint64_t count, int asc, const char *move,
+                  const CERT_SERIAL *cursor);
+
+/* ---------------------------------------------------------- *
+ * certfile.c: store file access, PEM files or DER archive    *
+ * ---------------------------------------------------------- */
+int load_certarchive(CERT_ARCHIVE *arc, const char *arcfile);
+void free_certarchive(CERT_ARCHIVE *arc);
+const unsigned char *certarchive_der(const CERT_ARCHIVE *arc, uint64_t off,
+                  const CERT_SERIAL *serial, long *len);
+uint64_t certarchive_next(const CERT_ARCHIVE *arc, uint64_t off);
+uint64_t certarchive_find(const CERT_ARCHIVE *arc, const CERT_SERIAL *serial);
+int append_certarchive(const char *arcfile, const unsigned char *der,
+                  long len, const CERT_SERIAL *serial, uint64_t *off);
+char *storecert_path(const char *storedir, const char *certfilestr,
+                                    int sharded, char *buf, size_t buflen);
+void storecert_mkdirs(const char *path);
+X509 *read_certfile(FILE *fp, X509 **x);
+X509 *read_storecert(const char *certfilestr);
+int write_storecert(X509 *cert, uint64_t *off);
+
+/* ---------------------------------------------------------- *
+ * certcols.c: column file and vectorized range kernels       *
+ * ---------------------------------------------------------- */
+int load_certcols(CERT_COLS *cols, const char *colfile, const CERT_INDEX *idx);
+void free_certcols(CERT_COLS *cols);
+void certcols_range(const int64_t *col, uint64_t count, int64_t lo,
+                  int64_t hi, unsigned char *bits, int and);
+void certcols_state(const char *col, uint64_t count, char state,
+                  int match, unsigned char *bits, int and);
+uint64_t certcols_count(const unsigned char *bits, uint64_t count);
+
+/* ---------------------------------------------------------- *
+ * certbuild.c: the unsigned cert of a request and profile    *
+ * ---------------------------------------------------------- */
+void cgi_load_profile(SIGN_PROFILE *prof);
+X509 *build_cert(X509_REQ *certreq, X509 *cacert, const SIGN_PROFILE *prof,
+                  const ASN1_INTEGER *aserial);
+
+/* ---------------------------------------------------------- *
+ * casign.c: CA signing, by certsignd or with the CAKEY file  *
+ * ---------------------------------------------------------- */
+EVP_PKEY *load_cakey();
+int casign_cert(X509 **cert, const EVP_MD *md);
+int casign_crl(X509_CRL **crl, const EVP_MD *md);
+int casign_aid(EVP_PKEY *key, const EVP_MD *md, unsigned char *aid,
+                                                      size_t *aidlen);
+int casign_crltbs(const unsigned char *tbs, size_t tbslen, const EVP_MD *md,
+                                      unsigned char **sig, size_t *siglen);
+int casign_certs(X509 **certs, int count, const EVP_MD *md);
+int casign_read(int fd, CASIGN_FRAME *f, unsigned char **data);
+int casign_write(int fd, const CASIGN_FRAME *f, const unsigned char *data);
+
+/* ---------------------------------------------------------- *
+ * certdb.c: the B-tree CA database of the certs (INDEXDB)    *
+ * ---------------------------------------------------------- */
+CA_DB *certdb_open(const char *dbfile, DB_ATTR *db_attr);
+void certdb_close(CA_DB *db);
+int certdb_unique_subject(CA_DB *db);
+uint64_t certdb_count(CA_DB *db);
+int certdb_get(CA_DB *db, const CERT_SERIAL *serial, CADB_REC *rec);
+int certdb_last(CA_DB *db, CERT_SERIAL *serial);
+int certdb_scan(CA_DB *db, certdb_cb cb, void *arg);
+int certdb_scan_subject(CA_DB *db, const char *name, certdb_cb cb, void *arg);
+int certdb_scan_expiry(CA_DB *db, int64_t from, int64_t to, certdb_cb cb,
+                                                              void *arg);
+int certdb_put(CA_DB *db, const CADB_REC *rec);
+int certdb_commit(CA_DB *db, int durable);
+int certdb_compact(const char *dbfile);
+uint64_t certdb_revgen(CA_DB *db, uint64_t *dbid, CERT_SERIAL *last);
+
+/* ---------------------------------------------------------- *
+ * dblog.c: journal of the serial files (DBLOG)               *
+ * ---------------------------------------------------------- */
+int dblog_lock(int exclusive);
+void dblog_unlock();
+BIGNUM *dblog_serial(const char *serialfile);
+int dblog_put_serial(const char *serialfile, BIGNUM *value, int durable);
+
+/* ---------------------------------------------------------- *
+ * certlog.c: issuance journal with group commit (ISSUELOG)   *
+ * ---------------------------------------------------------- */
+void issuelog_begin();
+int issuelog_commit(X509 **certs, int count);
+int issuelog_replay(CA_DB *db, X509 **certs, int count);
+void issuelog_done();
+
+/* ---------------------------------------------------------- *
+ * certprof.c: named signing profiles (PROFILEFILE)           *
+ * ---------------------------------------------------------- */
+const CERT_PROFILE *load_profiles(int *count);
+const CERT_PROFILE *find_profile(const char *name);
+
+/* ---------------------------------------------------------- *
+ * crlcache.c: the revoked entries of the CRL (CRLCACHE file) *
+ * ---------------------------------------------------------- */
+int load_crlcache(CRL_CACHE *cc, const char *cachefile, const char *dbfile);
+void free_crlcache(CRL_CACHE *cc);
+unsigned char *crlcache_tbs(const CRL_CACHE *cc, const unsigned char *aid,
+                   size_t aidlen, const X509_NAME *issuer,
+                   const ASN1_TIME *thisupd, const ASN1_TIME *nextupd,
+                   const ASN1_INTEGER *crlnumber, size_t *len);
+unsigned char *crlcache_crl(const unsigned char *tbs, size_t tbslen,
+                   const unsigned char *aid, size_t aidlen,
+                   const unsigned char *sig, size_t siglen, size_t *len);
+
+/* ---------------------------------------------------------- *
+ * certcache.c: certsearch result cache (SEARCHCACHE dir)     *
+ * ---------------------------------------------------------- */
+int load_searchcache(SEARCH_CACHE *sc, const char *cachedir,
+                              const char *key, const CERT_INDEX *idx);
+void free_searchcache(SEARCH_CACHE *sc);
+int save_searchcache(const char *cachedir, const char *key,
+          const CERT_INDEX *idx, const uint32_t *list, uint64_t count);
+
+/* ---------------------------------------------------------- *
+ * certgram.c: trigram index of subject values (DNINDEX file) *
+ * ---------------------------------------------------------- */
+int dngram_attr(const char *sn);
+int dngram_rebuild(const char *gramfile, const CERT_REC *recs, uint64_t count);
+int dngram_add(const char *gramfile, const CERT_SERIAL *serial);
+unsigned char *dngram_query(const char *gramfile, const CERT_REC *recs,
+                  uint64_t count, const char *sn, const char *value);
+
+/* ---------------------------------------------------------- *
+ * certsan.c: SAN DNS name and IP address index (SANINDEX)    *
+ * ---------------------------------------------------------- */
+int sanidx_rebuild(const char *sanfile);
+int sanidx_add(const char *sanfile, X509 *cert);
+int sanidx_query(const char *sanfile, const char *name, CERT_SERIAL **serials);
+
+/* ---------------------------------------------------------- *
+ * certtime.c: ASN1 and form times to UTC epoch seconds       *
+ * ---------------------------------------------------------- */
+int utc_to_epoch(int year, int mon, int day, int hour, int min, int sec, int64_t *epoch);
+int dbtime_to_epoch(const char *str, int64_t *epoch);
+int asn1_to_epoch(const ASN1_TIME *t, int64_t *epoch);
+int formtime_to_epoch(const char *datestr, const char *timestr, int64_t *epoch);
+char *epoch_to_str(int64_t epoch, char *buf, size_t buflen);
+int lifetime_left(int64_t notbefore, int64_t notafter, int64_t now);
+
+/* ---------------------------------------------------------- *
+ * certscan.c: multi-threaded cert store directory scan       *
+ * ---------------------------------------------------------- */
+int list_certstore(const char *dir, char ***files);
+int scan_certstore(const char *dir, certscan_cb match, void *arg, size_t ressize, void **results);
+int scan_certarchive(const char *arcfile, certscan_cb match, void *arg, size_t ressize, void **results);
+int scan_issued(certscan_cb match, void *arg, size_t ressize, void **results);
 
 /* ---------------------------------------------------------- *
  * This function adds missing OID's to the internal structure *
@@ -163,6 +668,11 @@ void display_crl_top(X509_CRL *crl, int count);
 void key_validate_PEM(char *);
 void csr_validate_PEM(char *);
 
+/* ---------------------------------------------------------- *
+ * html_escape() copies text into 'out' with html entities    *
+ * ---------------------------------------------------------- */
+char *html_escape(char *out, size_t outlen, const char *in);
+
 /* ---------------------------------------------------------- *
  * cgi_load_xxxfile() load a PEM file to corresponding struct *
  * ---------------------------------------------------------- */